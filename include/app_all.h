@@ -40,6 +40,9 @@
 #include "smdi.h"
 #include "smdi_sample.h"
 #include "smdi_aif.h"
+#include "smdi_wav.h"
+#include "smdi_catalog.h"
+#include "smdi_jobs.h"
 
 /* Include custom grid widget header */
 #include "grid_widget.h"
@@ -52,9 +55,12 @@ extern Widget XmSelectionBoxGetChild();
 
 
 /* Maximum number of samples to display */
-#define MAX_SAMPLES 128
+#define MAX_SAMPLES 2048
 #define MAX_SCSI_DEVICES 16
 
+/* Devices that can be connected at once */
+#define MAX_SESSIONS 8
+
 typedef enum {
     MODE_NOT_CONNECTED,  /* Not connected to any device */
     MODE_CONNECTED       /* Connected to a SMDI device */
@@ -71,6 +77,19 @@ typedef struct {
     int exists;              /* Whether sample exists */
 } SampleInfo;
 
+/* A connected device; every connected device keeps its connection,
+   catalog and transfer queue while another one is shown */
+typedef struct {
+    int inUse;               /* Slot holds a connected device */
+    int ha;                  /* Host adapter */
+    int id;                  /* SCSI target ID */
+    SMDI_Connection *connection; /* Connection held open since connect */
+    SMDI_Catalog *catalog;       /* Sample headers of the device */
+    XtWorkProcId revalidateProc; /* Background catalog revalidation, 0 if idle */
+    SMDI_JobQueue *jobs;     /* Uploads, downloads and deletes, run by a worker of its own */
+    char deviceName[32];     /* Inquiry name */
+    char deviceVendor[16];   /* Inquiry vendor */
+} DeviceSession;
 
 typedef struct {
     Widget mainWindow;       /* Main window widget */
@@ -86,9 +105,11 @@ typedef struct {
 
 
     /* Connection and sample data */
-    int connected;           /* Connection state */
-    int currentHA;           /* Current host adapter */
-    int currentID;           /* Current SCSI target ID */
+    int connected;           /* The selected device is connected */
+    int currentHA;           /* Selected host adapter */
+    int currentID;           /* Selected SCSI target ID */
+    DeviceSession sessions[MAX_SESSIONS]; /* Connected devices */
+    DeviceSession *session;  /* Selected device, NULL if it is not connected */
     char deviceName[32];     /* Connected device name */
     char deviceVendor[16];   /* Connected device vendor */
     SampleInfo samples[MAX_SAMPLES];  /* Sample information array */
@@ -96,6 +117,9 @@ typedef struct {
     
     /* Progress tracking */
     int operationInProgress; /* Flag for ongoing operation */
+    int transfersPaused;     /* Queued jobs are held back on every device */
+    int progressPipe[2];     /* Progress from the workers: read end, write end */
+    XtInputId progressInput; /* Watches the read end of progressPipe */
     char statusMessage[256]; /* Current status message */
 } AppData;
 
@@ -129,10 +153,18 @@ void create_status_bar(Widget parent);
 /* SMDI operations */
 int scan_scsi_devices(int ha_id, char *device_names[], int *device_types);
 int connect_to_device(int ha_id, int id);
+void disconnect_from_device(void);
+void disconnect_all_devices(void);
+void select_device(int ha_id, int id);
 int refresh_sample_list(void);
 int receive_sample_as_aif(int sample_id, const char *filename);
 int delete_sample(int sample_id);
 int send_aif_file(const char *filename, int sample_id);
+int send_aif_files(char **filenames, int file_count, int start_sample_id);
+int init_transfers(void);
+int transfers_pending(void);
+void cancel_transfers(void);
+void pause_transfers(int pause);
 
 /* UI callbacks */
 void exit_callback(Widget widget, XtPointer client_data, XtPointer call_data);
@@ -151,6 +183,8 @@ void id_option_callback(Widget widget, XtPointer client_data, XtPointer call_dat
 void sample_create_popup_menu(Widget widget, XtPointer client_data, XEvent *event, Boolean *continue_to_dispatch);
 void receive_aif_callback(Widget widget, XtPointer client_data, XtPointer call_data);
 void delete_sample_callback(Widget widget, XtPointer client_data, XtPointer call_data);
+void cancel_transfer_callback(Widget widget, XtPointer client_data, XtPointer call_data);
+void pause_transfers_callback(Widget widget, XtPointer client_data, XtPointer call_data);
 
 /* Utility functions */
 void update_status(const char *format, ...);
@@ -38,6 +38,14 @@ extern "C" {
 #define MAX_PATH 260
 #endif
 
+/* Per-target handle cache counters */
+typedef struct {
+    unsigned long opens;          /* Device opens actually performed */
+    unsigned long reuses;         /* Commands served by a cached handle (opens saved) */
+    unsigned long closes;         /* Device closes performed */
+    unsigned long invalidations;  /* Cached handles dropped after a transport error */
+} ASPI_HandleStats;
+
 /* ASPI function declarations - fixed return types */
 int ASPI_Check(scsi_debug_t *debug);
 void ASPI_RescanPort(scsi_debug_t *debug, unsigned char ha_id);
@@ -46,6 +54,13 @@ int ASPI_TestUnitReady(scsi_debug_t *debug, unsigned char ha_id, unsigned char i
 int ASPI_Send(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size);
 unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size);
 void ASPI_InquireDevice(scsi_debug_t *debug, char result[], unsigned char ha_id, unsigned char id);
+unsigned long ASPI_GetMaxTransfer(scsi_debug_t *debug, unsigned char ha_id, unsigned char id);
+
+/* Connection-scoped handle cache */
+int ASPI_OpenDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id);
+void ASPI_CloseDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id);
+void ASPI_CloseAllDevices(void);
+void ASPI_GetHandleStats(ASPI_HandleStats *stats);
 
 #ifdef __cplusplus
 }
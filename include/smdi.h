@@ -11,6 +11,7 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include "scsi_debug.h"
 
 /* Type definitions for 32-bit IRIX 5.3 */
 #ifndef BYTE
@@ -61,9 +62,12 @@ extern "C" {
 #define	SMDIE_NOMEMORY                  0x00200004
 #define SMDIE_UNSUPPSAMBITS             0x00200006
 
-/* Copy modes for SMDI_SendDataPacket - Not used in IRIX (big-endian) */
-/* We keep the defines but don't actually use them */
+/* Copy modes for the sample data of a transmission (dwCopyMode). The
+   device keeps 16-bit words big-endian; 8-bit samples are always copied
+   1:1 */
 #define	CM_NORMAL                       0x00000000 /* Does a 1:1 copy */
+#define	CM_BYTESWAP                     0x00000001 /* Swaps the bytes of every 16-bit word */
+#define	CM_HOSTORDER                    0x00000002 /* 16-bit words in host order: swapped on little-endian hosts */
 
 /* Sample format identifiers */
 #define SF_NATIVE                       0x00000001 /* SMDI native sample format */
@@ -71,13 +75,35 @@ extern "C" {
 /* File errors */
 #define FE_OPENERROR                    0x00010001 /* Couldn't open the file */
 #define	FE_UNKNOWNFORMAT                0x00010002 /* Unsupported file format */
+#define FE_WRITEERROR                   0x00010003 /* Couldn't write the file */
+#define FE_CANCELLED                    0x00010004 /* The transfer was cancelled */
+#define FE_PACKETSIZE                   0x00010005 /* The device's packets split sample words */
 
 /* Default SMDI Packet Size */
 #define PACKETSIZE 16384
 
+/* Largest packet size: the SCSI transfer length is 24 bits and also
+   carries the 14 byte data packet header */
+#define SMDI_MAX_PACKETSIZE 0xFFFFF0
+
 /* Maximum number of samples to scan */
 #define MAX_SAMPLES_TO_SCAN 64
 
+/* Sample number range not known (no valid sample numbers) */
+#define SMDI_RANGE_UNKNOWN              0xFFFFFFFF
+
+/* Command types with separately tracked answer turnaround */
+#define SMDI_RC_IDENTIFY                0
+#define SMDI_RC_DATAPACKET              1
+#define SMDI_RC_SAMPLENAME              2
+#define SMDI_RC_BEGINTRANSFER           3
+#define SMDI_RC_SAMPLEHEADER            4
+#define SMDI_RC_NEXTPACKET              5
+#define SMDI_RC_HEADERREQUEST           6
+#define SMDI_RC_DELETE                  7
+#define SMDI_RC_ABORT                   8
+#define SMDI_RC_COUNT                   9
+
 /* SCSI device information structure */
 typedef struct SCSI_DevInfo
 {
@@ -110,6 +136,42 @@ typedef struct SMDI_SampleHeader
   DWORD dwDataOffset;                   /* (288) - for file operations only */
 } SMDI_SampleHeader;
 
+/* Answer turnaround statistics for one command type */
+typedef struct SMDI_ResponseTiming
+{
+  DWORD dwAverage;                      /* Running average turnaround in microseconds */
+  DWORD dwSamples;                      /* Number of answers measured */
+  DWORD dwRetries;                      /* READs that came back without an answer */
+} SMDI_ResponseTiming;
+
+/* SMDI connection: all protocol state for talking to one device */
+typedef struct SMDI_Connection
+{
+  DWORD dwStructSize;
+  BYTE HA_ID;
+  BYTE SCSI_ID;
+  BYTE Rsvd1;
+  BYTE Rsvd2;
+  BOOL bOpen;                           /* Transport handle held open */
+  DWORD dwLastError;                    /* Error code of a rejected command, else 0 */
+  DWORD dwPacketSize;                   /* Packet length of the last negotiated transfer */
+  DWORD dwMaxPacketSize;                /* Packet length asked for, 0 = not determined yet */
+  scsi_debug_t Debug;                   /* Debug settings for this connection */
+  unsigned char cCommand[256];          /* Outgoing message buffer */
+  unsigned char cResponse[512];         /* Answer buffer, holds a sample header with a 255 char name */
+  unsigned char * lpPacket;             /* Data packet message: 14 byte header + payload */
+  DWORD dwPacketAlloc;                  /* Payload capacity of lpPacket */
+  unsigned char * lpReceive;            /* Received data packet: header + payload */
+  DWORD dwReceiveAlloc;                 /* Payload capacity of lpReceive */
+  SMDI_ResponseTiming Timing[SMDI_RC_COUNT];
+  struct SMDI_Bus * lpBus;              /* Bus of the host adapter, shared by its devices */
+  struct SMDI_Semaphore * lpBusTurn;    /* Posted when the bus is handed to this connection */
+  DWORD dwBusWaits;                     /* SCSI commands that waited for another device's */
+  DWORD dwTargetRate;                   /* Sample rate uploads are resampled to, 0 = as they are */
+  DWORD dwTargetBits;                   /* Bits sample files are converted to, 0 = as their reader picks */
+  DWORD dwConvertFlags;                 /* SMDI_CONVERT_* for converting sample files */
+} SMDI_Connection;
+
 /* SMDI transmission information structure */
 typedef struct SMDI_TransmissionInfo
 {
@@ -124,8 +186,45 @@ typedef struct SMDI_TransmissionInfo
   BYTE HA_ID;                           /* (29) */
   BYTE Rsvd1;                           /* (30) */
   BYTE Rsvd2;                           /* (31) */
+  SMDI_Connection * lpConnection;       /* (32) - NULL: default connection */
 } SMDI_TransmissionInfo;
 
+/* Source of the sample data of an upload. lpRead copies up to dwBytes
+   of sample data into buffer and returns the bytes copied, 0 at the end
+   or SMDI_SOURCE_ERROR; lpClose releases the source's state. */
+typedef struct SMDI_SampleSource
+{
+  DWORD dwStructSize;
+  SMDI_SampleHeader Header;             /* Format, loop points and name of the sample */
+  DWORD (*lpRead)(struct SMDI_SampleSource*, void*, DWORD);
+  void (*lpClose)(struct SMDI_SampleSource*);
+  void * lpState;                       /* Owned by the source */
+} SMDI_SampleSource;
+
+#define SMDI_SOURCE_ERROR ((DWORD)-1)
+
+/* Packets a read-ahead source keeps ready for the device */
+#define SMDI_READAHEAD_DEFAULT 4
+
+/* Destination of the data of a download. lpBegin receives the sample
+   header before the first packet, lpWrite each packet's data as it
+   arrives; lpClose finishes the output, or discards it if the transfer
+   was not complete. All return FALSE on error. */
+typedef struct SMDI_SampleSink
+{
+  DWORD dwStructSize;
+  BOOL (*lpBegin)(struct SMDI_SampleSink*, SMDI_SampleHeader*);
+  BOOL (*lpWrite)(struct SMDI_SampleSink*, void*, DWORD);
+  BOOL (*lpClose)(struct SMDI_SampleSink*, BOOL);
+  void * lpState;                       /* Owned by the sink */
+} SMDI_SampleSink;
+
+/* File transfer running on a worker thread, see SMDI_PollTransfer */
+typedef struct SMDI_Transfer SMDI_Transfer;
+
+/* Result of a transfer that has not ended yet */
+#define SMDI_TRANSFER_PENDING ((DWORD)-1)
+
 /* SMDI file transmission information structure */
 typedef struct SMDI_FileTransmissionInfo
 {
@@ -137,6 +236,10 @@ typedef struct SMDI_FileTransmissionInfo
   char cFileName[MAX_PATH];
   DWORD * lpReturnValue;
   DWORD dwUserData;
+  SMDI_SampleSource * lpSource;         /* Upload data; NULL: the native file cFileName */
+  SMDI_SampleSink * lpSink;             /* Download data; NULL: the native file cFileName */
+  DWORD dwReadAhead;                    /* Upload packets read ahead by a reader thread, 0: read inline */
+  SMDI_Transfer * lpTransfer;           /* Asynchronous transfer running this, NULL: synchronous */
 } SMDI_FileTransmissionInfo;
 
 /* SMDI file transfer structure */
@@ -159,13 +262,148 @@ typedef struct SMDI_FileTransfer
   DWORD dwUserData;
   BOOL bAsync;
   DWORD * lpReturnValue;
+  SMDI_Connection * lpConnection;      /* NULL: default connection of HA_ID:SCSI_ID */
+  SMDI_SampleSource * lpSource;        /* Sending: data source instead of lpFileName, closed when done */
+  SMDI_SampleSink * lpSink;            /* Receiving: data sink instead of lpFileName, closed when done */
+  SMDI_SampleHeader * lpSampleHeader;  /* Receiving: header already known, NULL: requested */
+  DWORD dwReadAhead;                   /* Sending: packets read ahead of the device, 0: read inline */
+  SMDI_Transfer ** lpHandle;           /* Async: receives the transfer, NULL if it ran synchronously */
 } SMDI_FileTransfer;
 
+/* Consecutive occupied sample numbers, first..last inclusive */
+typedef struct SMDI_SampleRun
+{
+  DWORD dwFirst;
+  DWORD dwLast;
+} SMDI_SampleRun;
+
+/* Occupied sample numbers of a device as ascending runs */
+typedef struct SMDI_Occupancy
+{
+  DWORD dwStructSize;
+  DWORD dwMaxSample;                    /* Highest valid sample number, SMDI_RANGE_UNKNOWN if not known */
+  DWORD dwRuns;                         /* Runs in lpRuns */
+  DWORD dwRunAlloc;                     /* Capacity of lpRuns */
+  SMDI_SampleRun * lpRuns;
+} SMDI_Occupancy;
+
+/* Sample discovery parameters and statistics */
+typedef struct SMDI_DiscoverInfo
+{
+  DWORD dwStructSize;
+  DWORD dwGapLimit;                     /* Empty slots that end a dense stretch, 0 = 8 */
+  DWORD dwStride;                       /* Probe spacing in unexplored gaps, 0 = automatic, 1 = every slot */
+  DWORD dwLimit;                        /* Highest sample number to scan, 0 = device range */
+  DWORD dwFirst;                        /* Lowest sample number to scan */
+  DWORD dwMaxSample;                    /* Out: highest valid sample number */
+  DWORD dwProbes;                       /* Out: sample header requests sent */
+  DWORD dwRangeProbes;                  /* Out: of those, spent finding the range */
+  DWORD dwCovered;                      /* Out: sample numbers whose state is known */
+  DWORD dwFound;                        /* Out: occupied sample numbers found */
+} SMDI_DiscoverInfo;
+
+/* Receives each existing sample header from SMDIC_EnumerateHeaders;
+   return FALSE to stop the scan */
+typedef BOOL (*SMDI_HeaderCallback)(DWORD sample_number, SMDI_SampleHeader* sh, DWORD dwUserData);
+
+/* Connections
+ * SMDI_OpenConnection opens the device and returns a connection that owns
+ * its buffers, error state and timing, so several devices or threads can
+ * be served at once. SMDIC_* functions work on a connection; the SMDI_*
+ * functions taking HA_ID/SCSI_ID use a default connection per device.
+ * Connections are opened and closed on one thread, and each is then used
+ * by one thread at a time. Devices on different host adapters are driven
+ * in parallel; devices sharing a host adapter take turns on its bus one
+ * SCSI command at a time, in the order they asked for it.
+ */
+SMDI_Connection* SMDI_OpenConnection(BYTE HA_ID, BYTE SCSI_ID);
+void SMDI_CloseConnection(SMDI_Connection* conn);
+SMDI_Connection* SMDI_GetDefaultConnection(BYTE HA_ID, BYTE SCSI_ID);
+
+BOOL SMDIC_TestUnitReady(SMDI_Connection* conn);
+void SMDIC_GetDeviceInfo(SMDI_Connection* conn, SCSI_DevInfo* info);
+void SMDIC_SetDebugMode(SMDI_Connection* conn, int enable);
+int SMDIC_GetDebugMode(SMDI_Connection* conn);
+DWORD SMDIC_DeleteSample(SMDI_Connection* conn, DWORD sample_number);
+DWORD SMDIC_SampleHeaderRequest(SMDI_Connection* conn, DWORD sample_number, SMDI_SampleHeader* sh);
+DWORD SMDIC_EnumerateHeaders(SMDI_Connection* conn, DWORD first, DWORD last, SMDI_HeaderCallback callback, DWORD dwUserData);
+DWORD SMDIC_SendDataPacket(SMDI_Connection* conn, DWORD pn, void* data, DWORD length);
+void* SMDIC_GetPacketBuffer(SMDI_Connection* conn, DWORD length);
+DWORD SMDIC_SendBeginSampleTransfer(SMDI_Connection* conn, DWORD sampleNum, void* packetLength);
+DWORD SMDIC_AbortProcedure(SMDI_Connection* conn);
+DWORD SMDIC_SendSampleHeader(SMDI_Connection* conn, DWORD sampleNum, SMDI_SampleHeader* sh, DWORD* DataPacketLength);
+DWORD SMDIC_NextDataPacketRequest(SMDI_Connection* conn, DWORD packetNumber, void* buffer, DWORD maxlen);
+DWORD SMDIC_NextDataPacketBuffer(SMDI_Connection* conn, DWORD packetNumber, DWORD maxlen, void** data, DWORD* length);
+DWORD SMDIC_NextDataPacketInPlace(SMDI_Connection* conn, DWORD packetNumber, void* buffer, DWORD maxlen, BOOL bHeadroom);
+DWORD SMDIC_MasterIdentify(SMDI_Connection* conn);
+DWORD SMDIC_SampleName(SMDI_Connection* conn, DWORD sampleNum, char sampleName[]);
+DWORD SMDIC_GetMessage(SMDI_Connection* conn);
+DWORD SMDIC_GetLastError(SMDI_Connection* conn);
+
+/* Packet size negotiation
+ * Transfers ask for SMDIC_GetMaxPacketSize() and accept the device's
+ * counter-offer. Unless set explicitly it is the calibrated size stored
+ * for the device's vendor/product, else the largest packet the transport
+ * can carry. SMDIC_CalibratePacketSize() uploads a test sample to a
+ * scratch slot at a range of packet sizes, deletes it again and keeps
+ * the fastest size, storing it in the packet size file when one is set.
+ * SMDI_Init creates the lock that lets connections share the sizes.
+ */
+DWORD SMDIC_GetMaxPacketSize(SMDI_Connection* conn);
+void SMDIC_SetMaxPacketSize(SMDI_Connection* conn, DWORD size);
+DWORD SMDIC_CalibratePacketSize(SMDI_Connection* conn, DWORD scratchSample, DWORD testBytes, DWORD* bytesPerSecond);
+DWORD SMDIC_GetStoredPacketSize(SMDI_Connection* conn);
+BOOL SMDI_SetPacketSizeFile(const char* filename);
+BOOL SMDI_StorePacketSize(const char* vendor, const char* product, DWORD size);
+BOOL SMDI_InitPacketSizes(void);
+
+/* Upload sample rate
+ * Samplers that play back at fixed rates get every upload from a source
+ * resampled to the rate set here (see smdi_resample.h), with its length
+ * and loop points moved along; 0 sends samples at their own rate.
+ */
+DWORD SMDIC_GetTargetRate(SMDI_Connection* conn);
+void SMDIC_SetTargetRate(SMDI_Connection* conn, DWORD rate);
+
+/* Upload bit depth
+ * Sample files opened for a connection (see SMDI_SourceOpener) are
+ * converted to the device's 8 or 16 bits set here, 0 leaving 8-bit files
+ * as they are and the rest at 16, with the SMDI_CONVERT_* options of
+ * smdi_convert.h; connections start out with SMDI_CONVERT_DITHER.
+ */
+DWORD SMDIC_GetTargetBits(SMDI_Connection* conn);
+void SMDIC_SetTargetBits(SMDI_Connection* conn, DWORD bits);
+DWORD SMDIC_GetConvertFlags(SMDI_Connection* conn);
+void SMDIC_SetConvertFlags(SMDI_Connection* conn, DWORD flags);
+
+/* Sample discovery
+ * SMDIC_DiscoverSamples maps the occupied sample numbers of a device
+ * without requesting every header: the valid range is found from
+ * out-of-range answers, slots around remembered and newly found samples
+ * are probed one by one and empty stretches only every few slots.
+ * SMDIC_LoadOccupancy/SMDIC_StoreOccupancy keep the map per device
+ * (vendor/product and HA:ID) in the file set with SMDI_SetOccupancyFile,
+ * so the next session starts from it.
+ */
+void SMDI_InitOccupancy(SMDI_Occupancy* occ);
+BOOL SMDI_AddOccupied(SMDI_Occupancy* occ, DWORD number);
+void SMDI_FreeOccupancy(SMDI_Occupancy* occ);
+DWORD SMDI_OccupiedCount(const SMDI_Occupancy* occ);
+DWORD SMDIC_FindSampleRange(SMDI_Connection* conn, DWORD hint, DWORD* maxSample, DWORD* probes);
+DWORD SMDIC_DiscoverSamples(SMDI_Connection* conn, SMDI_Occupancy* occ, SMDI_DiscoverInfo* info, SMDI_HeaderCallback callback, DWORD dwUserData);
+BOOL SMDI_SetOccupancyFile(const char* filename);
+BOOL SMDIC_LoadOccupancy(SMDI_Connection* conn, SMDI_Occupancy* occ);
+BOOL SMDIC_StoreOccupancy(SMDI_Connection* conn, const SMDI_Occupancy* occ);
+
 /* Core SMDI functions */
 unsigned char SMDI_Init(void);
 BOOL SMDI_TestUnitReady(BYTE HA_ID, BYTE SCSI_ID);
 void SMDI_GetDeviceInfo(BYTE HA_ID, BYTE SCSI_ID, SCSI_DevInfo* info);
 
+/* Device handle management - keeps the target open between commands */
+BOOL SMDI_OpenDevice(BYTE HA_ID, BYTE SCSI_ID);
+void SMDI_CloseDevice(BYTE HA_ID, BYTE SCSI_ID);
+
 /* Debug functions */
 void SMDI_SetDebugMode(int enable);
 int SMDI_GetDebugMode(void);
@@ -174,6 +412,36 @@ int SMDI_GetDebugMode(void);
 DWORD SMDI_SendFile(SMDI_FileTransfer* ft);
 DWORD SMDI_ReceiveFile(SMDI_FileTransfer* ft);
 
+/* Upload sources and download sinks
+ * A sample is uploaded from a source that fills the connection's packet
+ * buffer one packet at a time, and downloaded into a sink that is handed
+ * each packet as it arrives, so only a packet of the sample is held in
+ * memory. SMDI_OpenFileSource/SMDI_OpenFileSink handle native sample
+ * files; smdi_sample.h and smdi_aif.h add in-memory samples and AIF files.
+ * SMDI_OpenReadAheadSource reads another source a packet at a time in a
+ * thread of its own, dwPackets ahead of the device, so slow file reads
+ * overlap with sending; it owns src from then on.
+ */
+SMDI_SampleSource* SMDI_OpenFileSource(char cFileName[], DWORD* lpFileType);
+DWORD SMDI_ReadSource(SMDI_SampleSource* src, void* buffer, DWORD dwBytes);
+void SMDI_CloseSource(SMDI_SampleSource* src);
+SMDI_SampleSource* SMDI_OpenReadAheadSource(SMDI_SampleSource* src, DWORD dwPacketSize, DWORD dwPackets);
+SMDI_SampleSink* SMDI_OpenFileSink(char cFileName[]);
+BOOL SMDI_CloseSink(SMDI_SampleSink* sink, BOOL bComplete);
+
+/* Asynchronous transfers
+ * With bAsync and lpHandle set, SMDI_SendFile/SMDI_ReceiveFile run the
+ * transfer on a worker thread and return SMDI_TRANSFER_PENDING at once.
+ * The callback runs on the worker after each packet and once more when
+ * the transfer has ended, with the result in lpReturnValue. A transfer
+ * can be polled or cancelled between packets and must be waited for to
+ * free it. If no thread can be started the transfer runs synchronously
+ * and *lpHandle is NULL.
+ */
+DWORD SMDI_PollTransfer(SMDI_Transfer* transfer);
+DWORD SMDI_WaitTransfer(SMDI_Transfer* transfer);
+void SMDI_CancelTransfer(SMDI_Transfer* transfer);
+
 /* Sample operations */
 DWORD SMDI_DeleteSample(BYTE HA_ID, BYTE SCSI_ID, DWORD sample_number);
 DWORD SMDI_SampleHeaderRequest(BYTE HA_ID, BYTE SCSI_ID, DWORD sample_number, SMDI_SampleHeader* sh);
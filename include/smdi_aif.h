@@ -12,13 +12,52 @@ extern "C" {
 
 #include "smdi.h"
 #include "smdi_sample.h"
+#include "smdi_convert.h"
+
+/* An AIFF or AIFF-C file mapped into memory. The frames are left where
+   they are in the file, in the layout Format gives. */
+typedef struct SMDI_AIFFile
+{
+  SMDI_Sample Info;                     /* Format, loop and name as the sampler
+                                           gets them: 8-bit samples as they
+                                           are, others as 16 bits; no data */
+  SMDI_PCMFormat Format;                /* Layout of lpFrames */
+  const unsigned char* lpFrames;        /* SSND frames inside the mapping */
+  DWORD dwDataSize;                     /* Bytes at lpFrames */
+  SMDI_FileMap Map;                     /* The whole file */
+} SMDI_AIFFile;
+
+/* Map an AIFF or AIFF-C file and parse its COMM, SSND, INST, MARK and
+   NAME chunks; NULL if it cannot be read or its format is not supported */
+SMDI_AIFFile* SMDI_OpenAIFFile(const char* filename);
+void SMDI_CloseAIFFile(SMDI_AIFFile* aif);
 
 /* Load an AIF file into SMDI sample format */
 SMDI_Sample* SMDI_LoadAIFSample(const char* filename);
 
+/* Load an AIF file as bBits-bit samples (8 or 16, 0 as Info has it),
+   converted with the SMDI_CONVERT_* options dwFlags where needed */
+SMDI_Sample* SMDI_LoadAIFSampleAs(const char* filename, BYTE bBits, DWORD dwFlags);
+
+/* Open an AIF file as an upload source; frames are copied from the
+   mapped file into each packet as it is sent */
+SMDI_SampleSource* SMDI_OpenAIFSource(const char* filename);
+
+/* Open an AIF file as an upload source of bBits-bit samples, as
+   SMDI_LoadAIFSampleAs converts them */
+SMDI_SampleSource* SMDI_OpenAIFSourceAs(const char* filename, BYTE bBits, DWORD dwFlags);
+
+/* Open an AIF file for its header only; its frames are mapped when the
+   handle is loaded or an upload of it reads its first packet */
+SMDI_SampleFile* SMDI_OpenAIFSampleFile(const char* filename);
+
 /* Save SMDI sample as AIF file */
 BOOL SMDI_SaveAIFSample(SMDI_Sample* sample, const char* filename, int use_aifc);
 
+/* Open an AIF file as a download sink; the header is written when the
+   transfer starts and each packet's frames as they arrive */
+SMDI_SampleSink* SMDI_OpenAIFSink(const char* filename, int use_aifc);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,111 @@
+/*
+ * SMDI sample bank files for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_BANK_H
+#define _SMDI_BANK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include "smdi.h"
+#include "smdi_sample.h"
+
+/* Bank file signature and version */
+#define BANK_FILE_SIGNATURE "SMBK"
+#define BANK_FILE_VERSION   1
+
+/* Backup and restore flags */
+#define SMDI_BANK_ALL       0x00000001  /* Copy unchanged samples too */
+#define SMDI_BANK_MIRROR    0x00000002  /* Remove samples the other side does not hold */
+
+/* One sample in a bank */
+typedef struct {
+    DWORD dwSampleNumber;
+    DWORD dwOffset;                     /* Of its native sample image in the bank file */
+    SMDI_SampleFileHeader File;         /* The image's header; File.data_offset
+                                           counts from dwOffset */
+} SMDI_BankEntry;
+
+/* A bank file open for reading and appending. Entries are those of the
+   last commit plus the samples appended since. */
+typedef struct {
+    DWORD dwStructSize;
+    char  cFileName[MAX_PATH];
+    FILE* hFile;                        /* Open for update */
+    DWORD dwEnd;                        /* Bytes in the file; appends start at
+                                           the next SAMPLE_DATA_ALIGN boundary */
+    DWORD dwEntries;
+    DWORD dwEntryAlloc;
+    SMDI_BankEntry* lpEntries;          /* Sorted by sample number */
+    BOOL  bAppending;                   /* A sink is writing an image */
+    BOOL  bDirty;                       /* Entries changed since the last commit */
+} SMDI_Bank;
+
+/* Samples handled by a backup or restore */
+typedef struct {
+    DWORD dwStructSize;
+    DWORD dwCopied;                     /* Transferred */
+    DWORD dwUnchanged;                  /* Skipped, the same on both sides */
+    DWORD dwRemoved;                    /* Removed with SMDI_BANK_MIRROR */
+    DWORD dwFailed;
+    DWORD dwBytes;                      /* Sample data transferred */
+} SMDI_BankStats;
+
+/* Open a bank file; with bCreate a missing one is created empty. NULL if
+   it cannot be opened or is not a bank. */
+SMDI_Bank* SMDI_OpenBank(const char* filename, BOOL bCreate);
+
+/* Close a bank; samples appended since the last commit are dropped */
+void SMDI_CloseBank(SMDI_Bank* bank);
+
+/* Write the table of contents after the last image and point the file
+   header at it; until then the bank reads as it was */
+BOOL SMDI_CommitBank(SMDI_Bank* bank);
+
+/* Rewrite the bank through a temporary file with only the images its
+   entries use; commits first */
+BOOL SMDI_CompactBank(SMDI_Bank* bank);
+
+/* Find the entry of a sample number, NULL if the bank does not hold it */
+SMDI_BankEntry* SMDI_BankLookup(SMDI_Bank* bank, DWORD dwSampleNumber);
+
+/* Drop the entry of a sample number; its image stays until compacted */
+void SMDI_BankRemove(SMDI_Bank* bank, DWORD dwSampleNumber);
+
+/* TRUE if an entry holds the sample a device reports with sh: same
+   format, length, loop, pitch and name */
+BOOL SMDI_BankEntryMatches(SMDI_BankEntry* entry, SMDI_SampleHeader* sh);
+
+/* Open a download sink appending a sample to the bank. The image
+   replaces the sample's entry once complete, unless it holds the same
+   header and data, in which case it is dropped again. One sink at a
+   time writes to a bank. */
+SMDI_SampleSink* SMDI_OpenBankSink(SMDI_Bank* bank, DWORD dwSampleNumber);
+
+/* Open a sample of the bank as an upload source; the file is mapped and
+   the data copied into each packet, checked against its hash */
+SMDI_SampleSource* SMDI_OpenBankSource(SMDI_Bank* bank, DWORD dwSampleNumber);
+
+/* Load one sample of the bank from the mapped file */
+SMDI_Sample* SMDI_LoadBankSample(SMDI_Bank* bank, DWORD dwSampleNumber);
+
+/* Backup: download the samples of first..last that the bank does not
+   hold as the device reports them, then commit. Restore: upload the
+   bank's samples in first..last that the device does not hold as they
+   are in the bank. SMDI_BANK_ALL copies every sample, SMDI_BANK_MIRROR
+   also removes those missing on the other side. Returns
+   SMDIM_ENDOFPROCEDURE, else the result of the last failure. */
+DWORD SMDIC_BackupBank(SMDI_Connection* conn, SMDI_Bank* bank, DWORD first, DWORD last,
+                       DWORD dwFlags, SMDI_BankStats* stats);
+DWORD SMDIC_RestoreBank(SMDI_Connection* conn, SMDI_Bank* bank, DWORD first, DWORD last,
+                        DWORD dwFlags, SMDI_BankStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_BANK_H */
@@ -0,0 +1,97 @@
+/*
+ * SMDI sample header catalog for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_CATALOG_H
+#define _SMDI_CATALOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Catalog file signature and version */
+#define CATALOG_FILE_SIGNATURE "SMCT"
+#define CATALOG_FILE_VERSION   1
+
+/* Changes reported by revalidation */
+#define CATALOG_ADDED          1
+#define CATALOG_CHANGED        2
+#define CATALOG_REMOVED        3
+
+/* One cached sample header */
+typedef struct {
+    DWORD dwSampleNumber;
+    DWORD dwFingerprint;       /* Hash of the header fields */
+    BOOL  bValid;              /* Confirmed by the device this session */
+    SMDI_SampleHeader Header;
+} SMDI_CatalogEntry;
+
+/* Sample headers of one device, sorted by sample number */
+typedef struct {
+    DWORD dwStructSize;
+    char  cVendor[9];          /* Inquiry vendor */
+    char  cProduct[17];        /* Inquiry product */
+    BYTE  HA_ID;
+    BYTE  SCSI_ID;
+    DWORD dwMaxSample;         /* Highest valid sample number, SMDI_RANGE_UNKNOWN if not known */
+    DWORD dwEntries;
+    DWORD dwEntryAlloc;
+    SMDI_CatalogEntry* lpEntries;
+    DWORD dwRevalidateNext;    /* Next sample number to revalidate */
+    BOOL  bDirty;              /* Changed since loaded or saved */
+} SMDI_Catalog;
+
+/* Receives each change found by revalidation; entry is NULL for
+   CATALOG_REMOVED */
+typedef void (*SMDI_CatalogCallback)(SMDI_Catalog* cat, DWORD sample_number,
+                                     SMDI_CatalogEntry* entry, DWORD change,
+                                     DWORD dwUserData);
+
+/* Set the catalog file, which is read when a catalog is opened and
+   rewritten when one is saved; FALSE if the name is too long. NULL
+   disables persistence. */
+BOOL SMDI_SetCatalogFile(const char* filename);
+
+/* Open the catalog of the device on a connection, with the headers
+   saved in the catalog file (not yet valid) */
+SMDI_Catalog* SMDIC_OpenCatalog(SMDI_Connection* conn);
+
+/* Free a catalog without saving it */
+void SMDI_CloseCatalog(SMDI_Catalog* cat);
+
+/* Write a catalog into the catalog file, replacing its earlier copy */
+BOOL SMDI_SaveCatalog(SMDI_Catalog* cat);
+
+/* Find the entry of a sample number, NULL if not cataloged */
+SMDI_CatalogEntry* SMDI_CatalogLookup(SMDI_Catalog* cat, DWORD sample_number);
+
+/* Enter a header the device reported (valid) or that was sent to it */
+SMDI_CatalogEntry* SMDI_CatalogUpdate(SMDI_Catalog* cat, DWORD sample_number,
+                                      SMDI_SampleHeader* sh, BOOL bValid);
+
+/* Drop the entry of a sample number */
+void SMDI_CatalogRemove(SMDI_Catalog* cat, DWORD sample_number);
+
+/* Occupancy of the cataloged samples, for discovery hints */
+BOOL SMDI_CatalogOccupancy(SMDI_Catalog* cat, SMDI_Occupancy* occ);
+
+/* Sample header from the catalog if confirmed this session, else from
+   the device (updating the catalog) */
+DWORD SMDIC_CatalogHeaderRequest(SMDI_Connection* conn, SMDI_Catalog* cat,
+                                 DWORD sample_number, SMDI_SampleHeader* sh);
+
+/* Revalidate the catalog against the device, slots sample numbers per
+   call (0 = all). Headers are compared by fingerprint and every change
+   is passed to callback. Returns SMDIM_ACK while slots remain,
+   SMDIM_ENDOFPROCEDURE when the whole range has been revalidated. */
+DWORD SMDIC_RevalidateCatalog(SMDI_Connection* conn, SMDI_Catalog* cat, DWORD slots,
+                              SMDI_CatalogCallback callback, DWORD dwUserData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_CATALOG_H */
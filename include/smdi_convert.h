@@ -0,0 +1,77 @@
+/*
+ * SMDI sample format conversion for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_CONVERT_H
+#define _SMDI_CONVERT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Encodings of PCM sample data */
+#define SMDI_PCM_SIGNED            1    /* Two's complement integer */
+#define SMDI_PCM_UNSIGNED          2    /* Offset binary integer, as 8-bit WAV */
+#define SMDI_PCM_FLOAT             3    /* IEEE 754 single precision, full scale 1.0 */
+
+/* Byte orders of PCM sample data */
+#define SMDI_PCM_BIGENDIAN         1
+#define SMDI_PCM_LITTLEENDIAN      2
+#define SMDI_PCM_HOSTORDER         3
+
+/* Conversion options */
+#define SMDI_CONVERT_DITHER        0x00000001 /* TPDF dither where bits are dropped */
+#define SMDI_CONVERT_NOISESHAPE    0x00000002 /* Move the dither noise up, out of the
+                                                 ear's most sensitive band; implies
+                                                 SMDI_CONVERT_DITHER */
+
+/* Layout of PCM sample data */
+typedef struct SMDI_PCMFormat
+{
+  DWORD dwEncoding;                     /* SMDI_PCM_SIGNED... */
+  DWORD dwBits;                         /* Significant bits, 8 to 32; 32 for float */
+  DWORD dwBytes;                        /* Bytes per sample, 1 to 4; a wider sample
+                                           holds its bits at the low end */
+  DWORD dwByteOrder;                    /* SMDI_PCM_BIGENDIAN... */
+} SMDI_PCMFormat;
+
+/* Converts interleaved frames of one PCM format into the device's 8- or
+   16-bit words (16-bit words big-endian) a block at a time, keeping the
+   dither state from one call to the next */
+typedef struct SMDI_Converter SMDI_Converter;
+
+/* Converter from lpFormat to bBits-bit samples; NULL if either format
+   is not supported or memory ran out. Dither and noise shaping are only
+   applied where bits are dropped. */
+SMDI_Converter* SMDI_CreateConverter(const SMDI_PCMFormat* lpFormat, BYTE bChannels,
+                                     BYTE bBits, DWORD dwFlags);
+void SMDI_FreeConverter(SMDI_Converter* conv);
+
+/* Convert dwFrames frames from lpIn to lpOut; returns the bytes written */
+DWORD SMDI_ConvertFrames(SMDI_Converter* conv, void* lpOut, const void* lpIn, DWORD dwFrames);
+
+/* FALSE if data in lpFormat can be sent as bBits-bit samples as it is */
+BOOL SMDI_NeedsConversion(const SMDI_PCMFormat* lpFormat, BYTE bBits);
+
+/* Upload source converting the data of src, which is in lpFormat, to
+   bBits-bit samples packet by packet; src's header gives the channels,
+   length, loop and name. Owns src from then on and closes it on
+   failure. */
+SMDI_SampleSource* SMDI_OpenConvertSource(SMDI_SampleSource* src, const SMDI_PCMFormat* lpFormat,
+                                          BYTE bBits, DWORD dwFlags);
+
+/* Kernel converting to 16 bits, numbered as the kernels of smdi_swap.h:
+   the fastest one the build and the CPU support, found on first use */
+DWORD SMDI_GetConvertKernel(void);
+
+/* Use another kernel; FALSE if the build or the CPU lacks it */
+BOOL SMDI_SetConvertKernel(DWORD dwKernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_CONVERT_H */
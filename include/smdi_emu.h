@@ -0,0 +1,76 @@
+/*
+ * In-process SMDI sampler emulator
+ * Implements the aspi_irix.h API with a software sampler so the SMDI
+ * stack can be exercised and benchmarked without SCSI hardware.
+ */
+
+#ifndef _SMDI_EMU_H
+#define _SMDI_EMU_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Samplers the emulator can hold at once */
+#define SMDI_EMU_MAX_DEVICES    8
+
+/* Emulated sampler configuration */
+typedef struct {
+    BYTE  HA_ID;                /* Host adapter the sampler answers on, below 16 */
+    BYTE  SCSI_ID;              /* Target ID the sampler answers on */
+    DWORD dwMemorySize;         /* Sample memory in bytes */
+    DWORD dwMaxSampleNumber;    /* Highest valid sample number */
+    DWORD dwPacketSize;         /* Largest data packet length the sampler accepts */
+    DWORD dwMaxTransfer;        /* Host adapter transfer limit in bytes, 0 = 24-bit limit */
+    DWORD dwLatency;            /* Processing time per command, microseconds */
+    DWORD dwBusRate;            /* Bus transfer rate in bytes/s, 0 = unlimited; the
+                                   samplers on one host adapter share the bus */
+    DWORD dwWaitEvery;          /* Answer every Nth data packet with WAIT, 0 = never */
+    DWORD dwWaitTime;           /* Busy time after a WAIT, microseconds */
+    char  cVendor[9];           /* Inquiry vendor */
+    char  cProduct[17];         /* Inquiry product */
+} SMDI_EmuConfig;
+
+/* Emulator activity counters */
+typedef struct {
+    DWORD dwCommands;           /* SMDI messages received */
+    DWORD dwReads;              /* READs issued by the host */
+    DWORD dwEmptyReads;         /* READs issued before an answer was ready */
+    DWORD dwWaits;              /* WAIT answers sent */
+    DWORD dwRejects;            /* Message Reject answers sent */
+    DWORD dwBytesIn;            /* Bytes written by the host */
+    DWORD dwBytesOut;           /* Bytes read by the host */
+} SMDI_EmuStats;
+
+/* Fill a configuration with the defaults (16 MB, 1000 samples, 0:5) */
+void SMDI_EmuGetDefaultConfig(SMDI_EmuConfig* config);
+
+/* Apply a configuration to a single sampler; drops all other samplers
+   and all stored samples */
+void SMDI_EmuConfigure(const SMDI_EmuConfig* config);
+
+/* Add another sampler on its own address; FALSE if the address is taken
+   or SMDI_EMU_MAX_DEVICES samplers are configured */
+BOOL SMDI_EmuAddDevice(const SMDI_EmuConfig* config);
+
+/* Direct the functions below to the sampler at HA_ID:SCSI_ID; FALSE if
+   there is none. The first sampler configured is selected at first. */
+BOOL SMDI_EmuSelectDevice(BYTE HA_ID, BYTE SCSI_ID);
+
+/* Store a sample directly in emulated memory (for seeding benchmarks) */
+BOOL SMDI_EmuStoreSample(DWORD sample_number, SMDI_SampleHeader* header, const void* data);
+
+/* Read back the data of a stored sample, NULL if the slot is empty */
+const void* SMDI_EmuGetSampleData(DWORD sample_number, DWORD* size);
+
+/* Get and reset the activity counters */
+void SMDI_EmuGetStats(SMDI_EmuStats* stats);
+void SMDI_EmuResetStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_EMU_H */
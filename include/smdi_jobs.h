@@ -0,0 +1,125 @@
+/*
+ * SMDI job queue for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_JOBS_H
+#define _SMDI_JOBS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Job kinds */
+#define SMDI_JOB_UPLOAD            1
+#define SMDI_JOB_DOWNLOAD          2
+#define SMDI_JOB_DELETE            3
+#define SMDI_JOB_RENAME            4
+
+/* Job states */
+#define SMDI_JOB_QUEUED            0
+#define SMDI_JOB_RUNNING           1
+#define SMDI_JOB_DONE              2
+#define SMDI_JOB_FAILED            3
+#define SMDI_JOB_CANCELLED         4
+
+/* Priorities, lower runs first */
+#define SMDI_PRIORITY_INTERACTIVE  0
+#define SMDI_PRIORITY_BATCH        1
+
+/* Size of a job whose size is not known, ordered after every other */
+#define SMDI_JOB_SIZE_UNKNOWN      ((DWORD)-1)
+
+/* Opens the source of an upload queued by file name for the queue's
+   connection, whose target bits and conversion options a sample file is
+   converted with; NULL on failure */
+typedef SMDI_SampleSource* (*SMDI_SourceOpener)(const char* cFileName, SMDI_Connection* conn);
+
+/* State of one job */
+typedef struct SMDI_JobInfo
+{
+  DWORD dwStructSize;
+  DWORD dwJobID;                        /* Nonzero, unique per queue */
+  DWORD dwKind;                         /* SMDI_JOB_UPLOAD... */
+  DWORD dwPriority;
+  DWORD dwState;                        /* SMDI_JOB_QUEUED... */
+  DWORD dwSampleNumber;
+  DWORD dwBytes;                        /* Sample data size, SMDI_JOB_SIZE_UNKNOWN if not known */
+  DWORD dwDone;                         /* Sample data bytes transferred so far */
+  DWORD dwResult;                       /* Final answer or file error once the job has ended */
+  DWORD dwError;                        /* Error code if the device rejected the job, else 0 */
+  DWORD dwUserData;                     /* Given when the job was queued */
+  char cName[MAX_PATH];                 /* Upload file name or new sample name, else empty */
+} SMDI_JobInfo;
+
+/* Jobs of one connection, run one after another on a worker thread */
+typedef struct SMDI_JobQueue SMDI_JobQueue;
+
+/* Receives every change of a job's state and the progress of running
+   transfers, on the queue's threads (or on the caller's thread when a
+   queued job is cancelled); job is NULL when the queue has run dry */
+typedef void (*SMDI_JobCallback)(SMDI_JobInfo* job, DWORD dwUserData);
+
+/* Job queue
+ * The worker owns the connection while jobs are queued or running: the
+ * next job starts as soon as the previous one ends. Interactive jobs run
+ * before batch jobs, and within a priority smaller jobs before larger
+ * ones (deletes and renames count as empty), then in queue order. A
+ * paused queue finishes its running job and starts no other. Ended jobs
+ * are kept until collected with SMDI_CollectJob.
+ */
+SMDI_JobQueue* SMDI_OpenJobQueue(SMDI_Connection* conn, SMDI_JobCallback callback, DWORD dwUserData);
+
+/* Cancel every job, wait for the worker and free the queue */
+void SMDI_CloseJobQueue(SMDI_JobQueue* queue);
+
+/* Queue a job; each returns its ID, or 0 if it could not be queued. The
+   queue owns source and sink from then on, and closes them on failure.
+   An upload queued by file name is opened when it starts, through
+   lpOpen or, if NULL, as a native sample file. A download's header may
+   be NULL to have it requested when the job starts. */
+DWORD SMDI_QueueUpload(SMDI_JobQueue* queue, DWORD dwSampleNumber, SMDI_SampleSource* src,
+                       DWORD dwPriority, DWORD dwUserData);
+DWORD SMDI_QueueUploadFile(SMDI_JobQueue* queue, DWORD dwSampleNumber, const char* cFileName,
+                           SMDI_SourceOpener lpOpen, DWORD dwPriority, DWORD dwUserData);
+DWORD SMDI_QueueDownload(SMDI_JobQueue* queue, DWORD dwSampleNumber, SMDI_SampleSink* sink,
+                         SMDI_SampleHeader* sh, DWORD dwPriority, DWORD dwUserData);
+DWORD SMDI_QueueDelete(SMDI_JobQueue* queue, DWORD dwSampleNumber,
+                       DWORD dwPriority, DWORD dwUserData);
+DWORD SMDI_QueueRename(SMDI_JobQueue* queue, DWORD dwSampleNumber, const char* cName,
+                       DWORD dwPriority, DWORD dwUserData);
+
+/* Cancel a job: a queued one ends at once, a running transfer at its
+   next packet. FALSE if the job is not queued or running. */
+BOOL SMDI_CancelJob(SMDI_JobQueue* queue, DWORD dwJobID);
+
+/* Cancel every queued and running job */
+void SMDI_CancelAllJobs(SMDI_JobQueue* queue);
+
+/* Move a queued job to another priority; FALSE if it is not queued */
+BOOL SMDI_SetJobPriority(SMDI_JobQueue* queue, DWORD dwJobID, DWORD dwPriority);
+
+/* Stop or resume starting jobs */
+void SMDI_PauseJobQueue(SMDI_JobQueue* queue, BOOL bPause);
+
+/* State of a queued or running job; FALSE if there is none */
+BOOL SMDI_GetJobInfo(SMDI_JobQueue* queue, DWORD dwJobID, SMDI_JobInfo* info);
+
+/* Take the oldest ended job; FALSE if none has ended */
+BOOL SMDI_CollectJob(SMDI_JobQueue* queue, SMDI_JobInfo* info);
+
+/* Jobs queued and running */
+DWORD SMDI_PendingJobs(SMDI_JobQueue* queue);
+
+/* Wait until no job is queued or running and the callback has been told
+   the queue ran dry; a paused queue with jobs waits for them to be
+   resumed or cancelled */
+void SMDI_WaitJobQueue(SMDI_JobQueue* queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_JOBS_H */
@@ -0,0 +1,56 @@
+/*
+ * SMDI sample rate conversion for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_RESAMPLE_H
+#define _SMDI_RESAMPLE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Filter taps per output sample; the filter reaches this many input
+   samples around each output sample */
+#define SMDI_RESAMPLE_TAPS         64
+
+/* Most filter phases kept for a ratio; ratios needing more use the
+   nearest phase */
+#define SMDI_RESAMPLE_MAX_PHASES   512
+
+/* Sample rate of a header period in nanoseconds, rounded to whole Hz
+   and snapped to the standard rate it stands for (20833 ns is 48000 Hz) */
+DWORD SMDI_PeriodToRate(DWORD dwPeriod);
+
+/* Period in nanoseconds of a sample rate, rounded */
+DWORD SMDI_RateToPeriod(DWORD dwRate);
+
+/* Upload source resampling the 8- or 16-bit device words of src from
+   dwSourceRate (0: the rate of src's header period) to dwTargetRate
+   packet by packet. The header gets the new period and length, and
+   loop points moved to the same times. Owns src from then on and closes
+   it on failure. */
+SMDI_SampleSource* SMDI_OpenResampleSource(SMDI_SampleSource* src, DWORD dwSourceRate,
+                                           DWORD dwTargetRate);
+
+/* Frames dwFrames frames at dwSourceRate become at dwTargetRate */
+DWORD SMDI_ResampledLength(DWORD dwFrames, DWORD dwSourceRate, DWORD dwTargetRate);
+
+/* Create the lock the filter banks are shared under and pick the
+   kernel; called by SMDI_Init, before any upload is resampled */
+BOOL SMDI_InitResample(void);
+
+/* Kernel running the filter, numbered as the kernels of smdi_swap.h:
+   the fastest one the build and the CPU support, found on first use */
+DWORD SMDI_GetResampleKernel(void);
+
+/* Use another kernel; FALSE if the build or the CPU lacks it */
+BOOL SMDI_SetResampleKernel(DWORD dwKernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_RESAMPLE_H */
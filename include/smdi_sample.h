@@ -12,8 +12,20 @@ extern "C" {
 
 #include "smdi.h"
 
-/* Native sample file signature */
+/* Native sample file signature; version 2 is written, version 1 read */
 #define SAMPLE_FILE_SIGNATURE "SDMP"
+#define SAMPLE_FILE_VERSION   2
+
+/* Native sample file layout: fixed header fields, the name, then zeros
+   up to the data, which starts on a SAMPLE_DATA_ALIGN boundary */
+#define SAMPLE_HEADER_SIZE    64
+#define SAMPLE_DATA_ALIGN     4096
+
+/* Native sample file flags */
+#define SAMPLE_FLAG_HASH      0x00000001  /* content_hash is set */
+
+/* First value of SMDI_HashData */
+#define SAMPLE_HASH_INIT      2166136261UL
 
 /* Loop types */
 #define SAMPLE_LOOP_NONE          0
@@ -37,6 +49,26 @@ typedef struct {
     DWORD data_size;           /* Size in bytes */
 } SMDI_Sample;
 
+/* A whole file in memory: mapped where the system allows, read in
+   otherwise */
+typedef struct {
+    unsigned char* data;       /* The file's bytes, read only */
+    DWORD size;                /* Bytes at data */
+    BOOL  mapped;              /* FALSE if the file was read instead */
+} SMDI_FileMap;
+
+/* Header of a native sample file */
+typedef struct {
+    DWORD version;             /* 1 or 2 */
+    DWORD flags;               /* SAMPLE_FLAG_* */
+    DWORD data_offset;         /* Of the sample data, from the file start */
+    DWORD data_size;           /* Bytes of sample data */
+    DWORD content_hash;        /* SMDI_HashData of the sample data */
+    DWORD sample_rate;         /* In Hz */
+    SMDI_SampleHeader header;  /* Format, loop, pitch and name; dwDataOffset
+                                  is data_offset */
+} SMDI_SampleFileHeader;
+
 /* Create a new sample */
 SMDI_Sample* SMDI_CreateSample(DWORD sample_rate, BYTE bits_per_sample, 
                              BYTE channels, DWORD sample_count);
@@ -44,7 +76,8 @@ SMDI_Sample* SMDI_CreateSample(DWORD sample_rate, BYTE bits_per_sample,
 /* Free a sample */
 void SMDI_FreeSample(SMDI_Sample* sample);
 
-/* Convert SMDI sample header to our sample structure */
+/* Convert SMDI sample header to our sample structure; with data NULL the
+   sample data is left unfilled for the caller to receive into */
 SMDI_Sample* SMDI_HeaderToSample(SMDI_SampleHeader* header, void* data);
 
 /* Convert our sample structure to SMDI sample header */
@@ -56,6 +89,79 @@ BOOL SMDI_SaveSample(SMDI_Sample* sample, const char* filename);
 /* Load a sample from a file */
 SMDI_Sample* SMDI_LoadSample(const char* filename);
 
+/* Open an in-memory sample as an upload source; the sample must stay
+   until the source is closed */
+SMDI_SampleSource* SMDI_OpenSampleSource(SMDI_Sample* sample);
+
+/* Big-endian 32-bit field at p, as the native file formats store them */
+DWORD SMDI_Get32(const unsigned char* p);
+void SMDI_Put32(unsigned char* p, DWORD v);
+
+/* FNV-1a hash of length bytes, continuing from hash (SAMPLE_HASH_INIT
+   for the first bytes) */
+DWORD SMDI_HashData(DWORD hash, const void* data, DWORD length);
+
+/* Encode a version 2 header into buffer, which holds SAMPLE_DATA_ALIGN
+   bytes: everything up to fh->data_offset, which is set, is written.
+   Returns data_offset. */
+DWORD SMDI_EncodeSampleFileHeader(SMDI_SampleFileHeader* fh, unsigned char* buffer);
+
+/* Decode the header from the first size bytes of a native sample file,
+   version 1 or 2; FALSE if they do not hold one or fail the header
+   checksum. The data is not checked. */
+BOOL SMDI_DecodeSampleFileHeader(const unsigned char* data, DWORD size, SMDI_SampleFileHeader* fh);
+
+/* Load the native sample image at offset in a mapped file, whose header
+   fh has been decoded; NULL if its data is cut short or fails its hash */
+SMDI_Sample* SMDI_LoadMappedSample(const SMDI_FileMap* map, DWORD offset, SMDI_SampleFileHeader* fh);
+
+/* Open the native sample image at offset in a mapped file as an upload
+   source, whose data is copied out of the mapping into each packet and
+   checked against its hash. The source takes the mapping over, and
+   unmaps it when closed or if NULL is returned. */
+SMDI_SampleSource* SMDI_OpenMappedSource(SMDI_FileMap* map, DWORD offset, SMDI_SampleFileHeader* fh);
+
+/* A sample file opened for its header only. Format, loop and name are
+   parsed when it is opened; the data stays in the file until it is
+   loaded or an upload reads its first packet. */
+typedef struct SMDI_SampleFile {
+    SMDI_Sample Info;          /* As the sampler gets it; data_size is the
+                                  bytes an upload sends, sample_data NULL */
+    char cFileName[MAX_PATH];
+    SMDI_SampleSource* (*lpOpenSource)(const char* filename);  /* Of its format */
+    SMDI_Sample* (*lpLoad)(const char* filename);
+} SMDI_SampleFile;
+
+/* Make a handle for a sample file whose header the format's reader has
+   parsed into info; for the format modules */
+SMDI_SampleFile* SMDI_CreateSampleFile(const char* filename, SMDI_Sample* info,
+                                       SMDI_SampleSource* (*lpOpenSource)(const char* filename),
+                                       SMDI_Sample* (*lpLoad)(const char* filename));
+
+/* Open a native sample file for its header; only the first bytes of the
+   file are read. NULL if it is not a native sample file or its data is
+   cut short. */
+SMDI_SampleFile* SMDI_OpenSampleFile(const char* filename);
+
+/* Open a sample file as an upload source. The file is opened and mapped
+   when the first packet is read, and the read fails if the file no
+   longer holds a sample of the format and length it was opened with.
+   The source does not refer to the handle. */
+SMDI_SampleSource* SMDI_OpenSampleFileSource(SMDI_SampleFile* file);
+
+/* Load the data of a sample file; NULL if it cannot be read or no longer
+   holds the sample it was opened with */
+SMDI_Sample* SMDI_LoadSampleFile(SMDI_SampleFile* file);
+
+/* Release a sample file handle */
+void SMDI_CloseSampleFile(SMDI_SampleFile* file);
+
+/* Map a whole file into memory; FALSE if it cannot be read or is empty */
+BOOL SMDI_MapFile(const char* filename, SMDI_FileMap* map);
+
+/* Release a file mapped with SMDI_MapFile */
+void SMDI_UnmapFile(SMDI_FileMap* map);
+
 #ifdef __cplusplus
 }
 #endif
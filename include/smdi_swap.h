@@ -0,0 +1,44 @@
+/*
+ * SMDI sample data byte order conversion for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_SWAP_H
+#define _SMDI_SWAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Kernels swapping the bytes of 16-bit words */
+#define SMDI_SWAP_SCALAR           0    /* Portable C, always available */
+#define SMDI_SWAP_SSE2             1    /* x86 SSE2, 32 bytes per step */
+#define SMDI_SWAP_AVX2             2    /* x86 AVX2, 64 bytes per step */
+#define SMDI_SWAP_NEON             3    /* ARM NEON, 32 bytes per step */
+#define SMDI_SWAP_KERNELS          4
+
+/* Copy dwLength bytes of sample data from src to dest as dwCopyMode
+   (CM_NORMAL...) says; dest may be src to convert in place, but the two
+   must not overlap otherwise. A trailing odd byte is copied as it is. */
+void SMDI_CopySwap(void* dest, const void* src, DWORD dwLength, DWORD dwCopyMode);
+
+/* TRUE if dwCopyMode changes the data on this host */
+BOOL SMDI_CopyModeSwaps(DWORD dwCopyMode);
+
+/* Kernel in use: the fastest one the build and the CPU support, found
+   on first use */
+DWORD SMDI_GetSwapKernel(void);
+
+/* Use another kernel; FALSE if the build or the CPU lacks it */
+BOOL SMDI_SetSwapKernel(DWORD dwKernel);
+
+/* Name of a kernel, e.g. "sse2" */
+const char* SMDI_SwapKernelName(DWORD dwKernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_SWAP_H */
@@ -0,0 +1,44 @@
+/*
+ * SMDI threads and semaphores for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_THREAD_H
+#define _SMDI_THREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+
+/* Threads are sproc() share groups on IRIX 5.3 and POSIX threads
+   elsewhere, or on IRIX when built with -DSMDI_PTHREADS */
+typedef struct SMDI_Thread SMDI_Thread;
+
+/* Counting semaphore; a post makes the memory written before it visible
+   to the thread whose wait it ends */
+typedef struct SMDI_Semaphore SMDI_Semaphore;
+
+/* Run lpProc(lpArg) in a new thread sharing the address space; NULL if
+   it could not be started */
+SMDI_Thread* SMDI_StartThread(void (*lpProc)(void*), void* lpArg);
+
+/* Wait for a thread to return and free it */
+void SMDI_JoinThread(SMDI_Thread* thread);
+
+/* Semaphore with dwCount initial units; NULL on failure */
+SMDI_Semaphore* SMDI_CreateSemaphore(DWORD dwCount);
+void SMDI_FreeSemaphore(SMDI_Semaphore* sem);
+
+/* Take a unit, blocking until one is posted */
+void SMDI_WaitSemaphore(SMDI_Semaphore* sem);
+
+/* Return a unit, waking one waiter */
+void SMDI_PostSemaphore(SMDI_Semaphore* sem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_THREAD_H */
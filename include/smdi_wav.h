@@ -0,0 +1,73 @@
+/*
+ * SMDI WAV file format support for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ */
+
+#ifndef _SMDI_WAV_H
+#define _SMDI_WAV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "smdi.h"
+#include "smdi_sample.h"
+#include "smdi_convert.h"
+
+/* A WAV or Broadcast WAV file mapped into memory. The frames are left
+   where they are in the file, in the layout Format gives. */
+typedef struct SMDI_WAVFile
+{
+  SMDI_Sample Info;                     /* Format, loop and name as the sampler
+                                           gets them: 8-bit samples as 8 bits,
+                                           others as 16 bits; no data */
+  SMDI_PCMFormat Format;                /* Layout of lpFrames */
+  const unsigned char* lpFrames;        /* data chunk frames inside the mapping */
+  DWORD dwDataSize;                     /* Bytes at lpFrames */
+  SMDI_FileMap Map;                     /* The whole file */
+} SMDI_WAVFile;
+
+/* Map a WAV file and parse its fmt, data, smpl, inst, LIST INFO and bext
+   chunks: PCM of 8 to 32 bits, 32-bit float and WAVE_FORMAT_EXTENSIBLE
+   of either; NULL if it cannot be read or its format is not supported */
+SMDI_WAVFile* SMDI_OpenWAVFile(const char* filename);
+void SMDI_CloseWAVFile(SMDI_WAVFile* wav);
+
+/* Load a WAV file into SMDI sample format */
+SMDI_Sample* SMDI_LoadWAVSample(const char* filename);
+
+/* Load a WAV file as bBits-bit samples (8 or 16, 0 as Info has it),
+   converted with the SMDI_CONVERT_* options dwFlags */
+SMDI_Sample* SMDI_LoadWAVSampleAs(const char* filename, BYTE bBits, DWORD dwFlags);
+
+/* Open a WAV file as an upload source; frames are converted from the
+   mapped file into each packet as it is sent */
+SMDI_SampleSource* SMDI_OpenWAVSource(const char* filename);
+
+/* Open a WAV file as an upload source of bBits-bit samples, as
+   SMDI_LoadWAVSampleAs converts them */
+SMDI_SampleSource* SMDI_OpenWAVSourceAs(const char* filename, BYTE bBits, DWORD dwFlags);
+
+/* Open a WAV file for its header only; its frames are mapped when the
+   handle is loaded or an upload of it reads its first packet */
+SMDI_SampleFile* SMDI_OpenWAVSampleFile(const char* filename);
+
+/* Save SMDI sample as WAV file; use_bwf adds a Broadcast WAV bext chunk */
+BOOL SMDI_SaveWAVSample(SMDI_Sample* sample, const char* filename, int use_bwf);
+
+/* Open a WAV file as a download sink; the header is written when the
+   transfer starts and each packet's frames, in WAV byte order, as they
+   arrive */
+SMDI_SampleSink* SMDI_OpenWAVSink(const char* filename, int use_bwf);
+
+/* TRUE if filename ends in .wav or .bwf, in any case */
+BOOL SMDI_IsWAVFileName(const char* filename);
+
+/* TRUE if filename ends in .bwf, in any case: saved with a bext chunk */
+BOOL SMDI_IsBWFFileName(const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMDI_WAV_H */
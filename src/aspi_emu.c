@@ -0,0 +1,1249 @@
+/*
+ * ASPI interface backed by an in-process SMDI sampler emulator
+ * Implements the aspi_irix.h API without SCSI hardware; see smdi_emu.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "aspi_irix.h"
+#include "scsi_debug.h"
+#include "smdi.h"
+#include "smdi_emu.h"
+#include "smdi_thread.h"
+
+/* Host adapters the emulated samplers can sit on */
+#define EMU_MAX_HA          16
+
+/* Reject code for messages the emulator does not implement */
+#define EMU_REJECT_UNSUPPORTED 0x00000000
+
+/* Transfer states */
+#define EMU_IDLE            0
+#define EMU_UPLOAD_HEADER   1   /* Sample header accepted, waiting for Begin */
+#define EMU_UPLOAD          2   /* Receiving data packets */
+#define EMU_DOWNLOAD        3   /* Sending data packets */
+
+/* One occupied sample slot */
+typedef struct {
+    DWORD number;
+    SMDI_SampleHeader header;
+    unsigned char *data;
+    DWORD size;
+} emu_slot_t;
+
+/* Emulated sampler state */
+typedef struct {
+    SMDI_EmuConfig config;
+    SMDI_EmuStats stats;
+
+    /* Occupied slots, sorted by sample number */
+    emu_slot_t *slots;
+    DWORD slot_count;
+    DWORD slot_alloc;
+    DWORD memory_used;
+
+    /* Answer waiting to be read */
+    unsigned char *answer;
+    DWORD answer_len;
+    DWORD answer_alloc;
+    int answer_pending;
+    unsigned long answer_ready;       /* Time the answer becomes readable */
+
+    /* Answer held back behind a WAIT */
+    unsigned char *deferred;
+    DWORD deferred_len;
+    int deferred_pending;
+    unsigned long busy_until;         /* TEST UNIT READY fails until then */
+
+    /* Transfer in progress */
+    int state;
+    DWORD xfer_number;
+    DWORD xfer_packet_size;
+    SMDI_SampleHeader xfer_header;
+    unsigned char *xfer_data;
+    DWORD xfer_size;
+    DWORD xfer_received;
+    DWORD data_packets;
+
+    /* Handle bookkeeping to mirror the real backends */
+    int refcount;
+} emu_sampler_t;
+
+static emu_sampler_t emu_devices[SMDI_EMU_MAX_DEVICES];
+static int emu_count = 0;
+static ASPI_HandleStats aspi_stats;
+
+/* Guards aspi_stats and the samplers' refcounts; created by ASPI_Check */
+static SMDI_Semaphore *emu_handle_lock = NULL;
+
+/* Sampler the control functions work on */
+static emu_sampler_t *emu_selected = NULL;
+
+/* Bus of each host adapter, held for the length of one transfer */
+static SMDI_Semaphore *emu_buses[EMU_MAX_HA];
+
+/* Current time in microseconds */
+static unsigned long emu_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (unsigned long)tv.tv_sec * 1000000UL + (unsigned long)tv.tv_usec;
+}
+
+/* Sleep for a number of microseconds */
+static void emu_sleep_us(unsigned long us)
+{
+    struct timeval tv;
+
+    if (us == 0)
+    {
+        return;
+    }
+
+    tv.tv_sec = us / 1000000UL;
+    tv.tv_usec = us % 1000000UL;
+    select(0, NULL, NULL, NULL, &tv);
+}
+
+/* Model the time a transfer of size bytes spends on the bus; samplers
+   on one host adapter wait for each other's transfers */
+static void emu_bus_transfer(emu_sampler_t *emu, unsigned long size)
+{
+    SMDI_Semaphore *bus;
+
+    if (emu->config.dwBusRate > 0)
+    {
+        bus = emu_buses[emu->config.HA_ID];
+        if (bus != NULL)
+        {
+            SMDI_WaitSemaphore(bus);
+        }
+        emu_sleep_us((unsigned long)((double)size * 1000000.0 / (double)emu->config.dwBusRate));
+        if (bus != NULL)
+        {
+            SMDI_PostSemaphore(bus);
+        }
+    }
+}
+
+/* Read big-endian values from a message */
+static DWORD emu_get24(const unsigned char *p)
+{
+    return ((DWORD)p[0] << 16) | ((DWORD)p[1] << 8) | (DWORD)p[2];
+}
+
+static DWORD emu_get32(const unsigned char *p)
+{
+    return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+}
+
+/* Write big-endian values into a message */
+static void emu_put24(unsigned char *p, DWORD v)
+{
+    p[0] = (unsigned char)((v >> 16) & 0xFF);
+    p[1] = (unsigned char)((v >> 8) & 0xFF);
+    p[2] = (unsigned char)(v & 0xFF);
+}
+
+static void emu_put32(unsigned char *p, DWORD v)
+{
+    p[0] = (unsigned char)((v >> 24) & 0xFF);
+    p[1] = (unsigned char)((v >> 16) & 0xFF);
+    p[2] = (unsigned char)((v >> 8) & 0xFF);
+    p[3] = (unsigned char)(v & 0xFF);
+}
+
+/* Bytes of sample data described by a header */
+static DWORD emu_data_size(const SMDI_SampleHeader *sh)
+{
+    return (sh->dwLength * (DWORD)sh->NumberOfChannels * (DWORD)sh->BitsPerWord) / 8;
+}
+
+/* Free everything held by the sampler */
+static void emu_clear(emu_sampler_t *emu)
+{
+    DWORD i;
+
+    for (i = 0; i < emu->slot_count; i++)
+    {
+        free(emu->slots[i].data);
+    }
+    free(emu->slots);
+    free(emu->answer);
+    free(emu->deferred);
+    free(emu->xfer_data);
+
+    emu->slots = NULL;
+    emu->slot_count = 0;
+    emu->slot_alloc = 0;
+    emu->memory_used = 0;
+    emu->answer = NULL;
+    emu->answer_alloc = 0;
+    emu->answer_pending = 0;
+    emu->deferred = NULL;
+    emu->deferred_pending = 0;
+    emu->xfer_data = NULL;
+    emu->state = EMU_IDLE;
+}
+
+/* Make sure the emulator has a configuration */
+static void emu_init(void)
+{
+    SMDI_EmuConfig config;
+
+    if (emu_count == 0)
+    {
+        SMDI_EmuGetDefaultConfig(&config);
+        SMDI_EmuConfigure(&config);
+    }
+}
+
+/* Find the sampler a command is addressed to, NULL if there is none */
+static emu_sampler_t *emu_addressed(unsigned char ha_id, unsigned char id)
+{
+    int i;
+
+    emu_init();
+
+    for (i = 0; i < emu_count; i++)
+    {
+        if (ha_id == emu_devices[i].config.HA_ID && id == emu_devices[i].config.SCSI_ID)
+        {
+            return &emu_devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the slot index of a sample, or where it would be inserted */
+static DWORD emu_find(emu_sampler_t *emu, DWORD number, int *found)
+{
+    DWORD lo;
+    DWORD hi;
+    DWORD mid;
+
+    lo = 0;
+    hi = emu->slot_count;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (emu->slots[mid].number < number)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    *found = (lo < emu->slot_count && emu->slots[lo].number == number);
+    return lo;
+}
+
+/* Remove a sample from memory */
+static void emu_delete(emu_sampler_t *emu, DWORD number)
+{
+    DWORD index;
+    int found;
+
+    index = emu_find(emu, number, &found);
+    if (!found)
+    {
+        return;
+    }
+
+    emu->memory_used -= emu->slots[index].size;
+    free(emu->slots[index].data);
+    memmove(&emu->slots[index], &emu->slots[index + 1],
+            (emu->slot_count - index - 1) * sizeof(emu_slot_t));
+    emu->slot_count--;
+}
+
+/* Put a sample into memory, replacing an existing one. Takes ownership of data. */
+static int emu_store(emu_sampler_t *emu, DWORD number, const SMDI_SampleHeader *sh,
+                     unsigned char *data, DWORD size)
+{
+    DWORD index;
+    int found;
+    emu_slot_t *grown;
+
+    emu_delete(emu, number);
+
+    if (emu->slot_count == emu->slot_alloc)
+    {
+        grown = (emu_slot_t*)realloc(emu->slots,
+                                     (emu->slot_alloc + 64) * sizeof(emu_slot_t));
+        if (grown == NULL)
+        {
+            return 0;
+        }
+        emu->slots = grown;
+        emu->slot_alloc += 64;
+    }
+
+    index = emu_find(emu, number, &found);
+    memmove(&emu->slots[index + 1], &emu->slots[index],
+            (emu->slot_count - index) * sizeof(emu_slot_t));
+    emu->slot_count++;
+
+    emu->slots[index].number = number;
+    memcpy(&emu->slots[index].header, sh, sizeof(SMDI_SampleHeader));
+    emu->slots[index].header.bDoesExist = TRUE;
+    emu->slots[index].data = data;
+    emu->slots[index].size = size;
+    emu->memory_used += size;
+
+    return 1;
+}
+
+/* Make room for an answer of the given total length */
+static unsigned char *emu_answer_buffer(emu_sampler_t *emu, DWORD length)
+{
+    unsigned char *grown;
+
+    if (length > emu->answer_alloc)
+    {
+        grown = (unsigned char*)realloc(emu->answer, length);
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        emu->answer = grown;
+        emu->answer_alloc = length;
+    }
+
+    return emu->answer;
+}
+
+/* Start an answer message and return a pointer to it */
+static unsigned char *emu_begin_answer(emu_sampler_t *emu, DWORD message_id, DWORD additional_length)
+{
+    unsigned char *m;
+
+    m = emu_answer_buffer(emu, 11 + additional_length);
+    if (m == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(m, "SMDI", 4);
+    emu_put32(&m[4], message_id);
+    emu_put24(&m[8], additional_length);
+
+    emu->answer_len = 11 + additional_length;
+    emu->answer_pending = 1;
+    emu->answer_ready = emu_now() + emu->config.dwLatency;
+
+    return m;
+}
+
+/* Answer with a Message Reject carrying an SMDI error code */
+static void emu_reject(emu_sampler_t *emu, DWORD error)
+{
+    unsigned char *m;
+
+    m = emu_begin_answer(emu, SMDIM_MESSAGEREJECT, 4);
+    if (m != NULL)
+    {
+        emu_put32(&m[11], error);
+    }
+    emu->stats.dwRejects++;
+}
+
+/* Answer with a message that carries only a sample or packet number */
+static void emu_answer_number(emu_sampler_t *emu, DWORD message_id, DWORD number)
+{
+    unsigned char *m;
+
+    m = emu_begin_answer(emu, message_id, 3);
+    if (m != NULL)
+    {
+        emu_put24(&m[11], number);
+    }
+}
+
+/* Answer with a Transfer Acknowledge */
+static void emu_transfer_ack(emu_sampler_t *emu, DWORD number, DWORD packet_size)
+{
+    unsigned char *m;
+
+    m = emu_begin_answer(emu, SMDIM_TRANSFERACKNOWLEDGE, 6);
+    if (m != NULL)
+    {
+        emu_put24(&m[11], number);
+        emu_put24(&m[14], packet_size);
+    }
+}
+
+/* Master Identify */
+static void emu_master_identify(emu_sampler_t *emu)
+{
+    emu_begin_answer(emu, SMDIM_SLAVEIDENTIFY, 0);
+}
+
+/* Sample Header Request */
+static void emu_header_request(emu_sampler_t *emu, const unsigned char *msg)
+{
+    DWORD number;
+    DWORD index;
+    int found;
+    SMDI_SampleHeader *sh;
+    unsigned char *m;
+
+    number = emu_get24(&msg[11]);
+    if (number > emu->config.dwMaxSampleNumber)
+    {
+        emu_reject(emu, SMDIE_OUTOFRANGE);
+        return;
+    }
+
+    index = emu_find(emu, number, &found);
+    if (!found)
+    {
+        emu_reject(emu, SMDIE_NOSAMPLE);
+        return;
+    }
+
+    sh = &emu->slots[index].header;
+    m = emu_begin_answer(emu, SMDIM_SAMPLEHEADER, 0x1a + (DWORD)sh->NameLength);
+    if (m == NULL)
+    {
+        return;
+    }
+
+    emu_put24(&m[11], number);
+    m[14] = sh->BitsPerWord;
+    m[15] = sh->NumberOfChannels;
+    emu_put24(&m[16], sh->dwPeriod);
+    emu_put32(&m[19], sh->dwLength);
+    emu_put32(&m[23], sh->dwLoopStart);
+    emu_put32(&m[27], sh->dwLoopEnd);
+    m[31] = sh->LoopControl;
+    m[32] = (unsigned char)((sh->wPitch >> 8) & 0xFF);
+    m[33] = (unsigned char)(sh->wPitch & 0xFF);
+    m[34] = (unsigned char)((sh->wPitchFraction >> 8) & 0xFF);
+    m[35] = (unsigned char)(sh->wPitchFraction & 0xFF);
+    m[36] = sh->NameLength;
+    memcpy(&m[37], sh->cName, sh->NameLength);
+}
+
+/* Sample Header sent by the host: start of an upload */
+static void emu_sample_header(emu_sampler_t *emu, const unsigned char *msg, DWORD length)
+{
+    SMDI_SampleHeader sh;
+    DWORD number;
+    DWORD size;
+    DWORD replaced;
+    DWORD index;
+    int found;
+
+    if (length < 37)
+    {
+        emu_reject(emu, EMU_REJECT_UNSUPPORTED);
+        return;
+    }
+
+    memset(&sh, 0, sizeof(sh));
+    sh.dwStructSize = sizeof(sh);
+    number = emu_get24(&msg[11]);
+    sh.BitsPerWord = msg[14];
+    sh.NumberOfChannels = msg[15];
+    sh.dwPeriod = emu_get24(&msg[16]);
+    sh.dwLength = emu_get32(&msg[19]);
+    sh.dwLoopStart = emu_get32(&msg[23]);
+    sh.dwLoopEnd = emu_get32(&msg[27]);
+    sh.LoopControl = msg[31];
+    sh.wPitch = (WORD)(((WORD)msg[32] << 8) | msg[33]);
+    sh.wPitchFraction = (WORD)(((WORD)msg[34] << 8) | msg[35]);
+    sh.NameLength = msg[36];
+    if (37 + (DWORD)sh.NameLength > length)
+    {
+        sh.NameLength = (BYTE)(length - 37);
+    }
+    memcpy(sh.cName, &msg[37], sh.NameLength);
+
+    if (number > emu->config.dwMaxSampleNumber)
+    {
+        emu_reject(emu, SMDIE_OUTOFRANGE);
+        return;
+    }
+
+    if ((sh.BitsPerWord != 8 && sh.BitsPerWord != 16) ||
+        sh.NumberOfChannels == 0 || sh.dwPeriod == 0)
+    {
+        emu_reject(emu, SMDIE_UNSUPPSAMBITS);
+        return;
+    }
+
+    /* The sample being replaced gives its memory back */
+    size = emu_data_size(&sh);
+    index = emu_find(emu, number, &found);
+    replaced = found ? emu->slots[index].size : 0;
+
+    if (size > emu->config.dwMemorySize - emu->memory_used + replaced)
+    {
+        emu_reject(emu, SMDIE_NOMEMORY);
+        return;
+    }
+
+    memcpy(&emu->xfer_header, &sh, sizeof(sh));
+    emu->xfer_number = number;
+    emu->xfer_size = size;
+    emu->state = EMU_UPLOAD_HEADER;
+
+    emu_transfer_ack(emu, number, emu->config.dwPacketSize);
+}
+
+/* Begin Sample Transfer: starts an upload after a header, otherwise a download */
+static void emu_begin_transfer(emu_sampler_t *emu, const unsigned char *msg)
+{
+    DWORD number;
+    DWORD packet_size;
+    int found;
+
+    number = emu_get24(&msg[11]);
+    packet_size = emu_get24(&msg[14]);
+
+    /* The sampler never uses packets larger than it prefers */
+    if (packet_size == 0 || packet_size > emu->config.dwPacketSize)
+    {
+        packet_size = emu->config.dwPacketSize;
+    }
+
+    if (emu->state == EMU_UPLOAD_HEADER && number == emu->xfer_number)
+    {
+        free(emu->xfer_data);
+        emu->xfer_data = (unsigned char*)malloc(emu->xfer_size > 0 ? emu->xfer_size : 1);
+        if (emu->xfer_data == NULL)
+        {
+            emu->state = EMU_IDLE;
+            emu_reject(emu, SMDIE_NOMEMORY);
+            return;
+        }
+
+        emu->xfer_packet_size = packet_size;
+        emu->xfer_received = 0;
+        emu->state = EMU_UPLOAD;
+        emu_answer_number(emu, SMDIM_SENDNEXTPACKET, 0);
+        return;
+    }
+
+    if (number > emu->config.dwMaxSampleNumber)
+    {
+        emu_reject(emu, SMDIE_OUTOFRANGE);
+        return;
+    }
+
+    emu_find(emu, number, &found);
+    if (!found)
+    {
+        emu_reject(emu, SMDIE_NOSAMPLE);
+        return;
+    }
+
+    emu->xfer_number = number;
+    emu->xfer_packet_size = packet_size;
+    emu->state = EMU_DOWNLOAD;
+    emu_transfer_ack(emu, number, packet_size);
+}
+
+/* Data Packet sent by the host during an upload */
+static void emu_data_packet(emu_sampler_t *emu, const unsigned char *msg, DWORD length)
+{
+    DWORD packet;
+    DWORD offset;
+    DWORD payload;
+
+    if (emu->state != EMU_UPLOAD || length < 14)
+    {
+        emu_answer_number(emu, SMDIM_ABORTPROCEDURE, 0);
+        return;
+    }
+
+    packet = emu_get24(&msg[11]);
+    payload = length - 14;
+    offset = packet * emu->xfer_packet_size;
+
+    if (offset < emu->xfer_size)
+    {
+        if (payload > emu->xfer_size - offset)
+        {
+            payload = emu->xfer_size - offset;
+        }
+        memcpy(emu->xfer_data + offset, &msg[14], payload);
+        if (offset + payload > emu->xfer_received)
+        {
+            emu->xfer_received = offset + payload;
+        }
+    }
+
+    if (emu->xfer_received >= emu->xfer_size)
+    {
+        emu_store(emu, emu->xfer_number, &emu->xfer_header, emu->xfer_data, emu->xfer_size);
+        emu->xfer_data = NULL;
+        emu->state = EMU_IDLE;
+        emu_answer_number(emu, SMDIM_ENDOFPROCEDURE, 0);
+    }
+    else
+    {
+        emu_answer_number(emu, SMDIM_SENDNEXTPACKET, packet + 1);
+    }
+
+    /* Every Nth packet the sampler is busy and answers WAIT first */
+    emu->data_packets++;
+    if (emu->config.dwWaitEvery > 0 && emu->data_packets % emu->config.dwWaitEvery == 0)
+    {
+        emu->deferred = (unsigned char*)realloc(emu->deferred, emu->answer_len);
+        if (emu->deferred != NULL)
+        {
+            memcpy(emu->deferred, emu->answer, emu->answer_len);
+            emu->deferred_len = emu->answer_len;
+            emu->deferred_pending = 1;
+            emu->busy_until = emu_now() + emu->config.dwLatency + emu->config.dwWaitTime;
+            emu_begin_answer(emu, SMDIM_WAIT, 0);
+            emu->stats.dwWaits++;
+        }
+    }
+}
+
+/* Send Next Packet from the host during a download */
+static void emu_send_next_packet(emu_sampler_t *emu, const unsigned char *msg)
+{
+    DWORD packet;
+    DWORD offset;
+    DWORD payload;
+    DWORD index;
+    int found;
+    unsigned char *m;
+
+    if (emu->state != EMU_DOWNLOAD)
+    {
+        emu_answer_number(emu, SMDIM_ABORTPROCEDURE, 0);
+        return;
+    }
+
+    index = emu_find(emu, emu->xfer_number, &found);
+    if (!found)
+    {
+        emu->state = EMU_IDLE;
+        emu_reject(emu, SMDIE_NOSAMPLE);
+        return;
+    }
+
+    packet = emu_get24(&msg[11]);
+    offset = packet * emu->xfer_packet_size;
+
+    if (offset >= emu->slots[index].size)
+    {
+        emu->state = EMU_IDLE;
+        emu_answer_number(emu, SMDIM_ENDOFPROCEDURE, 0);
+        return;
+    }
+
+    payload = emu->slots[index].size - offset;
+    if (payload > emu->xfer_packet_size)
+    {
+        payload = emu->xfer_packet_size;
+    }
+
+    m = emu_begin_answer(emu, SMDIM_DATAPACKET, 3 + payload);
+    if (m != NULL)
+    {
+        emu_put24(&m[11], packet);
+        memcpy(&m[14], emu->slots[index].data + offset, payload);
+    }
+}
+
+/* Sample Name */
+static void emu_sample_name(emu_sampler_t *emu, const unsigned char *msg, DWORD length)
+{
+    DWORD number;
+    DWORD index;
+    DWORD name_len;
+    int found;
+
+    number = emu_get24(&msg[11]);
+    if (number > emu->config.dwMaxSampleNumber)
+    {
+        emu_reject(emu, SMDIE_OUTOFRANGE);
+        return;
+    }
+
+    index = emu_find(emu, number, &found);
+    if (!found)
+    {
+        emu_reject(emu, SMDIE_NOSAMPLE);
+        return;
+    }
+
+    name_len = (length > 15) ? msg[14] : 0;
+    if (15 + name_len > length)
+    {
+        name_len = length - 15;
+    }
+
+    memset(emu->slots[index].header.cName, 0, sizeof(emu->slots[index].header.cName));
+    memcpy(emu->slots[index].header.cName, &msg[15], name_len);
+    emu->slots[index].header.NameLength = (BYTE)name_len;
+
+    emu_begin_answer(emu, SMDIM_ACK, 0);
+}
+
+/* Delete Sample */
+static void emu_delete_sample(emu_sampler_t *emu, const unsigned char *msg)
+{
+    DWORD number;
+    int found;
+
+    number = emu_get24(&msg[11]);
+    if (number > emu->config.dwMaxSampleNumber)
+    {
+        emu_reject(emu, SMDIE_OUTOFRANGE);
+        return;
+    }
+
+    emu_find(emu, number, &found);
+    if (!found)
+    {
+        emu_reject(emu, SMDIE_NOSAMPLE);
+        return;
+    }
+
+    emu_delete(emu, number);
+    emu_begin_answer(emu, SMDIM_ACK, 0);
+}
+
+/* Process one SMDI message written by the host */
+static void emu_process(emu_sampler_t *emu, const unsigned char *msg, DWORD length)
+{
+    DWORD message_id;
+
+    emu->stats.dwCommands++;
+
+    if (length < 11 || memcmp(msg, "SMDI", 4) != 0)
+    {
+        emu_reject(emu, EMU_REJECT_UNSUPPORTED);
+        return;
+    }
+
+    message_id = emu_get32(&msg[4]);
+
+    /* Messages that carry a number need at least the 3 bytes for it */
+    if (message_id != SMDIM_MASTERIDENTIFY && message_id != SMDIM_ABORTPROCEDURE &&
+        length < 14)
+    {
+        emu_reject(emu, EMU_REJECT_UNSUPPORTED);
+        return;
+    }
+
+    switch (message_id)
+    {
+        case SMDIM_MASTERIDENTIFY:
+            emu_master_identify(emu);
+            break;
+
+        case SMDIM_SAMPLEHEADERREQUEST:
+            emu_header_request(emu, msg);
+            break;
+
+        case SMDIM_SAMPLEHEADER:
+            emu_sample_header(emu, msg, length);
+            break;
+
+        case SMDIM_BEGINSAMPLETRANSFER:
+            if (length < 17)
+            {
+                emu_reject(emu, EMU_REJECT_UNSUPPORTED);
+                break;
+            }
+            emu_begin_transfer(emu, msg);
+            break;
+
+        case SMDIM_DATAPACKET:
+            emu_data_packet(emu, msg, length);
+            break;
+
+        case SMDIM_SENDNEXTPACKET:
+            emu_send_next_packet(emu, msg);
+            break;
+
+        case SMDIM_SAMPLENAME:
+            emu_sample_name(emu, msg, length);
+            break;
+
+        case SMDIM_DELETESAMPLE:
+            emu_delete_sample(emu, msg);
+            break;
+
+        case SMDIM_ABORTPROCEDURE:
+            free(emu->xfer_data);
+            emu->xfer_data = NULL;
+            emu->state = EMU_IDLE;
+            emu_begin_answer(emu, SMDIM_ACK, 0);
+            break;
+
+        default:
+            emu_reject(emu, EMU_REJECT_UNSUPPORTED);
+            break;
+    }
+}
+
+/*
+ * Emulator control
+ */
+
+void SMDI_EmuGetDefaultConfig(SMDI_EmuConfig* config)
+{
+    if (config == NULL)
+    {
+        return;
+    }
+
+    memset(config, 0, sizeof(SMDI_EmuConfig));
+    config->HA_ID = 0;
+    config->SCSI_ID = 5;
+    config->dwMemorySize = 16 * 1024 * 1024;
+    config->dwMaxSampleNumber = 999;
+    config->dwPacketSize = PACKETSIZE;
+    config->dwMaxTransfer = 0xFFFFFF;
+    config->dwLatency = 0;
+    config->dwBusRate = 0;
+    config->dwWaitEvery = 0;
+    config->dwWaitTime = 0;
+    strcpy(config->cVendor, "SMDIEMU");
+    strcpy(config->cProduct, "Software Sampler");
+}
+
+/* Set up a sampler from a configuration */
+static void emu_setup(emu_sampler_t *emu, const SMDI_EmuConfig* config)
+{
+    memset(emu, 0, sizeof(emu_sampler_t));
+    memcpy(&emu->config, config, sizeof(SMDI_EmuConfig));
+
+    /* Packet lengths travel as 24-bit values */
+    if (emu->config.dwPacketSize == 0 || emu->config.dwPacketSize > 0xFFFFF0)
+    {
+        emu->config.dwPacketSize = PACKETSIZE;
+    }
+
+    if (emu->config.dwMaxTransfer == 0 || emu->config.dwMaxTransfer > 0xFFFFFF)
+    {
+        emu->config.dwMaxTransfer = 0xFFFFFF;
+    }
+
+    if (emu_buses[config->HA_ID] == NULL)
+    {
+        emu_buses[config->HA_ID] = SMDI_CreateSemaphore(1);
+    }
+}
+
+void SMDI_EmuConfigure(const SMDI_EmuConfig* config)
+{
+    int i;
+
+    for (i = 0; i < emu_count; i++)
+    {
+        emu_clear(&emu_devices[i]);
+    }
+
+    emu_count = 0;
+    emu_selected = NULL;
+    SMDI_EmuAddDevice(config);
+}
+
+BOOL SMDI_EmuAddDevice(const SMDI_EmuConfig* config)
+{
+    int i;
+
+    if (config == NULL || config->HA_ID >= EMU_MAX_HA || emu_count >= SMDI_EMU_MAX_DEVICES)
+    {
+        return FALSE;
+    }
+
+    for (i = 0; i < emu_count; i++)
+    {
+        if (emu_devices[i].config.HA_ID == config->HA_ID &&
+            emu_devices[i].config.SCSI_ID == config->SCSI_ID)
+        {
+            return FALSE;
+        }
+    }
+
+    emu_setup(&emu_devices[emu_count], config);
+    if (emu_selected == NULL)
+    {
+        emu_selected = &emu_devices[emu_count];
+    }
+    emu_count++;
+
+    return TRUE;
+}
+
+BOOL SMDI_EmuSelectDevice(BYTE HA_ID, BYTE SCSI_ID)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(HA_ID, SCSI_ID);
+    if (emu == NULL)
+    {
+        return FALSE;
+    }
+
+    emu_selected = emu;
+
+    return TRUE;
+}
+
+BOOL SMDI_EmuStoreSample(DWORD sample_number, SMDI_SampleHeader* header, const void* data)
+{
+    emu_sampler_t *emu;
+    unsigned char *copy;
+    DWORD size;
+
+    emu_init();
+    emu = emu_selected;
+
+    if (header == NULL || sample_number > emu->config.dwMaxSampleNumber)
+    {
+        return FALSE;
+    }
+
+    size = emu_data_size(header);
+    copy = (unsigned char*)malloc(size > 0 ? size : 1);
+    if (copy == NULL)
+    {
+        return FALSE;
+    }
+
+    if (data != NULL)
+    {
+        memcpy(copy, data, size);
+    }
+    else
+    {
+        memset(copy, 0, size);
+    }
+
+    if (!emu_store(emu, sample_number, header, copy, size))
+    {
+        free(copy);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+const void* SMDI_EmuGetSampleData(DWORD sample_number, DWORD* size)
+{
+    emu_sampler_t *emu;
+    DWORD index;
+    int found;
+
+    emu_init();
+    emu = emu_selected;
+
+    index = emu_find(emu, sample_number, &found);
+    if (!found)
+    {
+        return NULL;
+    }
+
+    if (size != NULL)
+    {
+        *size = emu->slots[index].size;
+    }
+
+    return emu->slots[index].data;
+}
+
+void SMDI_EmuGetStats(SMDI_EmuStats* stats)
+{
+    emu_init();
+
+    if (stats != NULL)
+    {
+        memcpy(stats, &emu_selected->stats, sizeof(SMDI_EmuStats));
+    }
+}
+
+void SMDI_EmuResetStats(void)
+{
+    emu_init();
+    memset(&emu_selected->stats, 0, sizeof(SMDI_EmuStats));
+}
+
+/*
+ * ASPI interface
+ */
+
+/* Take and release the handle bookkeeping; without ASPI_Check there is
+   no lock, nor any other thread */
+static void emu_lock_handles(void)
+{
+    if (emu_handle_lock != NULL)
+    {
+        SMDI_WaitSemaphore(emu_handle_lock);
+    }
+}
+
+static void emu_unlock_handles(void)
+{
+    if (emu_handle_lock != NULL)
+    {
+        SMDI_PostSemaphore(emu_handle_lock);
+    }
+}
+
+/* Account a command against the handle statistics */
+static void emu_count_handle(emu_sampler_t *emu)
+{
+    emu_lock_handles();
+    if (emu->refcount > 0)
+    {
+        aspi_stats.reuses++;
+    }
+    else
+    {
+        aspi_stats.opens++;
+        aspi_stats.closes++;
+    }
+    emu_unlock_handles();
+}
+
+int ASPI_OpenDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL)
+    {
+        return FALSE;
+    }
+
+    emu_lock_handles();
+    if (emu->refcount++ == 0)
+    {
+        aspi_stats.opens++;
+    }
+    emu_unlock_handles();
+
+    return TRUE;
+}
+
+void ASPI_CloseDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL)
+    {
+        return;
+    }
+
+    emu_lock_handles();
+    if (emu->refcount > 0 && --emu->refcount == 0)
+    {
+        aspi_stats.closes++;
+    }
+    emu_unlock_handles();
+}
+
+void ASPI_CloseAllDevices(void)
+{
+    int i;
+
+    emu_lock_handles();
+    for (i = 0; i < emu_count; i++)
+    {
+        if (emu_devices[i].refcount > 0)
+        {
+            aspi_stats.closes++;
+        }
+        emu_devices[i].refcount = 0;
+    }
+    emu_unlock_handles();
+}
+
+void ASPI_GetHandleStats(ASPI_HandleStats *stats)
+{
+    if (stats != NULL)
+    {
+        emu_lock_handles();
+        memcpy(stats, &aspi_stats, sizeof(ASPI_HandleStats));
+        emu_unlock_handles();
+    }
+}
+
+unsigned long ASPI_GetMaxTransfer(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL)
+    {
+        return 0;
+    }
+
+    return emu->config.dwMaxTransfer;
+}
+
+int ASPI_Check(scsi_debug_t *debug)
+{
+    emu_init();
+
+    /* Locked from the start, before connections share the samplers */
+    if (emu_handle_lock == NULL)
+    {
+        emu_handle_lock = SMDI_CreateSemaphore(1);
+    }
+
+    return emu_handle_lock != NULL;
+}
+
+void ASPI_RescanPort(scsi_debug_t *debug, unsigned char ha_id)
+{
+}
+
+int ASPI_GetDevType(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL)
+    {
+        return 0xFF;
+    }
+
+    emu_count_handle(emu);
+    return 3;  /* Processor device, like real SMDI samplers */
+}
+
+int ASPI_TestUnitReady(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL)
+    {
+        return FALSE;
+    }
+
+    emu_count_handle(emu);
+    return (emu_now() >= emu->busy_until) ? TRUE : FALSE;
+}
+
+BOOL ASPI_Send(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size)
+{
+    emu_sampler_t *emu;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL || buffer == NULL || size > emu->config.dwMaxTransfer) {
+        return FALSE;
+    }
+
+    emu_count_handle(emu);
+    emu_bus_transfer(emu, size);
+
+    emu->stats.dwBytesIn += size;
+
+    /* A new command replaces any answer the host did not collect */
+    emu->answer_pending = 0;
+    emu->deferred_pending = 0;
+
+    emu_process(emu, (const unsigned char*)buffer, (DWORD)size);
+
+    if (debug != NULL && debug->enabled) {
+        printf("ASPI_Send (emulator): %lu bytes\n", size);
+    }
+
+    return TRUE;
+}
+
+unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size)
+{
+    emu_sampler_t *emu;
+    unsigned long count;
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL || buffer == NULL) {
+        return 0;
+    }
+
+    emu_count_handle(emu);
+    emu->stats.dwReads++;
+
+    /* After a WAIT the real answer is released once the sampler is ready */
+    if (!emu->answer_pending && emu->deferred_pending && emu_now() >= emu->busy_until) {
+        if (emu_answer_buffer(emu, emu->deferred_len) != NULL) {
+            memcpy(emu->answer, emu->deferred, emu->deferred_len);
+            emu->answer_len = emu->deferred_len;
+            emu->answer_pending = 1;
+            emu->answer_ready = 0;
+        }
+        emu->deferred_pending = 0;
+    }
+
+    /* Still processing: the READ comes back empty */
+    if (!emu->answer_pending || emu_now() < emu->answer_ready) {
+        emu->stats.dwEmptyReads++;
+        return 0;
+    }
+
+    /* The host adapter cannot move more than its transfer limit */
+    if (size > emu->config.dwMaxTransfer) {
+        size = emu->config.dwMaxTransfer;
+    }
+
+    count = emu->answer_len;
+    if (count > size) {
+        count = size;
+    }
+
+    emu_bus_transfer(emu, count);
+    memcpy(buffer, emu->answer, count);
+    emu->answer_pending = 0;
+    emu->stats.dwBytesOut += count;
+
+    if (debug != NULL && debug->enabled) {
+        printf("ASPI_Receive (emulator): %lu bytes\n", count);
+    }
+
+    return count;
+}
+
+void ASPI_InquireDevice(scsi_debug_t *debug, char result[], unsigned char ha_id, unsigned char id)
+{
+    emu_sampler_t *emu;
+
+    if (result == NULL)
+    {
+        return;
+    }
+
+    memset(result, 0, 96);
+
+    emu = emu_addressed(ha_id, id);
+    if (emu == NULL)
+    {
+        return;
+    }
+
+    emu_count_handle(emu);
+
+    result[0] = 3;      /* Processor device */
+    result[4] = 91;     /* Additional length */
+    memset(&result[8], ' ', 24);
+    memcpy(&result[8], emu->config.cVendor, strlen(emu->config.cVendor));
+    memcpy(&result[16], emu->config.cProduct, strlen(emu->config.cProduct));
+    memcpy(&result[32], "1.0 ", 4);
+}
@@ -17,6 +17,50 @@
 #include "aspi_irix.h"
 #include "scsi_debug.h"
 #include "aspi_defs.h"
+#include "smdi_thread.h"
+
+/* Size of the per-target handle cache */
+#define ASPI_MAX_HA 16
+#define ASPI_MAX_ID 16
+
+/* Largest single dslib transfer; dslib cannot query the host adapter,
+   so stay well under the default maxdmasz of every IRIX 5.3 machine */
+#define ASPI_DS_MAX_TRANSFER (256 * 1024)
+
+/* Cached device handle for one HA:ID pair */
+typedef struct {
+    struct dsreq *dsp;      /* Open handle, NULL if not currently open */
+    int refcount;           /* Number of ASPI_OpenDevice calls outstanding */
+} aspi_handle_t;
+
+/* Handle cache and its counters */
+static aspi_handle_t aspi_handles[ASPI_MAX_HA][ASPI_MAX_ID];
+static ASPI_HandleStats aspi_stats;
+
+/* Guards the cache and its counters: connections open, close and reopen
+   targets from their own threads. Created by ASPI_Check, which SMDI_Init
+   calls before any connection exists. */
+static SMDI_Semaphore *aspi_lock = NULL;
+
+/*
+ * Take and release the cache; without ASPI_Check there is no lock, nor
+ * any other thread
+ */
+static void aspi_lock_handles(void)
+{
+    if (aspi_lock != NULL)
+    {
+        SMDI_WaitSemaphore(aspi_lock);
+    }
+}
+
+static void aspi_unlock_handles(void)
+{
+    if (aspi_lock != NULL)
+    {
+        SMDI_PostSemaphore(aspi_lock);
+    }
+}
 
 /*
  * Get device path string for a given host adapter and target ID
@@ -94,6 +138,257 @@ static void fill_debug_packet(scsi_debug_t *debug,
     }
 }
 
+/*
+ * Look up the cache slot for a target, NULL if out of range; called locked
+ */
+static aspi_handle_t *aspi_lookup(unsigned char ha_id, unsigned char id)
+{
+    if (ha_id >= ASPI_MAX_HA || id >= ASPI_MAX_ID)
+    {
+        return NULL;
+    }
+    
+    return &aspi_handles[ha_id][id];
+}
+
+/*
+ * Get a device handle for a command; called locked. Connected targets
+ * are served from the cache (and reopened there if an earlier error
+ * dropped the handle); everything else gets a temporary handle that
+ * aspi_release() closes.
+ */
+static struct dsreq *aspi_acquire_locked(unsigned char ha_id, unsigned char id,
+                                         int flags, int *temporary)
+{
+    char dev_path[MAX_PATH];
+    aspi_handle_t *handle;
+    struct dsreq *dsp;
+    
+    handle = aspi_lookup(ha_id, id);
+    *temporary = (handle == NULL || handle->refcount == 0);
+    
+    if (!*temporary && handle->dsp != NULL)
+    {
+        aspi_stats.reuses++;
+        return handle->dsp;
+    }
+    
+    ASPI_GetDevNameByID(dev_path, ha_id, id);
+    dsp = dsopen(dev_path, *temporary ? flags : O_RDWR);
+    
+    if (dsp != NULL)
+    {
+        aspi_stats.opens++;
+        
+        if (!*temporary)
+        {
+            handle->dsp = dsp;
+        }
+    }
+    
+    return dsp;
+}
+
+/*
+ * Get a device handle for a command, see aspi_acquire_locked()
+ */
+static struct dsreq *aspi_acquire(unsigned char ha_id, unsigned char id,
+                                  int flags, int *temporary)
+{
+    struct dsreq *dsp;
+    
+    aspi_lock_handles();
+    dsp = aspi_acquire_locked(ha_id, id, flags, temporary);
+    aspi_unlock_handles();
+    
+    return dsp;
+}
+
+/*
+ * Give back a handle obtained from aspi_acquire()
+ */
+static void aspi_release(struct dsreq *dsp, int temporary)
+{
+    if (temporary && dsp != NULL)
+    {
+        dsclose(dsp);
+        
+        aspi_lock_handles();
+        aspi_stats.closes++;
+        aspi_unlock_handles();
+    }
+}
+
+/*
+ * Drop the cached handle of a target after a transport error, so the
+ * next command starts from a freshly opened device
+ */
+static void aspi_invalidate(unsigned char ha_id, unsigned char id)
+{
+    aspi_handle_t *handle;
+    
+    aspi_lock_handles();
+    
+    handle = aspi_lookup(ha_id, id);
+    
+    if (handle != NULL && handle->dsp != NULL)
+    {
+        dsclose(handle->dsp);
+        handle->dsp = NULL;
+        aspi_stats.closes++;
+        aspi_stats.invalidations++;
+    }
+    
+    aspi_unlock_handles();
+}
+
+/*
+ * Decide whether a failed request points at the handle itself rather
+ * than at a SCSI-level answer from the target
+ */
+static int aspi_transport_failed(int result, struct dsreq *dsp)
+{
+    if (result < 0)
+    {
+        return 1;
+    }
+    
+    return (RET(dsp) == DSRT_NOSEL ||
+            RET(dsp) == DSRT_TIMEOUT ||
+            RET(dsp) == DSRT_HOST);
+}
+
+/*
+ * Open a target for the duration of a connection. Every ASPI call to
+ * this HA:ID reuses the same handle until ASPI_CloseDevice().
+ */
+int ASPI_OpenDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    aspi_handle_t *handle;
+    struct dsreq *dsp;
+    int temporary;
+    
+    aspi_lock_handles();
+    
+    handle = aspi_lookup(ha_id, id);
+    if (handle == NULL)
+    {
+        aspi_unlock_handles();
+        return FALSE;
+    }
+    
+    handle->refcount++;
+    
+    /* Opened now unless already open for another user of this target */
+    dsp = handle->dsp;
+    if (dsp == NULL)
+    {
+        dsp = aspi_acquire_locked(ha_id, id, O_RDWR, &temporary);
+        if (dsp == NULL)
+        {
+            handle->refcount--;
+        }
+    }
+    
+    aspi_unlock_handles();
+    
+    if (dsp == NULL)
+    {
+        if (debug != NULL && debug->enabled)
+        {
+            printf("ASPI_OpenDevice: Failed to open device %d:%d\n", ha_id, id);
+        }
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+/*
+ * Release a target opened with ASPI_OpenDevice()
+ */
+void ASPI_CloseDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    aspi_handle_t *handle;
+    ASPI_HandleStats stats;
+    
+    aspi_lock_handles();
+    
+    handle = aspi_lookup(ha_id, id);
+    if (handle == NULL || handle->refcount == 0)
+    {
+        aspi_unlock_handles();
+        return;
+    }
+    
+    handle->refcount--;
+    
+    if (handle->refcount == 0 && handle->dsp != NULL)
+    {
+        dsclose(handle->dsp);
+        handle->dsp = NULL;
+        aspi_stats.closes++;
+    }
+    
+    memcpy(&stats, &aspi_stats, sizeof(ASPI_HandleStats));
+    
+    aspi_unlock_handles();
+    
+    if (debug != NULL && debug->enabled)
+    {
+        printf("ASPI_CloseDevice: %d:%d, %lu opens, %lu opens saved\n",
+               ha_id, id, stats.opens, stats.reuses);
+    }
+}
+
+/*
+ * Close every cached handle (used on application exit)
+ */
+void ASPI_CloseAllDevices(void)
+{
+    int ha;
+    int id;
+    
+    aspi_lock_handles();
+    
+    for (ha = 0; ha < ASPI_MAX_HA; ha++)
+    {
+        for (id = 0; id < ASPI_MAX_ID; id++)
+        {
+            if (aspi_handles[ha][id].dsp != NULL)
+            {
+                dsclose(aspi_handles[ha][id].dsp);
+                aspi_stats.closes++;
+            }
+            aspi_handles[ha][id].dsp = NULL;
+            aspi_handles[ha][id].refcount = 0;
+        }
+    }
+    
+    aspi_unlock_handles();
+}
+
+/*
+ * Get the handle cache counters
+ */
+void ASPI_GetHandleStats(ASPI_HandleStats *stats)
+{
+    if (stats != NULL)
+    {
+        aspi_lock_handles();
+        memcpy(stats, &aspi_stats, sizeof(ASPI_HandleStats));
+        aspi_unlock_handles();
+    }
+}
+
+/*
+ * Get the largest data transfer a single SEND or READ may carry
+ */
+unsigned long ASPI_GetMaxTransfer(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    return ASPI_DS_MAX_TRANSFER;
+}
+
 /*
  * Check if ASPI is available
  */
@@ -112,6 +407,16 @@ int ASPI_Check(scsi_debug_t *debug)
         packet.direction = SCSI_DIR_NONE;
     }
     
+    /* The cache is locked from the first call, before any connection */
+    if (aspi_lock == NULL)
+    {
+        aspi_lock = SMDI_CreateSemaphore(1);
+        if (aspi_lock == NULL)
+        {
+            return 0;
+        }
+    }
+    
     /* Try to open known device that works */
     sprintf(dev_path, "/dev/scsi/sc0d5l0");
     fd = open(dev_path, O_RDONLY);
@@ -195,14 +500,13 @@ void ASPI_RescanPort(scsi_debug_t *debug, unsigned char ha_id)
 int ASPI_GetDevType(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
 {
     unsigned char cDevType;
-    char dev_path[MAX_PATH];
     struct dsreq *dsp;
+    int temporary;
     unsigned char inqbuf[36];  /* Standard inquiry data */
     scsi_debug_packet_t packet;
     
-    /* Get device path and open device */
-    ASPI_GetDevNameByID(dev_path, ha_id, id);
-    dsp = dsopen(dev_path, O_RDONLY);
+    /* Get a handle for the device (cached while connected) */
+    dsp = aspi_acquire(ha_id, id, O_RDONLY, &temporary);
     
     if (dsp == NULL)
     {
@@ -244,13 +548,13 @@ int ASPI_GetDevType(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
             scsi_debug_log(debug, &packet);
         }
         
-        dsclose(dsp);
+        aspi_release(dsp, temporary);
         return 0xFF;  /* Error code */
     }
     
     /* Get device type from inquiry data */
     cDevType = inqbuf[0] & 0x1F;
-    dsclose(dsp);
+    aspi_release(dsp, temporary);
     
     /* Log success if debug enabled */
     if (debug != NULL && debug->enabled)
@@ -279,12 +583,11 @@ int ASPI_TestUnitReady(scsi_debug_t *debug, unsigned char ha_id, unsigned char i
 {
     int result;
     struct dsreq *dsp;
-    char dev_path[MAX_PATH];
+    int temporary;
     scsi_debug_packet_t packet;
     
-    /* Get device path and open device */
-    ASPI_GetDevNameByID(dev_path, ha_id, id);
-    dsp = dsopen(dev_path, O_RDONLY);
+    /* Get a handle for the device (cached while connected) */
+    dsp = aspi_acquire(ha_id, id, O_RDONLY, &temporary);
     
     if (dsp == NULL)
     {
@@ -337,7 +640,7 @@ int ASPI_TestUnitReady(scsi_debug_t *debug, unsigned char ha_id, unsigned char i
         scsi_debug_log(debug, &packet);
     }
     
-    dsclose(dsp);
+    aspi_release(dsp, temporary);
     return (result == 0) ? TRUE : FALSE;
 }
 
@@ -348,17 +651,16 @@ int ASPI_TestUnitReady(scsi_debug_t *debug, unsigned char ha_id, unsigned char i
 BOOL ASPI_Send(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size)
 {
     struct dsreq *dsp;
-    char dev_path[MAX_PATH];
     unsigned char cmd[6];
     int result;
+    int temporary;
     
-    /* Get device path and open it using dslib */
-    ASPI_GetDevNameByID(dev_path, ha_id, id);
-    dsp = dsopen(dev_path, O_RDWR);
+    /* Get a dslib handle for the device (cached while connected) */
+    dsp = aspi_acquire(ha_id, id, O_RDWR, &temporary);
     
     if (dsp == NULL) {
         if (debug != NULL && debug->enabled) {
-            printf("ASPI_Send: Failed to open device %s\n", dev_path);
+            printf("ASPI_Send: Failed to open device %d:%d\n", ha_id, id);
         }
         return FALSE;
     }
@@ -392,11 +694,14 @@ BOOL ASPI_Send(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void
             printf("ASPI_Send: Command failed, result=%d, ds_ret=%d, status=%d\n", 
                    result, dsp->ds_ret, dsp->ds_status);
         }
-        dsclose(dsp);
+        if (!temporary && aspi_transport_failed(result, dsp)) {
+            aspi_invalidate(ha_id, id);
+        }
+        aspi_release(dsp, temporary);
         return FALSE;
     }
     
-    dsclose(dsp);
+    aspi_release(dsp, temporary);
     return TRUE;
 }
 
@@ -406,20 +711,19 @@ BOOL ASPI_Send(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void
 
 unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size)
 {
-    int fd;
-    char dev_path[MAX_PATH];
+    struct dsreq *dsp;
     struct dsreq ds_req;
     unsigned char cmd[6];
     int result;
+    int temporary;
     unsigned long bytes_received = 0;
     
-    /* Get device path and open it directly */
-    ASPI_GetDevNameByID(dev_path, ha_id, id);
-    fd = open(dev_path, O_RDWR);
+    /* Get a handle for the device (cached while connected) */
+    dsp = aspi_acquire(ha_id, id, O_RDWR, &temporary);
     
-    if (fd < 0) {
+    if (dsp == NULL) {
         if (debug != NULL && debug->enabled) {
-            printf("ASPI_Receive: Failed to open device %s, errno=%d\n", dev_path, errno);
+            printf("ASPI_Receive: Failed to open device %d:%d, errno=%d\n", ha_id, id, errno);
         }
         return 0;
     }
@@ -444,7 +748,7 @@ unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned ch
     ds_req.ds_time = 10 * 1000;  /* 10 second timeout */
     
     /* Execute the SCSI command */
-    result = ioctl(fd, DS_ENTER, &ds_req);
+    result = ioctl(getfd(dsp), DS_ENTER, &ds_req);
     
     /* Get bytes received */
     if (result >= 0 && ds_req.ds_ret == 0) {
@@ -458,8 +762,12 @@ unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned ch
         printf("ASPI_Receive: ioctl failed, result=%d, ds_ret=%d\n", result, ds_req.ds_ret);
     }
     
-    /* Close the device */
-    close(fd);
+    /* Drop a cached handle the driver no longer accepts */
+    if (!temporary && aspi_transport_failed(result, &ds_req)) {
+        aspi_invalidate(ha_id, id);
+    }
+    
+    aspi_release(dsp, temporary);
     
     return bytes_received;
 }
@@ -471,7 +779,7 @@ unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned ch
 void ASPI_InquireDevice(scsi_debug_t *debug, char result[], unsigned char ha_id, unsigned char id)
 {
     struct dsreq *dsp;
-    char dev_path[MAX_PATH];
+    int temporary;
     unsigned char inqbuf[96];  /* Inquiry data buffer */
     scsi_debug_packet_t packet;
     
@@ -484,9 +792,8 @@ void ASPI_InquireDevice(scsi_debug_t *debug, char result[], unsigned char ha_id,
     /* Initialize result */
     memset(result, 0, 96);
     
-    /* Get device path and open device */
-    ASPI_GetDevNameByID(dev_path, ha_id, id);
-    dsp = dsopen(dev_path, O_RDONLY);
+    /* Get a handle for the device (cached while connected) */
+    dsp = aspi_acquire(ha_id, id, O_RDONLY, &temporary);
     
     if (dsp == NULL)
     {
@@ -569,5 +876,5 @@ void ASPI_InquireDevice(scsi_debug_t *debug, char result[], unsigned char ha_id,
         }
     }
     
-    dsclose(dsp);
+    aspi_release(dsp, temporary);
 }
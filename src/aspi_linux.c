@@ -0,0 +1,915 @@
+/*
+ * ASPI interface for Linux
+ * Implements the aspi_irix.h API on top of the sg driver (SG_IO)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+
+#include "aspi_irix.h"
+#include "scsi_debug.h"
+#include "smdi_thread.h"
+
+/* Size of the per-target handle cache */
+#define ASPI_MAX_HA 16
+#define ASPI_MAX_ID 16
+
+/* Number of /dev/sgN nodes probed when mapping HA:ID to a device */
+#define ASPI_MAX_SG 256
+
+/* Reserved buffer requested from sg, large enough for the biggest packet */
+#define ASPI_SG_RESERVED (256 * 1024)
+
+/* Sense buffer size */
+#define ASPI_SENSE_LEN 32
+
+/* Cached device handle for one HA:ID pair */
+typedef struct {
+    int fd;                 /* Open sg file descriptor, -1 if not open */
+    int refcount;           /* Number of ASPI_OpenDevice calls outstanding */
+} aspi_handle_t;
+
+/* Handle cache and its counters */
+static aspi_handle_t aspi_handles[ASPI_MAX_HA][ASPI_MAX_ID];
+static ASPI_HandleStats aspi_stats;
+static int aspi_handles_ready = 0;
+
+/* HA:ID to /dev/sgN map, filled on first use */
+static char aspi_sg_map[ASPI_MAX_HA][ASPI_MAX_ID][32];
+static int aspi_sg_mapped = 0;
+
+/* Guards the cache, its counters and the map: connections open, close
+   and reopen targets from their own threads. Created by ASPI_Check,
+   which SMDI_Init calls before any connection exists. */
+static SMDI_Semaphore *aspi_lock = NULL;
+
+/*
+ * Take and release the tables; without ASPI_Check there is no lock, nor
+ * any other thread
+ */
+static void aspi_lock_tables(void)
+{
+    if (aspi_lock != NULL)
+    {
+        SMDI_WaitSemaphore(aspi_lock);
+    }
+}
+
+static void aspi_unlock_tables(void)
+{
+    if (aspi_lock != NULL)
+    {
+        SMDI_PostSemaphore(aspi_lock);
+    }
+}
+
+/*
+ * Parse SMDI_SG_DEVICES ("ha:id=/dev/sgN,ha:id=/dev/sgM") into the map.
+ * Lets a target be reached under any HA:ID, e.g. a scsi_debug host.
+ */
+static void ASPI_ParseDeviceOverrides(void)
+{
+    const char *env;
+    const char *p;
+    int ha;
+    int id;
+    int n;
+    char path[32];
+
+    env = getenv("SMDI_SG_DEVICES");
+    if (env == NULL)
+    {
+        return;
+    }
+
+    p = env;
+    while (*p != '\0')
+    {
+        n = 0;
+        if (sscanf(p, "%d:%d=%31[^,]%n", &ha, &id, path, &n) == 3 &&
+            ha >= 0 && ha < ASPI_MAX_HA && id >= 0 && id < ASPI_MAX_ID)
+        {
+            strcpy(aspi_sg_map[ha][id], path);
+        }
+
+        /* Skip to the next entry */
+        p = strchr(p, ',');
+        if (p == NULL)
+        {
+            break;
+        }
+        p++;
+    }
+}
+
+/*
+ * Build the HA:ID to sg device map by asking every sg node for its
+ * address; called locked
+ */
+static void ASPI_BuildDeviceMap(void)
+{
+    char path[32];
+    struct sg_scsi_id sid;
+    int i;
+    int fd;
+
+    if (aspi_sg_mapped)
+    {
+        return;
+    }
+
+    memset(aspi_sg_map, 0, sizeof(aspi_sg_map));
+
+    for (i = 0; i < ASPI_MAX_SG; i++)
+    {
+        sprintf(path, "/dev/sg%d", i);
+        fd = open(path, O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+        {
+            /* sg nodes are numbered densely, stop at the first gap */
+            if (errno == ENOENT)
+            {
+                break;
+            }
+            continue;
+        }
+
+        memset(&sid, 0, sizeof(sid));
+        if (ioctl(fd, SG_GET_SCSI_ID, &sid) == 0 && sid.lun == 0 &&
+            sid.host_no >= 0 && sid.host_no < ASPI_MAX_HA &&
+            sid.scsi_id >= 0 && sid.scsi_id < ASPI_MAX_ID &&
+            aspi_sg_map[sid.host_no][sid.scsi_id][0] == '\0')
+        {
+            strcpy(aspi_sg_map[sid.host_no][sid.scsi_id], path);
+        }
+
+        close(fd);
+    }
+
+    /* Explicit mappings win over the scan */
+    ASPI_ParseDeviceOverrides();
+
+    aspi_sg_mapped = 1;
+}
+
+/*
+ * Get device path string for a given host adapter and target ID; called
+ * locked. Returns 0 if no sg device answers to that address.
+ */
+static int ASPI_GetDevNameByID(char cResult[], unsigned char ha_id, unsigned char id)
+{
+    ASPI_BuildDeviceMap();
+
+    if (ha_id >= ASPI_MAX_HA || id >= ASPI_MAX_ID || aspi_sg_map[ha_id][id][0] == '\0')
+    {
+        cResult[0] = '\0';
+        return 0;
+    }
+
+    strcpy(cResult, aspi_sg_map[ha_id][id]);
+    return 1;
+}
+
+/*
+ * Open an sg device and size its reserved buffer so that data packets
+ * are served from it instead of a per-command kernel allocation
+ */
+static int ASPI_OpenSG(const char *path)
+{
+    int fd;
+    int version;
+    int reserved;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    /* SG_IO needs the version 3 sg driver */
+    if (ioctl(fd, SG_GET_VERSION_NUM, &version) < 0 || version < 30000)
+    {
+        close(fd);
+        errno = ENOTTY;
+        return -1;
+    }
+
+    if (ioctl(fd, SG_GET_RESERVED_SIZE, &reserved) == 0 && reserved < ASPI_SG_RESERVED)
+    {
+        reserved = ASPI_SG_RESERVED;
+        ioctl(fd, SG_SET_RESERVED_SIZE, &reserved);
+    }
+
+    return fd;
+}
+
+/*
+ * Look up the cache slot for a target, NULL if out of range; called locked
+ */
+static aspi_handle_t *aspi_lookup(unsigned char ha_id, unsigned char id)
+{
+    int ha;
+    int i;
+
+    if (!aspi_handles_ready)
+    {
+        for (ha = 0; ha < ASPI_MAX_HA; ha++)
+        {
+            for (i = 0; i < ASPI_MAX_ID; i++)
+            {
+                aspi_handles[ha][i].fd = -1;
+                aspi_handles[ha][i].refcount = 0;
+            }
+        }
+        aspi_handles_ready = 1;
+    }
+
+    if (ha_id >= ASPI_MAX_HA || id >= ASPI_MAX_ID)
+    {
+        return NULL;
+    }
+
+    return &aspi_handles[ha_id][id];
+}
+
+/*
+ * Get a file descriptor for a command; called locked. Connected targets
+ * are served from the cache (and reopened there if an earlier error
+ * dropped the handle); everything else gets a temporary descriptor that
+ * aspi_release() closes.
+ */
+static int aspi_acquire_locked(unsigned char ha_id, unsigned char id, int *temporary)
+{
+    char dev_path[MAX_PATH];
+    aspi_handle_t *handle;
+    int fd;
+
+    handle = aspi_lookup(ha_id, id);
+    *temporary = (handle == NULL || handle->refcount == 0);
+
+    if (!*temporary && handle->fd >= 0)
+    {
+        aspi_stats.reuses++;
+        return handle->fd;
+    }
+
+    if (!ASPI_GetDevNameByID(dev_path, ha_id, id))
+    {
+        errno = ENODEV;
+        return -1;
+    }
+
+    fd = ASPI_OpenSG(dev_path);
+
+    if (fd >= 0)
+    {
+        aspi_stats.opens++;
+
+        if (!*temporary)
+        {
+            handle->fd = fd;
+        }
+    }
+
+    return fd;
+}
+
+/*
+ * Get a file descriptor for a command, see aspi_acquire_locked()
+ */
+static int aspi_acquire(unsigned char ha_id, unsigned char id, int *temporary)
+{
+    int fd;
+
+    aspi_lock_tables();
+    fd = aspi_acquire_locked(ha_id, id, temporary);
+    aspi_unlock_tables();
+
+    return fd;
+}
+
+/*
+ * Give back a descriptor obtained from aspi_acquire()
+ */
+static void aspi_release(int fd, int temporary)
+{
+    if (temporary && fd >= 0)
+    {
+        close(fd);
+
+        aspi_lock_tables();
+        aspi_stats.closes++;
+        aspi_unlock_tables();
+    }
+}
+
+/*
+ * Drop the cached descriptor of a target after a transport error
+ */
+static void aspi_invalidate(unsigned char ha_id, unsigned char id)
+{
+    aspi_handle_t *handle;
+
+    aspi_lock_tables();
+
+    handle = aspi_lookup(ha_id, id);
+
+    if (handle != NULL && handle->fd >= 0)
+    {
+        close(handle->fd);
+        handle->fd = -1;
+        aspi_stats.closes++;
+        aspi_stats.invalidations++;
+    }
+
+    aspi_unlock_tables();
+}
+
+/*
+ * Execute one CDB with SG_IO. Returns the ioctl result; the io header
+ * holds status, residual count and sense data afterwards.
+ */
+static int aspi_sg_command(int fd, sg_io_hdr_t *io,
+                           unsigned char *cmd, unsigned char cmd_len,
+                           int direction, void *buffer, unsigned long size,
+                           unsigned char *sense, unsigned int timeout_ms)
+{
+    memset(io, 0, sizeof(sg_io_hdr_t));
+    io->interface_id = 'S';
+    io->cmdp = cmd;
+    io->cmd_len = cmd_len;
+    io->dxfer_direction = direction;
+    io->dxferp = buffer;
+    io->dxfer_len = (unsigned int)size;
+    io->sbp = sense;
+    io->mx_sb_len = ASPI_SENSE_LEN;
+    io->timeout = timeout_ms;
+
+    /* Let the HBA transfer straight from/to user memory when the kernel
+       allows it (allow_dio); sg falls back to the reserved buffer */
+    if (size > 0)
+    {
+        io->flags = SG_FLAG_DIRECT_IO;
+    }
+
+    return ioctl(fd, SG_IO, io);
+}
+
+/*
+ * Check the outcome of an SG_IO request
+ */
+static int aspi_sg_ok(int result, sg_io_hdr_t *io)
+{
+    return (result >= 0 &&
+            io->host_status == 0 &&
+            (io->driver_status & 0x0F) == 0 &&
+            io->status == 0);
+}
+
+/*
+ * Decide whether a failed request points at the descriptor itself rather
+ * than at a SCSI-level answer from the target
+ */
+static int aspi_transport_failed(int result, sg_io_hdr_t *io)
+{
+    return (result < 0 || io->host_status != 0);
+}
+
+/*
+ * Fill and log a debug packet for a completed command
+ */
+static void aspi_log_command(scsi_debug_t *debug,
+                             unsigned char ha_id, unsigned char id,
+                             unsigned char *cmd, unsigned char cmd_len,
+                             scsi_direction_t direction,
+                             void *data, unsigned long data_len,
+                             int result, sg_io_hdr_t *io, unsigned char *sense)
+{
+    scsi_debug_packet_t packet;
+    unsigned long copy_len;
+
+    if (debug == NULL || !debug->enabled)
+    {
+        return;
+    }
+
+    memset(&packet, 0, sizeof(packet));
+    packet.timestamp = (unsigned long)time(NULL);
+    packet.direction = direction;
+    packet.ha_id = ha_id;
+    packet.target_id = id;
+
+    if (cmd != NULL && cmd_len > 0)
+    {
+        memcpy(packet.cmd, cmd, cmd_len);
+        packet.cmd_len = cmd_len;
+    }
+
+    if (data != NULL && data_len > 0)
+    {
+        copy_len = data_len;
+        if (copy_len > SCSI_DEBUG_MAX_DATA)
+        {
+            copy_len = SCSI_DEBUG_MAX_DATA;
+        }
+        memcpy(packet.data, data, copy_len);
+        packet.data_len = data_len;
+    }
+
+    packet.result = result;
+
+    if (io != NULL)
+    {
+        packet.status = io->status;
+
+        if (io->sb_len_wr > 0 && sense != NULL)
+        {
+            packet.sense_len = io->sb_len_wr;
+            if (packet.sense_len > sizeof(packet.sense_data))
+            {
+                packet.sense_len = sizeof(packet.sense_data);
+            }
+            memcpy(packet.sense_data, sense, packet.sense_len);
+        }
+    }
+
+    scsi_debug_log(debug, &packet);
+}
+
+/*
+ * Log a plain text event
+ */
+static void aspi_log_text(scsi_debug_t *debug, unsigned char ha_id,
+                          unsigned char id, const char *text, int result)
+{
+    scsi_debug_packet_t packet;
+
+    if (debug == NULL || !debug->enabled)
+    {
+        return;
+    }
+
+    memset(&packet, 0, sizeof(packet));
+    packet.timestamp = (unsigned long)time(NULL);
+    packet.direction = SCSI_DIR_NONE;
+    packet.ha_id = ha_id;
+    packet.target_id = id;
+    strcpy((char*)packet.data, text);
+    packet.data_len = strlen(text);
+    packet.result = result;
+    scsi_debug_log(debug, &packet);
+}
+
+/*
+ * Open a target for the duration of a connection. Every ASPI call to
+ * this HA:ID reuses the same descriptor until ASPI_CloseDevice().
+ */
+int ASPI_OpenDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    aspi_handle_t *handle;
+    int temporary;
+    int fd;
+
+    aspi_lock_tables();
+
+    handle = aspi_lookup(ha_id, id);
+    if (handle == NULL)
+    {
+        aspi_unlock_tables();
+        return FALSE;
+    }
+
+    handle->refcount++;
+
+    /* Opened now unless already open for another user of this target */
+    fd = handle->fd;
+    if (fd < 0)
+    {
+        fd = aspi_acquire_locked(ha_id, id, &temporary);
+        if (fd < 0)
+        {
+            handle->refcount--;
+        }
+    }
+
+    aspi_unlock_tables();
+
+    if (fd < 0)
+    {
+        if (debug != NULL && debug->enabled)
+        {
+            printf("ASPI_OpenDevice: Failed to open device %d:%d, errno=%d\n", ha_id, id, errno);
+        }
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Release a target opened with ASPI_OpenDevice()
+ */
+void ASPI_CloseDevice(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    aspi_handle_t *handle;
+    ASPI_HandleStats stats;
+
+    aspi_lock_tables();
+
+    handle = aspi_lookup(ha_id, id);
+    if (handle == NULL || handle->refcount == 0)
+    {
+        aspi_unlock_tables();
+        return;
+    }
+
+    handle->refcount--;
+
+    if (handle->refcount == 0 && handle->fd >= 0)
+    {
+        close(handle->fd);
+        handle->fd = -1;
+        aspi_stats.closes++;
+    }
+
+    memcpy(&stats, &aspi_stats, sizeof(ASPI_HandleStats));
+
+    aspi_unlock_tables();
+
+    if (debug != NULL && debug->enabled)
+    {
+        printf("ASPI_CloseDevice: %d:%d, %lu opens, %lu opens saved\n",
+               ha_id, id, stats.opens, stats.reuses);
+    }
+}
+
+/*
+ * Close every cached descriptor (used on application exit)
+ */
+void ASPI_CloseAllDevices(void)
+{
+    int ha;
+    int id;
+
+    aspi_lock_tables();
+
+    aspi_lookup(0, 0);
+
+    for (ha = 0; ha < ASPI_MAX_HA; ha++)
+    {
+        for (id = 0; id < ASPI_MAX_ID; id++)
+        {
+            if (aspi_handles[ha][id].fd >= 0)
+            {
+                close(aspi_handles[ha][id].fd);
+                aspi_stats.closes++;
+            }
+            aspi_handles[ha][id].fd = -1;
+            aspi_handles[ha][id].refcount = 0;
+        }
+    }
+
+    aspi_unlock_tables();
+}
+
+/*
+ * Get the handle cache counters
+ */
+void ASPI_GetHandleStats(ASPI_HandleStats *stats)
+{
+    if (stats != NULL)
+    {
+        aspi_lock_tables();
+        memcpy(stats, &aspi_stats, sizeof(ASPI_HandleStats));
+        aspi_unlock_tables();
+    }
+}
+
+/*
+ * Get the largest data transfer a single SEND or READ may carry: the
+ * reserved buffer sg serves commands from, within the 24-bit CDB length
+ */
+unsigned long ASPI_GetMaxTransfer(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    int fd;
+    int temporary;
+    int reserved;
+
+    fd = aspi_acquire(ha_id, id, &temporary);
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    if (ioctl(fd, SG_GET_RESERVED_SIZE, &reserved) < 0 || reserved <= 0)
+    {
+        reserved = ASPI_SG_RESERVED;
+    }
+
+    aspi_release(fd, temporary);
+
+    if ((unsigned long)reserved > 0xFFFFFFUL)
+    {
+        reserved = 0xFFFFFF;
+    }
+
+    if (debug != NULL && debug->enabled)
+    {
+        printf("ASPI_GetMaxTransfer: %d:%d reserved buffer %d bytes\n", ha_id, id, reserved);
+    }
+
+    return (unsigned long)reserved;
+}
+
+/*
+ * Check if ASPI is available (any usable sg device)
+ */
+int ASPI_Check(scsi_debug_t *debug)
+{
+    int ha;
+    int id;
+    int found;
+
+    if (aspi_lock == NULL)
+    {
+        aspi_lock = SMDI_CreateSemaphore(1);
+        if (aspi_lock == NULL)
+        {
+            aspi_log_text(debug, 0, 0, "ASPI lock not available", 0);
+            return 0;
+        }
+    }
+
+    /* Build the tables before any connection uses them */
+    aspi_lock_tables();
+
+    aspi_lookup(0, 0);
+    ASPI_BuildDeviceMap();
+
+    found = 0;
+    for (ha = 0; ha < ASPI_MAX_HA && !found; ha++)
+    {
+        for (id = 0; id < ASPI_MAX_ID && !found; id++)
+        {
+            found = (aspi_sg_map[ha][id][0] != '\0');
+        }
+    }
+
+    aspi_unlock_tables();
+
+    aspi_log_text(debug, 0, 0, found ? "ASPI available" : "ASPI not available", found);
+    return found;
+}
+
+/*
+ * Rescan SCSI bus. The sg node list is rebuilt on the next lookup;
+ * asking the kernel to rescan the host needs root and is left to udev.
+ */
+void ASPI_RescanPort(scsi_debug_t *debug, unsigned char ha_id)
+{
+    aspi_lock_tables();
+    aspi_sg_mapped = 0;
+    aspi_unlock_tables();
+
+    aspi_log_text(debug, ha_id, 0, "RescanPort rebuilds the sg device map", 0);
+}
+
+/*
+ * Get SCSI device type
+ */
+int ASPI_GetDevType(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    unsigned char cmd[6] = {0x12, 0, 0, 0, 36, 0};  /* INQUIRY */
+    unsigned char inqbuf[36];  /* Standard inquiry data */
+    unsigned char sense[ASPI_SENSE_LEN];
+    sg_io_hdr_t io;
+    int fd;
+    int temporary;
+    int result;
+
+    fd = aspi_acquire(ha_id, id, &temporary);
+    if (fd < 0)
+    {
+        aspi_log_text(debug, ha_id, id, "Failed to open device", -1);
+        return 0xFF;  /* Error code */
+    }
+
+    memset(inqbuf, 0, sizeof(inqbuf));
+    result = aspi_sg_command(fd, &io, cmd, 6, SG_DXFER_FROM_DEV,
+                             inqbuf, sizeof(inqbuf), sense, 5 * 1000);
+
+    aspi_log_command(debug, ha_id, id, cmd, 6, SCSI_DIR_IN,
+                     inqbuf, sizeof(inqbuf), result, &io, sense);
+
+    if (!aspi_sg_ok(result, &io))
+    {
+        if (!temporary && aspi_transport_failed(result, &io))
+        {
+            aspi_invalidate(ha_id, id);
+        }
+        aspi_release(fd, temporary);
+        return 0xFF;  /* Error code */
+    }
+
+    aspi_release(fd, temporary);
+
+    return inqbuf[0] & 0x1F;
+}
+
+/*
+ * Test if SCSI unit is ready
+ */
+int ASPI_TestUnitReady(scsi_debug_t *debug, unsigned char ha_id, unsigned char id)
+{
+    unsigned char cmd[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};  /* TEST UNIT READY */
+    unsigned char sense[ASPI_SENSE_LEN];
+    sg_io_hdr_t io;
+    int fd;
+    int temporary;
+    int result;
+
+    fd = aspi_acquire(ha_id, id, &temporary);
+    if (fd < 0)
+    {
+        aspi_log_text(debug, ha_id, id, "Failed to open device", -1);
+        return FALSE;
+    }
+
+    result = aspi_sg_command(fd, &io, cmd, 6, SG_DXFER_NONE,
+                             NULL, 0, sense, 5 * 1000);
+
+    aspi_log_command(debug, ha_id, id, cmd, 6, SCSI_DIR_NONE,
+                     NULL, 0, result, &io, sense);
+
+    if (!temporary && aspi_transport_failed(result, &io))
+    {
+        aspi_invalidate(ha_id, id);
+    }
+
+    aspi_release(fd, temporary);
+
+    return aspi_sg_ok(result, &io) ? TRUE : FALSE;
+}
+
+/*
+ * Send data to SCSI device
+ */
+BOOL ASPI_Send(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size)
+{
+    unsigned char cmd[6];
+    unsigned char sense[ASPI_SENSE_LEN];
+    sg_io_hdr_t io;
+    int fd;
+    int temporary;
+    int result;
+
+    fd = aspi_acquire(ha_id, id, &temporary);
+    if (fd < 0) {
+        if (debug != NULL && debug->enabled) {
+            printf("ASPI_Send: Failed to open device %d:%d, errno=%d\n", ha_id, id, errno);
+        }
+        return FALSE;
+    }
+
+    /* Same 6-byte WRITE the IRIX backend sends */
+    cmd[0] = 0x0A;  /* WRITE command */
+    cmd[1] = 0x00;
+    cmd[2] = (unsigned char)((size & 0x00FF0000) >> 16);
+    cmd[3] = (unsigned char)((size & 0x0000FF00) >> 8);
+    cmd[4] = (unsigned char)(size & 0x000000FF);
+    cmd[5] = 0x00;
+
+    result = aspi_sg_command(fd, &io, cmd, 6, SG_DXFER_TO_DEV,
+                             buffer, size, sense, 30 * 1000);
+
+    if (!aspi_sg_ok(result, &io)) {
+        if (debug != NULL && debug->enabled) {
+            printf("ASPI_Send: Command failed, result=%d, host=%d, driver=%d, status=%d\n",
+                   result, io.host_status, io.driver_status, io.status);
+        }
+        if (!temporary && aspi_transport_failed(result, &io)) {
+            aspi_invalidate(ha_id, id);
+        }
+        aspi_release(fd, temporary);
+        return FALSE;
+    }
+
+    if (debug != NULL && debug->enabled) {
+        printf("ASPI_Send: Sent %lu bytes%s\n", size,
+               (io.info & SG_INFO_DIRECT_IO_MASK) == SG_INFO_DIRECT_IO ? " (direct I/O)" : "");
+    }
+
+    aspi_release(fd, temporary);
+    return TRUE;
+}
+
+/*
+ * Receive data from SCSI device
+ */
+unsigned long ASPI_Receive(scsi_debug_t *debug, unsigned char ha_id, unsigned char id, void *buffer, unsigned long size)
+{
+    unsigned char cmd[6];
+    unsigned char sense[ASPI_SENSE_LEN];
+    sg_io_hdr_t io;
+    int fd;
+    int temporary;
+    int result;
+    unsigned long bytes_received = 0;
+
+    fd = aspi_acquire(ha_id, id, &temporary);
+    if (fd < 0) {
+        if (debug != NULL && debug->enabled) {
+            printf("ASPI_Receive: Failed to open device %d:%d, errno=%d\n", ha_id, id, errno);
+        }
+        return 0;
+    }
+
+    cmd[0] = 0x08;  /* READ */
+    cmd[1] = 0x00;
+    cmd[2] = (unsigned char)((size & 0x00FF0000) >> 16);
+    cmd[3] = (unsigned char)((size & 0x0000FF00) >> 8);
+    cmd[4] = (unsigned char)(size & 0x000000FF);
+    cmd[5] = 0x00;
+
+    result = aspi_sg_command(fd, &io, cmd, 6, SG_DXFER_FROM_DEV,
+                             buffer, size, sense, 10 * 1000);
+
+    if (aspi_sg_ok(result, &io)) {
+        bytes_received = size - (unsigned long)io.resid;
+
+        if (debug != NULL && debug->enabled) {
+            printf("ASPI_Receive: Received %lu bytes%s\n", bytes_received,
+                   (io.info & SG_INFO_DIRECT_IO_MASK) == SG_INFO_DIRECT_IO ? " (direct I/O)" : "");
+        }
+    }
+    else if (debug != NULL && debug->enabled) {
+        printf("ASPI_Receive: SG_IO failed, result=%d, host=%d, driver=%d, status=%d\n",
+               result, io.host_status, io.driver_status, io.status);
+    }
+
+    /* Drop a cached descriptor the driver no longer accepts */
+    if (!temporary && aspi_transport_failed(result, &io)) {
+        aspi_invalidate(ha_id, id);
+    }
+
+    aspi_release(fd, temporary);
+
+    return bytes_received;
+}
+
+/*
+ * Inquire SCSI device (get identity information)
+ */
+void ASPI_InquireDevice(scsi_debug_t *debug, char result[], unsigned char ha_id, unsigned char id)
+{
+    unsigned char cmd[6] = {0x12, 0, 0, 0, 96, 0};  /* INQUIRY */
+    unsigned char inqbuf[96];  /* Inquiry data buffer */
+    unsigned char sense[ASPI_SENSE_LEN];
+    sg_io_hdr_t io;
+    int fd;
+    int temporary;
+    int ret;
+
+    /* Check parameters */
+    if (result == NULL)
+    {
+        return;
+    }
+
+    /* Initialize result */
+    memset(result, 0, 96);
+
+    fd = aspi_acquire(ha_id, id, &temporary);
+    if (fd < 0)
+    {
+        aspi_log_text(debug, ha_id, id, "Failed to open device", -1);
+        return;
+    }
+
+    memset(inqbuf, 0, sizeof(inqbuf));
+    ret = aspi_sg_command(fd, &io, cmd, 6, SG_DXFER_FROM_DEV,
+                          inqbuf, sizeof(inqbuf), sense, 5 * 1000);
+
+    if (aspi_sg_ok(ret, &io))
+    {
+        /* Copy inquiry data to result buffer */
+        memcpy(result, inqbuf, sizeof(inqbuf));
+    }
+    else if (!temporary && aspi_transport_failed(ret, &io))
+    {
+        aspi_invalidate(ha_id, id);
+    }
+
+    aspi_log_command(debug, ha_id, id, cmd, 6, SCSI_DIR_IN,
+                     inqbuf, sizeof(inqbuf), ret, &io, sense);
+
+    aspi_release(fd, temporary);
+}
@@ -1,5 +1,6 @@
 /* src/callbacks.c - Callback functions for GUI events */
 #include "app_all.h"
+#include "aspi_irix.h"
 
 /* Structure for sample ID dialog callbacks */
 typedef struct {
@@ -9,12 +10,120 @@ typedef struct {
 } OkCallbackData;
 
 
+/* Sample file types offered by the file dialogs, the first shown first */
+static char *file_type_labels[] = { "AIFF (*.aif)", "WAV (*.wav)", "Broadcast WAV (*.bwf)" };
+static char *file_type_patterns[] = { "*.aif", "*.wav", "*.bwf" };
+#define NUM_FILE_TYPES 3
+
+
 /* Function declarations */
 static void sample_id_ok_callback(Widget widget, XtPointer client_data, XtPointer call_data);
 
+/* File type chosen: list the files of that type */
+static void file_type_callback(Widget widget, XtPointer client_data, XtPointer call_data)
+{
+    XtPointer file_dialog;
+    XmString pattern;
+    
+    XtVaGetValues(widget, XmNuserData, &file_dialog, NULL);
+    
+    /* Setting the pattern makes the dialog search again */
+    pattern = XmStringCreateLocalized(file_type_patterns[(int)(long)client_data]);
+    XtVaSetValues((Widget)file_dialog, XmNpattern, pattern, NULL);
+    XmStringFree(pattern);
+}
+
+/* Add a File Type option menu to a sample file dialog and list the
+   files of the first type */
+static void add_file_type_menu(Widget file_dialog)
+{
+    Widget pulldown;
+    Widget button;
+    Widget option_menu;
+    XmString str;
+    Arg args[2];
+    int n;
+    int i;
+    
+    pulldown = XmCreatePulldownMenu(file_dialog, "file_type_menu", NULL, 0);
+    
+    for (i = 0; i < NUM_FILE_TYPES; i++) {
+        str = XmStringCreateLocalized(file_type_labels[i]);
+        button = XtVaCreateManagedWidget(
+            "file_type",               /* Widget name */
+            xmPushButtonWidgetClass,   /* Widget class */
+            pulldown,                  /* Parent widget */
+            XmNlabelString, str,       /* Label */
+            XmNuserData, (XtPointer)file_dialog, /* Dialog to search */
+            NULL);                     /* Terminate list */
+        XmStringFree(str);
+        
+        XtAddCallback(button, XmNactivateCallback, file_type_callback, (XtPointer)(long)i);
+    }
+    
+    /* The option menu becomes the dialog's work area */
+    n = 0;
+    str = XmStringCreateLocalized("File Type");
+    XtSetArg(args[n], XmNlabelString, str); n++;
+    XtSetArg(args[n], XmNsubMenuId, pulldown); n++;
+    
+    option_menu = XmCreateOptionMenu(file_dialog, "file_type_option", args, n);
+    XtManageChild(option_menu);
+    XmStringFree(str);
+    
+    str = XmStringCreateLocalized(file_type_patterns[0]);
+    XtVaSetValues(file_dialog, XmNpattern, str, NULL);
+    XmStringFree(str);
+}
+
+/* A file name without an extension gets the one of the files the dialog
+   lists, so a sample is saved as the type chosen; returns the name to
+   use in place of filename, which it may have freed */
+static char *add_file_extension(char *filename, XmString pattern)
+{
+    char *base;
+    char *text;
+    char *ext;
+    char *named;
+    
+    base = strrchr(filename, '/');
+    base = (base != NULL) ? base + 1 : filename;
+    if (*base == '\0' || strchr(base, '.') != NULL || pattern == NULL) {
+        return filename;
+    }
+    if (!XmStringGetLtoR(pattern, XmSTRING_DEFAULT_CHARSET, &text)) {
+        return filename;
+    }
+    
+    ext = strrchr(text, '.');
+    if (ext != NULL && strchr(ext, '*') == NULL && strchr(ext, '?') == NULL) {
+        named = XtMalloc(strlen(filename) + strlen(ext) + 1);
+        sprintf(named, "%s%s", filename, ext);
+        XtFree(filename);
+        filename = named;
+    }
+    XtFree(text);
+    
+    return filename;
+}
+
+/* Label the Connect button for the selected device */
+static void update_connect_button(void)
+{
+    XmString str;
+    
+    str = XmStringCreateLocalized(app_data.connected ? "Disconnect" : "Connect");
+    XtVaSetValues(app_data.connectButton, XmNlabelString, str, NULL);
+    XmStringFree(str);
+}
+
 /* Exit application */
 void exit_callback(Widget widget, XtPointer client_data, XtPointer call_data)
 {
+    /* Release any open device handles, and any a session left cached */
+    disconnect_all_devices();
+    ASPI_CloseAllDevices();
+    
     /* Exit the application */
     exit(0);
 }
@@ -68,7 +177,14 @@ void connect_callback(Widget widget, XtPointer client_data, XtPointer call_data)
 {
     int ha_id;
     int id;
-    XmString str;
+    
+    /* Button acts as Disconnect while the selected device is connected;
+       the other connected devices stay connected */
+    if (app_data.connected) {
+        disconnect_from_device();
+        update_connect_button();
+        return;
+    }
     
     /* Get the selected values from the app_data structure */
     ha_id = app_data.currentHA;
@@ -79,9 +195,7 @@ void connect_callback(Widget widget, XtPointer client_data, XtPointer call_data)
     /* Try to connect to the device */
     if (connect_to_device(ha_id, id)) {
         /* Change the Connect button to Disconnect */
-        str = XmStringCreateLocalized("Disconnect");
-        XtVaSetValues(app_data.connectButton, XmNlabelString, str, NULL);
-        XmStringFree(str);
+        update_connect_button();
         
         /* Clear and refresh the sample list */
         clear_sample_list();
@@ -214,15 +328,15 @@ void scan_callback(Widget widget, XtPointer client_data, XtPointer call_data)
         
         /* If we found an SMDI device, set the Host Adapter and Target ID */
         if (found_smdi) {
-            /* Set Host Adapter */
-            app_data.currentHA = smdi_ha;
+            /* Show the device found and set the Host Adapter */
+            select_device(smdi_ha, smdi_id);
+            update_connect_button();
             sprintf(temp_buffer, "Host Adapter: %d", smdi_ha);
             str = XmStringCreateLocalized(temp_buffer);
             XtVaSetValues(app_data.haOption, XmNlabelString, str, NULL);
             XmStringFree(str);
             
             /* Set Target ID */
-            app_data.currentID = smdi_id;
             sprintf(temp_buffer, "Target ID: %d", smdi_id);
             str = XmStringCreateLocalized(temp_buffer);
             XtVaSetValues(app_data.idOption, XmNlabelString, str, NULL);
@@ -331,6 +445,21 @@ void scan_callback(Widget widget, XtPointer client_data, XtPointer call_data)
     }
 }
 
+/* Cancel the queued transfers and the one running */
+void cancel_transfer_callback(Widget widget, XtPointer client_data, XtPointer call_data)
+{
+    cancel_transfers();
+}
+
+/* Hold back or release the queued transfers */
+void pause_transfers_callback(Widget widget, XtPointer client_data, XtPointer call_data)
+{
+    XmToggleButtonCallbackStruct *cbs;
+    
+    cbs = (XmToggleButtonCallbackStruct *)call_data;
+    pause_transfers(cbs->set);
+}
+
 /* Refresh sample list */
 void refresh_callback(Widget widget, XtPointer client_data, XtPointer call_data)
 {
@@ -342,6 +471,12 @@ void refresh_callback(Widget widget, XtPointer client_data, XtPointer call_data)
         return;
     }
     
+    /* The list is refreshed when the queued transfers are done */
+    if (transfers_pending()) {
+        refresh_sample_list();
+        return;
+    }
+    
     /* Clear the list */
     clear_sample_list();
     
@@ -513,7 +648,7 @@ void dialog_close_callback(Widget widget, XtPointer client_data, XtPointer call_
     XtDestroyWidget(dialog);
 }
 
-/* Sample ID selection dialog - Called before sending AIF file */
+/* Sample ID selection dialog - Called before sending a sample file */
 void select_sample_id_dialog(Widget parent, const char *filename)
 {
     Widget dialog_shell;
@@ -665,19 +800,15 @@ static void sample_id_ok_callback(Widget widget, XtPointer client_data, XtPointe
         return;
     }
     
-    /* Send the AIF file with the specified sample ID */
-    update_status("Sending AIF file to sample %d...", sample_id);
+    /* Send the sample file with the specified sample ID */
+    update_status("Sending sample file to sample %d...", sample_id);
     
-    if (send_aif_file(data->filename, sample_id)) {
-        update_status("AIF file sent successfully to sample %d", sample_id);
-        
-        /* Refresh the sample list */
-        clear_sample_list();
-        refresh_sample_list();
-    } else {
-        update_status("Failed to send AIF file to sample %d", sample_id);
+    /* The upload goes on in the background and refreshes the sample
+       list when it is done */
+    if (!send_aif_file(data->filename, sample_id)) {
+        update_status("Failed to send sample file to sample %d", sample_id);
         show_message_dialog(app_data.mainWindow, "Send Error", 
-                           "Failed to send the AIF file.", 
+                           "Failed to send the sample file.", 
                            XmDIALOG_ERROR);
     }
     
@@ -686,11 +817,10 @@ static void sample_id_ok_callback(Widget widget, XtPointer client_data, XtPointe
     XtFree((char *)data);
 }
 
-/* Send AIF file */
+/* Send AIF or WAV file */
 void send_aif_callback(Widget widget, XtPointer client_data, XtPointer call_data)
 {
     Widget file_dialog;
-    XmString filter;
     
     /* Check if connected */
     if (!app_data.connected) {
@@ -709,16 +839,11 @@ void send_aif_callback(Widget widget, XtPointer client_data, XtPointer call_data
     /* Set dialog title */
     XtVaSetValues(
         XtParent(file_dialog),     /* Parent shell */
-XmNtitle, "Select AIF File", /* Dialog title */
+XmNtitle, "Select Sample File", /* Dialog title */
         NULL);                     /* Terminate list */
     
-    /* Set file filter pattern */
-    filter = XmStringCreateLocalized("*.aif");
-    XtVaSetValues(
-        file_dialog,
-        XmNpattern, filter,
-        NULL);
-    XmStringFree(filter);
+    /* Choose the file type to list */
+    add_file_type_menu(file_dialog);
     
     /* Add callbacks for OK and Cancel buttons */
     XtAddCallback(file_dialog, XmNokCallback, file_selected_callback, (XtPointer)1);
@@ -729,11 +854,10 @@ XmNtitle, "Select AIF File", /* Dialog title */
     XtManageChild(file_dialog);
 }
 
-/* Receive AIF file (right-click menu) */
+/* Receive AIF or WAV file (right-click menu) */
 void receive_aif_callback(Widget widget, XtPointer client_data, XtPointer call_data)
 {
     Widget file_dialog;
-    XmString filter;
     int selected_row;
     int sample_id;
     
@@ -768,16 +892,11 @@ void receive_aif_callback(Widget widget, XtPointer client_data, XtPointer call_d
     /* Set dialog title */
     XtVaSetValues(
         XtParent(file_dialog), /* Parent shell */
-        XmNtitle, "Save As AIF File", /* Dialog title */
+        XmNtitle, "Save As Sample File", /* Dialog title */
         NULL);                 /* Terminate list */
     
-    /* Set file filter pattern */
-    filter = XmStringCreateLocalized("*.aif");
-    XtVaSetValues(
-        file_dialog,
-        XmNpattern, filter,
-        NULL);
-    XmStringFree(filter);
+    /* Choose the file type to save as */
+    add_file_type_menu(file_dialog);
     
     /* Add callbacks for OK and Cancel buttons */
     XtAddCallback(file_dialog, XmNokCallback, file_selected_callback, 
@@ -871,18 +990,12 @@ void confirm_delete_callback(Widget widget, XtPointer client_data, XtPointer cal
     
     update_status("Deleting sample %d...", sample_id);
     
-    /* Delete the sample */
+    /* The delete is queued; the list is refreshed once the queue is done */
     result = delete_sample(sample_id);
     
-    if (result) {
-        update_status("Sample %d deleted successfully", sample_id);
-    } else {
-        update_status("Error reported during delete of sample %d, refreshing list anyway", sample_id);
+    if (!result) {
+        update_status("Failed to delete sample %d", sample_id);
     }
-    
-    /* Always refresh the sample list regardless of success or failure */
-    clear_sample_list();
-    refresh_sample_list();
 }
 
 /* File selection callback */
@@ -910,17 +1023,17 @@ void file_selected_callback(Widget widget, XtPointer client_data, XtPointer call
     
     /* Check the operation type */
     if (operation == 1) {
-        /* Send AIF file - Now call our sample ID selection dialog */
+        /* Send sample file - Now call our sample ID selection dialog */
         select_sample_id_dialog(app_data.mainWindow, filename);
     } else {
-        /* Receive sample as AIF (operation is the sample_id) */
+        /* Receive sample as AIF or WAV (operation is the sample_id) */
         sample_id = operation;
+        filename = add_file_extension(filename, cbs->pattern);
         
-        update_status("Receiving sample %d as AIF file...", sample_id);
+        update_status("Receiving sample %d as %s...", sample_id, filename);
         
-        if (receive_sample_as_aif(sample_id, filename)) {
-            update_status("Sample %d received and saved as %s", sample_id, filename);
-        } else {
+        /* The download goes on in the background */
+        if (!receive_sample_as_aif(sample_id, filename)) {
             update_status("Failed to receive sample %d", sample_id);
             show_message_dialog(app_data.mainWindow, "Receive Error", 
                                "Failed to receive the sample.",
@@ -963,8 +1076,8 @@ void sample_create_popup_menu(Widget widget, XtPointer client_data, XEvent *even
     if (!popup_menu) {
         popup_menu = XmCreatePopupMenu(app_data.sampleGrid, "sample_popup", NULL, 0);
         
-        /* Create "Receive as AIF" menu item */
-        str = XmStringCreateLocalized("Receive as AIF...");
+        /* Create "Receive as AIF/WAV" menu item */
+        str = XmStringCreateLocalized("Receive as AIF/WAV...");
         receive_button = XtVaCreateManagedWidget(
             "receive_aif",            /* Widget name */
             xmPushButtonWidgetClass,  /* Widget class */
@@ -1015,8 +1128,9 @@ void ha_option_callback(Widget widget, XtPointer client_data, XtPointer call_dat
     /* Get the host adapter ID from client data */
     ha_id = (int)(long)client_data;
     
-    /* Store the selected value */
-    app_data.currentHA = ha_id;
+    /* Show the device at the new address */
+    select_device(ha_id, app_data.currentID);
+    update_connect_button();
     
     /* Update the option menu label to reflect the selection */
     sprintf(buffer, "Host Adapter: %d", ha_id);
@@ -1037,8 +1151,9 @@ void id_option_callback(Widget widget, XtPointer client_data, XtPointer call_dat
     /* Get the target ID from client data */
     id = (int)(long)client_data;
     
-    /* Store the selected value */
-    app_data.currentID = id;
+    /* Show the device at the new address */
+    select_device(app_data.currentHA, id);
+    update_connect_button();
     
     /* Update the option menu label to reflect the selection */
     sprintf(buffer, "Target ID: %d", id);
@@ -1354,7 +1469,6 @@ void send_multiple_aif_callback(Widget widget, XtPointer client_data, XtPointer
 {
     Widget file_dialog;
     Widget file_list;
-    XmString filter;
     XmString title;
     MultiFileCallbackData *callback_data;
     
@@ -1373,23 +1487,22 @@ void send_multiple_aif_callback(Widget widget, XtPointer client_data, XtPointer
         NULL, 0);                  /* No arguments */
     
     /* Set dialog title */
-    title = XmStringCreateLocalized("Select AIF Files");
+    title = XmStringCreateLocalized("Select Sample Files");
     XtVaSetValues(
         XtParent(file_dialog),     /* Parent shell */
-        XmNtitle, "Select AIF Files", /* Dialog title */
+        XmNtitle, "Select Sample Files", /* Dialog title */
         NULL);                     /* Terminate list */
     
-    /* Set file filter pattern */
-    filter = XmStringCreateLocalized("*.aif");
     XtVaSetValues(
         file_dialog,
-        XmNpattern, filter,
         XmNdialogTitle, title,
         NULL);
     
-    XmStringFree(filter);
     XmStringFree(title);
     
+    /* Choose the file type to list */
+    add_file_type_menu(file_dialog);
+    
     /* Get the file list widget */
     file_list = (Widget)XmSelectionBoxGetChild(file_dialog, XmDIALOG_LIST);
     
@@ -1420,47 +1533,21 @@ void send_multiple_aif_callback(Widget widget, XtPointer client_data, XtPointer
 }
 
 
-/* Function to upload multiple AIF files */
+/* Function to upload multiple AIF or WAV files */
 void upload_multiple_aif_files(char **filenames, int file_count, int start_sample_id)
 {
     int i;
-    int success_count = 0;
-    int failure_count = 0;
-    char message[256];
     
     update_status("Starting upload of %d files from sample ID %d...", 
                  file_count, start_sample_id);
     
-    /* Upload each file */
+    /* The files are queued as one batch that keeps the device busy; the
+       results are shown and the list refreshed when it is done */
+    send_aif_files(filenames, file_count, start_sample_id);
+    
+    /* Free the filenames */
     for (i = 0; i < file_count; i++) {
-        int current_id = start_sample_id + i;
-        
-        update_status("Uploading file %d of %d to sample ID %d...", 
-                     i + 1, file_count, current_id);
-        
-        if (send_aif_file(filenames[i], current_id)) {
-            success_count++;
-        } else {
-            failure_count++;
-        }
-        
-        /* Free the filename */
         XtFree(filenames[i]);
     }
-    
-    /* Free the filenames array */
     XtFree((char *)filenames);
-    
-    /* Show results */
-    sprintf(message, "Upload complete: %d successful, %d failed", 
-           success_count, failure_count);
-    update_status("%s", message);
-    
-    /* Show dialog with results */
-    show_message_dialog(app_data.mainWindow, "Upload Results", 
-                       message, XmDIALOG_INFORMATION);
-    
-    /* Refresh the sample list */
-    clear_sample_list();
-    refresh_sample_list();
 }
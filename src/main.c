@@ -77,6 +77,8 @@ static String fallback_resources[] = {
 
 int main(int argc, char *argv[])
 {
+    char packet_file[256];
+    
     main_log("SMDI Manager starting - DEBUG BUILD");
     
     /* Initialize the application data */
@@ -86,6 +88,7 @@ int main(int argc, char *argv[])
     app_data.currentHA = 0;
     app_data.currentID = 0;
     app_data.numSamples = 0;
+    app_data.session = NULL;
     app_data.operationInProgress = 0;
     strcpy(app_data.statusMessage, "Ready");
     
@@ -118,6 +121,11 @@ int main(int argc, char *argv[])
     create_main_window(toplevel);
     main_log("Main window creation returned");
     
+    /* Progress of background transfers arrives through a pipe */
+    if (!init_transfers()) {
+        main_log("Failed to create the transfer progress pipe");
+    }
+    
     /* Realize and enter the main loop */
     main_log("About to realize widgets");
     XtRealizeWidget(toplevel);
@@ -130,6 +138,16 @@ int main(int argc, char *argv[])
     main_log("Initializing SMDI");
     if (SMDI_Init()) {
         main_log("SMDI initialized successfully");
+        
+        /* Packet sizes calibrated for known sampler models */
+        if (getenv("HOME") != NULL) {
+            sprintf(packet_file, "%.200s/.smdi_packets", getenv("HOME"));
+            SMDI_SetPacketSizeFile(packet_file);
+            
+            /* Sample headers remembered from earlier sessions */
+            sprintf(packet_file, "%.200s/.smdi_catalog", getenv("HOME"));
+            SMDI_SetCatalogFile(packet_file);
+        }
         update_status("SMDI initialized. Ready to connect to a device.");
     } else {
         main_log("SMDI initialization failed");
@@ -16,6 +16,8 @@ void create_menu_bar(Widget parent)
     Widget exit_button;
     Widget send_aif_button;
     Widget send_multi_aif_button;
+    Widget pause_button;
+    Widget cancel_button;
     Widget help_button;
     XmString str;
     
@@ -94,8 +96,8 @@ void create_menu_bar(Widget parent)
         NULL);                     /* Terminate list */
     XmStringFree(str);
     
-    /* Create the Send AIF button */
-    str = XmStringCreateLocalized("Send AIF File...");
+    /* Create the Send AIF/WAV button */
+    str = XmStringCreateLocalized("Send AIF/WAV File...");
     send_aif_button = XtVaCreateManagedWidget(
         "send_aif",                /* Widget name */
         xmPushButtonWidgetClass,   /* Widget class */
@@ -107,8 +109,8 @@ void create_menu_bar(Widget parent)
     /* Add the callback for the Send AIF button */
     XtAddCallback(send_aif_button, XmNactivateCallback, send_aif_callback, NULL);
 
-   /* Create the Send Multiple AIF button */
-   str = XmStringCreateLocalized("Send Multiple AIF Files...");
+   /* Create the Send Multiple AIF/WAV button */
+   str = XmStringCreateLocalized("Send Multiple AIF/WAV Files...");
    send_multi_aif_button = XtVaCreateManagedWidget(
     "send_multi_aif",          /* Widget name */
     xmPushButtonWidgetClass,   /* Widget class */
@@ -119,6 +121,32 @@ void create_menu_bar(Widget parent)
 
     /* Add the callback for the Send Multiple AIF button */
     XtAddCallback(send_multi_aif_button, XmNactivateCallback, send_multiple_aif_callback, NULL);
+
+    /* Create the Pause Transfers toggle */
+    str = XmStringCreateLocalized("Pause Transfers");
+    pause_button = XtVaCreateManagedWidget(
+        "pause_transfers",         /* Widget name */
+        xmToggleButtonWidgetClass, /* Widget class */
+        operations_menu,           /* Parent widget */
+        XmNlabelString, str,       /* Button label */
+        NULL);                     /* Terminate list */
+    XmStringFree(str);
+    
+    /* Add the callback for the Pause Transfers toggle */
+    XtAddCallback(pause_button, XmNvalueChangedCallback, pause_transfers_callback, NULL);
+    
+    /* Create the Cancel Transfers button */
+    str = XmStringCreateLocalized("Cancel Transfers");
+    cancel_button = XtVaCreateManagedWidget(
+        "cancel_transfer",         /* Widget name */
+        xmPushButtonWidgetClass,   /* Widget class */
+        operations_menu,           /* Parent widget */
+        XmNlabelString, str,       /* Button label */
+        NULL);                     /* Terminate list */
+    XmStringFree(str);
+    
+    /* Add the callback for the Cancel Transfers button */
+    XtAddCallback(cancel_button, XmNactivateCallback, cancel_transfer_callback, NULL);
     
     /* Create the Help menu */
     help_menu = XmCreatePulldownMenu(menu_bar, "help_menu", NULL, 0);
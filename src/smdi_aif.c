@@ -1,273 +1,768 @@
 /*
  * SMDI AIF file format support for IRIX 5.3
  * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * AIFF and AIFF-C files are read and written here directly. A file is
+ * mapped into memory and its chunks parsed in place: COMM gives the
+ * format, SSND the frames, INST the base note, detune and sustain loop,
+ * MARK the loop's positions and NAME the name. The frames are used where
+ * they lie in the mapping; uploads copy them straight into each packet,
+ * converted on the way only when the sampler cannot take them as they
+ * are. Files are written front to back in one pass, the chunk sizes
+ * being known from the sample's header.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dmedia/audioutil.h>
-#include <dmedia/audiofile.h>
 #include "smdi.h"
 #include "smdi_sample.h"
+#include "smdi_convert.h"
+#include "smdi_resample.h"
+#include "smdi_aif.h"
 
-/* Load an AIF file into SMDI sample format */
-SMDI_Sample* SMDI_LoadAIFSample(const char* filename) {
-    AFfilehandle file;
-    SMDI_Sample* sample = NULL;
-    long sampfmt, sampwidth;
-    long nframes, channels, rate;
-    int file_format;
-    void* buffer;
-    long ids[32]; /* Max 32 misc chunks */
-    int nmisc, i;
-    long size;
-    char name_buffer[256];
+/* Version stamp of the AIFF-C FVER chunk */
+#define AIFC_VERSION 0xA2805140UL
+
+/* Marker ids of the loop written */
+#define AIF_MARK_LOOP_START 1
+#define AIF_MARK_LOOP_END   2
+
+/* Loop play modes of the INST chunk */
+#define AIF_LOOP_NONE     0
+#define AIF_LOOP_FORWARD  1
+#define AIF_LOOP_BACKFORW 2
+
+/* Frames still to be read from an AIF file uploaded as a source */
+typedef struct {
+    SMDI_AIFFile* aif;
+    DWORD pos;
+} AIFSourceState;
+
+/* AIF file being written by a download */
+typedef struct {
+    FILE* file;
+    char filename[MAX_PATH];
+    int use_aifc;
+    DWORD data_size;
+    DWORD written;
+} AIFSinkState;
+
+/* Big-endian fields of the chunks */
+static DWORD SMDI_GetBE32(const unsigned char* p) {
+    return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+}
+
+static WORD SMDI_GetBE16(const unsigned char* p) {
+    return (WORD)((p[0] << 8) | p[1]);
+}
+
+static void SMDI_PutBE32(unsigned char* p, DWORD v) {
+    p[0] = (unsigned char)((v >> 24) & 0xFF);
+    p[1] = (unsigned char)((v >> 16) & 0xFF);
+    p[2] = (unsigned char)((v >> 8) & 0xFF);
+    p[3] = (unsigned char)(v & 0xFF);
+}
+
+static void SMDI_PutBE16(unsigned char* p, WORD v) {
+    p[0] = (unsigned char)((v >> 8) & 0xFF);
+    p[1] = (unsigned char)(v & 0xFF);
+}
+
+/* Whole Hz of an 80-bit IEEE extended sample rate, rounded */
+static DWORD SMDI_GetExtendedRate(const unsigned char* p) {
+    DWORD hi;
+    int exponent;
+    int shift;
+    
+    exponent = ((p[0] & 0x7F) << 8) | p[1];
+    hi = SMDI_GetBE32(p + 2);
+    if ((p[0] & 0x80) || hi == 0) {
+        return 0;
+    }
+    
+    /* The integer part is the top bits of the mantissa */
+    shift = 16383 + 31 - exponent;
+    if (shift < 0) {
+        return 0;
+    }
+    if (shift > 31) {
+        return (shift == 32 && (hi & 0x80000000UL)) ? 1 : 0;
+    }
+    if (shift == 0) {
+        return hi;
+    }
+    
+    return (hi >> shift) + ((hi >> (shift - 1)) & 1);
+}
+
+/* 80-bit IEEE extended of a whole sample rate */
+static void SMDI_PutExtendedRate(unsigned char* p, DWORD rate) {
+    int top;
+    
+    memset(p, 0, 10);
+    if (rate == 0) {
+        return;
+    }
+    
+    for (top = 31; !(rate & (1UL << top)); top--) {
+    }
+    
+    SMDI_PutBE16(p, (WORD)(16383 + top));
+    SMDI_PutBE32(p + 2, rate << (31 - top));
+}
+
+/* Layout of the frames from COMM's sample size and the AIFF-C
+   compression type (NULL for AIFF). Samples narrower than their bytes
+   are left-justified, so they are taken at the full width of their
+   bytes with the low bits zero. */
+static BOOL SMDI_ParseCompression(SMDI_PCMFormat* format, const unsigned char* type, DWORD bits) {
+    format->dwBytes = (bits + 7) / 8;
+    format->dwBits = format->dwBytes * 8;
+    format->dwEncoding = SMDI_PCM_SIGNED;
+    format->dwByteOrder = SMDI_PCM_BIGENDIAN;
+    
+    if (type == NULL || memcmp(type, "NONE", 4) == 0 || memcmp(type, "twos", 4) == 0) {
+        return bits >= 1 && bits <= 32;
+    }
+    if (memcmp(type, "sowt", 4) == 0) {
+        format->dwByteOrder = SMDI_PCM_LITTLEENDIAN;
+        return bits >= 1 && bits <= 32;
+    }
+    if (memcmp(type, "raw ", 4) == 0) {
+        format->dwEncoding = SMDI_PCM_UNSIGNED;
+        return bits >= 1 && bits <= 32;
+    }
+    if (memcmp(type, "fl32", 4) == 0 || memcmp(type, "FL32", 4) == 0) {
+        format->dwEncoding = SMDI_PCM_FLOAT;
+        format->dwBits = 32;
+        format->dwBytes = 4;
+        return TRUE;
+    }
+    
+    return FALSE;
+}
+
+/* Loop of the INST chunk's sustain loop, placed by the MARK chunk */
+static void SMDI_ParseLoop(SMDI_Sample* info, const unsigned char* inst, const unsigned char* mark,
+                           DWORD mark_size) {
+    WORD mode;
+    WORD begin_id;
+    WORD end_id;
+    WORD count;
+    WORD id;
+    DWORD begin;
+    DWORD end;
+    DWORD off;
+    int found;
+    
+    mode = SMDI_GetBE16(inst + 8);
+    begin_id = SMDI_GetBE16(inst + 10);
+    end_id = SMDI_GetBE16(inst + 12);
+    if (mode == AIF_LOOP_NONE || mark == NULL || mark_size < 2) {
+        return;
+    }
+    
+    /* Markers are an id, a position and a name padded to an even size */
+    begin = end = 0;
+    found = 0;
+    count = SMDI_GetBE16(mark);
+    off = 2;
+    while (count-- > 0 && off + 7 <= mark_size) {
+        id = SMDI_GetBE16(mark + off);
+        if (id == begin_id) {
+            begin = SMDI_GetBE32(mark + off + 2);
+            found |= 1;
+        }
+        if (id == end_id) {
+            end = SMDI_GetBE32(mark + off + 2);
+            found |= 2;
+        }
+        off += 6 + (((DWORD)mark[off + 6] + 2) & ~(DWORD)1);
+    }
+    
+    if (found == 3) {
+        info->loop_type = (mode == AIF_LOOP_BACKFORW) ? SAMPLE_LOOP_BIDIRECTIONAL :
+                          SAMPLE_LOOP_FORWARD;
+        info->loop_start = begin;
+        info->loop_end = end;
+    }
+}
+
+/* Open an AIFF or AIFF-C file and parse its chunks */
+SMDI_AIFFile* SMDI_OpenAIFFile(const char* filename) {
+    SMDI_AIFFile* aif;
+    SMDI_Sample* info;
+    const unsigned char* p;
+    const unsigned char* end;
+    const unsigned char* comm;
+    const unsigned char* ssnd;
+    const unsigned char* inst;
+    const unsigned char* mark;
+    const unsigned char* name;
+    DWORD comm_size;
+    DWORD ssnd_size;
+    DWORD mark_size;
+    DWORD name_size;
+    DWORD size;
+    DWORD frame_bytes;
+    BOOL aifc;
     const char* basename;
     char* dot;
     
-    /* Open the AIF file */
-    file = AFopenfile(filename, "r", AF_NULL_FILESETUP);
-    if (file == AF_NULL_FILEHANDLE) {
-        fprintf(stderr, "SMDI_LoadAIFSample: Failed to open file '%s'\n", filename);
+    aif = (SMDI_AIFFile*)malloc(sizeof(SMDI_AIFFile));
+    if (aif == NULL) {
         return NULL;
     }
+    memset(aif, 0, sizeof(SMDI_AIFFile));
+    info = &aif->Info;
     
-    /* Get file format - verify it's AIFF or AIFF-C */
-    file_format = AFgetfilefmt(file, NULL);
-    if (file_format != AF_FILE_AIFF && file_format != AF_FILE_AIFFC) {
-        fprintf(stderr, "SMDI_LoadAIFSample: File '%s' is not AIFF or AIFF-C format\n", filename);
-        AFclosefile(file);
+    if (!SMDI_MapFile(filename, &aif->Map)) {
+        fprintf(stderr, "SMDI_OpenAIFFile: Failed to open file '%s'\n", filename);
+        SMDI_CloseAIFFile(aif);
         return NULL;
     }
     
-    /* Get audio track information */
-    nframes = AFgetframecnt(file, AF_DEFAULT_TRACK);
-    channels = AFgetchannels(file, AF_DEFAULT_TRACK);
-    rate = (long)AFgetrate(file, AF_DEFAULT_TRACK);
-    AFgetsampfmt(file, AF_DEFAULT_TRACK, &sampfmt, &sampwidth);
-    
-    /* Only support 8-bit or 16-bit samples for now */
-    if (sampfmt != AF_SAMPFMT_TWOSCOMP || (sampwidth != 8 && sampwidth != 16)) {
-        fprintf(stderr, "SMDI_LoadAIFSample: Unsupported sample format in '%s'\n", filename);
-        AFclosefile(file);
+    /* A FORM of AIFF or AIFF-C; one claiming more than the file holds is
+       cut short */
+    p = aif->Map.data;
+    if (aif->Map.size < 12 || memcmp(p, "FORM", 4) != 0 ||
+        (memcmp(p + 8, "AIFF", 4) != 0 && memcmp(p + 8, "AIFC", 4) != 0)) {
+        fprintf(stderr, "SMDI_OpenAIFFile: File '%s' is not AIFF or AIFF-C format\n", filename);
+        SMDI_CloseAIFFile(aif);
         return NULL;
     }
+    aifc = (memcmp(p + 8, "AIFC", 4) == 0);
+    size = SMDI_GetBE32(p + 4);
+    end = p + 8 + ((size < aif->Map.size - 8) ? size : aif->Map.size - 8);
     
-    /* Create a new sample */
-    sample = SMDI_CreateSample(rate, sampwidth, channels, nframes);
-    if (sample == NULL) {
-        fprintf(stderr, "SMDI_LoadAIFSample: Failed to create sample\n");
-        AFclosefile(file);
+    /* Find the chunks; an odd-sized one is followed by a pad byte */
+    comm = ssnd = inst = mark = name = NULL;
+    comm_size = ssnd_size = mark_size = name_size = 0;
+    for (p += 12; end - p >= 8; p += 8 + ((size + 1) & ~(DWORD)1)) {
+        size = SMDI_GetBE32(p + 4);
+        if (size > (DWORD)(end - p) - 8) {
+            size = (DWORD)(end - p) - 8;
+        }
+    
+        if (memcmp(p, "COMM", 4) == 0) {
+            comm = p + 8;
+            comm_size = size;
+        } else if (memcmp(p, "SSND", 4) == 0) {
+            ssnd = p + 8;
+            ssnd_size = size;
+        } else if (memcmp(p, "INST", 4) == 0 && size >= 20) {
+            inst = p + 8;
+        } else if (memcmp(p, "MARK", 4) == 0) {
+            mark = p + 8;
+            mark_size = size;
+        } else if (memcmp(p, "NAME", 4) == 0) {
+            name = p + 8;
+            name_size = size;
+        }
+        /* The last chunk may lack its pad byte */
+        if ((DWORD)(end - p) - 8 - size < 2) {
+            break;
+        }
+    }
+    
+    if (comm == NULL || comm_size < (aifc ? 22UL : 18UL) || ssnd == NULL || ssnd_size < 8 ||
+        SMDI_GetBE16(comm) == 0 || SMDI_GetBE16(comm) > 255 ||
+        !SMDI_ParseCompression(&aif->Format, aifc ? comm + 18 : NULL, SMDI_GetBE16(comm + 6))) {
+        fprintf(stderr, "SMDI_OpenAIFFile: Unsupported sample format in '%s'\n", filename);
+        SMDI_CloseAIFFile(aif);
         return NULL;
     }
     
-    /* Extract loop information if available */
-    if (AFgetinstids(file, NULL) > 0) {
-        long loop_id, loop_mode, loop_start_id, loop_end_id;
-        long loop_start, loop_end;
-        
-        /* Get sustain loop information */
-        loop_id = AFgetinstparamlong(file, AF_DEFAULT_INST, AF_INST_SUSLOOPID);
-        if (loop_id > 0) {
-            loop_mode = AFgetloopmode(file, AF_DEFAULT_INST, loop_id);
-            loop_start_id = AFgetloopstart(file, AF_DEFAULT_INST, loop_id);
-            loop_end_id = AFgetloopend(file, AF_DEFAULT_INST, loop_id);
-            
-            if (loop_start_id > 0 && loop_end_id > 0) {
-                loop_start = AFgetmarkpos(file, AF_DEFAULT_TRACK, loop_start_id);
-                loop_end = AFgetmarkpos(file, AF_DEFAULT_TRACK, loop_end_id);
-                
-                /* Set loop parameters */
-                sample->loop_type = (loop_mode == 1) ? SAMPLE_LOOP_FORWARD : 
-                                   (loop_mode == 2) ? SAMPLE_LOOP_BIDIRECTIONAL : 
-                                   SAMPLE_LOOP_NONE;
-                sample->loop_start = loop_start;
-                sample->loop_end = loop_end;
-            }
-        }
-        
-        /* Get root note information */
-        sample->root_note = AFgetinstparamlong(file, AF_DEFAULT_INST, AF_INST_MIDI_BASENOTE);
-        
-        /* Get detune information */
-        sample->fine_tune = AFgetinstparamlong(file, AF_DEFAULT_INST, AF_INST_NUMCENTS_DETUNE);
-        
+    /* 8-bit samples are sent as they are, anything else as 16 bits */
+    info->channels = (BYTE)SMDI_GetBE16(comm);
+    info->sample_count = SMDI_GetBE32(comm + 2);
+    info->sample_rate = SMDI_GetExtendedRate(comm + 8);
+    info->bits_per_sample = (aif->Format.dwEncoding == SMDI_PCM_SIGNED &&
+                             aif->Format.dwBits == 8) ? 8 : 16;
+    info->root_note = 60;  /* Middle C */
+    
+    /* The frames start past the SSND chunk's offset; a chunk shorter than
+       COMM says holds the frames it holds */
+    size = SMDI_GetBE32(ssnd);
+    if (size > ssnd_size - 8) {
+        size = ssnd_size - 8;
+    }
+    frame_bytes = info->channels * aif->Format.dwBytes;
+    aif->lpFrames = ssnd + 8 + size;
+    if ((ssnd_size - 8 - size) / frame_bytes < info->sample_count) {
+        info->sample_count = (ssnd_size - 8 - size) / frame_bytes;
+    }
+    aif->dwDataSize = info->sample_count * frame_bytes;
+    info->data_size = info->sample_count * info->channels * (info->bits_per_sample / 8);
+    
+    /* Base note, detune and sustain loop */
+    if (inst != NULL) {
+        info->root_note = inst[0] & 0x7F;
+        info->fine_tune = (WORD)(short)(signed char)inst[1];
+    
         /* Ensure fine tune is in range -50 to +50 cents */
-        if (sample->fine_tune < -50) sample->fine_tune = -50;
-        if (sample->fine_tune > 50) sample->fine_tune = 50;
-    }
-    
-    /* Get sample name if available */
-    nmisc = AFgetmiscids(file, NULL);
-    if (nmisc > 0) {
-        if (nmisc > 32) nmisc = 32; /* Limit to our array size */
-        AFgetmiscids(file, ids);
-        
-        /* Look for a name chunk */
-        for (i = 0; i < nmisc; i++) {
-            if (AFgetmisctype(file, ids[i]) == AF_MISC_AIFF_NAME) {
-                size = AFgetmiscsize(file, ids[i]);
-                if (size > 0 && size < 256) {
-                    AFreadmisc(file, ids[i], name_buffer, size);
-                    name_buffer[size] = '\0';
-                    strncpy(sample->name, name_buffer, 255);
-                    sample->name[255] = '\0';
-                }
-                break;
-            }
+        if ((short)info->fine_tune < -50) info->fine_tune = (WORD)-50;
+        if ((short)info->fine_tune > 50) info->fine_tune = 50;
+    
+        SMDI_ParseLoop(info, inst, mark, mark_size);
+    }
+    
+    if (name != NULL && name_size > 0) {
+        if (name_size > 255) {
+            name_size = 255;
         }
+        memcpy(info->name, name, name_size);
+        info->name[name_size] = '\0';
     }
     
     /* If no name was found, use filename as fallback */
-    if (sample->name[0] == '\0') {
+    if (info->name[0] == '\0') {
         basename = strrchr(filename, '/');
         if (basename) {
             basename++; /* Skip the slash */
         } else {
             basename = filename;
         }
-        
+    
         /* Copy basename and remove extension */
-        strncpy(sample->name, basename, 255);
-        sample->name[255] = '\0';
-        dot = strrchr(sample->name, '.');
+        strncpy(info->name, basename, 255);
+        info->name[255] = '\0';
+        dot = strrchr(info->name, '.');
         if (dot) {
             *dot = '\0';
         }
     }
     
-    /* Allocate buffer for reading frames */
-    buffer = malloc(nframes * channels * (sampwidth / 8));
-    if (buffer == NULL) {
-        fprintf(stderr, "SMDI_LoadAIFSample: Failed to allocate buffer\n");
-        SMDI_FreeSample(sample);
-        AFclosefile(file);
+    return aif;
+}
+
+/* Close a file opened with SMDI_OpenAIFFile */
+void SMDI_CloseAIFFile(SMDI_AIFFile* aif) {
+    if (aif == NULL) {
+        return;
+    }
+    
+    SMDI_UnmapFile(&aif->Map);
+    free(aif);
+}
+
+/* Open an AIF file for bBits-bit samples, 0 for as Info has them */
+static SMDI_AIFFile* SMDI_OpenAIFFileAs(const char* filename, BYTE bBits) {
+    SMDI_AIFFile* aif;
+    
+    if (bBits != 0 && bBits != 8 && bBits != 16) {
+        return NULL;
+    }
+    
+    aif = SMDI_OpenAIFFile(filename);
+    if (aif != NULL && bBits != 0) {
+        aif->Info.bits_per_sample = bBits;
+        aif->Info.data_size = aif->Info.sample_count * aif->Info.channels * (bBits / 8);
+    }
+    
+    return aif;
+}
+
+/* Load an AIF file into SMDI sample format */
+SMDI_Sample* SMDI_LoadAIFSample(const char* filename) {
+    return SMDI_LoadAIFSampleAs(filename, 0, SMDI_CONVERT_DITHER);
+}
+
+/* Load an AIF file as bBits-bit samples */
+SMDI_Sample* SMDI_LoadAIFSampleAs(const char* filename, BYTE bBits, DWORD dwFlags) {
+    SMDI_AIFFile* aif;
+    SMDI_Sample* sample;
+    SMDI_Converter* conv;
+    short* data;
+    
+    aif = SMDI_OpenAIFFileAs(filename, bBits);
+    if (aif == NULL) {
         return NULL;
     }
     
-    /* Read all frames at once */
-    if (AFreadframes(file, AF_DEFAULT_TRACK, buffer, nframes) != nframes) {
-        fprintf(stderr, "SMDI_LoadAIFSample: Failed to read frames\n");
-        free(buffer);
-        SMDI_FreeSample(sample);
-        AFclosefile(file);
+    /* Create a new sample */
+    sample = SMDI_CreateSample(aif->Info.sample_rate, aif->Info.bits_per_sample,
+                               aif->Info.channels, aif->Info.sample_count);
+    if (sample == NULL) {
+        fprintf(stderr, "SMDI_LoadAIFSample: Failed to create sample\n");
+        SMDI_CloseAIFFile(aif);
         return NULL;
     }
     
-    /* Copy audio data to sample */
-    memcpy(sample->sample_data, buffer, nframes * channels * (sampwidth / 8));
+    /* Take over format, loop and name */
+    data = sample->sample_data;
+    memcpy(sample, &aif->Info, sizeof(SMDI_Sample));
+    sample->sample_data = data;
+    
+    /* Frames in the sample's layout are copied out of the mapping, others
+       converted out of it */
+    if (!SMDI_NeedsConversion(&aif->Format, sample->bits_per_sample)) {
+        memcpy(sample->sample_data, aif->lpFrames, sample->data_size);
+    } else {
+        conv = SMDI_CreateConverter(&aif->Format, sample->channels, sample->bits_per_sample,
+                                    dwFlags);
+        if (conv == NULL) {
+            fprintf(stderr, "SMDI_LoadAIFSample: Failed to set up conversion\n");
+            SMDI_FreeSample(sample);
+            SMDI_CloseAIFFile(aif);
+            return NULL;
+        }
+        SMDI_ConvertFrames(conv, sample->sample_data, aif->lpFrames, sample->sample_count);
+        SMDI_FreeConverter(conv);
+    }
     
     /* Clean up */
-    free(buffer);
-    AFclosefile(file);
+    SMDI_CloseAIFFile(aif);
     
     return sample;
 }
 
+/* Copy the next bytes of the mapped frames into an upload packet */
+static DWORD SMDI_AIFSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    AIFSourceState* state;
+    
+    state = (AIFSourceState*)src->lpState;
+    
+    if (dwBytes > state->aif->dwDataSize - state->pos) {
+        dwBytes = state->aif->dwDataSize - state->pos;
+    }
+    memcpy(buffer, state->aif->lpFrames + state->pos, dwBytes);
+    state->pos += dwBytes;
+    
+    return dwBytes;
+}
+
+/* Close an AIF file uploaded as a source */
+static void SMDI_AIFSourceClose(SMDI_SampleSource* src) {
+    AIFSourceState* state;
+    
+    state = (AIFSourceState*)src->lpState;
+    SMDI_CloseAIFFile(state->aif);
+    free(state);
+}
+
+/* Open an AIF file as an upload source */
+SMDI_SampleSource* SMDI_OpenAIFSource(const char* filename) {
+    return SMDI_OpenAIFSourceAs(filename, 0, SMDI_CONVERT_DITHER);
+}
+
+/* Open an AIF file as an upload source of bBits-bit samples */
+SMDI_SampleSource* SMDI_OpenAIFSourceAs(const char* filename, BYTE bBits, DWORD dwFlags) {
+    SMDI_SampleSource* src;
+    AIFSourceState* state;
+    SMDI_AIFFile* aif;
+    
+    aif = SMDI_OpenAIFFileAs(filename, bBits);
+    if (aif == NULL) {
+        return NULL;
+    }
+    
+    src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (AIFSourceState*)malloc(sizeof(AIFSourceState));
+    if (src == NULL || state == NULL) {
+        free(src);
+        free(state);
+        SMDI_CloseAIFFile(aif);
+        return NULL;
+    }
+    
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    SMDI_SampleToHeader(&aif->Info, &src->Header);
+    
+    memset(state, 0, sizeof(AIFSourceState));
+    state->aif = aif;
+    
+    src->lpRead = SMDI_AIFSourceRead;
+    src->lpClose = SMDI_AIFSourceClose;
+    src->lpState = state;
+    
+    /* Frames the sampler cannot take are converted on the way */
+    if (SMDI_NeedsConversion(&aif->Format, aif->Info.bits_per_sample)) {
+        return SMDI_OpenConvertSource(src, &aif->Format, aif->Info.bits_per_sample,
+                                      dwFlags);
+    }
+    
+    return src;
+}
+
+/* Open an AIF file for its header only. The file is mapped to parse its
+   chunks and unmapped again, so only the pages holding them are read. */
+SMDI_SampleFile* SMDI_OpenAIFSampleFile(const char* filename) {
+    SMDI_AIFFile* aif;
+    SMDI_SampleFile* file;
+    
+    aif = SMDI_OpenAIFFile(filename);
+    if (aif == NULL) {
+        return NULL;
+    }
+    
+    file = SMDI_CreateSampleFile(filename, &aif->Info, SMDI_OpenAIFSource, SMDI_LoadAIFSample);
+    SMDI_CloseAIFFile(aif);
+    
+    return file;
+}
+
+/* Write a chunk header */
+static BOOL SMDI_WriteChunk(FILE* file, const char* id, DWORD size) {
+    unsigned char head[8];
+    
+    memcpy(head, id, 4);
+    SMDI_PutBE32(head + 4, size);
+    
+    return fwrite(head, 1, 8, file) == 8;
+}
+
+/* Create an AIF file for a sample's format, loop and name and write it
+   up to its frames, which the caller writes */
+static FILE* SMDI_CreateAIF(SMDI_Sample* sample, const char* filename, int use_aifc) {
+    static const char compression[] = "not compressed";
+    unsigned char buf[64];
+    FILE* file;
+    DWORD data_size;
+    DWORD name_size;
+    DWORD comm_size;
+    DWORD mark_size;
+    DWORD form_size;
+    BOOL loop;
+    BOOL ok;
+    
+    if (sample->channels == 0 ||
+        (sample->bits_per_sample != 8 && sample->bits_per_sample != 16)) {
+        fprintf(stderr, "SMDI_CreateAIF: Unsupported sample format\n");
+        return NULL;
+    }
+    
+    data_size = sample->sample_count * sample->channels * (sample->bits_per_sample / 8);
+    name_size = (DWORD)strlen(sample->name);
+    loop = (sample->loop_type != SAMPLE_LOOP_NONE && sample->loop_start < sample->loop_end);
+    
+    /* Chunk sizes; every chunk is padded to an even length in the FORM.
+       The markers are "Loop Start" and "Loop End" with their lengths. */
+    comm_size = use_aifc ? 18 + 4 + ((sizeof(compression) + 1) & ~1UL) : 18;
+    mark_size = 2 + 6 + 12 + 6 + 10;
+    form_size = 4 + (use_aifc ? 8 + 4 : 0) + 8 + comm_size + (loop ? 8 + mark_size : 0) + 8 + 20 +
+                (name_size > 0 ? 8 + ((name_size + 1) & ~(DWORD)1) : 0) +
+                8 + 8 + ((data_size + 1) & ~(DWORD)1);
+    
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "SMDI_CreateAIF: Failed to open file '%s' for writing\n", filename);
+        return NULL;
+    }
+    
+    ok = SMDI_WriteChunk(file, "FORM", form_size) &&
+         fwrite(use_aifc ? "AIFC" : "AIFF", 1, 4, file) == 4;
+    
+    if (ok && use_aifc) {
+        SMDI_PutBE32(buf, AIFC_VERSION);
+        ok = SMDI_WriteChunk(file, "FVER", 4) && fwrite(buf, 1, 4, file) == 4;
+    }
+    
+    /* Format; AIFF-C adds that the frames are not compressed */
+    memset(buf, 0, sizeof(buf));
+    SMDI_PutBE16(buf, sample->channels);
+    SMDI_PutBE32(buf + 2, sample->sample_count);
+    SMDI_PutBE16(buf + 6, sample->bits_per_sample);
+    SMDI_PutExtendedRate(buf + 8, sample->sample_rate);
+    if (use_aifc) {
+        memcpy(buf + 18, "NONE", 4);
+        buf[22] = (unsigned char)(sizeof(compression) - 1);
+        memcpy(buf + 23, compression, sizeof(compression) - 1);
+    }
+    ok = ok && SMDI_WriteChunk(file, "COMM", comm_size) &&
+         fwrite(buf, 1, comm_size, file) == comm_size;
+    
+    /* Loop start and end markers */
+    if (ok && loop) {
+        memset(buf, 0, sizeof(buf));
+        SMDI_PutBE16(buf, 2);
+        SMDI_PutBE16(buf + 2, AIF_MARK_LOOP_START);
+        SMDI_PutBE32(buf + 4, sample->loop_start);
+        buf[8] = 10;
+        memcpy(buf + 9, "Loop Start", 10);
+        SMDI_PutBE16(buf + 20, AIF_MARK_LOOP_END);
+        SMDI_PutBE32(buf + 22, sample->loop_end);
+        buf[26] = 8;
+        memcpy(buf + 27, "Loop End", 8);
+        ok = SMDI_WriteChunk(file, "MARK", mark_size) &&
+             fwrite(buf, 1, mark_size, file) == mark_size;
+    }
+    
+    /* Base note, detune and the sustain loop over the markers, for the
+       whole key and velocity range at unity gain */
+    memset(buf, 0, sizeof(buf));
+    buf[0] = (unsigned char)(sample->root_note & 0x7F);
+    buf[1] = (unsigned char)(signed char)(short)sample->fine_tune;
+    buf[3] = 127;
+    buf[4] = 1;
+    buf[5] = 127;
+    if (loop) {
+        SMDI_PutBE16(buf + 8, (sample->loop_type == SAMPLE_LOOP_BIDIRECTIONAL) ?
+                              AIF_LOOP_BACKFORW : AIF_LOOP_FORWARD);
+        SMDI_PutBE16(buf + 10, AIF_MARK_LOOP_START);
+        SMDI_PutBE16(buf + 12, AIF_MARK_LOOP_END);
+    }
+    ok = ok && SMDI_WriteChunk(file, "INST", 20) && fwrite(buf, 1, 20, file) == 20;
+    
+    if (ok && name_size > 0) {
+        ok = SMDI_WriteChunk(file, "NAME", name_size) &&
+             fwrite(sample->name, 1, name_size, file) == name_size &&
+             ((name_size & 1) == 0 || fputc(0, file) != EOF);
+    }
+    
+    /* Sound data with no offset or block alignment */
+    memset(buf, 0, 8);
+    ok = ok && SMDI_WriteChunk(file, "SSND", 8 + data_size) && fwrite(buf, 1, 8, file) == 8;
+    
+    if (!ok) {
+        fprintf(stderr, "SMDI_CreateAIF: Failed to write '%s'\n", filename);
+        fclose(file);
+        remove(filename);
+        return NULL;
+    }
+    
+    return file;
+}
+
+/* Pad the frames to an even length and close the file */
+static BOOL SMDI_FinishAIF(FILE* file, DWORD data_size) {
+    BOOL ok;
+    
+    ok = (data_size & 1) == 0 || fputc(0, file) != EOF;
+    
+    return (fclose(file) == 0) && ok;
+}
+
 /* Save SMDI sample as AIF file */
 BOOL SMDI_SaveAIFSample(SMDI_Sample* sample, const char* filename, int use_aifc) {
-    AFfilehandle file;
-    AFfilesetup setup;
-    int error = 0;
-    long marker_ids[2];
-    long misc_ids[1];
-    long inst_ids[1];
-    long loop_ids[1];
+    FILE* file;
+    DWORD data_size;
+    BOOL ok;
     
     /* Verify parameters */
     if (sample == NULL || filename == NULL) {
         return FALSE;
     }
     
-    /* Create a new file setup structure */
-    setup = AFnewfilesetup();
-    if (setup == AF_NULL_FILESETUP) {
-        fprintf(stderr, "SMDI_SaveAIFSample: Failed to create file setup\n");
+    file = SMDI_CreateAIF(sample, filename, use_aifc);
+    if (file == NULL) {
         return FALSE;
     }
     
-    /* Set file format */
-    AFinitfilefmt(setup, use_aifc ? AF_FILE_AIFFC : AF_FILE_AIFF);
-    
-    /* Initialize audio track parameters */
-    AFinitchannels(setup, AF_DEFAULT_TRACK, sample->channels);
-    AFinitsampfmt(setup, AF_DEFAULT_TRACK, AF_SAMPFMT_TWOSCOMP, sample->bits_per_sample);
-    AFinitrate(setup, AF_DEFAULT_TRACK, sample->sample_rate);
-    AFinitcompression(setup, AF_DEFAULT_TRACK, AF_COMPRESSION_NONE);
-    
-    /* Set up loops if present */
-    if (sample->loop_type != SAMPLE_LOOP_NONE && 
-        sample->loop_start < sample->loop_end) {
-        
-        /* Set up markers for loop points */
-        marker_ids[0] = 1;  /* Loop start = 1 */
-        marker_ids[1] = 2;  /* Loop end = 2 */
-        AFinitmarkids(setup, AF_DEFAULT_TRACK, marker_ids, 2);
-        AFinitmarkname(setup, AF_DEFAULT_TRACK, 1, "Loop Start");
-        AFinitmarkname(setup, AF_DEFAULT_TRACK, 2, "Loop End");
-        
-        /* Set up instrument chunk */
-        inst_ids[0] = 1;
-        AFinitinstids(setup, inst_ids, 1);
-        
-        /* Set up loop IDs */
-        loop_ids[0] = 1;
-        AFinitloopids(setup, AF_DEFAULT_INST, loop_ids, 1);
-    }
-    
-    /* Set up name chunk if sample has a name */
-    if (sample->name[0] != '\0') {
-        misc_ids[0] = 1;
-        AFinitmiscids(setup, misc_ids, 1);
-        AFinitmisctype(setup, 1, AF_MISC_AIFF_NAME);
-        AFinitmiscsize(setup, 1, strlen(sample->name));
-    }
-    
-    /* Open output file */
-    file = AFopenfile(filename, "w", setup);
-    if (file == AF_NULL_FILEHANDLE) {
-        fprintf(stderr, "SMDI_SaveAIFSample: Failed to open file '%s' for writing\n", filename);
-        AFfreefilesetup(setup);
+    /* The sample's words are big-endian, as the file's */
+    data_size = sample->sample_count * sample->channels * (sample->bits_per_sample / 8);
+    ok = fwrite(sample->sample_data, 1, data_size, file) == data_size;
+    if (!ok) {
+        fprintf(stderr, "SMDI_SaveAIFSample: Failed to write frames\n");
+    }
+    
+    ok = SMDI_FinishAIF(file, data_size) && ok;
+    if (!ok) {
+        remove(filename);
+    }
+    
+    return ok;
+}
+
+/* Create the AIF file from the sample header */
+static BOOL SMDI_AIFSinkBegin(SMDI_SampleSink* sink, SMDI_SampleHeader* sh) {
+    AIFSinkState* state;
+    SMDI_Sample info;
+    
+    state = (AIFSinkState*)sink->lpState;
+    
+    if (sh->dwPeriod == 0 || sh->NumberOfChannels == 0 ||
+        (sh->BitsPerWord != 8 && sh->BitsPerWord != 16)) {
+        fprintf(stderr, "SMDI_AIFSinkBegin: Unsupported sample format\n");
         return FALSE;
     }
     
-    /* Set loop points if present */
-    if (sample->loop_type != SAMPLE_LOOP_NONE && 
-        sample->loop_start < sample->loop_end) {
-        
-        /* Set marker positions */
-        AFsetmarkpos(file, AF_DEFAULT_TRACK, 1, sample->loop_start);
-        AFsetmarkpos(file, AF_DEFAULT_TRACK, 2, sample->loop_end);
-        
-        /* Set instrument parameters */
-        AFsetinstparamlong(file, AF_DEFAULT_INST, AF_INST_MIDI_BASENOTE, sample->root_note);
-        AFsetinstparamlong(file, AF_DEFAULT_INST, AF_INST_NUMCENTS_DETUNE, sample->fine_tune);
-        
-        /* Set loop parameters */
-        AFsetinstparamlong(file, AF_DEFAULT_INST, AF_INST_SUSLOOPID, 1);
-        AFsetloopmode(file, AF_DEFAULT_INST, 1, 
-                    (sample->loop_type == SAMPLE_LOOP_FORWARD) ? 1 : 
-                    (sample->loop_type == SAMPLE_LOOP_BIDIRECTIONAL) ? 2 : 0);
-        AFsetloopstart(file, AF_DEFAULT_INST, 1, 1);  /* Marker ID 1 */
-        AFsetloopend(file, AF_DEFAULT_INST, 1, 2);    /* Marker ID 2 */
-    }
-    
-    /* Write name chunk if sample has a name */
-    if (sample->name[0] != '\0') {
-        AFwritemisc(file, 1, sample->name, strlen(sample->name));
-    }
-    
-    /* Write audio frames */
-    if (AFwriteframes(file, AF_DEFAULT_TRACK, sample->sample_data, sample->sample_count) 
-        != sample->sample_count) {
-        fprintf(stderr, "SMDI_SaveAIFSample: Failed to write frames\n");
-        error = 1;
+    /* Format, loop and name of the sample, without its data */
+    memset(&info, 0, sizeof(SMDI_Sample));
+    info.sample_rate = SMDI_PeriodToRate(sh->dwPeriod);
+    info.bits_per_sample = sh->BitsPerWord;
+    info.channels = sh->NumberOfChannels;
+    info.loop_type = sh->LoopControl;
+    info.sample_count = sh->dwLength;
+    info.loop_start = sh->dwLoopStart;
+    info.loop_end = sh->dwLoopEnd;
+    info.root_note = sh->wPitch;
+    info.fine_tune = sh->wPitchFraction;
+    strncpy(info.name, sh->cName, 255);
+    info.name[255] = '\0';
+    
+    state->data_size = info.sample_count * info.channels * (info.bits_per_sample / 8);
+    state->file = SMDI_CreateAIF(&info, state->filename, state->use_aifc);
+    
+    return state->file != NULL;
+}
+
+/* Write the frames of one packet as they came */
+static BOOL SMDI_AIFSinkWrite(SMDI_SampleSink* sink, void* data, DWORD length) {
+    AIFSinkState* state;
+    
+    state = (AIFSinkState*)sink->lpState;
+    
+    /* No more than the header said there is */
+    if (length > state->data_size - state->written) {
+        return FALSE;
     }
+    state->written += length;
     
-    /* Clean up */
-    AFclosefile(file);
-    AFfreefilesetup(setup);
+    return fwrite(data, 1, length, state->file) == length;
+}
+
+/* Close the AIF file; an incomplete one is removed */
+static BOOL SMDI_AIFSinkClose(SMDI_SampleSink* sink, BOOL bComplete) {
+    AIFSinkState* state;
+    BOOL ok;
+    
+    state = (AIFSinkState*)sink->lpState;
+    
+    ok = TRUE;
+    if (state->file != NULL) {
+        ok = SMDI_FinishAIF(state->file, state->data_size);
+        if (!bComplete || !ok || state->written != state->data_size) {
+            remove(state->filename);
+        }
+    }
+    
+    free(state);
+    
+    return ok;
+}
+
+/* Open an AIF file as a download sink */
+SMDI_SampleSink* SMDI_OpenAIFSink(const char* filename, int use_aifc) {
+    SMDI_SampleSink* sink;
+    AIFSinkState* state;
+    
+    if (filename == NULL || strlen(filename) >= MAX_PATH) {
+        return NULL;
+    }
+    
+    sink = (SMDI_SampleSink*)malloc(sizeof(SMDI_SampleSink));
+    state = (AIFSinkState*)malloc(sizeof(AIFSinkState));
+    if (sink == NULL || state == NULL) {
+        free(sink);
+        free(state);
+        return NULL;
+    }
+    
+    memset(sink, 0, sizeof(SMDI_SampleSink));
+    sink->dwStructSize = sizeof(SMDI_SampleSink);
+    
+    memset(state, 0, sizeof(AIFSinkState));
+    state->file = NULL;
+    strcpy(state->filename, filename);
+    state->use_aifc = use_aifc;
+    
+    sink->lpBegin = SMDI_AIFSinkBegin;
+    sink->lpWrite = SMDI_AIFSinkWrite;
+    sink->lpClose = SMDI_AIFSinkClose;
+    sink->lpState = state;
     
-    return (error == 0);
+    return sink;
 }
@@ -0,0 +1,845 @@
+/*
+ * SMDI sample bank files for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * A bank file holds many samples, each as the image of a native sample
+ * file (SDMP version 2, see smdi_sample.c) starting on a
+ * SAMPLE_DATA_ALIGN boundary, and a table of contents after them:
+ *
+ *   file header   "SMBK", version, TOC offset, TOC size, entries,
+ *                 TOC checksum, reserved                       32 bytes
+ *                 then zeros up to the first image
+ *   image         SDMP header and name, zeros, the sample data
+ *   TOC entry     sample number, image offset                   8 bytes
+ *                 followed by the image's SDMP header and name,
+ *                 padded to 4 bytes
+ *
+ * All fields are big-endian, and offsets 32 bits, so a bank stays under
+ * 4 GB. The TOC checksum is the FNV-1a hash of the TOC, and the TOC is
+ * sorted by sample number. The TOC copies the image headers so a bank
+ * is listed from one read; the images keep theirs so each one can be
+ * cut out as a sample file.
+ *
+ * A bank is only ever appended to: images and the TOC of each commit go
+ * after everything already in the file, and the file header is rewritten
+ * last, so until a commit is complete the bank reads as the one before.
+ * Replaced images and old TOCs stay until the bank is compacted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "smdi.h"
+#include "smdi_sample.h"
+#include "smdi_resample.h"
+#include "smdi_bank.h"
+
+/* Record sizes */
+#define BANK_FILE_HEADER     32
+#define BANK_ENTRY_HEADER    8
+#define BANK_ENTRY_MAX       (BANK_ENTRY_HEADER + SAMPLE_HEADER_SIZE + 256)
+
+/* Image being appended by a download */
+typedef struct {
+    SMDI_Bank* bank;
+    SMDI_BankEntry entry;               /* Data size and hash so far */
+    BOOL bBegun;                        /* The image header is written */
+    unsigned char buffer[SAMPLE_DATA_ALIGN]; /* Encoded image header */
+} BankSinkState;
+
+/* Sample headers a device reported, for a backup or restore */
+typedef struct {
+    DWORD count;
+    DWORD alloc;
+    DWORD* numbers;
+    SMDI_SampleHeader* headers;
+    BOOL bFailed;                       /* Out of memory */
+} BankDeviceState;
+
+/* Offset rounded up to the next image boundary */
+static DWORD SMDI_BankAlign(DWORD offset) {
+    return (offset + SAMPLE_DATA_ALIGN - 1) & ~(DWORD)(SAMPLE_DATA_ALIGN - 1);
+}
+
+/* Push buffered writes to the disk */
+static BOOL SMDI_BankSync(FILE* hFile) {
+    return fflush(hFile) == 0 && fsync(fileno(hFile)) == 0;
+}
+
+/* Encode one TOC entry; returns the record size. scratch holds
+   SAMPLE_DATA_ALIGN bytes. */
+static DWORD SMDI_EncodeBankEntry(unsigned char* record, unsigned char* scratch, SMDI_BankEntry* entry) {
+    DWORD size;
+    
+    SMDI_EncodeSampleFileHeader(&entry->File, scratch);
+    
+    size = (BANK_ENTRY_HEADER + SAMPLE_HEADER_SIZE + entry->File.header.NameLength + 3) & ~(DWORD)3;
+    memset(record, 0, size);
+    SMDI_Put32(&record[0], entry->dwSampleNumber);
+    SMDI_Put32(&record[4], entry->dwOffset);
+    memcpy(&record[BANK_ENTRY_HEADER], scratch, SAMPLE_HEADER_SIZE + entry->File.header.NameLength);
+    
+    return size;
+}
+
+/* Decode one TOC entry; returns the record size, 0 if it does not fit
+   in the bytes left or is damaged */
+static DWORD SMDI_DecodeBankEntry(const unsigned char* record, DWORD left, SMDI_BankEntry* entry) {
+    DWORD size;
+    
+    if (left < BANK_ENTRY_HEADER ||
+        !SMDI_DecodeSampleFileHeader(&record[BANK_ENTRY_HEADER], left - BANK_ENTRY_HEADER, &entry->File) ||
+        entry->File.version != SAMPLE_FILE_VERSION) {
+        return 0;
+    }
+    
+    size = (BANK_ENTRY_HEADER + SAMPLE_HEADER_SIZE + entry->File.header.NameLength + 3) & ~(DWORD)3;
+    if (size > left) {
+        return 0;
+    }
+    
+    entry->dwSampleNumber = SMDI_Get32(&record[0]);
+    entry->dwOffset = SMDI_Get32(&record[4]);
+    
+    return size;
+}
+
+/* Write the file header */
+static BOOL SMDI_WriteBankHeader(FILE* hFile, DWORD toc_offset, DWORD toc_size, DWORD entries,
+                                 DWORD checksum) {
+    unsigned char header[BANK_FILE_HEADER];
+    
+    memset(header, 0, sizeof(header));
+    memcpy(header, BANK_FILE_SIGNATURE, 4);
+    SMDI_Put32(&header[4], BANK_FILE_VERSION);
+    SMDI_Put32(&header[8], toc_offset);
+    SMDI_Put32(&header[12], toc_size);
+    SMDI_Put32(&header[16], entries);
+    SMDI_Put32(&header[20], checksum);
+    
+    return fseek(hFile, 0, SEEK_SET) == 0 &&
+           fwrite(header, 1, sizeof(header), hFile) == sizeof(header);
+}
+
+/* Write a TOC of entries after end, then the file header pointing at
+   it, each pushed to the disk before the next; end receives the end of
+   the TOC */
+static BOOL SMDI_WriteBankTOC(FILE* hFile, SMDI_BankEntry* entries, DWORD count, DWORD* end) {
+    unsigned char* toc;
+    unsigned char* scratch;
+    DWORD toc_offset;
+    DWORD toc_size;
+    DWORD i;
+    BOOL ok;
+    
+    toc = (unsigned char*)malloc(count * BANK_ENTRY_MAX + 1);
+    scratch = (unsigned char*)malloc(SAMPLE_DATA_ALIGN);
+    if (toc == NULL || scratch == NULL) {
+        free(toc);
+        free(scratch);
+        return FALSE;
+    }
+    
+    toc_size = 0;
+    for (i = 0; i < count; i++) {
+        toc_size += SMDI_EncodeBankEntry(toc + toc_size, scratch, &entries[i]);
+    }
+    toc_offset = (*end + 3) & ~(DWORD)3;
+    
+    ok = fseek(hFile, toc_offset, SEEK_SET) == 0 &&
+         fwrite(toc, 1, toc_size, hFile) == toc_size &&
+         SMDI_BankSync(hFile) &&
+         SMDI_WriteBankHeader(hFile, toc_offset, toc_size, count,
+                              SMDI_HashData(SAMPLE_HASH_INIT, toc, toc_size)) &&
+         SMDI_BankSync(hFile);
+    
+    if (ok) {
+        *end = toc_offset + toc_size;
+    }
+    
+    free(toc);
+    free(scratch);
+    
+    return ok;
+}
+
+/* Make room for one more entry */
+static BOOL SMDI_GrowBank(SMDI_Bank* bank) {
+    SMDI_BankEntry* grown;
+    
+    if (bank->dwEntries < bank->dwEntryAlloc) {
+        return TRUE;
+    }
+    
+    grown = (SMDI_BankEntry*)realloc(bank->lpEntries,
+                                     (bank->dwEntryAlloc + 64) * sizeof(SMDI_BankEntry));
+    if (grown == NULL) {
+        return FALSE;
+    }
+    
+    bank->lpEntries = grown;
+    bank->dwEntryAlloc += 64;
+    
+    return TRUE;
+}
+
+/* Index of the first entry at or after a sample number */
+static DWORD SMDI_FindBankEntry(SMDI_Bank* bank, DWORD sample_number) {
+    DWORD lo;
+    DWORD hi;
+    DWORD mid;
+    
+    lo = 0;
+    hi = bank->dwEntries;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (bank->lpEntries[mid].dwSampleNumber < sample_number) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo;
+}
+
+/* Enter an entry, replacing the one of its sample number */
+static BOOL SMDI_StoreBankEntry(SMDI_Bank* bank, SMDI_BankEntry* entry) {
+    DWORD index;
+    
+    index = SMDI_FindBankEntry(bank, entry->dwSampleNumber);
+    if (index >= bank->dwEntries || bank->lpEntries[index].dwSampleNumber != entry->dwSampleNumber) {
+        if (!SMDI_GrowBank(bank)) {
+            return FALSE;
+        }
+        memmove(&bank->lpEntries[index + 1], &bank->lpEntries[index],
+                (bank->dwEntries - index) * sizeof(SMDI_BankEntry));
+        bank->dwEntries++;
+    }
+    
+    memcpy(&bank->lpEntries[index], entry, sizeof(SMDI_BankEntry));
+    bank->bDirty = TRUE;
+    
+    return TRUE;
+}
+
+/* Read the TOC of a mapped bank file; FALSE if it is not a bank or its
+   TOC is damaged */
+static BOOL SMDI_ParseBank(SMDI_Bank* bank, const unsigned char* data, DWORD size) {
+    SMDI_BankEntry entry;
+    DWORD toc_offset;
+    DWORD toc_size;
+    DWORD entries;
+    DWORD offset;
+    DWORD record;
+    DWORD i;
+    
+    if (size < BANK_FILE_HEADER || memcmp(data, BANK_FILE_SIGNATURE, 4) != 0 ||
+        SMDI_Get32(&data[4]) != BANK_FILE_VERSION) {
+        return FALSE;
+    }
+    
+    toc_offset = SMDI_Get32(&data[8]);
+    toc_size = SMDI_Get32(&data[12]);
+    entries = SMDI_Get32(&data[16]);
+    if (toc_offset > size || toc_size > size - toc_offset ||
+        SMDI_HashData(SAMPLE_HASH_INIT, data + toc_offset, toc_size) != SMDI_Get32(&data[20])) {
+        return FALSE;
+    }
+    
+    /* Images lie before the TOC that lists them */
+    offset = toc_offset;
+    for (i = 0; i < entries; i++) {
+        record = SMDI_DecodeBankEntry(data + offset, toc_offset + toc_size - offset, &entry);
+        if (record == 0 || entry.dwOffset > toc_offset ||
+            entry.File.data_offset > toc_offset - entry.dwOffset ||
+            entry.File.data_size > toc_offset - entry.dwOffset - entry.File.data_offset ||
+            !SMDI_StoreBankEntry(bank, &entry)) {
+            return FALSE;
+        }
+        offset += record;
+    }
+    bank->bDirty = FALSE;
+    
+    return TRUE;
+}
+
+/* Open a bank file */
+SMDI_Bank* SMDI_OpenBank(const char* filename, BOOL bCreate) {
+    SMDI_Bank* bank;
+    SMDI_FileMap map;
+    BOOL ok;
+    
+    if (filename == NULL || strlen(filename) >= MAX_PATH) {
+        return NULL;
+    }
+    
+    bank = (SMDI_Bank*)malloc(sizeof(SMDI_Bank));
+    if (bank == NULL) {
+        return NULL;
+    }
+    
+    memset(bank, 0, sizeof(SMDI_Bank));
+    bank->dwStructSize = sizeof(SMDI_Bank);
+    strcpy(bank->cFileName, filename);
+    
+    ok = FALSE;
+    bank->hFile = fopen(filename, "r+b");
+    if (bank->hFile != NULL) {
+        /* The TOC is read from the mapped file */
+        if (SMDI_MapFile(filename, &map)) {
+            ok = SMDI_ParseBank(bank, map.data, map.size);
+            bank->dwEnd = map.size;
+            SMDI_UnmapFile(&map);
+        }
+    } else if (bCreate) {
+        /* An empty bank: a header and an empty TOC */
+        bank->hFile = fopen(filename, "w+b");
+        bank->dwEnd = BANK_FILE_HEADER;
+        ok = bank->hFile != NULL &&
+             SMDI_WriteBankHeader(bank->hFile, BANK_FILE_HEADER, 0, 0, SAMPLE_HASH_INIT) &&
+             SMDI_BankSync(bank->hFile);
+    }
+    
+    if (!ok) {
+        SMDI_CloseBank(bank);
+        return NULL;
+    }
+    
+    return bank;
+}
+
+/* Close a bank without committing it */
+void SMDI_CloseBank(SMDI_Bank* bank) {
+    if (bank == NULL) {
+        return;
+    }
+    
+    if (bank->hFile != NULL) {
+        fclose(bank->hFile);
+    }
+    free(bank->lpEntries);
+    free(bank);
+}
+
+/* Commit the entries of a bank */
+BOOL SMDI_CommitBank(SMDI_Bank* bank) {
+    if (bank == NULL || bank->bAppending) {
+        return FALSE;
+    }
+    
+    if (!bank->bDirty) {
+        return TRUE;
+    }
+    
+    if (!SMDI_WriteBankTOC(bank->hFile, bank->lpEntries, bank->dwEntries, &bank->dwEnd)) {
+        return FALSE;
+    }
+    
+    bank->bDirty = FALSE;
+    
+    return TRUE;
+}
+
+/* Rewrite a bank with only the images its entries use */
+BOOL SMDI_CompactBank(SMDI_Bank* bank) {
+    SMDI_BankEntry* entries;
+    SMDI_FileMap map;
+    char temp[MAX_PATH + 8];
+    FILE* hFile;
+    FILE* hReopened;
+    DWORD length;
+    DWORD end;
+    DWORD i;
+    BOOL ok;
+    
+    if (!SMDI_CommitBank(bank) || !SMDI_MapFile(bank->cFileName, &map)) {
+        return FALSE;
+    }
+    
+    entries = (SMDI_BankEntry*)malloc((bank->dwEntries + 1) * sizeof(SMDI_BankEntry));
+    sprintf(temp, "%s.new", bank->cFileName);
+    hFile = entries != NULL ? fopen(temp, "w+b") : NULL;
+    if (hFile == NULL) {
+        free(entries);
+        SMDI_UnmapFile(&map);
+        return FALSE;
+    }
+    
+    /* Copy each image straight from the map to the next boundary */
+    ok = TRUE;
+    end = BANK_FILE_HEADER;
+    for (i = 0; ok && i < bank->dwEntries; i++) {
+        memcpy(&entries[i], &bank->lpEntries[i], sizeof(SMDI_BankEntry));
+        entries[i].dwOffset = SMDI_BankAlign(end);
+        length = entries[i].File.data_offset + entries[i].File.data_size;
+        ok = fseek(hFile, entries[i].dwOffset, SEEK_SET) == 0 &&
+             fwrite(map.data + bank->lpEntries[i].dwOffset, 1, length, hFile) == length;
+        end = entries[i].dwOffset + length;
+    }
+    SMDI_UnmapFile(&map);
+    
+    ok = ok && SMDI_WriteBankTOC(hFile, entries, bank->dwEntries, &end);
+    if (fclose(hFile) != 0) {
+        ok = FALSE;
+    }
+    
+    hReopened = NULL;
+    if (ok && rename(temp, bank->cFileName) == 0) {
+        hReopened = fopen(bank->cFileName, "r+b");
+    } else {
+        remove(temp);
+    }
+    
+    if (hReopened == NULL) {
+        free(entries);
+        return FALSE;
+    }
+    
+    fclose(bank->hFile);
+    bank->hFile = hReopened;
+    bank->dwEnd = end;
+    memcpy(bank->lpEntries, entries, bank->dwEntries * sizeof(SMDI_BankEntry));
+    free(entries);
+    
+    return TRUE;
+}
+
+/* Find the entry of a sample number */
+SMDI_BankEntry* SMDI_BankLookup(SMDI_Bank* bank, DWORD dwSampleNumber) {
+    DWORD index;
+    
+    if (bank == NULL) {
+        return NULL;
+    }
+    
+    index = SMDI_FindBankEntry(bank, dwSampleNumber);
+    if (index < bank->dwEntries && bank->lpEntries[index].dwSampleNumber == dwSampleNumber) {
+        return &bank->lpEntries[index];
+    }
+    
+    return NULL;
+}
+
+/* Drop the entry of a sample number */
+void SMDI_BankRemove(SMDI_Bank* bank, DWORD dwSampleNumber) {
+    DWORD index;
+    
+    if (bank == NULL) {
+        return;
+    }
+    
+    index = SMDI_FindBankEntry(bank, dwSampleNumber);
+    if (index < bank->dwEntries && bank->lpEntries[index].dwSampleNumber == dwSampleNumber) {
+        memmove(&bank->lpEntries[index], &bank->lpEntries[index + 1],
+                (bank->dwEntries - index - 1) * sizeof(SMDI_BankEntry));
+        bank->dwEntries--;
+        bank->bDirty = TRUE;
+    }
+}
+
+/* Compare an entry with a device's sample header */
+BOOL SMDI_BankEntryMatches(SMDI_BankEntry* entry, SMDI_SampleHeader* sh) {
+    SMDI_SampleHeader* eh;
+    
+    if (entry == NULL || sh == NULL) {
+        return FALSE;
+    }
+    
+    eh = &entry->File.header;
+    
+    return eh->BitsPerWord == sh->BitsPerWord &&
+           eh->NumberOfChannels == sh->NumberOfChannels &&
+           eh->LoopControl == sh->LoopControl &&
+           eh->dwPeriod == sh->dwPeriod &&
+           eh->dwLength == sh->dwLength &&
+           eh->dwLoopStart == sh->dwLoopStart &&
+           eh->dwLoopEnd == sh->dwLoopEnd &&
+           eh->wPitch == sh->wPitch &&
+           eh->wPitchFraction == sh->wPitchFraction &&
+           strncmp(eh->cName, sh->cName, 255) == 0;
+}
+
+/* Write the image header after everything in the file */
+static BOOL SMDI_BankSinkBegin(SMDI_SampleSink* sink, SMDI_SampleHeader* sh) {
+    BankSinkState* state;
+    SMDI_Bank* bank;
+    DWORD offset;
+    
+    state = (BankSinkState*)sink->lpState;
+    bank = state->bank;
+    
+    if (bank->bAppending || sh->dwPeriod == 0) {
+        return FALSE;
+    }
+    
+    state->entry.dwOffset = SMDI_BankAlign(bank->dwEnd);
+    memset(&state->entry.File, 0, sizeof(SMDI_SampleFileHeader));
+    state->entry.File.flags = SAMPLE_FLAG_HASH;
+    state->entry.File.content_hash = SAMPLE_HASH_INIT;
+    state->entry.File.sample_rate = SMDI_PeriodToRate(sh->dwPeriod);
+    memcpy(&state->entry.File.header, sh, sizeof(SMDI_SampleHeader));
+    state->entry.File.header.NameLength = (BYTE)strlen(state->entry.File.header.cName);
+    
+    /* The gap up to the boundary reads as zeros */
+    offset = SMDI_EncodeSampleFileHeader(&state->entry.File, state->buffer);
+    if (fseek(bank->hFile, state->entry.dwOffset, SEEK_SET) != 0 ||
+        fwrite(state->buffer, 1, offset, bank->hFile) != offset) {
+        return FALSE;
+    }
+    
+    bank->bAppending = TRUE;
+    state->bBegun = TRUE;
+    
+    return TRUE;
+}
+
+/* Append packet data to the image */
+static BOOL SMDI_BankSinkWrite(SMDI_SampleSink* sink, void* data, DWORD length) {
+    BankSinkState* state;
+    
+    state = (BankSinkState*)sink->lpState;
+    
+    state->entry.File.data_size += length;
+    state->entry.File.content_hash = SMDI_HashData(state->entry.File.content_hash, data, length);
+    
+    return fwrite(data, 1, length, state->bank->hFile) == length;
+}
+
+/* Finish the image and enter it; an incomplete image, or one the bank
+   already holds, is cut off the file again */
+static BOOL SMDI_BankSinkClose(SMDI_SampleSink* sink, BOOL bComplete) {
+    BankSinkState* state;
+    SMDI_Bank* bank;
+    SMDI_BankEntry* old;
+    DWORD offset;
+    BOOL keep;
+    BOOL ok;
+    
+    state = (BankSinkState*)sink->lpState;
+    bank = state->bank;
+    
+    ok = TRUE;
+    if (state->bBegun) {
+        keep = FALSE;
+        if (bComplete) {
+            old = SMDI_BankLookup(bank, state->entry.dwSampleNumber);
+            keep = old == NULL ||
+                   old->File.data_size != state->entry.File.data_size ||
+                   old->File.content_hash != state->entry.File.content_hash ||
+                   !SMDI_BankEntryMatches(old, &state->entry.File.header);
+        }
+    
+        if (keep) {
+            offset = SMDI_EncodeSampleFileHeader(&state->entry.File, state->buffer);
+            ok = fseek(bank->hFile, state->entry.dwOffset, SEEK_SET) == 0 &&
+                 fwrite(state->buffer, 1, offset, bank->hFile) == offset &&
+                 fflush(bank->hFile) == 0 &&
+                 SMDI_StoreBankEntry(bank, &state->entry);
+        }
+    
+        if (keep && ok) {
+            bank->dwEnd = state->entry.dwOffset + state->entry.File.data_offset +
+                          state->entry.File.data_size;
+        } else {
+            fflush(bank->hFile);
+            if (ftruncate(fileno(bank->hFile), (off_t)bank->dwEnd) != 0) {
+                ok = FALSE;
+            }
+        }
+    
+        bank->bAppending = FALSE;
+    }
+    
+    free(state);
+    
+    return ok;
+}
+
+/* Open a download sink appending to a bank */
+SMDI_SampleSink* SMDI_OpenBankSink(SMDI_Bank* bank, DWORD dwSampleNumber) {
+    SMDI_SampleSink* sink;
+    BankSinkState* state;
+    
+    if (bank == NULL) {
+        return NULL;
+    }
+    
+    sink = (SMDI_SampleSink*)malloc(sizeof(SMDI_SampleSink));
+    state = (BankSinkState*)malloc(sizeof(BankSinkState));
+    if (sink == NULL || state == NULL) {
+        free(sink);
+        free(state);
+        return NULL;
+    }
+    
+    memset(sink, 0, sizeof(SMDI_SampleSink));
+    sink->dwStructSize = sizeof(SMDI_SampleSink);
+    
+    state->bank = bank;
+    state->entry.dwSampleNumber = dwSampleNumber;
+    state->bBegun = FALSE;
+    
+    sink->lpBegin = SMDI_BankSinkBegin;
+    sink->lpWrite = SMDI_BankSinkWrite;
+    sink->lpClose = SMDI_BankSinkClose;
+    sink->lpState = state;
+    
+    return sink;
+}
+
+/* Open a sample of a bank as an upload source */
+SMDI_SampleSource* SMDI_OpenBankSource(SMDI_Bank* bank, DWORD dwSampleNumber) {
+    SMDI_BankEntry* entry;
+    SMDI_FileMap map;
+    
+    entry = SMDI_BankLookup(bank, dwSampleNumber);
+    if (entry == NULL || bank->bAppending) {
+        return NULL;
+    }
+    
+    /* Pending writes must be in the file the source maps */
+    fflush(bank->hFile);
+    if (!SMDI_MapFile(bank->cFileName, &map)) {
+        return NULL;
+    }
+    
+    return SMDI_OpenMappedSource(&map, entry->dwOffset, &entry->File);
+}
+
+/* Load one sample of a bank */
+SMDI_Sample* SMDI_LoadBankSample(SMDI_Bank* bank, DWORD dwSampleNumber) {
+    SMDI_BankEntry* entry;
+    SMDI_Sample* sample;
+    SMDI_FileMap map;
+    
+    entry = SMDI_BankLookup(bank, dwSampleNumber);
+    if (entry == NULL || bank->bAppending) {
+        return NULL;
+    }
+    
+    fflush(bank->hFile);
+    if (!SMDI_MapFile(bank->cFileName, &map)) {
+        return NULL;
+    }
+    
+    sample = SMDI_LoadMappedSample(&map, entry->dwOffset, &entry->File);
+    SMDI_UnmapFile(&map);
+    
+    return sample;
+}
+
+/* Collect each existing sample header of a device */
+static BOOL SMDI_CollectBankHeader(DWORD sample_number, SMDI_SampleHeader* sh, DWORD user_data) {
+    BankDeviceState* device;
+    DWORD* numbers;
+    SMDI_SampleHeader* headers;
+    
+    device = (BankDeviceState*)user_data;
+    
+    if (device->count == device->alloc) {
+        numbers = (DWORD*)realloc(device->numbers, (device->alloc + 64) * sizeof(DWORD));
+        if (numbers == NULL) {
+            device->bFailed = TRUE;
+            return FALSE;
+        }
+        device->numbers = numbers;
+        headers = (SMDI_SampleHeader*)realloc(device->headers,
+                                              (device->alloc + 64) * sizeof(SMDI_SampleHeader));
+        if (headers == NULL) {
+            device->bFailed = TRUE;
+            return FALSE;
+        }
+        device->headers = headers;
+        device->alloc += 64;
+    }
+    
+    device->numbers[device->count] = sample_number;
+    memcpy(&device->headers[device->count], sh, sizeof(SMDI_SampleHeader));
+    device->count++;
+    
+    return TRUE;
+}
+
+/* Sample headers of first..last on a device; SMDIM_ENDOFPROCEDURE if
+   they were all read */
+static DWORD SMDI_ReadDeviceHeaders(SMDI_Connection* conn, DWORD first, DWORD last, BankDeviceState* device) {
+    DWORD result;
+    
+    memset(device, 0, sizeof(BankDeviceState));
+    
+    result = SMDIC_EnumerateHeaders(conn, first, last, SMDI_CollectBankHeader, (DWORD)device);
+    if (result == SMDIM_ENDOFPROCEDURE && device->bFailed) {
+        result = SMDIM_ERROR;
+    }
+    
+    return result;
+}
+
+/* Release the headers read from a device */
+static void SMDI_FreeDeviceHeaders(BankDeviceState* device) {
+    free(device->numbers);
+    free(device->headers);
+}
+
+/* Copy a device's samples into a bank */
+DWORD SMDIC_BackupBank(SMDI_Connection* conn, SMDI_Bank* bank, DWORD first, DWORD last,
+                       DWORD dwFlags, SMDI_BankStats* stats) {
+    SMDI_BankStats st;
+    SMDI_FileTransfer ft;
+    BankDeviceState device;
+    SMDI_BankEntry* entry;
+    DWORD result;
+    DWORD answer;
+    DWORD i;
+    DWORD d;
+    
+    if (conn == NULL || bank == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    memset(&st, 0, sizeof(st));
+    st.dwStructSize = sizeof(st);
+    
+    result = SMDI_ReadDeviceHeaders(conn, first, last, &device);
+    
+    for (i = 0; result == SMDIM_ENDOFPROCEDURE && i < device.count; i++) {
+        entry = SMDI_BankLookup(bank, device.numbers[i]);
+        if (!(dwFlags & SMDI_BANK_ALL) && SMDI_BankEntryMatches(entry, &device.headers[i])) {
+            st.dwUnchanged++;
+            continue;
+        }
+    
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = device.numbers[i];
+        ft.lpReturnValue = &answer;
+        ft.lpConnection = conn;
+        ft.lpSampleHeader = &device.headers[i];
+        ft.lpSink = SMDI_OpenBankSink(bank, device.numbers[i]);
+    
+        answer = ft.lpSink != NULL ? SMDI_ReceiveFile(&ft) : FE_OPENERROR;
+        if (answer == SMDIM_ENDOFPROCEDURE) {
+            st.dwCopied++;
+            st.dwBytes += (device.headers[i].dwLength * device.headers[i].NumberOfChannels *
+                           ((device.headers[i].BitsPerWord + 7) / 8));
+        } else {
+            st.dwFailed++;
+            result = answer;
+        }
+    }
+    
+    /* Entries of samples the device no longer holds */
+    if (result == SMDIM_ENDOFPROCEDURE && (dwFlags & SMDI_BANK_MIRROR)) {
+        d = 0;
+        for (i = 0; i < bank->dwEntries; ) {
+            entry = &bank->lpEntries[i];
+            while (d < device.count && device.numbers[d] < entry->dwSampleNumber) {
+                d++;
+            }
+            if (entry->dwSampleNumber >= first && entry->dwSampleNumber <= last &&
+                (d == device.count || device.numbers[d] != entry->dwSampleNumber)) {
+                SMDI_BankRemove(bank, entry->dwSampleNumber);
+                st.dwRemoved++;
+            } else {
+                i++;
+            }
+        }
+    }
+    
+    SMDI_FreeDeviceHeaders(&device);
+    
+    /* What was copied is kept even if a later sample failed */
+    if (!SMDI_CommitBank(bank) && result == SMDIM_ENDOFPROCEDURE) {
+        result = FE_WRITEERROR;
+    }
+    
+    if (stats != NULL) {
+        memcpy(stats, &st, sizeof(st));
+    }
+    
+    return result;
+}
+
+/* Copy a bank's samples to a device */
+DWORD SMDIC_RestoreBank(SMDI_Connection* conn, SMDI_Bank* bank, DWORD first, DWORD last,
+                        DWORD dwFlags, SMDI_BankStats* stats) {
+    SMDI_BankStats st;
+    SMDI_FileTransfer ft;
+    BankDeviceState device;
+    SMDI_BankEntry* entry;
+    DWORD result;
+    DWORD answer;
+    DWORD i;
+    DWORD d;
+    
+    if (conn == NULL || bank == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    memset(&st, 0, sizeof(st));
+    st.dwStructSize = sizeof(st);
+    
+    /* The device's headers tell which samples need sending */
+    result = SMDI_ReadDeviceHeaders(conn, first, last, &device);
+    
+    d = 0;
+    for (i = 0; result == SMDIM_ENDOFPROCEDURE && i < bank->dwEntries; i++) {
+        entry = &bank->lpEntries[i];
+        if (entry->dwSampleNumber < first || entry->dwSampleNumber > last) {
+            continue;
+        }
+        while (d < device.count && device.numbers[d] < entry->dwSampleNumber) {
+            d++;
+        }
+        if (!(dwFlags & SMDI_BANK_ALL) && d < device.count &&
+            device.numbers[d] == entry->dwSampleNumber &&
+            SMDI_BankEntryMatches(entry, &device.headers[d])) {
+            st.dwUnchanged++;
+            continue;
+        }
+    
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = entry->dwSampleNumber;
+        ft.lpReturnValue = &answer;
+        ft.lpConnection = conn;
+        ft.lpSource = SMDI_OpenBankSource(bank, entry->dwSampleNumber);
+    
+        answer = ft.lpSource != NULL ? SMDI_SendFile(&ft) : FE_OPENERROR;
+        if (answer == SMDIM_ENDOFPROCEDURE) {
+            st.dwCopied++;
+            st.dwBytes += entry->File.data_size;
+        } else {
+            st.dwFailed++;
+            result = answer;
+        }
+    }
+    
+    /* Samples the bank does not hold */
+    for (d = 0; result == SMDIM_ENDOFPROCEDURE && (dwFlags & SMDI_BANK_MIRROR) &&
+                d < device.count; d++) {
+        if (SMDI_BankLookup(bank, device.numbers[d]) == NULL) {
+            answer = SMDIC_DeleteSample(conn, device.numbers[d]);
+            if (answer == SMDIM_ACK) {
+                st.dwRemoved++;
+            } else {
+                st.dwFailed++;
+                result = answer;
+            }
+        }
+    }
+    
+    SMDI_FreeDeviceHeaders(&device);
+    
+    if (stats != NULL) {
+        memcpy(stats, &st, sizeof(st));
+    }
+    
+    return result;
+}
@@ -0,0 +1,3006 @@
+/*
+ * smdi_bench - SMDI protocol throughput benchmark
+ * Runs identify, header enumeration, upload and download against the
+ * in-process sampler emulator and reports timings. Linked against the
+ * emulator backend so it runs on any host without SCSI hardware.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <math.h>
+#include "smdi.h"
+#include "smdi_sample.h"
+#include "smdi_catalog.h"
+#include "smdi_jobs.h"
+#include "smdi_swap.h"
+#include "smdi_convert.h"
+#include "smdi_resample.h"
+#include "smdi_aif.h"
+#include "smdi_wav.h"
+#include "smdi_bank.h"
+#include "smdi_emu.h"
+#include "aspi_irix.h"
+
+/* Benchmark parameters */
+typedef struct {
+    DWORD sample_kb;        /* Size of each transferred sample */
+    DWORD iterations;       /* Uploads and downloads per run */
+    DWORD headers;          /* Sample slots to enumerate */
+    DWORD seeded;           /* Occupied slots for the enumeration */
+    DWORD occupied;         /* Occupied slots for the discovery */
+    DWORD read_latency;     /* Source read latency per packet in us */
+    int calibrate;          /* Calibrate the packet size before transfers */
+} bench_params_t;
+
+/* Current time in seconds */
+static double bench_now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+/* Print usage information */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  -s kb     sample size in KB (default 1024)\n");
+    fprintf(stderr, "  -n count  uploads/downloads per run (default 8)\n");
+    fprintf(stderr, "  -h count  sample slots to enumerate (default 64)\n");
+    fprintf(stderr, "  -o count  occupied slots for the sample discovery (default 200)\n");
+    fprintf(stderr, "  -p bytes  largest packet size of the sampler (default %d)\n", PACKETSIZE);
+    fprintf(stderr, "  -m bytes  host adapter transfer limit (default 16M)\n");
+    fprintf(stderr, "  -c        calibrate the packet size before the transfers\n");
+    fprintf(stderr, "  -l us     sampler latency per command (default 0)\n");
+    fprintf(stderr, "  -r kb/s   bus transfer rate, 0 = unlimited (default 0)\n");
+    fprintf(stderr, "  -w count  answer every Nth data packet with WAIT (default 0)\n");
+    fprintf(stderr, "  -f us     source read latency per packet (default 0)\n");
+    fprintf(stderr, "  -d        enable SMDI debug output\n");
+}
+
+/* Fill a sample header for a 16-bit mono sample of the given size */
+static void make_header(SMDI_SampleHeader *sh, DWORD bytes, const char *name)
+{
+    memset(sh, 0, sizeof(SMDI_SampleHeader));
+    sh->dwStructSize = sizeof(SMDI_SampleHeader);
+    sh->bDoesExist = TRUE;
+    sh->BitsPerWord = 16;
+    sh->NumberOfChannels = 1;
+    sh->dwPeriod = 1000000000 / 44100;
+    sh->dwLength = bytes / 2;
+    sh->dwLoopEnd = sh->dwLength - 1;
+    sh->wPitch = 60;
+    strcpy(sh->cName, name);
+    sh->NameLength = (BYTE)strlen(sh->cName);
+}
+
+/* Print one result line */
+static void report(const char *name, DWORD count, double seconds, double bytes)
+{
+    printf("  %-13s %6lu ops %9.3f s %9.1f ops/s", name, count, seconds,
+           seconds > 0.0 ? (double)count / seconds : 0.0);
+
+    if (bytes > 0.0) {
+        printf(" %9.2f MB/s", seconds > 0.0 ? bytes / seconds / (1024.0 * 1024.0) : 0.0);
+    }
+
+    printf("\n");
+}
+
+/* Master Identify round trips */
+static int bench_identify(SMDI_Connection *conn, DWORD count)
+{
+    DWORD i;
+    double start;
+
+    start = bench_now();
+    for (i = 0; i < count; i++) {
+        if (SMDIC_MasterIdentify(conn) != SMDIM_SLAVEIDENTIFY) {
+            printf("Master Identify failed\n");
+            return 0;
+        }
+    }
+    report("identify", count, bench_now() - start, 0.0);
+
+    return 1;
+}
+
+/* Count enumerated samples */
+static BOOL count_header(DWORD sample_number, SMDI_SampleHeader *sh, DWORD user_data)
+{
+    (*(DWORD *)user_data)++;
+
+    return TRUE;
+}
+
+/* Sample header enumeration over partly occupied memory */
+static int bench_headers(SMDI_Connection *conn, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    DWORD i;
+    DWORD found;
+    DWORD enumerated;
+    DWORD result;
+    char name[32];
+    double start;
+
+    for (i = 0; i < params->seeded; i++) {
+        sprintf(name, "Bench %lu", i);
+        make_header(&sh, 2048, name);
+        SMDI_EmuStoreSample(i * 2, &sh, NULL);
+    }
+
+    found = 0;
+    start = bench_now();
+    for (i = 0; i < params->headers; i++) {
+        memset(&sh, 0, sizeof(sh));
+        sh.dwStructSize = sizeof(sh);
+        if (SMDIC_SampleHeaderRequest(conn, i, &sh) == SMDIM_SAMPLEHEADER &&
+            sh.bDoesExist) {
+            found++;
+        }
+    }
+    report("headers", params->headers, bench_now() - start, 0.0);
+
+    if (found != (params->seeded * 2 < params->headers ? params->seeded :
+                  (params->headers + 1) / 2)) {
+        printf("Header enumeration found %lu samples\n", found);
+        return 0;
+    }
+
+    /* The same slots through the batch enumeration */
+    enumerated = 0;
+    start = bench_now();
+    result = SMDIC_EnumerateHeaders(conn, 0, params->headers - 1, count_header, (DWORD)&enumerated);
+    report("enumerate", params->headers, bench_now() - start, 0.0);
+
+    if (result != SMDIM_ENDOFPROCEDURE || enumerated != found) {
+        printf("Batch enumeration found %lu samples (0x%08lX)\n", enumerated, result);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Count the occupied slots of the emulated sampler */
+static DWORD count_stored(DWORD max)
+{
+    DWORD i;
+    DWORD count;
+
+    count = 0;
+    for (i = 0; i <= max; i++) {
+        if (SMDI_EmuGetSampleData(i, NULL) != NULL) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* One discovery run; checks the number of samples found */
+static int discover(SMDI_Connection *conn, SMDI_Occupancy *occ, const char *name, DWORD expected)
+{
+    SMDI_DiscoverInfo info;
+    DWORD result;
+    double start;
+
+    memset(&info, 0, sizeof(info));
+    info.dwStructSize = sizeof(info);
+
+    start = bench_now();
+    result = SMDIC_DiscoverSamples(conn, occ, &info, NULL, 0);
+    report(name, info.dwProbes, bench_now() - start, 0.0);
+
+    printf("  found %lu of %lu slots, %lu probes (%lu for the range), %.1f%% covered\n",
+           info.dwFound, info.dwMaxSample + 1, info.dwProbes, info.dwRangeProbes,
+           100.0 * (double)info.dwCovered / (double)(info.dwMaxSample + 1));
+
+    if (result != SMDIM_ENDOFPROCEDURE || info.dwFound != expected ||
+        SMDI_OccupiedCount(occ) != expected) {
+        printf("Discovery found %lu samples, %lu expected (0x%08lX)\n",
+               info.dwFound, expected, result);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Sample discovery over the whole range: a dense bank at the bottom and
+   a smaller one in the middle, scanned without and then with the
+   occupancy of the first scan after the banks changed a little */
+static int bench_discover(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    SMDI_Occupancy occ;
+    DWORD dense;
+    DWORD middle;
+    DWORD i;
+    int ok;
+
+    if (params->occupied == 0) {
+        return 1;
+    }
+
+    dense = params->occupied * 3 / 4;
+    middle = config->dwMaxSampleNumber / 2;
+
+    for (i = 0; i < params->occupied; i++) {
+        make_header(&sh, 2048, "Bench discover");
+        SMDI_EmuStoreSample(i < dense ? i : middle + i - dense, &sh, NULL);
+    }
+
+    SMDI_InitOccupancy(&occ);
+    ok = discover(conn, &occ, "discover", count_stored(config->dwMaxSampleNumber));
+
+    /* One sample added after the bottom bank, one deleted in the middle */
+    if (ok) {
+        make_header(&sh, 2048, "Bench discover");
+        SMDI_EmuStoreSample(dense, &sh, NULL);
+        SMDIC_DeleteSample(conn, middle);
+        ok = discover(conn, &occ, "rediscover", count_stored(config->dwMaxSampleNumber));
+    }
+
+    SMDI_FreeOccupancy(&occ);
+
+    return ok;
+}
+
+/* Count the changes found by a catalog revalidation */
+static void count_change(SMDI_Catalog *cat, DWORD sample_number,
+                         SMDI_CatalogEntry *entry, DWORD change, DWORD user_data)
+{
+    ((DWORD *)user_data)[change]++;
+}
+
+/* One catalog revalidation in windows of slots; checks the changes */
+static int revalidate(SMDI_Connection *conn, SMDI_Catalog *cat, const char *name, DWORD slots,
+                      DWORD added, DWORD changed, DWORD removed)
+{
+    DWORD changes[4];
+    DWORD result;
+    DWORD windows;
+    double start;
+
+    memset(changes, 0, sizeof(changes));
+    windows = 0;
+
+    start = bench_now();
+    do {
+        result = SMDIC_RevalidateCatalog(conn, cat, slots, count_change, (DWORD)changes);
+        windows++;
+    } while (result == SMDIM_ACK);
+    report(name, windows, bench_now() - start, 0.0);
+
+    printf("  %lu entries, %lu added, %lu changed, %lu removed\n", cat->dwEntries,
+           changes[CATALOG_ADDED], changes[CATALOG_CHANGED], changes[CATALOG_REMOVED]);
+
+    if (result != SMDIM_ENDOFPROCEDURE || changes[CATALOG_ADDED] != added ||
+        changes[CATALOG_CHANGED] != changed || changes[CATALOG_REMOVED] != removed) {
+        printf("Revalidation found %lu/%lu/%lu changes, %lu/%lu/%lu expected (0x%08lX)\n",
+               changes[CATALOG_ADDED], changes[CATALOG_CHANGED], changes[CATALOG_REMOVED],
+               added, changed, removed, result);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Header catalog on the samples left by the discovery: built, saved and
+   reloaded, then revalidated in windows after one sample was added, one
+   renamed and one deleted */
+static int bench_catalog(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    SMDI_Catalog *cat;
+    char filename[64];
+    DWORD stored;
+    DWORD middle;
+    int ok;
+
+    if (params->occupied == 0) {
+        return 1;
+    }
+
+    sprintf(filename, "/tmp/smdi_bench.%d.catalog", (int)getpid());
+    SMDI_SetCatalogFile(filename);
+
+    stored = count_stored(config->dwMaxSampleNumber);
+    middle = config->dwMaxSampleNumber / 2;
+
+    cat = SMDIC_OpenCatalog(conn);
+    ok = (cat != NULL) &&
+         revalidate(conn, cat, "catalog build", 0, stored, 0, 0) &&
+         SMDI_SaveCatalog(cat);
+    SMDI_CloseCatalog(cat);
+
+    cat = ok ? SMDIC_OpenCatalog(conn) : NULL;
+    if (cat == NULL || cat->dwEntries != stored) {
+        printf("Catalog reloaded with %lu entries, %lu expected\n",
+               (cat != NULL) ? cat->dwEntries : 0, stored);
+        ok = 0;
+    }
+
+    if (ok) {
+        make_header(&sh, 2048, "Bench catalog");
+        SMDI_EmuStoreSample(params->occupied * 3 / 4 + 1, &sh, NULL);
+        make_header(&sh, 4096, "Bench renamed");
+        SMDI_EmuStoreSample(middle + 1, &sh, NULL);
+        SMDIC_DeleteSample(conn, 0);
+        ok = revalidate(conn, cat, "catalog revalidate", 256, 1, 1, 1);
+    }
+
+    SMDI_CloseCatalog(cat);
+    SMDI_SetCatalogFile(NULL);
+    remove(filename);
+
+    return ok;
+}
+
+/* Upload the pattern buffer to the sampler */
+static int upload(SMDI_Connection *conn, DWORD number, unsigned char *data, DWORD bytes,
+                  DWORD copy_mode)
+{
+    SMDI_TransmissionInfo ti;
+    SMDI_SampleHeader sh;
+    DWORD result;
+
+    make_header(&sh, bytes, "Bench upload");
+
+    memset(&ti, 0, sizeof(ti));
+    ti.dwStructSize = sizeof(ti);
+    ti.HA_ID = conn->HA_ID;
+    ti.SCSI_ID = conn->SCSI_ID;
+    ti.lpConnection = conn;
+    ti.dwSampleNumber = number;
+    ti.lpSampleHeader = &sh;
+    ti.dwCopyMode = copy_mode;
+
+    result = SMDI_InitSampleTransmission(&ti);
+    while (result == SMDIM_SENDNEXTPACKET) {
+        ti.lpSampleData = data + ti.dwTransmittedPackets * ti.dwPacketSize;
+        result = SMDI_SampleTransmission(&ti);
+    }
+
+    return result == SMDIM_ENDOFPROCEDURE;
+}
+
+/* Upload a native sample file through the file transfer path */
+static int upload_file(SMDI_Connection *conn, DWORD number, const char *filename)
+{
+    SMDI_FileTransfer ft;
+    DWORD result;
+
+    memset(&ft, 0, sizeof(ft));
+    ft.dwStructSize = sizeof(ft);
+    ft.HA_ID = conn->HA_ID;
+    ft.SCSI_ID = conn->SCSI_ID;
+    ft.dwSampleNumber = number;
+    ft.lpFileName = (char*)filename;
+    ft.lpSampleName = "Bench file";
+    ft.lpReturnValue = &result;
+    ft.lpConnection = conn;
+
+    return SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+}
+
+/* Write the pattern buffer as a native sample file */
+static int write_sample_file(const char *filename, unsigned char *data, DWORD bytes)
+{
+    SMDI_Sample *sample;
+    int ok;
+
+    sample = SMDI_CreateSample(44100, 16, 1, bytes / 2);
+    if (sample == NULL) {
+        return 0;
+    }
+
+    memcpy(sample->sample_data, data, bytes);
+    strcpy(sample->name, "Bench file");
+    ok = SMDI_SaveSample(sample, filename);
+    SMDI_FreeSample(sample);
+
+    return ok;
+}
+
+/* Download a sample into a native sample file through the file transfer path */
+static int download_file(SMDI_Connection *conn, DWORD number, const char *filename)
+{
+    SMDI_FileTransfer ft;
+    DWORD result;
+
+    memset(&ft, 0, sizeof(ft));
+    ft.dwStructSize = sizeof(ft);
+    ft.HA_ID = conn->HA_ID;
+    ft.SCSI_ID = conn->SCSI_ID;
+    ft.dwSampleNumber = number;
+    ft.lpFileName = (char*)filename;
+    ft.lpReturnValue = &result;
+    ft.lpConnection = conn;
+
+    return SMDI_ReceiveFile(&ft) == SMDIM_ENDOFPROCEDURE;
+}
+
+/* Compare a native sample file with the pattern buffer */
+static int check_sample_file(const char *filename, unsigned char *data, DWORD bytes)
+{
+    SMDI_Sample *sample;
+    int ok;
+
+    sample = SMDI_LoadSample(filename);
+    if (sample == NULL) {
+        return 0;
+    }
+
+    ok = sample->data_size == bytes && memcmp(sample->sample_data, data, bytes) == 0;
+    SMDI_FreeSample(sample);
+
+    return ok;
+}
+
+/* Download a sample from the sampler into a buffer */
+static int download(SMDI_Connection *conn, DWORD number, unsigned char *data, DWORD copy_mode)
+{
+    SMDI_TransmissionInfo ti;
+    SMDI_SampleHeader sh;
+    DWORD result;
+
+    memset(&sh, 0, sizeof(sh));
+    sh.dwStructSize = sizeof(sh);
+
+    memset(&ti, 0, sizeof(ti));
+    ti.dwStructSize = sizeof(ti);
+    ti.HA_ID = conn->HA_ID;
+    ti.SCSI_ID = conn->SCSI_ID;
+    ti.lpConnection = conn;
+    ti.dwSampleNumber = number;
+    ti.lpSampleHeader = &sh;
+    ti.lpSampleData = data;
+    ti.dwCopyMode = copy_mode;
+
+    result = SMDI_InitSampleReception(&ti);
+    if (result != SMDIM_TRANSFERACKNOWLEDGE) {
+        return 0;
+    }
+
+    result = SMDIM_DATAPACKET;
+    while (result == SMDIM_DATAPACKET) {
+        result = SMDI_SampleReception(&ti);
+    }
+
+    return result == SMDIM_ENDOFPROCEDURE;
+}
+
+/* Packet size calibration against a scratch slot */
+static int bench_calibrate(SMDI_Connection *conn, SMDI_EmuConfig *config)
+{
+    DWORD size;
+    DWORD rate;
+    double start;
+
+    rate = 0;
+    start = bench_now();
+    size = SMDIC_CalibratePacketSize(conn, config->dwMaxSampleNumber - 1, 0, &rate);
+    report("calibrate", 1, bench_now() - start, 0.0);
+
+    if (size == 0) {
+        printf("Packet size calibration failed\n");
+        return 0;
+    }
+
+    printf("  packet size %lu at %.2f MB/s\n", size, (double)rate / (1024.0 * 1024.0));
+
+    return 1;
+}
+
+/* Upload and download throughput with data verification */
+/* Source that delays every read, standing in for a sample library on a
+   slow disk or network mount */
+typedef struct {
+    SMDI_SampleSource *inner;
+    DWORD latency;
+} slow_source_t;
+
+static DWORD slow_read(SMDI_SampleSource *src, void *buffer, DWORD bytes)
+{
+    slow_source_t *slow = (slow_source_t*)src->lpState;
+
+    if (slow->latency > 0) {
+        usleep(slow->latency);
+    }
+
+    return (*slow->inner->lpRead)(slow->inner, buffer, bytes);
+}
+
+static void slow_close(SMDI_SampleSource *src)
+{
+    slow_source_t *slow = (slow_source_t*)src->lpState;
+
+    SMDI_CloseSource(slow->inner);
+    free(slow);
+}
+
+static SMDI_SampleSource *open_slow_source(SMDI_Sample *sample, DWORD latency)
+{
+    SMDI_SampleSource *src;
+    slow_source_t *slow;
+
+    src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    slow = (slow_source_t*)malloc(sizeof(slow_source_t));
+    if (src == NULL || slow == NULL ||
+        (slow->inner = SMDI_OpenSampleSource(sample)) == NULL) {
+        free(src);
+        free(slow);
+        return NULL;
+    }
+    slow->latency = latency;
+
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    memcpy(&src->Header, &slow->inner->Header, sizeof(SMDI_SampleHeader));
+    src->lpRead = slow_read;
+    src->lpClose = slow_close;
+    src->lpState = slow;
+
+    return src;
+}
+
+/* Upload an in-memory sample through an upload source, reading it
+   inline or read_ahead packets ahead */
+static int upload_source(SMDI_Connection *conn, DWORD number, SMDI_Sample *sample,
+                         DWORD latency, DWORD read_ahead)
+{
+    SMDI_FileTransfer ft;
+    DWORD result;
+
+    memset(&ft, 0, sizeof(ft));
+    ft.dwStructSize = sizeof(ft);
+    ft.HA_ID = conn->HA_ID;
+    ft.SCSI_ID = conn->SCSI_ID;
+    ft.dwSampleNumber = number;
+    ft.lpSource = open_slow_source(sample, latency);
+    ft.dwReadAhead = read_ahead;
+    ft.lpReturnValue = &result;
+    ft.lpConnection = conn;
+
+    return ft.lpSource != NULL && SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+}
+
+/* Whether a holds the 16-bit words of b with their bytes swapped */
+static int swapped_equal(const unsigned char *a, const unsigned char *b, DWORD bytes)
+{
+    DWORD i;
+
+    for (i = 0; i + 1 < bytes; i += 2) {
+        if (a[i] != b[i + 1] || a[i + 1] != b[i]) {
+            return 0;
+        }
+    }
+
+    return i == bytes || a[i] == b[i];
+}
+
+static int bench_transfer(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    SMDI_Sample *sample;
+    unsigned char *data;
+    unsigned char *back;
+    const unsigned char *stored;
+    char filename[64];
+    DWORD bytes;
+    DWORD size;
+    DWORD i;
+    double start;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+
+    data = (unsigned char*)malloc(bytes);
+    back = (unsigned char*)malloc(bytes);
+    if (data == NULL || back == NULL) {
+        free(data);
+        free(back);
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    for (i = 0; i < bytes; i++) {
+        data[i] = (unsigned char)((i * 7 + (i >> 8)) & 0xFF);
+    }
+
+    ok = 1;
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        ok = upload(conn, config->dwMaxSampleNumber, data, bytes, CM_NORMAL);
+    }
+    report("upload", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (!ok || stored == NULL || size != bytes || memcmp(stored, data, bytes) != 0) {
+        printf("Upload failed or data mismatch\n");
+        ok = 0;
+    }
+
+    sprintf(filename, "/tmp/smdi_bench_%lu.sdmp", (unsigned long)getpid());
+    if (ok && !write_sample_file(filename, data, bytes)) {
+        printf("Cannot write %s\n", filename);
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        ok = upload_file(conn, config->dwMaxSampleNumber, filename);
+    }
+    report("upload-file", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+    remove(filename);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (ok && (stored == NULL || size != bytes || memcmp(stored, data, bytes) != 0)) {
+        printf("File upload data mismatch\n");
+        ok = 0;
+    }
+
+    make_header(&sh, bytes, "Bench source");
+    sample = ok ? SMDI_HeaderToSample(&sh, data) : NULL;
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && sample != NULL && ok; i++) {
+        ok = upload_source(conn, config->dwMaxSampleNumber, sample, params->read_latency, 0);
+    }
+    report("upload-source", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (ok && (sample == NULL || stored == NULL || size != bytes || memcmp(stored, data, bytes) != 0)) {
+        printf("Source upload data mismatch\n");
+        ok = 0;
+    }
+
+    /* Same source read by a reader thread while the packets go out */
+    SMDIC_DeleteSample(conn, config->dwMaxSampleNumber);
+    start = bench_now();
+    for (i = 0; i < params->iterations && sample != NULL && ok; i++) {
+        ok = upload_source(conn, config->dwMaxSampleNumber, sample, params->read_latency,
+                           SMDI_READAHEAD_DEFAULT);
+    }
+    report("upload-readahead", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+    SMDI_FreeSample(sample);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (ok && (sample == NULL || stored == NULL || size != bytes || memcmp(stored, data, bytes) != 0)) {
+        printf("Read-ahead upload data mismatch\n");
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        memset(back, 0, bytes);
+        ok = download(conn, config->dwMaxSampleNumber, back, CM_NORMAL);
+    }
+    report("download", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+
+    if (ok && memcmp(back, data, bytes) != 0) {
+        printf("Download data mismatch\n");
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        ok = download_file(conn, config->dwMaxSampleNumber, filename);
+    }
+    report("download-file", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+
+    if (ok && !check_sample_file(filename, data, bytes)) {
+        printf("File download data mismatch\n");
+        ok = 0;
+    }
+    remove(filename);
+
+    /* Little-endian words: swapped on the way in and on the way out */
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        ok = upload(conn, config->dwMaxSampleNumber, data, bytes, CM_BYTESWAP);
+    }
+    report("upload-swap", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (ok && (stored == NULL || size != bytes || !swapped_equal(stored, data, bytes))) {
+        printf("Swapped upload data mismatch\n");
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        memset(back, 0, bytes);
+        ok = download(conn, config->dwMaxSampleNumber, back, CM_BYTESWAP);
+    }
+    report("download-swap", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+
+    if (ok && memcmp(back, data, bytes) != 0) {
+        printf("Swapped download data mismatch\n");
+        ok = 0;
+    }
+
+    free(data);
+    free(back);
+
+    return ok;
+}
+
+/* Callbacks of an asynchronous transfer; the transfer cancels itself
+   after cancel_after packets if that is set */
+typedef struct {
+    volatile DWORD packets;
+    volatile DWORD ends;
+    DWORD cancel_after;
+} async_progress_t;
+
+static void async_callback(SMDI_FileTransmissionInfo *fti, DWORD user_data)
+{
+    async_progress_t *progress = (async_progress_t*)user_data;
+
+    if (*fti->lpReturnValue != SMDI_TRANSFER_PENDING) {
+        progress->ends++;
+        return;
+    }
+
+    progress->packets++;
+    if (progress->cancel_after > 0 && progress->packets == progress->cancel_after) {
+        SMDI_CancelTransfer(fti->lpTransfer);
+    }
+}
+
+/* Start an asynchronous transfer and poll it until it ends */
+static DWORD run_async(SMDI_FileTransfer *ft, int upload, DWORD *polls)
+{
+    SMDI_Transfer *transfer;
+    DWORD result;
+
+    ft->bAsync = TRUE;
+    ft->lpHandle = &transfer;
+
+    result = upload ? SMDI_SendFile(ft) : SMDI_ReceiveFile(ft);
+    if (result != SMDI_TRANSFER_PENDING) {
+        return result;
+    }
+
+    *polls = 0;
+    while (SMDI_PollTransfer(transfer) == SMDI_TRANSFER_PENDING) {
+        (*polls)++;
+        usleep(100);
+    }
+
+    return SMDI_WaitTransfer(transfer);
+}
+
+/* Asynchronous upload, and a download cancelled part way */
+static int bench_async(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_FileTransfer ft;
+    SMDI_SampleHeader sh;
+    SMDI_Sample *sample;
+    async_progress_t progress;
+    const unsigned char *stored;
+    char filename[64];
+    DWORD bytes;
+    DWORD size;
+    DWORD result;
+    DWORD polls;
+    DWORD i;
+    double start;
+
+    bytes = params->sample_kb * 1024;
+
+    make_header(&sh, bytes, "Bench async");
+    sample = SMDI_HeaderToSample(&sh, NULL);
+    if (sample == NULL) {
+        printf("Out of memory\n");
+        return 0;
+    }
+    for (i = 0; i < bytes; i++) {
+        ((unsigned char*)sample->sample_data)[i] = (unsigned char)((i * 13 + 5) & 0xFF);
+    }
+
+    memset(&ft, 0, sizeof(ft));
+    ft.dwStructSize = sizeof(ft);
+    ft.HA_ID = conn->HA_ID;
+    ft.SCSI_ID = conn->SCSI_ID;
+    ft.dwSampleNumber = config->dwMaxSampleNumber;
+    ft.lpSource = SMDI_OpenSampleSource(sample);
+    ft.lpCallback = (void*)async_callback;
+    ft.dwUserData = (DWORD)&progress;
+    ft.lpReturnValue = &result;
+    ft.lpConnection = conn;
+    memset(&progress, 0, sizeof(progress));
+
+    start = bench_now();
+    polls = 0;
+    result = ft.lpSource != NULL ? run_async(&ft, 1, &polls) : SMDIM_ERROR;
+    report("upload-async", 1, bench_now() - start, (double)bytes);
+    printf("  %lu packets, %lu polls while running\n", progress.packets, polls);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (result != SMDIM_ENDOFPROCEDURE || progress.ends != 1 || stored == NULL ||
+        size != bytes || memcmp(stored, sample->sample_data, bytes) != 0) {
+        printf("Asynchronous upload failed: 0x%08lX\n", result);
+        SMDI_FreeSample(sample);
+        return 0;
+    }
+    SMDI_FreeSample(sample);
+
+    /* The download stops itself after two packets */
+    sprintf(filename, "/tmp/smdi_bench_%lu.sdmp", (unsigned long)getpid());
+    memset(&ft, 0, sizeof(ft));
+    ft.dwStructSize = sizeof(ft);
+    ft.HA_ID = conn->HA_ID;
+    ft.SCSI_ID = conn->SCSI_ID;
+    ft.dwSampleNumber = config->dwMaxSampleNumber;
+    ft.lpFileName = filename;
+    ft.lpCallback = (void*)async_callback;
+    ft.dwUserData = (DWORD)&progress;
+    ft.lpReturnValue = &result;
+    ft.lpConnection = conn;
+    memset(&progress, 0, sizeof(progress));
+    progress.cancel_after = 2;
+
+    result = run_async(&ft, 0, &polls);
+    if (progress.packets <= progress.cancel_after) {
+        /* The sample ended with the packet that cancelled it */
+        remove(filename);
+    } else if (result != FE_CANCELLED || access(filename, F_OK) == 0) {
+        printf("Cancelled download not discarded: 0x%08lX\n", result);
+        remove(filename);
+        return 0;
+    }
+
+    /* The sampler must be back to idle */
+    if (SMDIC_MasterIdentify(conn) != SMDIM_SLAVEIDENTIFY) {
+        printf("Sampler not idle after the cancelled download\n");
+        return 0;
+    }
+    printf("  download cancelled after %lu packets, partial file removed\n",
+           progress.packets);
+
+    return 1;
+}
+
+/* Job states seen by the bench's queue callback */
+typedef struct {
+    SMDI_JobQueue *queue;
+    DWORD started[16];      /* Job IDs in the order they started */
+    DWORD starts;
+    DWORD cancel_id;        /* Job to cancel once it has moved data */
+    volatile DWORD dry;     /* Times the queue ran dry */
+} jobs_progress_t;
+
+static void jobs_callback(SMDI_JobInfo *job, DWORD user_data)
+{
+    jobs_progress_t *progress = (jobs_progress_t*)user_data;
+
+    if (job == NULL) {
+        progress->dry++;
+        return;
+    }
+
+    if (job->dwState != SMDI_JOB_RUNNING) {
+        return;
+    }
+
+    if (job->dwDone == 0 && progress->starts < 16) {
+        progress->started[progress->starts++] = job->dwJobID;
+    } else if (job->dwJobID == progress->cancel_id && job->dwDone > 0) {
+        SMDI_CancelJob(progress->queue, job->dwJobID);
+    }
+}
+
+/* Collect the ended jobs and check each ended in the expected state */
+static int collect_jobs(SMDI_JobQueue *queue, DWORD *ids, DWORD *states, DWORD count)
+{
+    SMDI_JobInfo info;
+    DWORD collected;
+    DWORD i;
+
+    collected = 0;
+    while (SMDI_CollectJob(queue, &info)) {
+        collected++;
+        for (i = 0; i < count && ids[i] != info.dwJobID; i++) {
+            /* Find the job */
+        }
+        if (i == count || info.dwState != states[i]) {
+            printf("Job %lu ended in state %lu: 0x%08lX\n",
+                   info.dwJobID, info.dwState, info.dwResult);
+            return 0;
+        }
+        /* The uploads the bench expects to fail have no file to open, the
+           other jobs are rejected by the device */
+        if (info.dwState == SMDI_JOB_FAILED &&
+            (info.dwKind == SMDI_JOB_UPLOAD ?
+             info.dwResult != FE_OPENERROR || info.dwError != 0 :
+             info.dwResult != SMDIM_MESSAGEREJECT || info.dwError != SMDIE_NOSAMPLE)) {
+            printf("Job %lu failed without the reject: 0x%08lX, error 0x%08lX\n",
+                   info.dwJobID, info.dwResult, info.dwError);
+            return 0;
+        }
+    }
+
+    if (collected != count) {
+        printf("%lu of %lu jobs ended\n", collected, count);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Batch uploads and a delete reordered by the queue, then a rename, a
+   cancelled download and a job cancelled while queued, jobs the device
+   rejects and a whole queue cancelled */
+static int bench_jobs(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    SMDI_Sample *big;
+    SMDI_Sample *small;
+    jobs_progress_t progress;
+    const unsigned char *stored;
+    char filename[64];
+    const char *cancelled;
+    DWORD ids[4];
+    DWORD states[4];
+    DWORD expected[4];
+    DWORD top;
+    DWORD bytes;
+    DWORD size;
+    DWORD i;
+    double start;
+    int ok;
+
+    top = config->dwMaxSampleNumber;
+    bytes = params->sample_kb * 1024;
+
+    make_header(&sh, bytes / 2, "Bench big");
+    big = SMDI_HeaderToSample(&sh, NULL);
+    make_header(&sh, bytes / 8, "Bench small");
+    small = SMDI_HeaderToSample(&sh, NULL);
+    if (big == NULL || small == NULL) {
+        SMDI_FreeSample(big);
+        SMDI_FreeSample(small);
+        printf("Out of memory\n");
+        return 0;
+    }
+    for (i = 0; i < bytes / 2; i++) {
+        ((unsigned char*)big->sample_data)[i] = (unsigned char)((i * 11 + 3) & 0xFF);
+    }
+    for (i = 0; i < bytes / 8; i++) {
+        ((unsigned char*)small->sample_data)[i] = (unsigned char)((i * 5 + 1) & 0xFF);
+    }
+
+    memset(&progress, 0, sizeof(progress));
+    progress.queue = SMDI_OpenJobQueue(conn, jobs_callback, (DWORD)&progress);
+    if (progress.queue == NULL) {
+        SMDI_FreeSample(big);
+        SMDI_FreeSample(small);
+        printf("Cannot open a job queue\n");
+        return 0;
+    }
+
+    /* Queued while paused so the order is the scheduler's alone */
+    SMDI_PauseJobQueue(progress.queue, TRUE);
+    ids[0] = SMDI_QueueUpload(progress.queue, top - 1, SMDI_OpenSampleSource(big),
+                              SMDI_PRIORITY_BATCH, 0);
+    ids[1] = SMDI_QueueUpload(progress.queue, top - 2, SMDI_OpenSampleSource(big),
+                              SMDI_PRIORITY_BATCH, 0);
+    ids[2] = SMDI_QueueUpload(progress.queue, top - 3, SMDI_OpenSampleSource(small),
+                              SMDI_PRIORITY_BATCH, 0);
+    ids[3] = SMDI_QueueDelete(progress.queue, top, SMDI_PRIORITY_BATCH, 0);
+    SMDI_SetJobPriority(progress.queue, ids[1], SMDI_PRIORITY_INTERACTIVE);
+
+    /* Interactive first, then the delete before the small and the big upload */
+    expected[0] = ids[1];
+    expected[1] = ids[3];
+    expected[2] = ids[2];
+    expected[3] = ids[0];
+
+    start = bench_now();
+    SMDI_PauseJobQueue(progress.queue, FALSE);
+    SMDI_WaitJobQueue(progress.queue);
+    report("jobs", 4, bench_now() - start, (double)bytes * 1.125);
+
+    ok = progress.starts == 4 && progress.dry == 1;
+    for (i = 0; i < 4 && ok; i++) {
+        ok = progress.started[i] == expected[i];
+    }
+    if (!ok) {
+        printf("Jobs ran out of order\n");
+    }
+
+    states[0] = states[1] = states[2] = states[3] = SMDI_JOB_DONE;
+    ok = ok && collect_jobs(progress.queue, ids, states, 4);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(top - 3, &size);
+    if (ok && (stored == NULL || size != bytes / 8 ||
+               memcmp(stored, small->sample_data, bytes / 8) != 0 ||
+               SMDI_EmuGetSampleData(top, &size) != NULL)) {
+        printf("Queued upload or delete not done\n");
+        ok = 0;
+    }
+
+    /* A rename, a download cancelled once it moves data and an upload
+       cancelled before it starts */
+    sprintf(filename, "/tmp/smdi_bench_%lu.sdmp", (unsigned long)getpid());
+    SMDI_PauseJobQueue(progress.queue, TRUE);
+    progress.starts = 0;
+    ids[0] = SMDI_QueueRename(progress.queue, top - 3, "Renamed", SMDI_PRIORITY_INTERACTIVE, 0);
+    ids[1] = SMDI_QueueDownload(progress.queue, top - 1, SMDI_OpenFileSink(filename), NULL,
+                                SMDI_PRIORITY_BATCH, 0);
+    ids[2] = SMDI_QueueUpload(progress.queue, top, SMDI_OpenSampleSource(small),
+                              SMDI_PRIORITY_BATCH, 0);
+    progress.cancel_id = ids[1];
+    SMDI_CancelJob(progress.queue, ids[2]);
+    SMDI_PauseJobQueue(progress.queue, FALSE);
+    SMDI_WaitJobQueue(progress.queue);
+
+    /* A download of two packets or less is done before the cancel can stop it */
+    states[0] = SMDI_JOB_DONE;
+    states[1] = bytes / 2 > 2 * conn->dwPacketSize ? SMDI_JOB_CANCELLED : SMDI_JOB_DONE;
+    states[2] = SMDI_JOB_CANCELLED;
+    ok = ok && collect_jobs(progress.queue, ids, states, 3);
+    cancelled = states[1] == SMDI_JOB_CANCELLED ? "2 jobs cancelled" : "queued job cancelled";
+
+    if (ok && ((states[1] == SMDI_JOB_CANCELLED && access(filename, F_OK) == 0) ||
+               SMDI_EmuGetSampleData(top, &size) != NULL)) {
+        printf("Cancelled jobs left data behind\n");
+        ok = 0;
+    }
+    remove(filename);
+
+    /* A delete and a rename of the empty slot, which the device rejects,
+       then an upload whose file is missing, which keeps no reject */
+    ids[0] = SMDI_QueueDelete(progress.queue, top, SMDI_PRIORITY_INTERACTIVE, 0);
+    ids[1] = SMDI_QueueRename(progress.queue, top, "Nothing", SMDI_PRIORITY_INTERACTIVE, 0);
+    ids[2] = SMDI_QueueUploadFile(progress.queue, top, "bench_missing.sdmp", NULL,
+                                  SMDI_PRIORITY_BATCH, 0);
+    SMDI_WaitJobQueue(progress.queue);
+
+    states[0] = states[1] = states[2] = SMDI_JOB_FAILED;
+    ok = ok && collect_jobs(progress.queue, ids, states, 3);
+
+    /* Every job still queued cancelled at once */
+    SMDI_PauseJobQueue(progress.queue, TRUE);
+    ids[0] = SMDI_QueueUpload(progress.queue, top, SMDI_OpenSampleSource(small),
+                              SMDI_PRIORITY_BATCH, 0);
+    ids[1] = SMDI_QueueDelete(progress.queue, top - 3, SMDI_PRIORITY_BATCH, 0);
+    ids[2] = SMDI_QueueRename(progress.queue, top - 3, "Cancelled", SMDI_PRIORITY_BATCH, 0);
+    SMDI_CancelAllJobs(progress.queue);
+    SMDI_PauseJobQueue(progress.queue, FALSE);
+    SMDI_WaitJobQueue(progress.queue);
+
+    states[0] = states[1] = states[2] = SMDI_JOB_CANCELLED;
+    ok = ok && collect_jobs(progress.queue, ids, states, 3);
+    if (ok && (SMDI_PendingJobs(progress.queue) != 0 ||
+               SMDI_EmuGetSampleData(top, &size) != NULL ||
+               SMDI_EmuGetSampleData(top - 3, &size) == NULL)) {
+        printf("Cancelled jobs ran\n");
+        ok = 0;
+    }
+
+    SMDI_CloseJobQueue(progress.queue);
+
+    memset(&sh, 0, sizeof(sh));
+    sh.dwStructSize = sizeof(sh);
+    if (ok && (SMDIC_SampleHeaderRequest(conn, top - 3, &sh) != SMDIM_SAMPLEHEADER ||
+               strcmp(sh.cName, "Renamed") != 0)) {
+        printf("Queued rename not done\n");
+        ok = 0;
+    }
+    if (ok) {
+        printf("  ran interactive, then smallest first; rename done, %s\n", cancelled);
+        printf("  rejected delete and rename reported, missing file not taken for a reject,\n"
+               "  queue cancelled at once\n");
+    }
+
+    SMDI_FreeSample(big);
+    SMDI_FreeSample(small);
+
+    return ok;
+}
+
+/* One sampler of the rack benchmark */
+typedef struct {
+    SMDI_Connection *conn;
+    SMDI_JobQueue *queue;
+    volatile double done;   /* Time its queue ran dry */
+} rack_device_t;
+
+static void rack_callback(SMDI_JobInfo *job, DWORD user_data)
+{
+    if (job == NULL) {
+        ((rack_device_t*)user_data)->done = bench_now();
+    }
+}
+
+/* Queue uploads on each device, start them all at once and wait for
+   them; returns the seconds taken, negative if an upload failed */
+static double run_rack(rack_device_t **devices, int count, SMDI_Sample *sample,
+                       DWORD number, DWORD uploads)
+{
+    SMDI_JobInfo info;
+    DWORD i;
+    double start;
+    double seconds;
+    int d;
+
+    for (d = 0; d < count; d++) {
+        SMDI_PauseJobQueue(devices[d]->queue, TRUE);
+        for (i = 0; i < uploads; i++) {
+            SMDI_QueueUpload(devices[d]->queue, number, SMDI_OpenSampleSource(sample),
+                             SMDI_PRIORITY_BATCH, 0);
+        }
+        devices[d]->done = 0.0;
+    }
+
+    start = bench_now();
+    for (d = 0; d < count; d++) {
+        SMDI_PauseJobQueue(devices[d]->queue, FALSE);
+    }
+    for (d = 0; d < count; d++) {
+        SMDI_WaitJobQueue(devices[d]->queue);
+    }
+    seconds = bench_now() - start;
+
+    for (d = 0; d < count; d++) {
+        devices[d]->done -= start;
+        while (SMDI_CollectJob(devices[d]->queue, &info)) {
+            if (info.dwState != SMDI_JOB_DONE) {
+                printf("Upload to %d:%d ended in state %lu: 0x%08lX\n",
+                       devices[d]->conn->HA_ID, devices[d]->conn->SCSI_ID,
+                       info.dwState, info.dwResult);
+                seconds = -1.0;
+            }
+        }
+    }
+
+    return seconds;
+}
+
+/* Uploads to one sampler, to two on separate host adapters and to two
+   sharing one host adapter's bus */
+static int bench_rack(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_EmuConfig other;
+    SMDI_SampleHeader sh;
+    SMDI_Sample *sample;
+    rack_device_t devices[3];
+    rack_device_t *run[2];
+    const unsigned char *stored;
+    DWORD number;
+    DWORD bytes;
+    DWORD size;
+    DWORD i;
+    double single;
+    double buses;
+    double shared;
+    int ok;
+    int d;
+
+    number = config->dwMaxSampleNumber - 4;
+    bytes = params->sample_kb * 1024;
+
+    /* A sampler on the next host adapter and one beside the first */
+    memcpy(&other, config, sizeof(other));
+    other.HA_ID = config->HA_ID + 1;
+    ok = SMDI_EmuAddDevice(&other);
+    other.HA_ID = config->HA_ID;
+    other.SCSI_ID = config->SCSI_ID - 1;
+    ok = ok && SMDI_EmuAddDevice(&other);
+    if (!ok) {
+        printf("Cannot add emulated samplers\n");
+        return 0;
+    }
+
+    make_header(&sh, bytes, "Bench rack");
+    sample = SMDI_HeaderToSample(&sh, NULL);
+    if (sample == NULL) {
+        printf("Out of memory\n");
+        return 0;
+    }
+    for (i = 0; i < bytes; i++) {
+        ((unsigned char*)sample->sample_data)[i] = (unsigned char)((i * 13 + 7) & 0xFF);
+    }
+
+    memset(devices, 0, sizeof(devices));
+    devices[0].conn = conn;
+    devices[1].conn = SMDI_OpenConnection(config->HA_ID + 1, config->SCSI_ID);
+    devices[2].conn = SMDI_OpenConnection(config->HA_ID, config->SCSI_ID - 1);
+    for (d = 0; d < 3 && ok; d++) {
+        if (devices[d].conn != NULL) {
+            devices[d].queue = SMDI_OpenJobQueue(devices[d].conn, rack_callback,
+                                                 (DWORD)&devices[d]);
+        }
+        ok = devices[d].queue != NULL;
+    }
+    if (!ok) {
+        printf("Cannot open the rack connections\n");
+    }
+
+    single = buses = shared = -1.0;
+    if (ok) {
+        run[0] = &devices[0];
+        single = run_rack(run, 1, sample, number, params->iterations);
+        report("rack-1", params->iterations, single, (double)bytes * params->iterations);
+
+        run[1] = &devices[1];
+        buses = run_rack(run, 2, sample, number, params->iterations);
+        report("rack-2-buses", params->iterations * 2, buses,
+               (double)bytes * params->iterations * 2);
+
+        run[1] = &devices[2];
+        devices[2].conn->dwBusWaits = 0;
+        shared = run_rack(run, 2, sample, number, params->iterations);
+        report("rack-1-bus", params->iterations * 2, shared,
+               (double)bytes * params->iterations * 2);
+
+        ok = single >= 0.0 && buses >= 0.0 && shared >= 0.0;
+    }
+
+    for (d = 0; d < 3 && ok; d++) {
+        SMDI_EmuSelectDevice(devices[d].conn->HA_ID, devices[d].conn->SCSI_ID);
+        stored = (const unsigned char*)SMDI_EmuGetSampleData(number, &size);
+        if (stored == NULL || size != bytes || memcmp(stored, sample->sample_data, bytes) != 0) {
+            printf("Sampler %d:%d holds the wrong data\n",
+                   devices[d].conn->HA_ID, devices[d].conn->SCSI_ID);
+            ok = 0;
+        }
+    }
+    SMDI_EmuSelectDevice(config->HA_ID, config->SCSI_ID);
+
+    if (ok) {
+        printf("  2 buses %.2fx one sampler; on 1 bus done after %.3f s and %.3f s, %lu waits\n",
+               buses > 0.0 ? single * 2.0 / buses : 0.0, devices[0].done, devices[2].done,
+               devices[2].conn->dwBusWaits);
+    }
+
+    for (d = 0; d < 3; d++) {
+        SMDI_CloseJobQueue(devices[d].queue);
+        if (d > 0) {
+            SMDI_CloseConnection(devices[d].conn);
+        }
+    }
+    SMDI_FreeSample(sample);
+
+    return ok;
+}
+
+/* Swap the sample buffer's words with each kernel the CPU supports,
+   into a second buffer and in place */
+static int bench_swap(bench_params_t *params)
+{
+    unsigned char *src;
+    unsigned char *dest;
+    DWORD bytes;
+    DWORD passes;
+    DWORD kernel;
+    DWORD saved;
+    DWORD i;
+    double start;
+    double copy_time;
+    double place_time;
+    double total;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+    passes = (256 * 1024 * 1024) / bytes;
+    if (passes == 0) {
+        passes = 1;
+    }
+
+    src = (unsigned char*)malloc(bytes);
+    dest = (unsigned char*)malloc(bytes);
+    if (src == NULL || dest == NULL) {
+        free(src);
+        free(dest);
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    for (i = 0; i < bytes; i++) {
+        src[i] = (unsigned char)((i * 13 + (i >> 9)) & 0xFF);
+    }
+
+    saved = SMDI_GetSwapKernel();
+    total = (double)bytes * (double)passes / (1024.0 * 1024.0 * 1024.0);
+    ok = 1;
+
+    for (kernel = 0; kernel < SMDI_SWAP_KERNELS && ok; kernel++) {
+        if (!SMDI_SetSwapKernel(kernel)) {
+            continue;
+        }
+
+        /* Odd lengths and unaligned buffers take the tail paths */
+        SMDI_CopySwap(dest, src, bytes - 1, CM_BYTESWAP);
+        ok = swapped_equal(dest, src, bytes - 1);
+        if (ok) {
+            memcpy(dest, src, bytes);
+            SMDI_CopySwap(dest + 1, dest + 1, bytes - 2, CM_BYTESWAP);
+            ok = dest[0] == src[0] && swapped_equal(dest + 1, src + 1, bytes - 2);
+        }
+        if (!ok) {
+            printf("Swap kernel %s gives wrong data\n", SMDI_SwapKernelName(kernel));
+            break;
+        }
+
+        start = bench_now();
+        for (i = 0; i < passes; i++) {
+            SMDI_CopySwap(dest, src, bytes, CM_BYTESWAP);
+        }
+        copy_time = bench_now() - start;
+
+        start = bench_now();
+        for (i = 0; i < passes; i++) {
+            SMDI_CopySwap(dest, dest, bytes, CM_BYTESWAP);
+        }
+        place_time = bench_now() - start;
+
+        printf("  swap-%-8s %6lu ops copy %8.2f GB/s  in place %8.2f GB/s%s\n",
+               SMDI_SwapKernelName(kernel), passes,
+               copy_time > 0.0 ? total / copy_time : 0.0,
+               place_time > 0.0 ? total / place_time : 0.0,
+               kernel == saved ? "  (default)" : "");
+    }
+
+    SMDI_SetSwapKernel(saved);
+
+    free(src);
+    free(dest);
+
+    return ok;
+}
+
+/* Source handing out a buffer of raw frames, for data the sampler
+   cannot take as it is */
+typedef struct {
+    const unsigned char *data;
+    DWORD size;
+    DWORD pos;
+} raw_source_t;
+
+static DWORD raw_read(SMDI_SampleSource *src, void *buffer, DWORD bytes)
+{
+    raw_source_t *raw = (raw_source_t*)src->lpState;
+
+    if (bytes > raw->size - raw->pos) {
+        bytes = raw->size - raw->pos;
+    }
+    memcpy(buffer, raw->data + raw->pos, bytes);
+    raw->pos += bytes;
+
+    return bytes;
+}
+
+static void raw_close(SMDI_SampleSource *src)
+{
+    free(src->lpState);
+}
+
+static SMDI_SampleSource *open_raw_source(SMDI_SampleHeader *sh, const unsigned char *data,
+                                          DWORD size)
+{
+    SMDI_SampleSource *src;
+    raw_source_t *raw;
+
+    src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    raw = (raw_source_t*)malloc(sizeof(raw_source_t));
+    if (src == NULL || raw == NULL) {
+        free(src);
+        free(raw);
+        return NULL;
+    }
+    raw->data = data;
+    raw->size = size;
+    raw->pos = 0;
+
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    memcpy(&src->Header, sh, sizeof(SMDI_SampleHeader));
+    src->lpRead = raw_read;
+    src->lpClose = raw_close;
+    src->lpState = raw;
+
+    return src;
+}
+
+/* Convert frames with a new converter; the bytes written, 0 on failure */
+static DWORD convert(const SMDI_PCMFormat *format, DWORD flags, unsigned char *out,
+                     const unsigned char *in, DWORD frames)
+{
+    SMDI_Converter *conv;
+    DWORD written;
+
+    conv = SMDI_CreateConverter(format, 2, 16, flags);
+    if (conv == NULL) {
+        return 0;
+    }
+    written = SMDI_ConvertFrames(conv, out, in, frames);
+    SMDI_FreeConverter(conv);
+
+    return written;
+}
+
+/* Largest difference between the big-endian words of a and b */
+static long word_distance(const unsigned char *a, const unsigned char *b, DWORD bytes)
+{
+    long most;
+    long d;
+    DWORD i;
+
+    most = 0;
+    for (i = 0; i + 1 < bytes; i += 2) {
+        d = (long)(short)((a[i] << 8) | a[i + 1]) - (long)(short)((b[i] << 8) | b[i + 1]);
+        if (d < 0) {
+            d = -d;
+        }
+        if (d > most) {
+            most = d;
+        }
+    }
+
+    return most;
+}
+
+/* Convert 24-bit and float stereo to 16 bits with each kernel the CPU
+   supports, then upload 24-bit frames converted packet by packet */
+static int bench_convert(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_PCMFormat pcm24;
+    SMDI_PCMFormat pcmfloat;
+    SMDI_PCMFormat swapped;
+    SMDI_SampleHeader sh;
+    SMDI_FileTransfer ft;
+    const unsigned char *stored;
+    unsigned char *in24;
+    unsigned char *infloat;
+    unsigned char *flipped;
+    unsigned char *ref;
+    unsigned char *out;
+    union {
+        float f;
+        unsigned char b[4];
+    } fv;
+    DWORD frames;
+    DWORD bytes;
+    DWORD passes;
+    DWORD kernel;
+    DWORD saved;
+    DWORD result;
+    DWORD size;
+    DWORD i;
+    DWORD k;
+    long v;
+    double start;
+    double t24;
+    double tfloat;
+    double total;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+    frames = bytes / 4;
+    passes = (64 * 1024 * 1024) / (frames * 2);
+    if (passes == 0) {
+        passes = 1;
+    }
+
+    in24 = (unsigned char*)malloc(frames * 6);
+    infloat = (unsigned char*)malloc(frames * 8);
+    flipped = (unsigned char*)malloc(frames * 8 + 1);
+    ref = (unsigned char*)malloc(bytes);
+    out = (unsigned char*)malloc(bytes);
+    if (in24 == NULL || infloat == NULL || flipped == NULL || ref == NULL || out == NULL) {
+        free(in24);
+        free(infloat);
+        free(flipped);
+        free(ref);
+        free(out);
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    /* The same 24-bit values packed big-endian and as float, starting
+       with full scale both ways; float beyond it is clamped */
+    for (i = 0; i < frames * 2; i++) {
+        v = (long)((i * 2654435761UL >> 8) & 0xFFFFFF) - 0x800000L;
+        if (i < 2) {
+            v = (i == 0) ? 0x7FFFFFL : -0x800000L;
+        }
+        in24[3 * i] = (unsigned char)((v >> 16) & 0xFF);
+        in24[3 * i + 1] = (unsigned char)((v >> 8) & 0xFF);
+        in24[3 * i + 2] = (unsigned char)(v & 0xFF);
+
+        fv.f = (i < 2) ? (i == 0 ? 1.5f : -2.0f) : (float)v / 8388608.0f;
+        memcpy(infloat + 4 * i, fv.b, 4);
+        for (k = 0; k < 4; k++) {
+            flipped[1 + 4 * i + k] = fv.b[3 - k];
+        }
+
+        /* Rounded to 16 bits */
+        v = (v + 128) >> 8;
+        if (v > 0x7FFF) {
+            v = 0x7FFF;
+        }
+        ref[2 * i] = (unsigned char)((v >> 8) & 0xFF);
+        ref[2 * i + 1] = (unsigned char)(v & 0xFF);
+    }
+
+    pcm24.dwEncoding = SMDI_PCM_SIGNED;
+    pcm24.dwBits = 24;
+    pcm24.dwBytes = 3;
+    pcm24.dwByteOrder = SMDI_PCM_BIGENDIAN;
+    pcmfloat.dwEncoding = SMDI_PCM_FLOAT;
+    pcmfloat.dwBits = 32;
+    pcmfloat.dwBytes = 4;
+    pcmfloat.dwByteOrder = SMDI_PCM_HOSTORDER;
+    memcpy(&swapped, &pcmfloat, sizeof(swapped));
+    swapped.dwByteOrder = SMDI_CopyModeSwaps(CM_HOSTORDER) ? SMDI_PCM_BIGENDIAN
+                                                             : SMDI_PCM_LITTLEENDIAN;
+
+    saved = SMDI_GetConvertKernel();
+    total = (double)frames * 2.0 * (double)passes / 1000000.0;
+    ok = 1;
+
+    for (kernel = 0; kernel < SMDI_SWAP_KERNELS && ok; kernel++) {
+        if (!SMDI_SetConvertKernel(kernel)) {
+            continue;
+        }
+
+        /* Exact without dither, within a step with it; float also in
+           the other byte order from an odd address */
+        ok = convert(&pcm24, 0, out, in24, frames) == bytes &&
+             memcmp(out, ref, bytes) == 0 &&
+             convert(&pcmfloat, 0, out, infloat, frames) == bytes &&
+             memcmp(out, ref, bytes) == 0 &&
+             convert(&pcm24, SMDI_CONVERT_DITHER, out, in24, frames) == bytes &&
+             word_distance(out, ref, bytes) <= 1;
+        if (ok) {
+            ok = convert(&swapped, 0, out, flipped + 1, frames) == bytes &&
+                 memcmp(out, ref, bytes) == 0;
+        }
+        if (!ok) {
+            printf("Convert kernel %s gives wrong data\n", SMDI_SwapKernelName(kernel));
+            break;
+        }
+
+        start = bench_now();
+        for (i = 0; i < passes; i++) {
+            convert(&pcm24, SMDI_CONVERT_DITHER, out, in24, frames);
+        }
+        t24 = bench_now() - start;
+
+        start = bench_now();
+        for (i = 0; i < passes; i++) {
+            convert(&pcmfloat, SMDI_CONVERT_DITHER, out, infloat, frames);
+        }
+        tfloat = bench_now() - start;
+
+        printf("  convert-%-6s %5lu ops 24-bit %7.1f Msamples/s  float %7.1f Msamples/s%s\n",
+               SMDI_SwapKernelName(kernel), passes,
+               t24 > 0.0 ? total / t24 : 0.0,
+               tfloat > 0.0 ? total / tfloat : 0.0,
+               kernel == saved ? "  (default)" : "");
+    }
+
+    SMDI_SetConvertKernel(saved);
+
+    /* Noise shaping runs on one kernel; its error feedback stays within
+       a few steps */
+    if (ok) {
+        start = bench_now();
+        for (i = 0; i < passes && ok; i++) {
+            ok = convert(&pcm24, SMDI_CONVERT_NOISESHAPE, out, in24, frames) == bytes;
+        }
+        t24 = bench_now() - start;
+        printf("  convert-shape  %5lu ops 24-bit %7.1f Msamples/s\n",
+               passes, t24 > 0.0 ? total / t24 : 0.0);
+
+        if (!ok || word_distance(out, ref, bytes) > 6) {
+            printf("Noise shaped conversion strays too far\n");
+            ok = 0;
+        }
+    }
+
+    /* Converted packet by packet on the way out, inline and read ahead */
+    make_header(&sh, bytes, "Bench convert");
+    sh.NumberOfChannels = 2;
+    sh.dwLength = frames;
+    sh.dwLoopEnd = frames - 1;
+
+    for (i = 0; i < 2 && ok; i++) {
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = config->dwMaxSampleNumber;
+        ft.lpSource = SMDI_OpenConvertSource(open_raw_source(&sh, in24, frames * 6),
+                                             &pcm24, 16, 0);
+        ft.dwReadAhead = (i == 0) ? 0 : SMDI_READAHEAD_DEFAULT;
+        ft.lpReturnValue = &result;
+        ft.lpConnection = conn;
+
+        start = bench_now();
+        ok = ft.lpSource != NULL && SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+        report(i == 0 ? "convert-up" : "convert-up-ra", 1, bench_now() - start,
+               (double)frames * 6.0);
+
+        stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+        if (ok && (stored == NULL || size != bytes || memcmp(stored, ref, bytes) != 0)) {
+            printf("Converted upload data mismatch\n");
+            ok = 0;
+        }
+    }
+
+    free(in24);
+    free(infloat);
+    free(flipped);
+    free(ref);
+    free(out);
+
+    return ok;
+}
+
+/* Resample frames through a resample source read in odd-sized chunks;
+   the bytes read, SMDI_SOURCE_ERROR on failure */
+static DWORD resample(SMDI_SampleHeader *sh, const unsigned char *data, DWORD size,
+                      DWORD rate, unsigned char *out, DWORD out_size, SMDI_SampleHeader *out_sh)
+{
+    SMDI_SampleSource *src;
+    DWORD total;
+    DWORD got;
+
+    src = SMDI_OpenResampleSource(open_raw_source(sh, data, size), 0, rate);
+    if (src == NULL) {
+        return SMDI_SOURCE_ERROR;
+    }
+    memcpy(out_sh, &src->Header, sizeof(SMDI_SampleHeader));
+
+    total = 0;
+    do {
+        got = SMDI_ReadSource(src, out + total, (out_size - total < 1001) ? out_size - total : 1001);
+        if (got != SMDI_SOURCE_ERROR) {
+            total += got;
+        }
+    } while (got != 0 && got != SMDI_SOURCE_ERROR && total < out_size);
+    SMDI_CloseSource(src);
+
+    return (got == SMDI_SOURCE_ERROR) ? SMDI_SOURCE_ERROR : total;
+}
+
+/* Largest difference of resampled stereo words from the tones they
+   carry, away from the ends the filter reaches past */
+static long tone_distance(const unsigned char *out, DWORD frames, double rate,
+                          double left, double right)
+{
+    long most;
+    long d;
+    double t;
+    DWORD i;
+
+    most = 0;
+    for (i = SMDI_RESAMPLE_TAPS; i + SMDI_RESAMPLE_TAPS < frames; i++) {
+        t = 2.0 * 3.14159265358979323846 * (double)i / rate;
+        d = (long)(short)((out[4 * i] << 8) | out[4 * i + 1]) - (long)floor(16000.0 * sin(left * t) + 0.5);
+        most = (d < 0 ? -d : d) > most ? (d < 0 ? -d : d) : most;
+        d = (long)(short)((out[4 * i + 2] << 8) | out[4 * i + 3]) - (long)floor(8000.0 * sin(right * t) + 0.5);
+        most = (d < 0 ? -d : d) > most ? (d < 0 ? -d : d) : most;
+    }
+
+    return most;
+}
+
+/* Resample stereo tones from 48 and 96 kHz to 44.1 kHz with each kernel
+   the CPU supports, then upload through a sampler set to 44.1 kHz */
+static int bench_resample(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    SMDI_SampleHeader out_sh;
+    SMDI_SampleHeader stored_sh;
+    SMDI_FileTransfer ft;
+    const unsigned char *stored;
+    unsigned char *in;
+    unsigned char *out;
+    unsigned char *first;
+    DWORD frames;
+    DWORD out_frames;
+    DWORD out_bytes;
+    DWORD passes;
+    DWORD kernel;
+    DWORD saved;
+    DWORD result;
+    DWORD size;
+    DWORD i;
+    long v;
+    double t;
+    double start;
+    double elapsed;
+    int ok;
+
+    frames = params->sample_kb * 1024 / 4;
+    out_frames = SMDI_ResampledLength(frames, 48000, 44100);
+    out_bytes = out_frames * 4;
+    passes = (8 * 1024 * 1024) / (out_frames * 2) + 1;
+
+    in = (unsigned char*)malloc(frames * 4);
+    out = (unsigned char*)malloc(out_bytes);
+    first = (unsigned char*)malloc(out_bytes);
+    if (in == NULL || out == NULL || first == NULL) {
+        free(in);
+        free(out);
+        free(first);
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    /* 1 kHz left and 5 kHz right at 48 kHz, twice that at 96 kHz */
+    for (i = 0; i < frames; i++) {
+        t = 2.0 * 3.14159265358979323846 * (double)i / 48000.0;
+        v = (long)floor(16000.0 * sin(1000.0 * t) + 0.5);
+        in[4 * i] = (unsigned char)((v >> 8) & 0xFF);
+        in[4 * i + 1] = (unsigned char)(v & 0xFF);
+        v = (long)floor(8000.0 * sin(5000.0 * t) + 0.5);
+        in[4 * i + 2] = (unsigned char)((v >> 8) & 0xFF);
+        in[4 * i + 3] = (unsigned char)(v & 0xFF);
+    }
+
+    make_header(&sh, frames * 4, "Bench resample");
+    sh.NumberOfChannels = 2;
+    sh.dwLength = frames;
+    sh.dwPeriod = SMDI_RateToPeriod(48000);
+    sh.dwLoopStart = frames / 4;
+    sh.dwLoopEnd = frames / 4 * 3;
+
+    saved = SMDI_GetResampleKernel();
+    ok = 1;
+
+    for (kernel = 0; kernel < SMDI_SWAP_KERNELS && ok; kernel++) {
+        if (!SMDI_SetResampleKernel(kernel)) {
+            continue;
+        }
+
+        /* Length and loop follow the rate; the tones come through within
+           a few steps, and all kernels agree on them */
+        sh.dwPeriod = SMDI_RateToPeriod(48000);
+        ok = resample(&sh, in, frames * 4, 44100, out, out_bytes, &out_sh) == out_bytes &&
+             out_sh.dwLength == out_frames &&
+             out_sh.dwPeriod == SMDI_RateToPeriod(44100) &&
+             out_sh.dwLoopStart == (DWORD)floor((double)sh.dwLoopStart * 44100.0 / 48000.0 + 0.5) &&
+             out_sh.dwLoopEnd == (DWORD)floor((double)sh.dwLoopEnd * 44100.0 / 48000.0 + 0.5) &&
+             tone_distance(out, out_frames, 44100.0, 1000.0, 5000.0) <= 2;
+        if (ok && kernel == 0) {
+            memcpy(first, out, out_bytes);
+        }
+        ok = ok && word_distance(out, first, out_bytes) <= 1;
+
+        sh.dwPeriod = SMDI_RateToPeriod(96000);
+        ok = ok && resample(&sh, in, frames * 4, 44100, out, out_bytes / 2 + 4, &out_sh) ==
+                   SMDI_ResampledLength(frames, 96000, 44100) * 4 &&
+             tone_distance(out, out_sh.dwLength, 44100.0, 2000.0, 10000.0) <= 2;
+        if (!ok) {
+            printf("Resample kernel %s gives wrong data\n", SMDI_SwapKernelName(kernel));
+            break;
+        }
+
+        sh.dwPeriod = SMDI_RateToPeriod(48000);
+        start = bench_now();
+        for (i = 0; i < passes; i++) {
+            resample(&sh, in, frames * 4, 44100, out, out_bytes, &out_sh);
+        }
+        elapsed = bench_now() - start;
+
+        printf("  resample-%-6s %5lu ops 48k>44.1k %7.1f Msamples/s%s\n",
+               SMDI_SwapKernelName(kernel), passes,
+               elapsed > 0.0 ? (double)out_frames * 2.0 * passes / elapsed / 1000000.0 : 0.0,
+               kernel == saved ? "  (default)" : "");
+    }
+
+    SMDI_SetResampleKernel(saved);
+
+    /* A sampler playing back at 44.1 kHz gets the sample resampled on
+       the way out */
+    if (ok) {
+        resample(&sh, in, frames * 4, 44100, first, out_bytes, &out_sh);
+        SMDIC_SetTargetRate(conn, 44100);
+
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = config->dwMaxSampleNumber;
+        ft.lpSource = open_raw_source(&sh, in, frames * 4);
+        ft.lpReturnValue = &result;
+        ft.lpConnection = conn;
+
+        start = bench_now();
+        ok = ft.lpSource != NULL && SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+        report("resample-up", 1, bench_now() - start, (double)frames * 4.0);
+        SMDIC_SetTargetRate(conn, 0);
+
+        memset(&stored_sh, 0, sizeof(stored_sh));
+        stored_sh.dwStructSize = sizeof(stored_sh);
+        stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+        if (ok && (stored == NULL || size != out_bytes || memcmp(stored, first, out_bytes) != 0 ||
+                   SMDIC_SampleHeaderRequest(conn, config->dwMaxSampleNumber, &stored_sh) !=
+                   SMDIM_SAMPLEHEADER ||
+                   stored_sh.dwLength != out_frames || stored_sh.dwLoopEnd != out_sh.dwLoopEnd)) {
+            printf("Resampled upload data mismatch\n");
+            ok = 0;
+        }
+    }
+
+    free(in);
+    free(out);
+    free(first);
+
+    return ok;
+}
+
+/* Compare a loaded sample with the one saved */
+static int same_sample(SMDI_Sample *a, SMDI_Sample *b)
+{
+    return a != NULL && b != NULL &&
+           a->sample_rate == b->sample_rate &&
+           a->bits_per_sample == b->bits_per_sample &&
+           a->channels == b->channels &&
+           a->loop_type == b->loop_type &&
+           a->sample_count == b->sample_count &&
+           a->loop_start == b->loop_start &&
+           a->loop_end == b->loop_end &&
+           a->root_note == b->root_note &&
+           a->fine_tune == b->fine_tune &&
+           strcmp(a->name, b->name) == 0 &&
+           a->data_size == b->data_size &&
+           memcmp(a->sample_data, b->sample_data, a->data_size) == 0;
+}
+
+/* Turn a saved AIFF-C file into one with little-endian 'sowt' frames */
+static int make_sowt_file(const char *filename, DWORD bytes)
+{
+    FILE *file;
+    unsigned char *data;
+    unsigned char c;
+    long size;
+    long i;
+    int ok;
+
+    file = fopen(filename, "r+b");
+    if (file == NULL) {
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    data = (unsigned char*)malloc((size_t)size);
+    ok = data != NULL && size > (long)bytes && fseek(file, 0, SEEK_SET) == 0 &&
+         fread(data, 1, (size_t)size, file) == (size_t)size;
+
+    /* The compression type follows COMM's 18 bytes; the frames end the
+       file */
+    for (i = 12; ok && i + 8 <= size; i++) {
+        if (memcmp(data + i, "COMM", 4) == 0) {
+            memcpy(data + i + 8 + 18, "sowt", 4);
+            break;
+        }
+    }
+    for (i = size - (long)bytes; ok && i < size; i += 2) {
+        c = data[i];
+        data[i] = data[i + 1];
+        data[i + 1] = c;
+    }
+
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+         fwrite(data, 1, (size_t)size, file) == (size_t)size;
+    ok = (fclose(file) == 0) && ok;
+    free(data);
+
+    return ok;
+}
+
+static int bench_aif(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_Sample *sample;
+    SMDI_Sample *loaded;
+    SMDI_SampleHeader sh;
+    SMDI_FileTransfer ft;
+    char filename[64];
+    char received[64];
+    const unsigned char *stored;
+    DWORD frames;
+    DWORD bytes;
+    DWORD result;
+    DWORD size;
+    DWORD i;
+    double start;
+    int aifc;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+    frames = bytes / 4;
+
+    sample = SMDI_CreateSample(48000, 16, 2, frames);
+    if (sample == NULL) {
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    for (i = 0; i < bytes; i++) {
+        ((unsigned char*)sample->sample_data)[i] = (unsigned char)((i * 2654435761UL) >> 13);
+    }
+    sample->loop_type = SAMPLE_LOOP_BIDIRECTIONAL;
+    sample->loop_start = frames / 4;
+    sample->loop_end = frames / 4 * 3;
+    sample->root_note = 57;
+    sample->fine_tune = (WORD)-12;
+    strcpy(sample->name, "Bench AIF");
+
+    sprintf(filename, "/tmp/smdi_bench_%lu.aif", (unsigned long)getpid());
+    sprintf(received, "/tmp/smdi_bench_%lu.rx.aif", (unsigned long)getpid());
+    ok = 1;
+
+    /* Format, loop, base note, detune and name survive a round trip
+       through AIFF and AIFF-C */
+    for (aifc = 0; aifc < 2 && ok; aifc++) {
+        start = bench_now();
+        ok = SMDI_SaveAIFSample(sample, filename, aifc);
+        report(aifc ? "aifc-save" : "aif-save", 1, bench_now() - start, (double)bytes);
+
+        start = bench_now();
+        loaded = ok ? SMDI_LoadAIFSample(filename) : NULL;
+        report(aifc ? "aifc-load" : "aif-load", 1, bench_now() - start, (double)bytes);
+
+        ok = same_sample(loaded, sample);
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("AIF%s round trip mismatch\n", aifc ? "-C" : "");
+        }
+    }
+
+    /* Little-endian frames load the same */
+    if (ok) {
+        loaded = make_sowt_file(filename, bytes) ? SMDI_LoadAIFSample(filename) : NULL;
+        ok = same_sample(loaded, sample);
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("AIF-C sowt data mismatch\n");
+        }
+    }
+
+    /* Uploaded from the mapped file and received back into a new one */
+    if (ok) {
+        ok = SMDI_SaveAIFSample(sample, filename, 0);
+
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = config->dwMaxSampleNumber;
+        ft.lpSource = ok ? SMDI_OpenAIFSource(filename) : NULL;
+        ft.lpReturnValue = &result;
+        ft.lpConnection = conn;
+
+        start = bench_now();
+        ok = ft.lpSource != NULL && SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+        report("aif-up", 1, bench_now() - start, (double)bytes);
+
+        memset(&sh, 0, sizeof(sh));
+        sh.dwStructSize = sizeof(sh);
+        stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+        if (ok && (stored == NULL || size != bytes ||
+                   memcmp(stored, sample->sample_data, bytes) != 0 ||
+                   SMDIC_SampleHeaderRequest(conn, config->dwMaxSampleNumber, &sh) !=
+                   SMDIM_SAMPLEHEADER ||
+                   sh.dwLoopStart != sample->loop_start || sh.wPitch != sample->root_note)) {
+            printf("AIF upload data mismatch\n");
+            ok = 0;
+        }
+    }
+
+    if (ok) {
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = config->dwMaxSampleNumber;
+        ft.lpSink = SMDI_OpenAIFSink(received, 1);
+        ft.lpReturnValue = &result;
+        ft.lpConnection = conn;
+
+        start = bench_now();
+        ok = ft.lpSink != NULL && SMDI_ReceiveFile(&ft) == SMDIM_ENDOFPROCEDURE;
+        report("aif-down", 1, bench_now() - start, (double)bytes);
+
+        loaded = ok ? SMDI_LoadAIFSample(received) : NULL;
+        ok = same_sample(loaded, sample);
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("AIF download data mismatch\n");
+        }
+    }
+
+    remove(filename);
+    remove(received);
+    SMDI_FreeSample(sample);
+
+    return ok;
+}
+
+/* Write interleaved stereo frames as a WAV file of the given format tag;
+   0xFFFE writes WAVE_FORMAT_EXTENSIBLE around the tag given in sub */
+static int write_wav_file(const char *filename, unsigned int tag, unsigned int sub,
+                          DWORD bytes, const unsigned char *data, DWORD frames)
+{
+    FILE *file;
+    unsigned char head[68];
+    DWORD fmt_size;
+    DWORD size;
+    DWORD i;
+    int ok;
+
+    fmt_size = (tag == 0xFFFE) ? 40 : 16;
+    size = frames * 2 * bytes;
+
+    memset(head, 0, sizeof(head));
+    memcpy(head, "RIFF", 4);
+    for (i = 0; i < 4; i++) {
+        head[4 + i] = (unsigned char)(((4 + 8 + fmt_size + 8 + size) >> (8 * i)) & 0xFF);
+        head[24 + i] = (unsigned char)((48000UL >> (8 * i)) & 0xFF);
+        head[20 + fmt_size + 4 + i] = (unsigned char)((size >> (8 * i)) & 0xFF);
+    }
+    memcpy(head + 8, "WAVEfmt ", 8);
+    head[16] = (unsigned char)fmt_size;
+    head[20] = (unsigned char)(tag & 0xFF);
+    head[21] = (unsigned char)(tag >> 8);
+    head[22] = 2;
+    head[32] = (unsigned char)(2 * bytes);
+    head[34] = (unsigned char)(8 * bytes);
+    if (tag == 0xFFFE) {
+        head[36] = 22;
+        head[38] = (unsigned char)(8 * bytes);
+        head[44] = (unsigned char)sub;
+    }
+    memcpy(head + 20 + fmt_size, "data", 4);
+
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    ok = fwrite(head, 1, 28 + fmt_size, file) == 28 + fmt_size &&
+         fwrite(data, 1, size, file) == size;
+
+    return (fclose(file) == 0) && ok;
+}
+
+/* Open a WAV file queued for upload as its connection is set */
+static SMDI_SampleSource *open_wav_for(const char *filename, SMDI_Connection *conn)
+{
+    return SMDI_OpenWAVSourceAs(filename, (BYTE)SMDIC_GetTargetBits(conn),
+                                SMDIC_GetConvertFlags(conn));
+}
+
+static int bench_wav(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_Sample *sample;
+    SMDI_Sample *loaded;
+    SMDI_SampleHeader sh;
+    SMDI_FileTransfer ft;
+    SMDI_JobQueue *queue;
+    SMDI_JobInfo info;
+    char filename[64];
+    char received[64];
+    const unsigned char *stored;
+    unsigned char *in24;
+    unsigned char *infloat;
+    unsigned char *ref;
+    union {
+        float f;
+        unsigned char b[4];
+    } fv;
+    DWORD frames;
+    DWORD bytes;
+    DWORD result;
+    DWORD size;
+    DWORD i;
+    DWORD k;
+    long v;
+    double start;
+    int bwf;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+    frames = bytes / 4;
+
+    sample = SMDI_CreateSample(48000, 16, 2, frames);
+    in24 = (unsigned char*)malloc(frames * 6);
+    infloat = (unsigned char*)malloc(frames * 8);
+    ref = (unsigned char*)malloc(bytes);
+    if (sample == NULL || in24 == NULL || infloat == NULL || ref == NULL) {
+        if (sample != NULL) {
+            SMDI_FreeSample(sample);
+        }
+        free(in24);
+        free(infloat);
+        free(ref);
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    for (i = 0; i < bytes; i++) {
+        ((unsigned char*)sample->sample_data)[i] = (unsigned char)((i * 2654435761UL) >> 13);
+    }
+    sample->loop_type = SAMPLE_LOOP_BIDIRECTIONAL;
+    sample->loop_start = frames / 4;
+    sample->loop_end = frames / 4 * 3;
+    sample->root_note = 57;
+    sample->fine_tune = (WORD)-12;
+    strcpy(sample->name, "Bench WAV");
+
+    /* 24-bit little-endian and float frames of the same values, and the
+       16 bits they round to */
+    for (i = 0; i < frames * 2; i++) {
+        v = (long)((i * 2654435761UL >> 8) & 0xFFFFFF) - 0x800000L;
+        for (k = 0; k < 3; k++) {
+            in24[3 * i + k] = (unsigned char)((v >> (8 * k)) & 0xFF);
+        }
+        fv.f = (float)v / 8388608.0f;
+        for (k = 0; k < 4; k++) {
+            infloat[4 * i + k] = fv.b[SMDI_CopyModeSwaps(CM_HOSTORDER) ? k : 3 - k];
+        }
+        v = (v + 128) >> 8;
+        if (v > 0x7FFF) {
+            v = 0x7FFF;
+        }
+        ref[2 * i] = (unsigned char)((v >> 8) & 0xFF);
+        ref[2 * i + 1] = (unsigned char)(v & 0xFF);
+    }
+
+    sprintf(filename, "/tmp/smdi_bench_%lu.wav", (unsigned long)getpid());
+    sprintf(received, "/tmp/smdi_bench_%lu.rx.wav", (unsigned long)getpid());
+    ok = 1;
+
+    /* Format, loop, unity note, fine tune and name survive a round trip
+       through WAV and Broadcast WAV */
+    for (bwf = 0; bwf < 2 && ok; bwf++) {
+        start = bench_now();
+        ok = SMDI_SaveWAVSample(sample, filename, bwf);
+        report(bwf ? "bwf-save" : "wav-save", 1, bench_now() - start, (double)bytes);
+
+        start = bench_now();
+        loaded = ok ? SMDI_LoadWAVSample(filename) : NULL;
+        report(bwf ? "bwf-load" : "wav-load", 1, bench_now() - start, (double)bytes);
+
+        ok = same_sample(loaded, sample);
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("%s round trip mismatch\n", bwf ? "BWF" : "WAV");
+        }
+    }
+
+    /* 24-bit extensible and float frames round to 16 bits within the
+       dither's step */
+    for (i = 0; i < 2 && ok; i++) {
+        ok = (i == 0) ? write_wav_file(filename, 0xFFFE, 1, 3, in24, frames)
+                      : write_wav_file(filename, 3, 0, 4, infloat, frames);
+        loaded = ok ? SMDI_LoadWAVSample(filename) : NULL;
+        ok = loaded != NULL && loaded->bits_per_sample == 16 && loaded->channels == 2 &&
+             loaded->sample_count == frames &&
+             word_distance((unsigned char*)loaded->sample_data, ref, bytes) <= 1;
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("WAV %s data mismatch\n", i == 0 ? "24-bit" : "float");
+        }
+    }
+
+    /* Queued by name on a connection set to 8 bits with noise shaping,
+       a 24-bit file reaches the device as the loader converts it */
+    if (ok) {
+        ok = write_wav_file(filename, 0xFFFE, 1, 3, in24, frames);
+        loaded = ok ? SMDI_LoadWAVSampleAs(filename, 8, SMDI_CONVERT_NOISESHAPE) : NULL;
+
+        SMDIC_SetTargetBits(conn, 8);
+        SMDIC_SetConvertFlags(conn, SMDI_CONVERT_NOISESHAPE);
+        queue = SMDI_OpenJobQueue(conn, NULL, 0);
+        ok = loaded != NULL && queue != NULL &&
+             SMDI_QueueUploadFile(queue, config->dwMaxSampleNumber, filename, open_wav_for,
+                                  SMDI_PRIORITY_INTERACTIVE, 0) != 0;
+        if (ok) {
+            SMDI_WaitJobQueue(queue);
+            ok = SMDI_CollectJob(queue, &info) && info.dwState == SMDI_JOB_DONE;
+        }
+        SMDI_CloseJobQueue(queue);
+        SMDIC_SetTargetBits(conn, 0);
+        SMDIC_SetConvertFlags(conn, SMDI_CONVERT_DITHER);
+
+        memset(&sh, 0, sizeof(sh));
+        sh.dwStructSize = sizeof(sh);
+        stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+        ok = ok && loaded->bits_per_sample == 8 && loaded->data_size == frames * 2 &&
+             stored != NULL && size == frames * 2 &&
+             memcmp(stored, loaded->sample_data, size) == 0 &&
+             SMDIC_SampleHeaderRequest(conn, config->dwMaxSampleNumber, &sh) == SMDIM_SAMPLEHEADER &&
+             sh.BitsPerWord == 8;
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("WAV upload at 8 bits mismatch\n");
+        }
+    }
+
+    /* Uploaded from the mapped file, swapped packet by packet, and
+       received back into a new one */
+    if (ok) {
+        ok = SMDI_SaveWAVSample(sample, filename, 0);
+
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = config->dwMaxSampleNumber;
+        ft.lpSource = ok ? SMDI_OpenWAVSource(filename) : NULL;
+        ft.lpReturnValue = &result;
+        ft.lpConnection = conn;
+
+        start = bench_now();
+        ok = ft.lpSource != NULL && SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+        report("wav-up", 1, bench_now() - start, (double)bytes);
+
+        memset(&sh, 0, sizeof(sh));
+        sh.dwStructSize = sizeof(sh);
+        stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+        if (ok && (stored == NULL || size != bytes ||
+                   memcmp(stored, sample->sample_data, bytes) != 0 ||
+                   SMDIC_SampleHeaderRequest(conn, config->dwMaxSampleNumber, &sh) !=
+                   SMDIM_SAMPLEHEADER ||
+                   sh.dwLoopEnd != sample->loop_end || sh.wPitch != sample->root_note)) {
+            printf("WAV upload data mismatch\n");
+            ok = 0;
+        }
+    }
+
+    if (ok) {
+        memset(&ft, 0, sizeof(ft));
+        ft.dwStructSize = sizeof(ft);
+        ft.HA_ID = conn->HA_ID;
+        ft.SCSI_ID = conn->SCSI_ID;
+        ft.dwSampleNumber = config->dwMaxSampleNumber;
+        ft.lpSink = SMDI_OpenWAVSink(received, 1);
+        ft.lpReturnValue = &result;
+        ft.lpConnection = conn;
+
+        start = bench_now();
+        ok = ft.lpSink != NULL && SMDI_ReceiveFile(&ft) == SMDIM_ENDOFPROCEDURE;
+        report("wav-down", 1, bench_now() - start, (double)bytes);
+
+        loaded = ok ? SMDI_LoadWAVSample(received) : NULL;
+        ok = same_sample(loaded, sample);
+        if (loaded != NULL) {
+            SMDI_FreeSample(loaded);
+        }
+        if (!ok) {
+            printf("WAV download data mismatch\n");
+        }
+    }
+
+    remove(filename);
+    remove(received);
+    SMDI_FreeSample(sample);
+    free(in24);
+    free(infloat);
+    free(ref);
+
+    return ok;
+}
+
+/* Native sample file header as version 1 wrote it */
+typedef struct {
+    BYTE  signature[4];
+    DWORD version;
+    BYTE  bitsPerSample;
+    BYTE  channels;
+    BYTE  loopType;
+    BYTE  reserved;
+    DWORD sampleRate;
+    DWORD sampleCount;
+    DWORD loopStart;
+    DWORD loopEnd;
+    WORD  pitch;
+    WORD  pitchFraction;
+    DWORD nameLength;
+} v1_header_t;
+
+/* Write the pattern buffer as a version 1 native sample file */
+static int write_v1_file(const char *filename, unsigned char *data, DWORD bytes)
+{
+    FILE *file;
+    v1_header_t header;
+    int ok;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, "SDMP", 4);
+    header.version = 1;
+    header.bitsPerSample = 16;
+    header.channels = 1;
+    header.sampleRate = 44100;
+    header.sampleCount = bytes / 2;
+    header.pitch = 60;
+    header.nameLength = 8;
+
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+         fwrite("Bench v1", 1, 8, file) == 8 &&
+         fwrite(data, 1, bytes, file) == bytes;
+
+    return fclose(file) == 0 && ok;
+}
+
+/* Flip one byte of a file */
+static int corrupt_file(const char *filename, long offset)
+{
+    FILE *file;
+    int c;
+
+    file = fopen(filename, "r+b");
+    if (file == NULL) {
+        return 0;
+    }
+    fseek(file, offset, SEEK_SET);
+    c = fgetc(file);
+    fseek(file, offset, SEEK_SET);
+    fputc(c ^ 0x5A, file);
+
+    return fclose(file) == 0 && c != EOF;
+}
+
+/* Native sample files: the version 2 layout, loads from the mapped file,
+   version 1 files, and damaged headers and data turned away */
+static int bench_native(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleHeader sh;
+    SMDI_Sample *sample;
+    unsigned char *data;
+    unsigned char *file;
+    const unsigned char *stored;
+    char filename[64];
+    FILE *f;
+    DWORD bytes;
+    DWORD size;
+    DWORD i;
+    double start;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+
+    data = (unsigned char*)malloc(bytes);
+    file = (unsigned char*)malloc(SAMPLE_DATA_ALIGN + bytes + 1);
+    if (data == NULL || file == NULL) {
+        free(data);
+        free(file);
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    for (i = 0; i < bytes; i++) {
+        data[i] = (unsigned char)((i * 13 + (i >> 9)) & 0xFF);
+    }
+
+    sprintf(filename, "/tmp/smdi_bench_%lu.sdmp", (unsigned long)getpid());
+    ok = write_sample_file(filename, data, bytes);
+
+    /* Big-endian version 2 header, data on the first page boundary */
+    size = 0;
+    f = ok ? fopen(filename, "rb") : NULL;
+    if (f != NULL) {
+        size = (DWORD)fread(file, 1, SAMPLE_DATA_ALIGN + bytes + 1, f);
+        fclose(f);
+    }
+    memset(&sh, 0, sizeof(sh));
+    sh.dwStructSize = sizeof(sh);
+    if (size != SAMPLE_DATA_ALIGN + bytes || memcmp(file, "SDMP\0\0\0\2", 8) != 0 ||
+        memcmp(file + SAMPLE_DATA_ALIGN, data, bytes) != 0 ||
+        SMDI_GetFileSampleHeader(filename, &sh) != SF_NATIVE ||
+        sh.dwDataOffset != SAMPLE_DATA_ALIGN || sh.dwLength != bytes / 2 ||
+        strcmp(sh.cName, "Bench file") != 0) {
+        printf("Native file layout wrong\n");
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        ok = check_sample_file(filename, data, bytes);
+    }
+    report("load-native", params->iterations, bench_now() - start,
+           (double)bytes * (double)params->iterations);
+    if (!ok) {
+        printf("Native file load data mismatch\n");
+    }
+
+    /* Damaged data fails the load and the upload; a damaged header is
+       not taken for a sample file */
+    if (ok && (!corrupt_file(filename, SAMPLE_DATA_ALIGN + bytes / 2) ||
+               SMDI_LoadSample(filename) != NULL ||
+               upload_file(conn, config->dwMaxSampleNumber, filename) ||
+               !corrupt_file(filename, 40) ||
+               SMDI_GetFileSampleHeader(filename, &sh) != FE_UNKNOWNFORMAT)) {
+        printf("Damaged native file accepted\n");
+        ok = 0;
+    }
+    SMDIC_DeleteSample(conn, config->dwMaxSampleNumber);
+
+    /* Version 1 files are still read and uploaded */
+    if (ok && !write_v1_file(filename, data, bytes)) {
+        printf("Cannot write %s\n", filename);
+        ok = 0;
+    }
+    sample = ok ? SMDI_LoadSample(filename) : NULL;
+    if (ok && (sample == NULL || sample->data_size != bytes ||
+               memcmp(sample->sample_data, data, bytes) != 0 ||
+               strcmp(sample->name, "Bench v1") != 0 ||
+               !upload_file(conn, config->dwMaxSampleNumber, filename))) {
+        printf("Version 1 native file not read\n");
+        ok = 0;
+    }
+    SMDI_FreeSample(sample);
+
+    stored = (const unsigned char*)SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+    if (ok && (stored == NULL || size != bytes || memcmp(stored, data, bytes) != 0)) {
+        printf("Version 1 file upload data mismatch\n");
+        ok = 0;
+    }
+
+    remove(filename);
+    free(data);
+    free(file);
+
+    return ok;
+}
+
+/* Native files pre-flighted by the lazy loading bench */
+#define PREFLIGHT_FILES 16
+
+/* Upload a sample file handle; its file is opened at the first packet */
+static int upload_sample_file(SMDI_Connection *conn, DWORD number, SMDI_SampleSource *src)
+{
+    SMDI_FileTransfer ft;
+    DWORD result;
+
+    memset(&ft, 0, sizeof(ft));
+    ft.dwStructSize = sizeof(ft);
+    ft.HA_ID = conn->HA_ID;
+    ft.SCSI_ID = conn->SCSI_ID;
+    ft.dwSampleNumber = number;
+    ft.lpSource = src;
+    ft.lpReturnValue = &result;
+    ft.lpConnection = conn;
+
+    return src != NULL && SMDI_SendFile(&ft) == SMDIM_ENDOFPROCEDURE;
+}
+
+/* Whether the scratch slot holds the data of a sample */
+static int stored_equal(SMDI_EmuConfig *config, SMDI_Sample *sample)
+{
+    const void *stored;
+    DWORD size;
+
+    stored = SMDI_EmuGetSampleData(config->dwMaxSampleNumber, &size);
+
+    return stored != NULL && size == sample->data_size &&
+           memcmp(stored, sample->sample_data, size) == 0;
+}
+
+/* Sample file handles: native, AIF and WAV headers read without their
+   data, uploads that open the file at the first packet, and a file
+   changed after it was opened */
+static int bench_preflight(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_SampleFile *files[PREFLIGHT_FILES];
+    SMDI_SampleFile *aif;
+    SMDI_SampleFile *wav;
+    SMDI_SampleSource *src;
+    SMDI_Sample *sample;
+    SMDI_Sample *loaded;
+    char filename[PREFLIGHT_FILES][64];
+    char aifname[64];
+    char wavname[64];
+    DWORD bytes;
+    DWORD total;
+    DWORD i;
+    double start;
+    int ok;
+
+    bytes = params->sample_kb * 1024;
+
+    sample = SMDI_CreateSample(44100, 16, 1, bytes / 2);
+    if (sample == NULL) {
+        printf("Out of memory\n");
+        return 0;
+    }
+    for (i = 0; i < bytes / 2; i++) {
+        sample->sample_data[i] = (short)(i * 11 + (i >> 7));
+    }
+    strcpy(sample->name, "Bench preflight");
+
+    ok = 1;
+    for (i = 0; i < PREFLIGHT_FILES; i++) {
+        sprintf(filename[i], "/tmp/smdi_bench_%lu_%lu.sdmp", (unsigned long)getpid(), i);
+        files[i] = NULL;
+        ok = ok && SMDI_SaveSample(sample, filename[i]);
+    }
+    sprintf(aifname, "/tmp/smdi_bench_%lu_pre.aif", (unsigned long)getpid());
+    sprintf(wavname, "/tmp/smdi_bench_%lu_pre.wav", (unsigned long)getpid());
+    ok = ok && SMDI_SaveAIFSample(sample, aifname, 0) && SMDI_SaveWAVSample(sample, wavname, 0);
+    if (!ok) {
+        printf("Cannot write the pre-flight files\n");
+    }
+
+    /* Headers only, against loading every file */
+    total = 0;
+    start = bench_now();
+    for (i = 0; i < PREFLIGHT_FILES && ok; i++) {
+        files[i] = SMDI_OpenSampleFile(filename[i]);
+        ok = files[i] != NULL && files[i]->Info.sample_data == NULL &&
+             files[i]->Info.sample_count == bytes / 2 &&
+             strcmp(files[i]->Info.name, "Bench preflight") == 0;
+        total += ok ? files[i]->Info.data_size : 0;
+    }
+    report("preflight", PREFLIGHT_FILES, bench_now() - start, 0.0);
+    if (ok && total != PREFLIGHT_FILES * bytes) {
+        printf("Pre-flight total %lu bytes, %lu expected\n", total, PREFLIGHT_FILES * bytes);
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < PREFLIGHT_FILES && ok; i++) {
+        loaded = SMDI_LoadSampleFile(files[i]);
+        ok = loaded != NULL && loaded->data_size == bytes;
+        SMDI_FreeSample(loaded);
+    }
+    report("preflight-load", PREFLIGHT_FILES, bench_now() - start,
+           (double)bytes * (double)PREFLIGHT_FILES);
+    if (!ok) {
+        printf("Pre-flight handle not read\n");
+    }
+
+    aif = ok ? SMDI_OpenAIFSampleFile(aifname) : NULL;
+    wav = ok ? SMDI_OpenWAVSampleFile(wavname) : NULL;
+    if (ok && (aif == NULL || wav == NULL || aif->Info.data_size != bytes ||
+               wav->Info.data_size != bytes || aif->Info.sample_count != bytes / 2 ||
+               wav->Info.sample_count != bytes / 2)) {
+        printf("AIF or WAV pre-flight header wrong\n");
+        ok = 0;
+    }
+
+    /* A handle can be released once its upload is set up */
+    if (ok) {
+        src = SMDI_OpenSampleFileSource(files[0]);
+        SMDI_CloseSampleFile(files[0]);
+        files[0] = NULL;
+        ok = upload_sample_file(conn, config->dwMaxSampleNumber, src) &&
+             stored_equal(config, sample) &&
+             upload_sample_file(conn, config->dwMaxSampleNumber, SMDI_OpenSampleFileSource(aif)) &&
+             stored_equal(config, sample) &&
+             upload_sample_file(conn, config->dwMaxSampleNumber, SMDI_OpenSampleFileSource(wav)) &&
+             stored_equal(config, sample);
+        if (!ok) {
+            printf("Pre-flight upload data mismatch\n");
+        }
+    }
+
+    /* The file is opened at the first packet, so a change made before
+       it is turned away then */
+    if (ok) {
+        src = SMDI_OpenSampleFileSource(files[1]);
+        sample->sample_count /= 2;
+        sample->data_size /= 2;
+        if (src == NULL || !SMDI_SaveSample(sample, filename[1]) ||
+            upload_sample_file(conn, config->dwMaxSampleNumber, src) ||
+            SMDI_LoadSampleFile(files[1]) != NULL) {
+            printf("Changed pre-flight file accepted\n");
+            ok = 0;
+        }
+        sample->sample_count *= 2;
+        sample->data_size *= 2;
+    }
+    SMDIC_DeleteSample(conn, config->dwMaxSampleNumber);
+
+    for (i = 0; i < PREFLIGHT_FILES; i++) {
+        SMDI_CloseSampleFile(files[i]);
+        remove(filename[i]);
+    }
+    SMDI_CloseSampleFile(aif);
+    SMDI_CloseSampleFile(wav);
+    remove(aifname);
+    remove(wavname);
+    SMDI_FreeSample(sample);
+
+    return ok;
+}
+
+/* Samples of the bank bench, on every other slot below the scratch slot */
+#define BANK_SAMPLES 6
+
+/* Fill the data of a bank bench sample from its seed */
+static void bank_pattern(unsigned char *data, DWORD bytes, DWORD seed)
+{
+    DWORD i;
+
+    for (i = 0; i < bytes; i++) {
+        data[i] = (unsigned char)((i * 7 + seed * 31 + (i >> 8)) & 0xFF);
+    }
+}
+
+/* Store a bank bench sample in the sampler */
+static void store_bank_sample(DWORD number, unsigned char *data, DWORD bytes, DWORD seed,
+                              const char *name)
+{
+    SMDI_SampleHeader sh;
+
+    bank_pattern(data, bytes, seed);
+    make_header(&sh, bytes, name);
+    SMDI_EmuStoreSample(number, &sh, data);
+}
+
+/* Compare the counts of a backup or restore */
+static int bank_counts(const char *name, DWORD result, SMDI_BankStats *stats,
+                       DWORD copied, DWORD unchanged, DWORD removed)
+{
+    if (result != SMDIM_ENDOFPROCEDURE || stats->dwFailed != 0 || stats->dwCopied != copied ||
+        stats->dwUnchanged != unchanged || stats->dwRemoved != removed) {
+        printf("%s: result %08lx, %lu copied, %lu unchanged, %lu removed, %lu failed\n",
+               name, result, stats->dwCopied, stats->dwUnchanged, stats->dwRemoved,
+               stats->dwFailed);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Compare the bank bench samples from index from on with the data of
+   their seeds, in a bank or, without one, in the sampler */
+static int check_bank_samples(SMDI_Bank *bank, unsigned char *data, DWORD bytes, DWORD first,
+                              const DWORD *seeds, DWORD from)
+{
+    SMDI_Sample *sample;
+    const void *stored;
+    DWORD size;
+    DWORD i;
+    int ok;
+
+    ok = 1;
+    for (i = from; i < BANK_SAMPLES && ok; i++) {
+        bank_pattern(data, bytes, seeds[i]);
+
+        if (bank != NULL) {
+            sample = SMDI_LoadBankSample(bank, first + i * 2);
+            ok = sample != NULL && sample->data_size == bytes &&
+                 memcmp(sample->sample_data, data, bytes) == 0;
+            SMDI_FreeSample(sample);
+        } else {
+            stored = SMDI_EmuGetSampleData(first + i * 2, &size);
+            ok = stored != NULL && size == bytes && memcmp(stored, data, bytes) == 0;
+        }
+    }
+
+    return ok;
+}
+
+/* Size of a file, -1 if it cannot be opened */
+static long file_size(const char *filename)
+{
+    FILE *file;
+    long size;
+
+    file = fopen(filename, "rb");
+    if (file == NULL) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fclose(file);
+
+    return size;
+}
+
+/* Bank files: backups that copy only changed samples, restores, mirrors,
+   random access, and banks read back after an interrupted append, a
+   compaction and a damaged TOC */
+static int bench_bank(SMDI_Connection *conn, SMDI_EmuConfig *config, bench_params_t *params)
+{
+    SMDI_BankStats stats;
+    SMDI_Bank *bank;
+    SMDI_Sample *sample;
+    unsigned char *data;
+    char filename[64];
+    DWORD seeds[BANK_SAMPLES];
+    DWORD bytes;
+    DWORD first;
+    DWORD last;
+    DWORD result;
+    DWORD i;
+    long size;
+    double start;
+    FILE *file;
+    int ok;
+
+    bytes = params->sample_kb * 1024 / 4;
+    first = config->dwMaxSampleNumber - 1 - BANK_SAMPLES * 2;
+    last = config->dwMaxSampleNumber - 1;
+
+    data = (unsigned char*)malloc(bytes);
+    if (data == NULL) {
+        printf("Out of memory\n");
+        return 0;
+    }
+
+    for (i = first; i <= last; i++) {
+        SMDIC_DeleteSample(conn, i);
+    }
+    for (i = 0; i < BANK_SAMPLES; i++) {
+        seeds[i] = i;
+        store_bank_sample(first + i * 2, data, bytes, seeds[i], "Bench bank");
+    }
+
+    sprintf(filename, "/tmp/smdi_bench_%lu.bank", (unsigned long)getpid());
+    remove(filename);
+
+    /* A new bank takes every sample, a second backup none */
+    memset(&stats, 0, sizeof(stats));
+    bank = SMDI_OpenBank(filename, TRUE);
+    ok = bank != NULL;
+    if (!ok) {
+        printf("Cannot create %s\n", filename);
+    }
+
+    start = bench_now();
+    result = ok ? SMDIC_BackupBank(conn, bank, first, last, 0, &stats) : SMDIM_ERROR;
+    report("bank-backup", BANK_SAMPLES, bench_now() - start, (double)stats.dwBytes);
+    ok = ok && bank_counts("Bank backup", result, &stats, BANK_SAMPLES, 0, 0);
+
+    if (ok) {
+        result = SMDIC_BackupBank(conn, bank, first, last, 0, &stats);
+        ok = bank_counts("Bank resync", result, &stats, 0, BANK_SAMPLES, 0);
+    }
+
+    /* A changed sample is copied again */
+    if (ok) {
+        seeds[2] = 100;
+        store_bank_sample(first + 4, data, bytes, seeds[2], "Bench changed");
+        result = SMDIC_BackupBank(conn, bank, first, last, 0, &stats);
+        ok = bank_counts("Bank changed", result, &stats, 1, BANK_SAMPLES - 1, 0);
+    }
+
+    /* Samples copied although unchanged are not stored twice */
+    size = file_size(filename);
+    if (ok) {
+        result = SMDIC_BackupBank(conn, bank, first, last, SMDI_BANK_ALL, &stats);
+        ok = bank_counts("Bank full backup", result, &stats, BANK_SAMPLES, 0, 0);
+        if (ok && file_size(filename) != size) {
+            printf("Bank grew by %ld bytes on unchanged samples\n", file_size(filename) - size);
+            ok = 0;
+        }
+    }
+    SMDI_CloseBank(bank);
+
+    /* An append cut short leaves the last commit readable */
+    file = ok ? fopen(filename, "ab") : NULL;
+    if (file != NULL) {
+        fwrite(data, 1, bytes / 2, file);
+        fclose(file);
+    }
+
+    bank = ok ? SMDI_OpenBank(filename, FALSE) : NULL;
+    if (ok && (bank == NULL || bank->dwEntries != BANK_SAMPLES)) {
+        printf("Bank read back wrong\n");
+        ok = 0;
+    }
+
+    start = bench_now();
+    for (i = 0; i < params->iterations && ok; i++) {
+        ok = check_bank_samples(bank, data, bytes, first, seeds, 0);
+    }
+    report("bank-load", params->iterations * BANK_SAMPLES, bench_now() - start,
+           (double)bytes * (double)params->iterations * BANK_SAMPLES);
+    if (!ok) {
+        printf("Bank load data mismatch\n");
+    }
+
+    /* Restore into an emptied range, then nothing to restore */
+    for (i = first; i <= last && ok; i++) {
+        SMDIC_DeleteSample(conn, i);
+    }
+    memset(&stats, 0, sizeof(stats));
+    start = bench_now();
+    result = ok ? SMDIC_RestoreBank(conn, bank, first, last, 0, &stats) : SMDIM_ERROR;
+    report("bank-restore", BANK_SAMPLES, bench_now() - start, (double)stats.dwBytes);
+    ok = ok && bank_counts("Bank restore", result, &stats, BANK_SAMPLES, 0, 0);
+    if (ok && !check_bank_samples(NULL, data, bytes, first, seeds, 0)) {
+        printf("Bank restore data mismatch\n");
+        ok = 0;
+    }
+    if (ok) {
+        result = SMDIC_RestoreBank(conn, bank, first, last, 0, &stats);
+        ok = bank_counts("Bank restore again", result, &stats, 0, BANK_SAMPLES, 0);
+    }
+
+    /* Mirroring removes what the other side does not hold */
+    if (ok) {
+        store_bank_sample(first + 1, data, bytes, 200, "Bench extra");
+        result = SMDIC_RestoreBank(conn, bank, first, last, SMDI_BANK_MIRROR, &stats);
+        ok = bank_counts("Bank mirror restore", result, &stats, 0, BANK_SAMPLES, 1) &&
+             SMDI_EmuGetSampleData(first + 1, &i) == NULL;
+    }
+    if (ok) {
+        SMDIC_DeleteSample(conn, first);
+        result = SMDIC_BackupBank(conn, bank, first, last, SMDI_BANK_MIRROR, &stats);
+        ok = bank_counts("Bank mirror backup", result, &stats, 0, BANK_SAMPLES - 1, 1) &&
+             SMDI_BankLookup(bank, first) == NULL;
+    }
+
+    /* Compaction keeps only the images in use */
+    size = file_size(filename);
+    if (ok && (!SMDI_CompactBank(bank) || file_size(filename) >= size)) {
+        printf("Bank not compacted\n");
+        ok = 0;
+    }
+    SMDI_CloseBank(bank);
+
+    bank = ok ? SMDI_OpenBank(filename, FALSE) : NULL;
+    sample = bank != NULL ? SMDI_LoadBankSample(bank, first) : NULL;
+    if (ok && (bank == NULL || bank->dwEntries != BANK_SAMPLES - 1 || sample != NULL ||
+               !check_bank_samples(bank, data, bytes, first, seeds, 1))) {
+        printf("Compacted bank read back wrong\n");
+        ok = 0;
+    }
+    SMDI_FreeSample(sample);
+    SMDI_CloseBank(bank);
+
+    /* A damaged TOC is not taken for a bank */
+    bank = NULL;
+    if (ok && (!corrupt_file(filename, file_size(filename) - 8) ||
+               (bank = SMDI_OpenBank(filename, FALSE)) != NULL)) {
+        printf("Damaged bank accepted\n");
+        ok = 0;
+    }
+    SMDI_CloseBank(bank);
+
+    for (i = first; i <= last; i++) {
+        SMDIC_DeleteSample(conn, i);
+    }
+    remove(filename);
+    free(data);
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    SMDI_EmuConfig config;
+    SMDI_EmuStats stats;
+    ASPI_HandleStats handles;
+    SMDI_Connection *conn;
+    bench_params_t params;
+    int argi;
+    int ok;
+
+    SMDI_EmuGetDefaultConfig(&config);
+    params.sample_kb = 1024;
+    params.iterations = 8;
+    params.headers = 64;
+    params.seeded = 16;
+    params.occupied = 200;
+    params.read_latency = 0;
+    params.calibrate = 0;
+
+    for (argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "-d") == 0) {
+            SMDI_SetDebugMode(1);
+            continue;
+        }
+
+        if (strcmp(argv[argi], "-c") == 0) {
+            params.calibrate = 1;
+            continue;
+        }
+
+        if (argv[argi][0] != '-' || argi + 1 >= argc) {
+            usage(argv[0]);
+            return 2;
+        }
+
+        switch (argv[argi][1]) {
+            case 's': params.sample_kb = strtoul(argv[++argi], NULL, 10); break;
+            case 'n': params.iterations = strtoul(argv[++argi], NULL, 10); break;
+            case 'h': params.headers = strtoul(argv[++argi], NULL, 10); break;
+            case 'o': params.occupied = strtoul(argv[++argi], NULL, 10); break;
+            case 'p': config.dwPacketSize = strtoul(argv[++argi], NULL, 10); break;
+            case 'm': config.dwMaxTransfer = strtoul(argv[++argi], NULL, 10); break;
+            case 'l': config.dwLatency = strtoul(argv[++argi], NULL, 10); break;
+            case 'r': config.dwBusRate = strtoul(argv[++argi], NULL, 10) * 1024; break;
+            case 'f': params.read_latency = strtoul(argv[++argi], NULL, 10); break;
+            case 'w': config.dwWaitEvery = strtoul(argv[++argi], NULL, 10);
+                      config.dwWaitTime = 2000; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (params.sample_kb == 0 || params.sample_kb * 1024 > config.dwMemorySize) {
+        fprintf(stderr, "Sample size must be between 1 and %lu KB\n",
+                config.dwMemorySize / 1024);
+        return 2;
+    }
+
+    SMDI_EmuConfigure(&config);
+
+    conn = SMDI_Init() ? SMDI_OpenConnection(config.HA_ID, config.SCSI_ID) : NULL;
+    if (conn == NULL) {
+        fprintf(stderr, "Emulated sampler not available\n");
+        return 1;
+    }
+
+    printf("SMDI benchmark: %lu KB samples, packet %lu, latency %lu us, bus %s\n",
+           params.sample_kb, config.dwPacketSize, config.dwLatency,
+           config.dwBusRate ? "limited" : "unlimited");
+    printf("  requested packet size %lu\n", SMDIC_GetMaxPacketSize(conn));
+
+    ok = bench_identify(conn, 1000) &&
+         bench_headers(conn, &params) &&
+         bench_discover(conn, &config, &params) &&
+         bench_catalog(conn, &config, &params) &&
+         (!params.calibrate || bench_calibrate(conn, &config)) &&
+         bench_transfer(conn, &config, &params) &&
+         bench_async(conn, &config, &params) &&
+         bench_jobs(conn, &config, &params) &&
+         bench_rack(conn, &config, &params) &&
+         bench_swap(&params) &&
+         bench_convert(conn, &config, &params) &&
+         bench_resample(conn, &config, &params) &&
+         bench_aif(conn, &config, &params) &&
+         bench_wav(conn, &config, &params) &&
+         bench_native(conn, &config, &params) &&
+         bench_preflight(conn, &config, &params) &&
+         bench_bank(conn, &config, &params);
+
+    SMDI_CloseConnection(conn);
+
+    SMDI_EmuGetStats(&stats);
+    ASPI_GetHandleStats(&handles);
+
+    printf("Sampler: %lu commands, %lu reads (%lu empty), %lu waits, %lu rejects\n",
+           stats.dwCommands, stats.dwReads, stats.dwEmptyReads,
+           stats.dwWaits, stats.dwRejects);
+    printf("Handles: %lu opens, %lu reuses, %lu closes\n",
+           handles.opens, handles.reuses, handles.closes);
+
+    return ok ? 0 : 1;
+}
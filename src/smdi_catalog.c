@@ -0,0 +1,768 @@
+/*
+ * SMDI sample header catalog for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * The catalog file holds the sample headers of every device seen, one
+ * section per device (inquiry vendor/product plus HA:ID):
+ *
+ *   file header     "SMCT", version, device count, reserved    16 bytes
+ *   device section  vendor[8], product[16], HA, ID, reserved,
+ *                   highest sample number, entries, section size 40 bytes
+ *   entry           sample number, fingerprint, bits, channels,
+ *                   loop control, name length, period, length,
+ *                   loop start, loop end, pitch, pitch fraction  32 bytes
+ *                   followed by the name, padded to 4 bytes
+ *
+ * All fields are big-endian. The file is mapped to read it and rewritten
+ * through a temporary file to save one device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "smdi.h"
+#include "smdi_catalog.h"
+
+#define MAXFNLEN   1024  /* Maximum file name length for IRIX */
+
+/* Record sizes */
+#define CATALOG_FILE_HEADER      16
+#define CATALOG_DEVICE_HEADER    40
+#define CATALOG_ENTRY_HEADER     32
+#define CATALOG_ENTRY_MAX        (CATALOG_ENTRY_HEADER + 256)
+
+/* Revalidation state passed through the discovery callback */
+typedef struct {
+    SMDI_Catalog* cat;
+    SMDI_CatalogCallback callback;
+    DWORD dwUserData;
+} catalog_scan_t;
+
+/* A mapped catalog file */
+typedef struct {
+    int fd;
+    unsigned char* data;
+    unsigned long size;
+} catalog_map_t;
+
+static char catalog_file[MAXFNLEN] = "";
+
+/* Big-endian field access */
+static DWORD catalog_get32(const unsigned char* p) {
+    return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+}
+
+static WORD catalog_get16(const unsigned char* p) {
+    return (WORD)(((WORD)p[0] << 8) | (WORD)p[1]);
+}
+
+static void catalog_put32(unsigned char* p, DWORD v) {
+    p[0] = (unsigned char)((v >> 24) & 0xFF);
+    p[1] = (unsigned char)((v >> 16) & 0xFF);
+    p[2] = (unsigned char)((v >> 8) & 0xFF);
+    p[3] = (unsigned char)(v & 0xFF);
+}
+
+static void catalog_put16(unsigned char* p, WORD v) {
+    p[0] = (unsigned char)((v >> 8) & 0xFF);
+    p[1] = (unsigned char)(v & 0xFF);
+}
+
+/* Copy an inquiry string, dropping the space padding */
+static void catalog_copy_name(char* dest, const char* src, int size) {
+    int length;
+    
+    length = 0;
+    while (length < size - 1 && src[length] != '\0') {
+        dest[length] = src[length];
+        length++;
+    }
+    
+    while (length > 0 && dest[length - 1] == ' ') {
+        length--;
+    }
+    
+    dest[length] = '\0';
+}
+
+/* Encode the header fields of an entry into record; returns the record
+   size. The fingerprint field is left for the caller. */
+static DWORD catalog_encode(unsigned char* record, DWORD sample_number, SMDI_SampleHeader* sh) {
+    DWORD nameLength;
+    DWORD size;
+    
+    nameLength = strlen(sh->cName);
+    if (nameLength > 255) {
+        nameLength = 255;
+    }
+    
+    size = (CATALOG_ENTRY_HEADER + nameLength + 3) & ~(DWORD)3;
+    memset(record, 0, size);
+    
+    catalog_put32(&record[0], sample_number);
+    record[8] = sh->BitsPerWord;
+    record[9] = sh->NumberOfChannels;
+    record[10] = sh->LoopControl;
+    record[11] = (unsigned char)nameLength;
+    catalog_put32(&record[12], sh->dwPeriod);
+    catalog_put32(&record[16], sh->dwLength);
+    catalog_put32(&record[20], sh->dwLoopStart);
+    catalog_put32(&record[24], sh->dwLoopEnd);
+    catalog_put16(&record[28], sh->wPitch);
+    catalog_put16(&record[30], sh->wPitchFraction);
+    memcpy(&record[CATALOG_ENTRY_HEADER], sh->cName, nameLength);
+    
+    return size;
+}
+
+/* FNV-1a hash of the header fields of an encoded entry */
+static DWORD catalog_hash(const unsigned char* record) {
+    DWORD hash;
+    DWORD length;
+    DWORD i;
+    
+    length = CATALOG_ENTRY_HEADER + (DWORD)record[11];
+    
+    hash = 2166136261UL;
+    for (i = 8; i < length; i++) {
+        hash ^= (DWORD)record[i];
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    
+    return hash;
+}
+
+/* Fingerprint of a sample header */
+static DWORD catalog_fingerprint(SMDI_SampleHeader* sh) {
+    unsigned char record[CATALOG_ENTRY_MAX];
+    
+    catalog_encode(record, 0, sh);
+    
+    return catalog_hash(record);
+}
+
+/* Decode one entry record; returns the record size, 0 if it does not
+   fit in the bytes left */
+static DWORD catalog_decode(const unsigned char* record, unsigned long left, SMDI_CatalogEntry* entry) {
+    DWORD size;
+    DWORD nameLength;
+    
+    if (left < CATALOG_ENTRY_HEADER) {
+        return 0;
+    }
+    
+    nameLength = record[11];
+    size = (CATALOG_ENTRY_HEADER + nameLength + 3) & ~(DWORD)3;
+    if (size > left) {
+        return 0;
+    }
+    
+    memset(entry, 0, sizeof(SMDI_CatalogEntry));
+    entry->dwSampleNumber = catalog_get32(&record[0]);
+    entry->dwFingerprint = catalog_get32(&record[4]);
+    entry->bValid = FALSE;
+    entry->Header.dwStructSize = sizeof(SMDI_SampleHeader);
+    entry->Header.bDoesExist = TRUE;
+    entry->Header.BitsPerWord = record[8];
+    entry->Header.NumberOfChannels = record[9];
+    entry->Header.LoopControl = record[10];
+    entry->Header.NameLength = (BYTE)nameLength;
+    entry->Header.dwPeriod = catalog_get32(&record[12]);
+    entry->Header.dwLength = catalog_get32(&record[16]);
+    entry->Header.dwLoopStart = catalog_get32(&record[20]);
+    entry->Header.dwLoopEnd = catalog_get32(&record[24]);
+    entry->Header.wPitch = catalog_get16(&record[28]);
+    entry->Header.wPitchFraction = catalog_get16(&record[30]);
+    memcpy(entry->Header.cName, &record[CATALOG_ENTRY_HEADER], nameLength);
+    
+    return size;
+}
+
+/* Map the catalog file; FALSE if there is none or it is not a catalog */
+static BOOL catalog_map(catalog_map_t* map) {
+    struct stat st;
+    void* data;
+    
+    map->fd = -1;
+    map->data = NULL;
+    map->size = 0;
+    
+    if (catalog_file[0] == '\0') {
+        return FALSE;
+    }
+    
+    map->fd = open(catalog_file, O_RDONLY);
+    if (map->fd < 0) {
+        return FALSE;
+    }
+    
+    if (fstat(map->fd, &st) != 0 || st.st_size < CATALOG_FILE_HEADER) {
+        close(map->fd);
+        map->fd = -1;
+        return FALSE;
+    }
+    
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, map->fd, 0);
+    if (data == MAP_FAILED) {
+        close(map->fd);
+        map->fd = -1;
+        return FALSE;
+    }
+    
+    map->data = (unsigned char*)data;
+    map->size = (unsigned long)st.st_size;
+    
+    if (memcmp(map->data, CATALOG_FILE_SIGNATURE, 4) != 0 ||
+        catalog_get32(&map->data[4]) != CATALOG_FILE_VERSION) {
+        munmap((void*)map->data, (size_t)map->size);
+        close(map->fd);
+        map->fd = -1;
+        map->data = NULL;
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+/* Release a mapped catalog file */
+static void catalog_unmap(catalog_map_t* map) {
+    if (map->data != NULL) {
+        munmap((void*)map->data, (size_t)map->size);
+    }
+    if (map->fd >= 0) {
+        close(map->fd);
+    }
+    
+    map->fd = -1;
+    map->data = NULL;
+    map->size = 0;
+}
+
+/* Check whether a device section belongs to a catalog's device */
+static BOOL catalog_section_matches(const unsigned char* section, SMDI_Catalog* cat) {
+    char vendor[9];
+    char product[17];
+    
+    memcpy(vendor, &section[0], 8);
+    vendor[8] = '\0';
+    memcpy(product, &section[8], 16);
+    product[16] = '\0';
+    
+    return section[24] == cat->HA_ID && section[25] == cat->SCSI_ID &&
+           strcmp(vendor, cat->cVendor) == 0 && strcmp(product, cat->cProduct) == 0;
+}
+
+/* Size of the device section at offset, 0 if it is damaged */
+static unsigned long catalog_section_size(catalog_map_t* map, unsigned long offset) {
+    unsigned long size;
+    
+    if (map->size - offset < CATALOG_DEVICE_HEADER) {
+        return 0;
+    }
+    
+    size = catalog_get32(&map->data[offset + 36]);
+    if (size < CATALOG_DEVICE_HEADER || size > map->size - offset) {
+        return 0;
+    }
+    
+    return size;
+}
+
+/* Set the catalog file; NULL disables persistence */
+BOOL SMDI_SetCatalogFile(const char* filename) {
+    catalog_file[0] = '\0';
+    
+    if (filename == NULL) {
+        return TRUE;
+    }
+    
+    if (strlen(filename) >= MAXFNLEN) {
+        return FALSE;
+    }
+    
+    strcpy(catalog_file, filename);
+    
+    return TRUE;
+}
+
+/* Make room for one more entry */
+static BOOL catalog_grow(SMDI_Catalog* cat) {
+    SMDI_CatalogEntry* grown;
+    
+    if (cat->dwEntries < cat->dwEntryAlloc) {
+        return TRUE;
+    }
+    
+    grown = (SMDI_CatalogEntry*)realloc(cat->lpEntries,
+                                        (cat->dwEntryAlloc + 64) * sizeof(SMDI_CatalogEntry));
+    if (grown == NULL) {
+        return FALSE;
+    }
+    
+    cat->lpEntries = grown;
+    cat->dwEntryAlloc += 64;
+    
+    return TRUE;
+}
+
+/* Read this device's section of the catalog file */
+static void catalog_load(SMDI_Catalog* cat) {
+    catalog_map_t map;
+    unsigned long offset;
+    unsigned long size;
+    unsigned long end;
+    DWORD record;
+    DWORD devices;
+    DWORD entries;
+    DWORD d;
+    DWORD i;
+    
+    if (!catalog_map(&map)) {
+        return;
+    }
+    
+    devices = catalog_get32(&map.data[8]);
+    offset = CATALOG_FILE_HEADER;
+    
+    for (d = 0; d < devices; d++) {
+        size = catalog_section_size(&map, offset);
+        if (size == 0) {
+            break;
+        }
+    
+        if (catalog_section_matches(&map.data[offset], cat)) {
+            cat->dwMaxSample = catalog_get32(&map.data[offset + 28]);
+            entries = catalog_get32(&map.data[offset + 32]);
+            end = offset + size;
+            offset += CATALOG_DEVICE_HEADER;
+    
+            /* Entries are stored in ascending order */
+            for (i = 0; i < entries && catalog_grow(cat); i++) {
+                record = catalog_decode(&map.data[offset], end - offset,
+                                        &cat->lpEntries[cat->dwEntries]);
+                if (record == 0) {
+                    break;
+                }
+                offset += record;
+                cat->dwEntries++;
+            }
+            break;
+        }
+    
+        offset += size;
+    }
+    
+    catalog_unmap(&map);
+}
+
+/* Open the catalog of the device on a connection */
+SMDI_Catalog* SMDIC_OpenCatalog(SMDI_Connection* conn) {
+    SMDI_Catalog* cat;
+    SCSI_DevInfo info;
+    
+    if (conn == NULL) {
+        return NULL;
+    }
+    
+    cat = (SMDI_Catalog*)malloc(sizeof(SMDI_Catalog));
+    if (cat == NULL) {
+        return NULL;
+    }
+    
+    memset(cat, 0, sizeof(SMDI_Catalog));
+    cat->dwStructSize = sizeof(SMDI_Catalog);
+    cat->HA_ID = conn->HA_ID;
+    cat->SCSI_ID = conn->SCSI_ID;
+    cat->dwMaxSample = SMDI_RANGE_UNKNOWN;
+    
+    /* The device is identified by its inquiry data and address */
+    memset(&info, 0, sizeof(info));
+    info.dwStructSize = sizeof(info);
+    SMDIC_GetDeviceInfo(conn, &info);
+    catalog_copy_name(cat->cVendor, info.cManufacturer, 9);
+    catalog_copy_name(cat->cProduct, info.cName, 17);
+    
+    catalog_load(cat);
+    
+    return cat;
+}
+
+/* Free a catalog without saving it */
+void SMDI_CloseCatalog(SMDI_Catalog* cat) {
+    if (cat == NULL) {
+        return;
+    }
+    
+    free(cat->lpEntries);
+    free(cat);
+}
+
+/* Write this device's section */
+static BOOL catalog_write_section(FILE* hFile, SMDI_Catalog* cat) {
+    unsigned char header[CATALOG_DEVICE_HEADER];
+    unsigned char record[CATALOG_ENTRY_MAX];
+    DWORD size;
+    DWORD i;
+    
+    size = CATALOG_DEVICE_HEADER;
+    for (i = 0; i < cat->dwEntries; i++) {
+        size += catalog_encode(record, 0, &cat->lpEntries[i].Header);
+    }
+    
+    memset(header, 0, sizeof(header));
+    memcpy(&header[0], cat->cVendor, strlen(cat->cVendor));
+    memcpy(&header[8], cat->cProduct, strlen(cat->cProduct));
+    header[24] = cat->HA_ID;
+    header[25] = cat->SCSI_ID;
+    catalog_put32(&header[28], cat->dwMaxSample);
+    catalog_put32(&header[32], cat->dwEntries);
+    catalog_put32(&header[36], size);
+    
+    if (fwrite(header, 1, sizeof(header), hFile) != sizeof(header)) {
+        return FALSE;
+    }
+    
+    for (i = 0; i < cat->dwEntries; i++) {
+        size = catalog_encode(record, cat->lpEntries[i].dwSampleNumber,
+                              &cat->lpEntries[i].Header);
+        catalog_put32(&record[4], cat->lpEntries[i].dwFingerprint);
+        if (fwrite(record, 1, size, hFile) != size) {
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+/* Write a catalog into the catalog file, keeping the other devices */
+BOOL SMDI_SaveCatalog(SMDI_Catalog* cat) {
+    catalog_map_t map;
+    unsigned char header[CATALOG_FILE_HEADER];
+    char temp[MAXFNLEN + 8];
+    FILE* hFile;
+    unsigned long offset;
+    unsigned long size;
+    DWORD devices;
+    DWORD written;
+    DWORD d;
+    BOOL ok;
+    
+    if (cat == NULL) {
+        return FALSE;
+    }
+    
+    if (catalog_file[0] == '\0') {
+        return TRUE;
+    }
+    
+    sprintf(temp, "%s.new", catalog_file);
+    hFile = fopen(temp, "wb");
+    if (hFile == NULL) {
+        return FALSE;
+    }
+    
+    /* The device count is filled in at the end */
+    memset(header, 0, sizeof(header));
+    memcpy(header, CATALOG_FILE_SIGNATURE, 4);
+    catalog_put32(&header[4], CATALOG_FILE_VERSION);
+    ok = fwrite(header, 1, sizeof(header), hFile) == sizeof(header) &&
+         catalog_write_section(hFile, cat);
+    written = 1;
+    
+    /* Copy the sections of every other device straight from the map */
+    if (ok && catalog_map(&map)) {
+        devices = catalog_get32(&map.data[8]);
+        offset = CATALOG_FILE_HEADER;
+    
+        for (d = 0; ok && d < devices; d++) {
+            size = catalog_section_size(&map, offset);
+            if (size == 0) {
+                break;
+            }
+    
+            if (!catalog_section_matches(&map.data[offset], cat)) {
+                ok = fwrite(&map.data[offset], 1, size, hFile) == size;
+                written++;
+            }
+            offset += size;
+        }
+    
+        catalog_unmap(&map);
+    }
+    
+    if (ok) {
+        catalog_put32(&header[8], written);
+        ok = fseek(hFile, 0, SEEK_SET) == 0 &&
+             fwrite(header, 1, sizeof(header), hFile) == sizeof(header);
+    }
+    
+    if (fclose(hFile) != 0) {
+        ok = FALSE;
+    }
+    
+    if (!ok || rename(temp, catalog_file) != 0) {
+        remove(temp);
+        return FALSE;
+    }
+    
+    cat->bDirty = FALSE;
+    
+    return TRUE;
+}
+
+/* Index of the first entry at or after a sample number */
+static DWORD catalog_find(SMDI_Catalog* cat, DWORD sample_number) {
+    DWORD lo;
+    DWORD hi;
+    DWORD mid;
+    
+    lo = 0;
+    hi = cat->dwEntries;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cat->lpEntries[mid].dwSampleNumber < sample_number) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    
+    return lo;
+}
+
+/* Find the entry of a sample number */
+SMDI_CatalogEntry* SMDI_CatalogLookup(SMDI_Catalog* cat, DWORD sample_number) {
+    DWORD index;
+    
+    if (cat == NULL) {
+        return NULL;
+    }
+    
+    index = catalog_find(cat, sample_number);
+    if (index < cat->dwEntries && cat->lpEntries[index].dwSampleNumber == sample_number) {
+        return &cat->lpEntries[index];
+    }
+    
+    return NULL;
+}
+
+/* Enter a sample header */
+SMDI_CatalogEntry* SMDI_CatalogUpdate(SMDI_Catalog* cat, DWORD sample_number,
+                                      SMDI_SampleHeader* sh, BOOL bValid) {
+    SMDI_CatalogEntry* entry;
+    DWORD index;
+    
+    if (cat == NULL || sh == NULL) {
+        return NULL;
+    }
+    
+    index = catalog_find(cat, sample_number);
+    if (index >= cat->dwEntries || cat->lpEntries[index].dwSampleNumber != sample_number) {
+        if (!catalog_grow(cat)) {
+            return NULL;
+        }
+        memmove(&cat->lpEntries[index + 1], &cat->lpEntries[index],
+                (cat->dwEntries - index) * sizeof(SMDI_CatalogEntry));
+        cat->dwEntries++;
+    }
+    
+    entry = &cat->lpEntries[index];
+    entry->dwSampleNumber = sample_number;
+    memcpy(&entry->Header, sh, sizeof(SMDI_SampleHeader));
+    entry->Header.dwStructSize = sizeof(SMDI_SampleHeader);
+    entry->Header.bDoesExist = TRUE;
+    entry->Header.NameLength = (BYTE)strlen(entry->Header.cName);
+    entry->dwFingerprint = catalog_fingerprint(&entry->Header);
+    entry->bValid = bValid;
+    cat->bDirty = TRUE;
+    
+    return entry;
+}
+
+/* Drop the entry of a sample number */
+void SMDI_CatalogRemove(SMDI_Catalog* cat, DWORD sample_number) {
+    DWORD index;
+    
+    if (cat == NULL) {
+        return;
+    }
+    
+    index = catalog_find(cat, sample_number);
+    if (index < cat->dwEntries && cat->lpEntries[index].dwSampleNumber == sample_number) {
+        memmove(&cat->lpEntries[index], &cat->lpEntries[index + 1],
+                (cat->dwEntries - index - 1) * sizeof(SMDI_CatalogEntry));
+        cat->dwEntries--;
+        cat->bDirty = TRUE;
+    }
+}
+
+/* Occupancy of the cataloged samples */
+BOOL SMDI_CatalogOccupancy(SMDI_Catalog* cat, SMDI_Occupancy* occ) {
+    DWORD i;
+    
+    if (cat == NULL || occ == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_FreeOccupancy(occ);
+    occ->dwMaxSample = cat->dwMaxSample;
+    
+    for (i = 0; i < cat->dwEntries; i++) {
+        if (!SMDI_AddOccupied(occ, cat->lpEntries[i].dwSampleNumber)) {
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+/* Sample header from the catalog if confirmed this session, else from
+   the device */
+DWORD SMDIC_CatalogHeaderRequest(SMDI_Connection* conn, SMDI_Catalog* cat,
+                                 DWORD sample_number, SMDI_SampleHeader* sh) {
+    SMDI_CatalogEntry* entry;
+    DWORD result;
+    
+    if (sh == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    entry = SMDI_CatalogLookup(cat, sample_number);
+    if (entry != NULL && entry->bValid) {
+        memcpy(sh, &entry->Header, sizeof(SMDI_SampleHeader));
+        return SMDIM_SAMPLEHEADER;
+    }
+    
+    result = SMDIC_SampleHeaderRequest(conn, sample_number, sh);
+    
+    if (result == SMDIM_SAMPLEHEADER) {
+        SMDI_CatalogUpdate(cat, sample_number, sh, TRUE);
+    } else if (result == SMDIM_MESSAGEREJECT &&
+               SMDIC_GetLastError(conn) == SMDIE_NOSAMPLE) {
+        SMDI_CatalogRemove(cat, sample_number);
+    }
+    
+    return result;
+}
+
+/* Compare one header found by discovery with the catalog */
+static BOOL catalog_revalidate_header(DWORD sample_number, SMDI_SampleHeader* sh, DWORD user_data) {
+    catalog_scan_t* scan;
+    SMDI_CatalogEntry* entry;
+    DWORD change;
+    
+    scan = (catalog_scan_t*)user_data;
+    
+    entry = SMDI_CatalogLookup(scan->cat, sample_number);
+    if (entry != NULL && entry->dwFingerprint == catalog_fingerprint(sh)) {
+        entry->bValid = TRUE;
+        return TRUE;
+    }
+    
+    change = (entry == NULL) ? CATALOG_ADDED : CATALOG_CHANGED;
+    entry = SMDI_CatalogUpdate(scan->cat, sample_number, sh, TRUE);
+    
+    if (entry != NULL && scan->callback != NULL) {
+        (*scan->callback)(scan->cat, sample_number, entry, change, scan->dwUserData);
+    }
+    
+    return TRUE;
+}
+
+/* Drop the entries of first..last that discovery did not find */
+static void catalog_drop_missing(SMDI_Catalog* cat, SMDI_Occupancy* occ,
+                                 DWORD first, DWORD last,
+                                 catalog_scan_t* scan) {
+    DWORD index;
+    DWORD number;
+    DWORD r;
+    
+    index = catalog_find(cat, first);
+    r = 0;
+    
+    while (index < cat->dwEntries && cat->lpEntries[index].dwSampleNumber <= last) {
+        number = cat->lpEntries[index].dwSampleNumber;
+    
+        while (r < occ->dwRuns && occ->lpRuns[r].dwLast < number) {
+            r++;
+        }
+    
+        if (r < occ->dwRuns && occ->lpRuns[r].dwFirst <= number) {
+            index++;
+            continue;
+        }
+    
+        SMDI_CatalogRemove(cat, number);
+        if (scan->callback != NULL) {
+            (*scan->callback)(cat, number, NULL, CATALOG_REMOVED, scan->dwUserData);
+        }
+    }
+}
+
+/* Revalidate the catalog against the device */
+DWORD SMDIC_RevalidateCatalog(SMDI_Connection* conn, SMDI_Catalog* cat, DWORD slots,
+                              SMDI_CatalogCallback callback, DWORD dwUserData) {
+    SMDI_DiscoverInfo info;
+    SMDI_Occupancy occ;
+    catalog_scan_t scan;
+    DWORD result;
+    DWORD last;
+    
+    if (conn == NULL || cat == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    /* The cataloged samples are the hints: each of them gets probed */
+    SMDI_InitOccupancy(&occ);
+    if (!SMDI_CatalogOccupancy(cat, &occ)) {
+        SMDI_FreeOccupancy(&occ);
+        return SMDIM_ERROR;
+    }
+    
+    memset(&info, 0, sizeof(info));
+    info.dwStructSize = sizeof(info);
+    info.dwFirst = cat->dwRevalidateNext;
+    if (slots != 0) {
+        info.dwLimit = info.dwFirst + slots - 1;
+    }
+    
+    scan.cat = cat;
+    scan.callback = callback;
+    scan.dwUserData = dwUserData;
+    
+    result = SMDIC_DiscoverSamples(conn, &occ, &info, catalog_revalidate_header, (DWORD)&scan);
+    
+    if (result == SMDIM_ENDOFPROCEDURE && info.dwMaxSample == SMDI_RANGE_UNKNOWN) {
+        /* Nothing could be probed, so nothing is known to be gone */
+        cat->dwRevalidateNext = 0;
+    } else if (result == SMDIM_ENDOFPROCEDURE) {
+        if (cat->dwMaxSample != info.dwMaxSample) {
+            cat->dwMaxSample = info.dwMaxSample;
+            cat->bDirty = TRUE;
+        }
+    
+        /* Everything in the window that was not found is gone, and so is
+           everything past the end of the range */
+        last = (slots != 0 && info.dwLimit < info.dwMaxSample) ? info.dwLimit : info.dwMaxSample;
+        catalog_drop_missing(cat, &occ, info.dwFirst, last, &scan);
+        if (last == info.dwMaxSample) {
+            catalog_drop_missing(cat, &occ, last + 1, SMDI_RANGE_UNKNOWN, &scan);
+        }
+    
+        if (last >= info.dwMaxSample) {
+            cat->dwRevalidateNext = 0;
+        } else {
+            cat->dwRevalidateNext = last + 1;
+            result = SMDIM_ACK;
+        }
+    }
+    
+    SMDI_FreeOccupancy(&occ);
+    
+    return result;
+}
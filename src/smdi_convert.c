@@ -0,0 +1,782 @@
+/*
+ * SMDI sample format conversion for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * Samples are decoded a block at a time into 32-bit integers holding
+ * the value in the top bits (float is clamped to full scale first) and
+ * rounded to the device's bit depth from there. Where bits are dropped,
+ * TPDF dither - the difference of two uniform random numbers, one output
+ * step wide each - keeps the rounding error from following the signal;
+ * noise shaping feeds the error back through a 3-tap filter, which moves
+ * it towards the top of the band where the ear is least sensitive.
+ *
+ * Rounding to 16 bits and decoding float run on SSE2 or AVX2 where the
+ * CPU has them (chosen when first used); noise shaping needs the errors
+ * of the samples before and stays scalar, as does everything on other
+ * CPUs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdi.h"
+#include "smdi_swap.h"
+#include "smdi_convert.h"
+
+/* x86 kernels need GCC 4.9 or clang for intrinsics outside -m flags */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SMDI_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+/* Samples decoded and rounded at a time */
+#define CONVERT_BLOCK 2048
+
+/* Frames a convert source reads from its source at a time */
+#define CONVERT_SOURCE_FRAMES 2048
+
+/* Largest float below 1.0, full scale of a clamped sample */
+#define FLOAT_FULL_SCALE 0.99999994f
+
+typedef void (*SMDI_DecodeFloatProc)(int* out, const unsigned char* in, DWORD count, BOOL bSwap);
+typedef void (*SMDI_Round16Proc)(unsigned char* out, const int* in, DWORD count,
+                                 unsigned int* rng, BOOL bDither);
+
+struct SMDI_Converter {
+    SMDI_PCMFormat format;              /* Host order resolved */
+    BYTE channels;
+    BYTE bits;
+    DWORD flags;                        /* None where no bits are dropped */
+    DWORD in_frame;
+    DWORD out_frame;
+    BOOL swap;                          /* Float not in host order */
+    BOOL move;                          /* Integers of the output's width: only
+                                           the byte order may change */
+    unsigned int rng[8];                /* Dither generators, one per vector lane */
+    double* error;                      /* Last 3 rounding errors of each channel */
+    int work[CONVERT_BLOCK];
+};
+
+/* Noise shaping filter, F-weighted */
+static const double shape_taps[3] = { 1.623, -0.982, 0.109 };
+
+/* Kernel in use, chosen on first use */
+static SMDI_DecodeFloatProc decode_float_proc = NULL;
+static SMDI_Round16Proc round16_proc = NULL;
+static DWORD convert_kernel = SMDI_SWAP_SCALAR;
+
+/* Next number of a xorshift generator */
+static unsigned int SMDI_NextRandom(unsigned int* state) {
+    unsigned int x;
+    
+    x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    
+    return x;
+}
+
+/* TPDF dither at a scale where one output step is 2^shift */
+static int SMDI_Dither(unsigned int* state, int shift) {
+    unsigned int a;
+    unsigned int b;
+    
+    a = SMDI_NextRandom(state) >> (32 - shift);
+    b = SMDI_NextRandom(state) >> (32 - shift);
+    
+    return (int)a - (int)b;
+}
+
+/* Round to bits, halving first so that value, dither and the half step
+   added for rounding cannot overflow */
+static void SMDI_RoundScalar(unsigned char* out, const int* in, DWORD count,
+                             unsigned int* rng, BOOL bDither, int bits) {
+    int shift;
+    int half;
+    int most;
+    int dither;
+    int q;
+    DWORD i;
+    
+    shift = 32 - bits;
+    half = 1 << (shift - 2);
+    most = (1 << (bits - 1)) - 1;
+    dither = 0;
+    
+    for (i = 0; i < count; i++) {
+        if (bDither) {
+            dither = SMDI_Dither(rng, shift);
+        }
+        q = ((in[i] >> 1) + (dither >> 1) + half) >> (shift - 1);
+        if (q > most) {
+            q = most;
+        } else if (q < -most - 1) {
+            q = -most - 1;
+        }
+    
+        if (bits == 16) {
+            out[2 * i] = (unsigned char)((q >> 8) & 0xFF);
+            out[2 * i + 1] = (unsigned char)(q & 0xFF);
+        } else {
+            out[i] = (unsigned char)(q & 0xFF);
+        }
+    }
+}
+
+static void SMDI_Round16Scalar(unsigned char* out, const int* in, DWORD count,
+                               unsigned int* rng, BOOL bDither) {
+    SMDI_RoundScalar(out, in, count, rng, bDither, 16);
+}
+
+/* Clamp float to full scale and scale it to 32 bits; NaN gives -1.0 as
+   on the vector units */
+static void SMDI_DecodeFloatScalar(int* out, const unsigned char* in, DWORD count, BOOL bSwap) {
+    union {
+        unsigned int u;
+        float f;
+    } v;
+    float f;
+    DWORD i;
+    
+    for (i = 0; i < count; i++, in += 4) {
+        memcpy(&v.u, in, 4);
+        if (bSwap) {
+            v.u = (v.u >> 24) | ((v.u >> 8) & 0xFF00) | ((v.u << 8) & 0xFF0000) | (v.u << 24);
+        }
+    
+        f = (v.f > -1.0f) ? v.f : -1.0f;
+        f = (f < FLOAT_FULL_SCALE) ? f : FLOAT_FULL_SCALE;
+        out[i] = (int)(f * 2147483648.0f);
+    }
+}
+
+#ifdef SMDI_CONVERT_X86
+
+/* Next numbers of four xorshift generators */
+__attribute__((target("sse2")))
+static __m128i SMDI_NextRandom4(__m128i x) {
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+    x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+    x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+    
+    return x;
+}
+
+/* Halved TPDF dither for 16 bits in four lanes */
+__attribute__((target("sse2")))
+static __m128i SMDI_Dither4(__m128i* state) {
+    __m128i a;
+    __m128i b;
+    
+    a = SMDI_NextRandom4(*state);
+    b = SMDI_NextRandom4(a);
+    *state = b;
+    
+    return _mm_srai_epi32(_mm_sub_epi32(_mm_srli_epi32(a, 16), _mm_srli_epi32(b, 16)), 1);
+}
+
+__attribute__((target("sse2")))
+static void SMDI_Round16SSE2(unsigned char* out, const int* in, DWORD count,
+                             unsigned int* rng, BOOL bDither) {
+    __m128i state;
+    __m128i half;
+    __m128i a;
+    __m128i b;
+    __m128i p;
+    DWORD i;
+    
+    state = _mm_loadu_si128((const __m128i*)rng);
+    half = _mm_set1_epi32(1 << 14);
+    
+    for (i = 0; i + 8 <= count; i += 8) {
+        a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(in + i)), 1);
+        b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*)(in + i + 4)), 1);
+        if (bDither) {
+            a = _mm_add_epi32(a, SMDI_Dither4(&state));
+            b = _mm_add_epi32(b, SMDI_Dither4(&state));
+        }
+        a = _mm_srai_epi32(_mm_add_epi32(a, half), 15);
+        b = _mm_srai_epi32(_mm_add_epi32(b, half), 15);
+    
+        /* Saturate to 16 bits and make the words big-endian */
+        p = _mm_packs_epi32(a, b);
+        p = _mm_or_si128(_mm_slli_epi16(p, 8), _mm_srli_epi16(p, 8));
+        _mm_storeu_si128((__m128i*)(out + 2 * i), p);
+    }
+    
+    _mm_storeu_si128((__m128i*)rng, state);
+    SMDI_RoundScalar(out + 2 * i, in + i, count - i, rng, bDither, 16);
+}
+
+__attribute__((target("sse2")))
+static void SMDI_DecodeFloatSSE2(int* out, const unsigned char* in, DWORD count, BOOL bSwap) {
+    __m128i x;
+    __m128 f;
+    __m128 lo;
+    __m128 hi;
+    __m128 scale;
+    DWORD i;
+    
+    lo = _mm_set1_ps(-1.0f);
+    hi = _mm_set1_ps(FLOAT_FULL_SCALE);
+    scale = _mm_set1_ps(2147483648.0f);
+    
+    for (i = 0; i + 4 <= count; i += 4) {
+        x = _mm_loadu_si128((const __m128i*)(in + 4 * i));
+        if (bSwap) {
+            x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);
+        }
+    
+        /* max and min give their second operand for NaN */
+        f = _mm_min_ps(_mm_max_ps(_mm_castsi128_ps(x), lo), hi);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_cvttps_epi32(_mm_mul_ps(f, scale)));
+    }
+    
+    SMDI_DecodeFloatScalar(out + i, in + 4 * i, count - i, bSwap);
+}
+
+__attribute__((target("avx2")))
+static __m256i SMDI_NextRandom8(__m256i x) {
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+    x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+    
+    return x;
+}
+
+__attribute__((target("avx2")))
+static __m256i SMDI_Dither8(__m256i* state) {
+    __m256i a;
+    __m256i b;
+    
+    a = SMDI_NextRandom8(*state);
+    b = SMDI_NextRandom8(a);
+    *state = b;
+    
+    return _mm256_srai_epi32(_mm256_sub_epi32(_mm256_srli_epi32(a, 16), _mm256_srli_epi32(b, 16)), 1);
+}
+
+__attribute__((target("avx2")))
+static void SMDI_Round16AVX2(unsigned char* out, const int* in, DWORD count,
+                             unsigned int* rng, BOOL bDither) {
+    __m256i state;
+    __m256i half;
+    __m256i a;
+    __m256i b;
+    __m256i p;
+    DWORD i;
+    
+    state = _mm256_loadu_si256((const __m256i*)rng);
+    half = _mm256_set1_epi32(1 << 14);
+    
+    for (i = 0; i + 16 <= count; i += 16) {
+        a = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(in + i)), 1);
+        b = _mm256_srai_epi32(_mm256_loadu_si256((const __m256i*)(in + i + 8)), 1);
+        if (bDither) {
+            a = _mm256_add_epi32(a, SMDI_Dither8(&state));
+            b = _mm256_add_epi32(b, SMDI_Dither8(&state));
+        }
+        a = _mm256_srai_epi32(_mm256_add_epi32(a, half), 15);
+        b = _mm256_srai_epi32(_mm256_add_epi32(b, half), 15);
+    
+        /* Packing works within 128-bit lanes; put the quarters back in
+           order before making the words big-endian */
+        p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        p = _mm256_or_si256(_mm256_slli_epi16(p, 8), _mm256_srli_epi16(p, 8));
+        _mm256_storeu_si256((__m256i*)(out + 2 * i), p);
+    }
+    
+    _mm256_storeu_si256((__m256i*)rng, state);
+    SMDI_RoundScalar(out + 2 * i, in + i, count - i, rng, bDither, 16);
+}
+
+__attribute__((target("avx2")))
+static void SMDI_DecodeFloatAVX2(int* out, const unsigned char* in, DWORD count, BOOL bSwap) {
+    __m256i x;
+    __m256i order;
+    __m256 f;
+    __m256 lo;
+    __m256 hi;
+    __m256 scale;
+    DWORD i;
+    
+    order = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                             3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    lo = _mm256_set1_ps(-1.0f);
+    hi = _mm256_set1_ps(FLOAT_FULL_SCALE);
+    scale = _mm256_set1_ps(2147483648.0f);
+    
+    for (i = 0; i + 8 <= count; i += 8) {
+        x = _mm256_loadu_si256((const __m256i*)(in + 4 * i));
+        if (bSwap) {
+            x = _mm256_shuffle_epi8(x, order);
+        }
+    
+        f = _mm256_min_ps(_mm256_max_ps(_mm256_castsi256_ps(x), lo), hi);
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_cvttps_epi32(_mm256_mul_ps(f, scale)));
+    }
+    
+    SMDI_DecodeFloatScalar(out + i, in + 4 * i, count - i, bSwap);
+}
+
+#endif /* SMDI_CONVERT_X86 */
+
+/* Kernel procedures; FALSE if the build or the CPU lacks the kernel */
+static BOOL SMDI_ConvertKernelProcs(DWORD dwKernel, SMDI_DecodeFloatProc* decode,
+                                    SMDI_Round16Proc* round16) {
+    switch (dwKernel) {
+        case SMDI_SWAP_SCALAR:
+            *decode = SMDI_DecodeFloatScalar;
+            *round16 = SMDI_Round16Scalar;
+            return TRUE;
+#ifdef SMDI_CONVERT_X86
+        case SMDI_SWAP_SSE2:
+            if (!__builtin_cpu_supports("sse2")) {
+                return FALSE;
+            }
+            *decode = SMDI_DecodeFloatSSE2;
+            *round16 = SMDI_Round16SSE2;
+            return TRUE;
+        case SMDI_SWAP_AVX2:
+            if (!__builtin_cpu_supports("avx2")) {
+                return FALSE;
+            }
+            *decode = SMDI_DecodeFloatAVX2;
+            *round16 = SMDI_Round16AVX2;
+            return TRUE;
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+/* Pick the fastest kernel; racing threads pick the same one */
+static void SMDI_InitConvert(void) {
+    SMDI_DecodeFloatProc decode;
+    SMDI_Round16Proc round16;
+    DWORD kernel;
+    
+    /* The scalar kernel ends the search */
+    kernel = SMDI_SWAP_KERNELS - 1;
+    while (!SMDI_ConvertKernelProcs(kernel, &decode, &round16)) {
+        kernel--;
+    }
+    
+    convert_kernel = kernel;
+    decode_float_proc = decode;
+    round16_proc = round16;
+}
+
+/* Byte order of data in dwByteOrder on this host */
+static DWORD SMDI_ResolveByteOrder(DWORD dwByteOrder) {
+    if (dwByteOrder != SMDI_PCM_HOSTORDER) {
+        return dwByteOrder;
+    }
+    
+    /* Hosts that swap host-order words are little-endian */
+    return SMDI_CopyModeSwaps(CM_HOSTORDER) ? SMDI_PCM_LITTLEENDIAN : SMDI_PCM_BIGENDIAN;
+}
+
+/* Decode integer samples into the top bits of 32 */
+static void SMDI_DecodeInt(SMDI_Converter* conv, int* out, const unsigned char* in, DWORD count) {
+    unsigned int u;
+    unsigned int flip;
+    DWORD bytes;
+    DWORD shift;
+    DWORD i;
+    DWORD k;
+    
+    bytes = conv->format.dwBytes;
+    shift = 32 - conv->format.dwBits;
+    flip = (conv->format.dwEncoding == SMDI_PCM_UNSIGNED) ? 0x80000000U : 0;
+    
+    if (conv->format.dwByteOrder == SMDI_PCM_BIGENDIAN) {
+        for (i = 0; i < count; i++, in += bytes) {
+            u = 0;
+            for (k = 0; k < bytes; k++) {
+                u = (u << 8) | in[k];
+            }
+            out[i] = (int)((u << shift) ^ flip);
+        }
+    } else {
+        for (i = 0; i < count; i++, in += bytes) {
+            u = 0;
+            for (k = bytes; k > 0; k--) {
+                u = (u << 8) | in[k - 1];
+            }
+            out[i] = (int)((u << shift) ^ flip);
+        }
+    }
+}
+
+/* Round with each channel's error fed back through the shaping filter;
+   returns the channel of the sample after the last */
+static DWORD SMDI_RoundShaped(SMDI_Converter* conv, unsigned char* out, const int* in,
+                              DWORD count, DWORD channel) {
+    double step;
+    double* e;
+    double w;
+    double t;
+    long q;
+    long most;
+    int shift;
+    DWORD i;
+    
+    shift = 32 - conv->bits;
+    step = (double)(1L << shift);
+    most = (1L << (conv->bits - 1)) - 1;
+    
+    for (i = 0; i < count; i++) {
+        e = conv->error + 3 * channel;
+        w = (double)in[i] / step - (shape_taps[0] * e[0] + shape_taps[1] * e[1] + shape_taps[2] * e[2]);
+    
+        /* Round down from half a step up, the dither added */
+        t = w + (double)SMDI_Dither(&conv->rng[0], shift) / step + 0.5;
+        q = (long)t;
+        if ((double)q > t) {
+            q--;
+        }
+        if (q > most) {
+            q = most;
+        } else if (q < -most - 1) {
+            q = -most - 1;
+        }
+    
+        /* A clipped sample would feed back more than rounding error */
+        e[2] = e[1];
+        e[1] = e[0];
+        e[0] = (double)q - w;
+        if (e[0] > 1.5) {
+            e[0] = 1.5;
+        } else if (e[0] < -1.5) {
+            e[0] = -1.5;
+        }
+    
+        if (conv->bits == 16) {
+            out[2 * i] = (unsigned char)((q >> 8) & 0xFF);
+            out[2 * i + 1] = (unsigned char)(q & 0xFF);
+        } else {
+            out[i] = (unsigned char)(q & 0xFF);
+        }
+    
+        if (++channel == conv->channels) {
+            channel = 0;
+        }
+    }
+    
+    return channel;
+}
+
+/* Create a converter */
+SMDI_Converter* SMDI_CreateConverter(const SMDI_PCMFormat* lpFormat, BYTE bChannels,
+                                     BYTE bBits, DWORD dwFlags) {
+    SMDI_Converter* conv;
+    SMDI_PCMFormat format;
+    DWORD k;
+    
+    if (lpFormat == NULL || bChannels == 0 || (bBits != 8 && bBits != 16)) {
+        return NULL;
+    }
+    
+    memcpy(&format, lpFormat, sizeof(SMDI_PCMFormat));
+    format.dwByteOrder = SMDI_ResolveByteOrder(format.dwByteOrder);
+    
+    /* Float is single precision; integers fit their bytes */
+    switch (format.dwEncoding) {
+        case SMDI_PCM_FLOAT:
+            if (format.dwBits != 32 || format.dwBytes != 4) {
+                return NULL;
+            }
+            break;
+        case SMDI_PCM_SIGNED:
+        case SMDI_PCM_UNSIGNED:
+            if (format.dwBits < 8 || format.dwBytes < 1 || format.dwBytes > 4 ||
+                format.dwBits > format.dwBytes * 8) {
+                return NULL;
+            }
+            break;
+        default:
+            return NULL;
+    }
+    if (format.dwByteOrder != SMDI_PCM_BIGENDIAN && format.dwByteOrder != SMDI_PCM_LITTLEENDIAN) {
+        return NULL;
+    }
+    
+    conv = (SMDI_Converter*)malloc(sizeof(SMDI_Converter));
+    if (conv == NULL) {
+        return NULL;
+    }
+    
+    memset(conv, 0, sizeof(SMDI_Converter));
+    memcpy(&conv->format, &format, sizeof(SMDI_PCMFormat));
+    conv->channels = bChannels;
+    conv->bits = bBits;
+    conv->in_frame = bChannels * format.dwBytes;
+    conv->out_frame = bChannels * (bBits / 8);
+    conv->swap = (format.dwEncoding == SMDI_PCM_FLOAT &&
+                  format.dwByteOrder != SMDI_ResolveByteOrder(SMDI_PCM_HOSTORDER));
+    
+    /* Integers that fit are only moved */
+    conv->flags = dwFlags;
+    if (conv->flags & SMDI_CONVERT_NOISESHAPE) {
+        conv->flags |= SMDI_CONVERT_DITHER;
+    }
+    if (format.dwEncoding != SMDI_PCM_FLOAT && format.dwBits <= bBits) {
+        conv->flags = 0;
+    }
+    conv->move = (format.dwEncoding == SMDI_PCM_SIGNED && format.dwBits == bBits &&
+                  format.dwBytes * 8 == bBits);
+    
+    /* Any nonzero seed will do, as long as the lanes differ */
+    for (k = 0; k < 8; k++) {
+        conv->rng[k] = 0x2545F491U * (unsigned int)(k + 1);
+    }
+    
+    if (conv->flags & SMDI_CONVERT_NOISESHAPE) {
+        conv->error = (double*)calloc(3 * bChannels, sizeof(double));
+        if (conv->error == NULL) {
+            free(conv);
+            return NULL;
+        }
+    }
+    
+    return conv;
+}
+
+/* Free a converter */
+void SMDI_FreeConverter(SMDI_Converter* conv) {
+    if (conv == NULL) {
+        return;
+    }
+    
+    free(conv->error);
+    free(conv);
+}
+
+/* Convert frames a block at a time */
+DWORD SMDI_ConvertFrames(SMDI_Converter* conv, void* lpOut, const void* lpIn, DWORD dwFrames) {
+    const unsigned char* in;
+    unsigned char* out;
+    DWORD left;
+    DWORD count;
+    DWORD channel;
+    
+    if (round16_proc == NULL) {
+        SMDI_InitConvert();
+    }
+    
+    /* Samples of the output's width are copied, swapped by the swap
+       kernel where they are little-endian */
+    if (conv->move) {
+        SMDI_CopySwap(lpOut, lpIn, dwFrames * conv->out_frame,
+                      (conv->bits > 8 && conv->format.dwByteOrder == SMDI_PCM_LITTLEENDIAN) ?
+                      CM_BYTESWAP : CM_NORMAL);
+        return dwFrames * conv->out_frame;
+    }
+    
+    in = (const unsigned char*)lpIn;
+    out = (unsigned char*)lpOut;
+    left = dwFrames * conv->channels;
+    channel = 0;
+    
+    while (left > 0) {
+        count = (left < CONVERT_BLOCK) ? left : CONVERT_BLOCK;
+    
+        if (conv->format.dwEncoding == SMDI_PCM_FLOAT) {
+            (*decode_float_proc)(conv->work, in, count, conv->swap);
+        } else {
+            SMDI_DecodeInt(conv, conv->work, in, count);
+        }
+    
+        if (conv->flags & SMDI_CONVERT_NOISESHAPE) {
+            channel = SMDI_RoundShaped(conv, out, conv->work, count, channel);
+        } else if (conv->bits == 16) {
+            (*round16_proc)(out, conv->work, count, conv->rng,
+                            (conv->flags & SMDI_CONVERT_DITHER) != 0);
+        } else {
+            SMDI_RoundScalar(out, conv->work, count, conv->rng,
+                             (conv->flags & SMDI_CONVERT_DITHER) != 0, 8);
+        }
+    
+        in += count * conv->format.dwBytes;
+        out += count * (conv->bits / 8);
+        left -= count;
+    }
+    
+    return dwFrames * conv->out_frame;
+}
+
+/* Whether data must be converted to be sent */
+BOOL SMDI_NeedsConversion(const SMDI_PCMFormat* lpFormat, BYTE bBits) {
+    if (lpFormat->dwEncoding != SMDI_PCM_SIGNED || lpFormat->dwBits != bBits ||
+        lpFormat->dwBytes * 8 != lpFormat->dwBits) {
+        return TRUE;
+    }
+    
+    return bBits > 8 && SMDI_ResolveByteOrder(lpFormat->dwByteOrder) != SMDI_PCM_BIGENDIAN;
+}
+
+/* Data of a source being converted */
+typedef struct {
+    SMDI_SampleSource* src;
+    SMDI_Converter* conv;
+    unsigned char* raw;                 /* Read from src */
+    DWORD raw_size;
+    DWORD raw_used;                     /* Converted */
+    DWORD raw_fill;
+    BOOL ended;
+    unsigned char frame[2 * 255];       /* A frame split between two packets */
+    DWORD frame_used;
+    DWORD frame_fill;
+} ConvertSourceState;
+
+/* Convert the next frames of the source into an upload packet */
+static DWORD SMDI_ConvertSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    ConvertSourceState* state;
+    SMDI_Converter* conv;
+    unsigned char* out;
+    DWORD count;
+    DWORD frames;
+    DWORD fit;
+    DWORD got;
+    
+    state = (ConvertSourceState*)src->lpState;
+    conv = state->conv;
+    out = (unsigned char*)buffer;
+    count = 0;
+    
+    while (count < dwBytes) {
+        /* Rest of a frame split at the end of the last packet */
+        if (state->frame_used < state->frame_fill) {
+            out[count++] = state->frame[state->frame_used++];
+            continue;
+        }
+    
+        /* Read on once less than a frame is left, keeping that part */
+        if (state->raw_fill - state->raw_used < conv->in_frame) {
+            if (state->ended) {
+                break;
+            }
+            state->raw_fill -= state->raw_used;
+            memmove(state->raw, state->raw + state->raw_used, state->raw_fill);
+            state->raw_used = 0;
+    
+            got = SMDI_ReadSource(state->src, state->raw + state->raw_fill,
+                                  state->raw_size - state->raw_fill);
+            if (got == SMDI_SOURCE_ERROR) {
+                return SMDI_SOURCE_ERROR;
+            }
+            if (got == 0) {
+                state->ended = TRUE;
+            }
+            state->raw_fill += got;
+            continue;
+        }
+    
+        /* Whole frames go straight into the packet */
+        frames = (state->raw_fill - state->raw_used) / conv->in_frame;
+        fit = (dwBytes - count) / conv->out_frame;
+        if (fit == 0) {
+            /* A packet length that is not a whole number of frames splits one */
+            SMDI_ConvertFrames(conv, state->frame, state->raw + state->raw_used, 1);
+            state->frame_fill = conv->out_frame;
+            state->frame_used = 0;
+            frames = 1;
+        } else {
+            if (frames > fit) {
+                frames = fit;
+            }
+            count += SMDI_ConvertFrames(conv, out + count, state->raw + state->raw_used, frames);
+        }
+        state->raw_used += frames * conv->in_frame;
+    }
+    
+    return count;
+}
+
+/* Close the converted source */
+static void SMDI_ConvertSourceClose(SMDI_SampleSource* src) {
+    ConvertSourceState* state;
+    
+    state = (ConvertSourceState*)src->lpState;
+    SMDI_CloseSource(state->src);
+    SMDI_FreeConverter(state->conv);
+    free(state->raw);
+    free(state);
+}
+
+/* Open a source converting another */
+SMDI_SampleSource* SMDI_OpenConvertSource(SMDI_SampleSource* src, const SMDI_PCMFormat* lpFormat,
+                                          BYTE bBits, DWORD dwFlags) {
+    SMDI_SampleSource* cs;
+    ConvertSourceState* state;
+    SMDI_Converter* conv;
+    
+    if (src == NULL) {
+        return NULL;
+    }
+    
+    conv = SMDI_CreateConverter(lpFormat, src->Header.NumberOfChannels, bBits, dwFlags);
+    cs = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (ConvertSourceState*)malloc(sizeof(ConvertSourceState));
+    if (conv == NULL || cs == NULL || state == NULL) {
+        SMDI_FreeConverter(conv);
+        free(cs);
+        free(state);
+        SMDI_CloseSource(src);
+        return NULL;
+    }
+    
+    memset(state, 0, sizeof(ConvertSourceState));
+    state->src = src;
+    state->conv = conv;
+    state->raw_size = CONVERT_SOURCE_FRAMES * conv->in_frame;
+    state->raw = (unsigned char*)malloc(state->raw_size);
+    if (state->raw == NULL) {
+        SMDI_FreeConverter(conv);
+        free(cs);
+        free(state);
+        SMDI_CloseSource(src);
+        return NULL;
+    }
+    
+    /* Same sample, sent at the device's depth */
+    memset(cs, 0, sizeof(SMDI_SampleSource));
+    cs->dwStructSize = sizeof(SMDI_SampleSource);
+    memcpy(&cs->Header, &src->Header, sizeof(SMDI_SampleHeader));
+    cs->Header.BitsPerWord = bBits;
+    cs->lpRead = SMDI_ConvertSourceRead;
+    cs->lpClose = SMDI_ConvertSourceClose;
+    cs->lpState = state;
+    
+    return cs;
+}
+
+/* Kernel in use */
+DWORD SMDI_GetConvertKernel(void) {
+    if (round16_proc == NULL) {
+        SMDI_InitConvert();
+    }
+    
+    return convert_kernel;
+}
+
+/* Use another kernel */
+BOOL SMDI_SetConvertKernel(DWORD dwKernel) {
+    SMDI_DecodeFloatProc decode;
+    SMDI_Round16Proc round16;
+    
+    if (!SMDI_ConvertKernelProcs(dwKernel, &decode, &round16)) {
+        return FALSE;
+    }
+    
+    convert_kernel = dwKernel;
+    decode_float_proc = decode;
+    round16_proc = round16;
+    
+    return TRUE;
+}
@@ -7,12 +7,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include "smdi.h"
+#include "smdi_sample.h"
+#include "smdi_thread.h"
+#include "smdi_swap.h"
+#include "smdi_resample.h"
 #include "aspi_irix.h"
 #include "scsi_debug.h"
 
-/* Standard data packet size for SMDI transfers */
-#define PACKETSIZE 16384
 #define MAXFNLEN   1024  /* Maximum file name length for IRIX */
 
 /* Sample loop control flags */
@@ -20,30 +24,39 @@
 #define LOOP_FORWARD      1
 #define LOOP_BIDIRECTIONAL 2
 
-/* Sleep function for IRIX */
+/* Sleep function */
 static void sleep_ms(int ms) {
+#ifdef __sgi
     /* Convert ms to clock ticks (10ms each), rounding up */
     sginap((ms + 9) / 10);
+#else
+    struct timeval tv;
+    
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    select(0, NULL, NULL, NULL, &tv);
+#endif
 }
 
-/* Structure for native sample format header */
-typedef struct {
-    BYTE  signature[4];       /* 'SDMP' */
-    DWORD version;            /* Version number (1) */
-    BYTE  bitsPerSample;      /* Typically 16 */
-    BYTE  channels;           /* 1=mono, 2=stereo */
-    BYTE  loopType;           /* 0=none, 1=forward, 2=bidirectional */
-    BYTE  reserved;
-    DWORD sampleRate;         /* In Hz */
-    DWORD sampleCount;        /* Per channel */
-    DWORD loopStart;          /* Sample point */
-    DWORD loopEnd;            /* Sample point */
-    WORD  pitch;              /* MIDI note */
-    WORD  pitchFraction;      /* Cents, -50 to +50 */
-    DWORD nameLength;         /* Length of name string */
-    /* Name string follows... */
-    /* Then sample data... */
-} NativeSampleHeader;
+/* Connection a transmission runs on: its own, or the device's default one */
+static SMDI_Connection* SMDI_TransmissionConnection(SMDI_TransmissionInfo* ti) {
+    if (ti->lpConnection != NULL) {
+        return ti->lpConnection;
+    }
+    
+    return SMDI_GetDefaultConnection(ti->HA_ID, ti->SCSI_ID);
+}
+
+/* Packet length to ask for: swapped words must not be split between
+   two packets */
+static DWORD SMDI_WholeWordPacketSize(SMDI_TransmissionInfo* ti, SMDI_SampleHeader* sh,
+                                      DWORD dwPacketSize) {
+    if (sh->BitsPerWord > 8 && SMDI_CopyModeSwaps(ti->dwCopyMode) && dwPacketSize > 1) {
+        return dwPacketSize & ~(DWORD)1;
+    }
+    
+    return dwPacketSize;
+}
 
 /*
  * Sample transmission functions
@@ -53,31 +66,41 @@ typedef struct {
 DWORD SMDI_InitSampleTransmission(SMDI_TransmissionInfo* lpTransmissionInfo) {
     BOOL unitready;
     SMDI_TransmissionInfo transmissionInfo;
+    SMDI_Connection* conn;
     DWORD messRet;
     
     /* Make a local copy */
     memcpy(&transmissionInfo, lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
     
+    conn = SMDI_TransmissionConnection(&transmissionInfo);
+    
     /* Initialize */
     transmissionInfo.dwTransmittedPackets = 0;
     transmissionInfo.dwPacketSize = PACKETSIZE;
     
     /* Send the sample header */
-    messRet = SMDI_SendSampleHeader(
-        transmissionInfo.HA_ID,
-        transmissionInfo.SCSI_ID,
+    messRet = SMDIC_SendSampleHeader(
+        conn,
         transmissionInfo.dwSampleNumber,
         transmissionInfo.lpSampleHeader,
         &transmissionInfo.dwPacketSize);
     
     if (messRet == SMDIM_TRANSFERACKNOWLEDGE) {
+        /* The sampler offered its packet length; ask for less if the
+           connection cannot carry that much */
+        if (transmissionInfo.dwPacketSize == 0 ||
+            transmissionInfo.dwPacketSize > SMDIC_GetMaxPacketSize(conn)) {
+            transmissionInfo.dwPacketSize = SMDIC_GetMaxPacketSize(conn);
+        }
+        transmissionInfo.dwPacketSize = SMDI_WholeWordPacketSize(
+            &transmissionInfo, transmissionInfo.lpSampleHeader, transmissionInfo.dwPacketSize);
+    
         /* Send begin sample transfer */
-        messRet = SMDI_SendBeginSampleTransfer(
-            transmissionInfo.HA_ID,
-            transmissionInfo.SCSI_ID,
+        messRet = SMDIC_SendBeginSampleTransfer(
+            conn,
             transmissionInfo.dwSampleNumber,
             &transmissionInfo.dwPacketSize);
-        
+    
         /* Handle WAIT response */
         if (messRet == SMDIM_WAIT) {
             unitready = FALSE;
@@ -85,23 +108,18 @@ DWORD SMDI_InitSampleTransmission(SMDI_TransmissionInfo* lpTransmissionInfo) {
                 /* Delay 100 ms */
                 sleep_ms(100);
                 printf("Waiting for unit to become ready\n");
-                
+    
                 /* Check if unit ready */
-                unitready = ASPI_TestUnitReady(
-                    NULL,
-                    transmissionInfo.HA_ID,
-                    transmissionInfo.SCSI_ID);
+                unitready = SMDIC_TestUnitReady(conn);
             }
             /* Get the next message */
-            messRet = SMDI_GetMessage(
-                transmissionInfo.HA_ID,
-                transmissionInfo.SCSI_ID);
+            messRet = SMDIC_GetMessage(conn);
         }
     }
     
     /* Check for message reject */
     if (messRet == SMDIM_MESSAGEREJECT) {
-        return SMDI_GetLastError();
+        return SMDIC_GetLastError(conn);
     }
     
     /* Copy back the updated info */
@@ -115,15 +133,19 @@ DWORD SMDI_SampleTransmission(SMDI_TransmissionInfo* lpTransmissionInfo)
 {
     SMDI_SampleHeader sampleHeader;
     SMDI_TransmissionInfo transmissionInfo;
+    SMDI_Connection* conn;
     BOOL ur;
     DWORD messRet;
     DWORD transmittedBytes;
     DWORD samLength;
+    void* dataPtr;
     
     /* Make local copies */
     memcpy(&transmissionInfo, lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
     memcpy(&sampleHeader, transmissionInfo.lpSampleHeader, sizeof(SMDI_SampleHeader));
     
+    conn = SMDI_TransmissionConnection(&transmissionInfo);
+    
     /* Calculate bytes already transmitted */
     transmittedBytes = (transmissionInfo.dwPacketSize * transmissionInfo.dwTransmittedPackets);
     
@@ -137,12 +159,26 @@ DWORD SMDI_SampleTransmission(SMDI_TransmissionInfo* lpTransmissionInfo)
         transmissionInfo.dwPacketSize = samLength - transmittedBytes;
     }
     
+    /* Words to swap are swapped into the packet buffer, or in place if
+       they are there already, and go out from there */
+    dataPtr = transmissionInfo.lpSampleData;
+    if (sampleHeader.BitsPerWord > 8 && SMDI_CopyModeSwaps(transmissionInfo.dwCopyMode)) {
+        if (conn->lpPacket == NULL || dataPtr != (void*)(conn->lpPacket + 14) ||
+            transmissionInfo.dwPacketSize > conn->dwPacketAlloc) {
+            dataPtr = SMDIC_GetPacketBuffer(conn, transmissionInfo.dwPacketSize);
+            if (dataPtr == NULL) {
+                return SMDIM_ERROR;
+            }
+        }
+        SMDI_CopySwap(dataPtr, transmissionInfo.lpSampleData,
+                      transmissionInfo.dwPacketSize, transmissionInfo.dwCopyMode);
+    }
+    
     /* Send the data packet */
-    messRet = SMDI_SendDataPacket(
-        transmissionInfo.HA_ID,
-        transmissionInfo.SCSI_ID,
+    messRet = SMDIC_SendDataPacket(
+        conn,
         transmissionInfo.dwTransmittedPackets,
-        (void*)((char*)transmissionInfo.lpSampleData),
+        dataPtr,
         transmissionInfo.dwPacketSize);
     
     /* Handle WAIT response */
@@ -151,17 +187,12 @@ DWORD SMDI_SampleTransmission(SMDI_TransmissionInfo* lpTransmissionInfo)
         while (ur == FALSE) {
             /* Delay 100 ticks (about 10ms) */
             sleep_ms(10);
-            
+    
             /* Check if unit ready */
-            ur = ASPI_TestUnitReady(
-                NULL,
-                transmissionInfo.HA_ID,
-                transmissionInfo.SCSI_ID);
+            ur = SMDIC_TestUnitReady(conn);
         }
         /* Get the next message */
-        messRet = SMDI_GetMessage(
-            transmissionInfo.HA_ID,
-            transmissionInfo.SCSI_ID);
+        messRet = SMDIC_GetMessage(conn);
     }
     
     /* Increment packet counter */
@@ -176,6 +207,7 @@ DWORD SMDI_SampleTransmission(SMDI_TransmissionInfo* lpTransmissionInfo)
 /* Initialize a sample reception */
 DWORD SMDI_InitSampleReception(SMDI_TransmissionInfo* tiATemp) {
     SMDI_TransmissionInfo tiTemp;
+    SMDI_Connection* conn;
     DWORD messRet;
     
     /* Make sure we have a valid pointer */
@@ -187,31 +219,33 @@ DWORD SMDI_InitSampleReception(SMDI_TransmissionInfo* tiATemp) {
     /* Make a local copy */
     memcpy(&tiTemp, tiATemp, sizeof(SMDI_TransmissionInfo));
     
+    conn = SMDI_TransmissionConnection(&tiTemp);
+    
     /* Initialize */
     tiTemp.dwTransmittedPackets = 0;
     
     /* Request the sample header */
-    messRet = SMDI_SampleHeaderRequest(
-        tiTemp.HA_ID,
-        tiTemp.SCSI_ID,
+    messRet = SMDIC_SampleHeaderRequest(
+        conn,
         tiTemp.dwSampleNumber,
         tiTemp.lpSampleHeader);
     
     if (messRet == SMDIM_SAMPLEHEADER) {
-        /* Set default packet size */
-        tiTemp.dwPacketSize = PACKETSIZE;
-        
+        /* Ask for the largest packet the connection carries; the
+           sampler answers with the length it will actually use */
+        tiTemp.dwPacketSize = SMDI_WholeWordPacketSize(&tiTemp, tiTemp.lpSampleHeader,
+                                                       SMDIC_GetMaxPacketSize(conn));
+    
         /* Begin the sample transfer */
-        messRet = SMDI_SendBeginSampleTransfer(
-            tiTemp.HA_ID,
-            tiTemp.SCSI_ID,
+        messRet = SMDIC_SendBeginSampleTransfer(
+            conn,
             tiTemp.dwSampleNumber,
             &tiTemp.dwPacketSize);
     }
     
     /* Check for message reject */
     if (messRet == SMDIM_MESSAGEREJECT) {
-        return SMDI_GetLastError();
+        return SMDIC_GetLastError(conn);
     }
     
     /* Copy back the updated info */
@@ -224,15 +258,21 @@ DWORD SMDI_InitSampleReception(SMDI_TransmissionInfo* tiATemp) {
 DWORD SMDI_SampleReception(SMDI_TransmissionInfo* lpTransmissionInfo) {
     SMDI_TransmissionInfo transmissionInfo;
     SMDI_SampleHeader sampleHeader;
+    SMDI_Connection* conn;
     DWORD messRet;
     DWORD transmittedBytes;
     DWORD samLength;
+    DWORD packetLength;
+    DWORD swapStart;
+    DWORD swapEnd;
     void* dataPtr;
     
     /* Make local copies */
     memcpy(&transmissionInfo, lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
     memcpy(&sampleHeader, transmissionInfo.lpSampleHeader, sizeof(SMDI_SampleHeader));
     
+    conn = SMDI_TransmissionConnection(&transmissionInfo);
+    
     /* Calculate bytes already transmitted */
     transmittedBytes = (transmissionInfo.dwPacketSize * transmissionInfo.dwTransmittedPackets);
     
@@ -244,13 +284,36 @@ DWORD SMDI_SampleReception(SMDI_TransmissionInfo* lpTransmissionInfo) {
     /* Calculate data pointer for this packet */
     dataPtr = (void*)((char*)transmissionInfo.lpSampleData + transmittedBytes);
     
-    /* Request the next data packet */
-    messRet = SMDI_NextDataPacketRequest(
-        transmissionInfo.HA_ID,
-        transmissionInfo.SCSI_ID,
+    /* The last packet only fills the rest of the sample */
+    packetLength = transmissionInfo.dwPacketSize;
+    if (transmittedBytes < samLength && samLength - transmittedBytes < packetLength) {
+        packetLength = samLength - transmittedBytes;
+    }
+    
+    /* Request the next data packet; from the second packet on the bytes
+       already received are headroom for the message header, so the
+       payload lands in place */
+    messRet = SMDIC_NextDataPacketInPlace(
+        conn,
         transmissionInfo.dwTransmittedPackets,
         dataPtr,
-        transmissionInfo.dwPacketSize);
+        packetLength,
+        transmittedBytes >= 14);
+    
+    /* Bring the words into the caller's byte order where they landed; a
+       word the sampler split between two packets is swapped with the
+       second one */
+    if (messRet == SMDIM_DATAPACKET && sampleHeader.BitsPerWord > 8 &&
+        SMDI_CopyModeSwaps(transmissionInfo.dwCopyMode)) {
+        swapStart = transmittedBytes & ~(DWORD)1;
+        swapEnd = (transmittedBytes + packetLength) & ~(DWORD)1;
+        if (transmittedBytes + packetLength >= samLength) {
+            swapEnd = transmittedBytes + packetLength;
+        }
+        SMDI_CopySwap((char*)transmissionInfo.lpSampleData + swapStart,
+                      (char*)transmissionInfo.lpSampleData + swapStart,
+                      swapEnd - swapStart, transmissionInfo.dwCopyMode);
+    }
     
     /* If we've transferred enough data, return END OF PROCEDURE */
     if ((transmittedBytes + transmissionInfo.dwPacketSize) >= samLength) {
@@ -270,140 +333,384 @@ DWORD SMDI_SampleReception(SMDI_TransmissionInfo* lpTransmissionInfo) {
  * File-based sample operations
  */
 
+/* Sample header of a decoded native sample file */
+static void SMDI_NativeSampleHeader(SMDI_SampleFileHeader* fh, SMDI_SampleHeader* lpSampleHeader) {
+    memcpy(lpSampleHeader, &fh->header, sizeof(SMDI_SampleHeader));
+    
+    /* If loop end is 0, set it to the sample length - 1 */
+    if (lpSampleHeader->dwLoopEnd == 0) {
+        lpSampleHeader->dwLoopEnd = lpSampleHeader->dwLength - 1;
+    }
+}
+
 /* Get sample header from a file */
 DWORD SMDI_GetFileSampleHeader(char cFileName[], SMDI_SampleHeader* lpSampleHeader) {
     FILE* hFile;
-    NativeSampleHeader nativeHdr;
-    SMDI_SampleHeader shMyTemp;
-    char buffer[8];
+    SMDI_SampleFileHeader fh;
+    unsigned char buffer[512];      /* Either version's header and name */
+    size_t bytes_read;
     
     /* Make sure we have valid pointers */
     if (cFileName == NULL || lpSampleHeader == NULL) {
         return FE_OPENERROR;
     }
     
-    /* Initialize header */
-    memcpy(&shMyTemp, lpSampleHeader, sizeof(SMDI_SampleHeader));
-    shMyTemp.LoopControl = 0;  /* No loop by default */
-    shMyTemp.wPitch = 60;      /* Middle C */
-    shMyTemp.wPitchFraction = 0;
-    shMyTemp.dwLoopStart = 0;
-    shMyTemp.dwLoopEnd = 0;
-    shMyTemp.dwLength = 0;     /* Make sure this starts at 0 */
-    
     /* Open the file */
     hFile = fopen(cFileName, "rb");
     if (hFile == NULL) {
         return FE_OPENERROR;
     }
     
-    /* Read file signature */
-    fread(buffer, 1, 4, hFile);
+    /* Only the header is read */
+    bytes_read = fread(buffer, 1, sizeof(buffer), hFile);
+    fclose(hFile);
     
     /* Check for native sample format */
-    if (memcmp(buffer, "SDMP", 4) == 0) {
-        /* Read the header from the beginning */
-        fseek(hFile, 0, SEEK_SET);
-        
-        /* Read native sample header */
-        if (fread(&nativeHdr, sizeof(NativeSampleHeader), 1, hFile) != 1) {
-            fclose(hFile);
-            return FE_UNKNOWNFORMAT;
-        }
-        
-        /* Fill sample header from native format */
-        shMyTemp.bDoesExist = TRUE;
-        shMyTemp.BitsPerWord = nativeHdr.bitsPerSample;
-        shMyTemp.NumberOfChannels = nativeHdr.channels;
-        shMyTemp.LoopControl = nativeHdr.loopType;
-        shMyTemp.dwPeriod = 1000000000 / nativeHdr.sampleRate;
-        shMyTemp.dwLength = nativeHdr.sampleCount;
-        shMyTemp.dwLoopStart = nativeHdr.loopStart;
-        shMyTemp.dwLoopEnd = nativeHdr.loopEnd;
-        shMyTemp.wPitch = nativeHdr.pitch;
-        shMyTemp.wPitchFraction = nativeHdr.pitchFraction;
-        
-        /* Read name */
-        shMyTemp.NameLength = (BYTE)(nativeHdr.nameLength > 255 ? 255 : nativeHdr.nameLength);
-        memset(shMyTemp.cName, 0, 256);
-        
-        if (shMyTemp.NameLength > 0) {
-            fread(shMyTemp.cName, 1, shMyTemp.NameLength, hFile);
-        }
-        
-        /* Data offset is right after the header and name */
-        shMyTemp.dwDataOffset = sizeof(NativeSampleHeader) + nativeHdr.nameLength;
-        
-        fclose(hFile);
-        
-        /* If loop end is 0, set it to the sample length - 1 */
-        if (shMyTemp.dwLoopEnd == 0) {
-            shMyTemp.dwLoopEnd = shMyTemp.dwLength - 1;
-        }
-        
-        /* Copy the updated header back */
-        memcpy(lpSampleHeader, &shMyTemp, sizeof(SMDI_SampleHeader));
-        
-        return SF_NATIVE;
-    }
-    
-    /* Unknown format */
-    fclose(hFile);
-    return FE_UNKNOWNFORMAT;
+    if (!SMDI_DecodeSampleFileHeader(buffer, (DWORD)bytes_read, &fh)) {
+        return FE_UNKNOWNFORMAT;
+    }
+    
+    SMDI_NativeSampleHeader(&fh, lpSampleHeader);
+    
+    return SF_NATIVE;
+}
+
+/* Open a native sample file as an upload source; lpFileType receives
+   SF_NATIVE or the error. The file is mapped and its data copied
+   straight into each packet. */
+SMDI_SampleSource* SMDI_OpenFileSource(char cFileName[], DWORD* lpFileType) {
+    SMDI_SampleSource* src;
+    SMDI_SampleFileHeader fh;
+    SMDI_FileMap map;
+    DWORD dwType;
+    
+    /* Map the file; the source checks that its data is all there */
+    src = NULL;
+    dwType = FE_OPENERROR;
+    if (cFileName != NULL && SMDI_MapFile(cFileName, &map)) {
+        dwType = FE_UNKNOWNFORMAT;
+        if (SMDI_DecodeSampleFileHeader(map.data, map.size, &fh)) {
+            src = SMDI_OpenMappedSource(&map, 0, &fh);
+        } else {
+            SMDI_UnmapFile(&map);
+        }
+    }
+    
+    if (src != NULL) {
+        dwType = SF_NATIVE;
+        SMDI_NativeSampleHeader(&fh, &src->Header);
+    }
+    
+    if (lpFileType != NULL) {
+        *lpFileType = dwType;
+    }
+    
+    return src;
+}
+
+/* Read dwBytes from a source unless it ends first; returns the bytes
+   read or SMDI_SOURCE_ERROR */
+DWORD SMDI_ReadSource(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    DWORD total;
+    DWORD count;
+    
+    total = 0;
+    while (total < dwBytes) {
+        count = (*src->lpRead)(src, (char*)buffer + total, dwBytes - total);
+        if (count == SMDI_SOURCE_ERROR) {
+            return SMDI_SOURCE_ERROR;
+        }
+        if (count == 0) {
+            break;
+        }
+        total += count;
+    }
+    
+    return total;
+}
+
+/* Close an upload source */
+void SMDI_CloseSource(SMDI_SampleSource* src) {
+    if (src == NULL) {
+        return;
+    }
+    
+    if (src->lpClose != NULL) {
+        (*src->lpClose)(src);
+    }
+    
+    free(src);
+}
+
+/* Read-ahead source: a reader thread fills a ring of packet buffers
+   from the wrapped source while the transmission sends. Each side keeps
+   its own ring index; the semaphores count the free and filled buffers
+   and hand them over, so only the stop flag takes a lock. The reader
+   stops when the ring is full, which is how a device answering WAIT
+   holds it back. */
+typedef struct {
+    SMDI_SampleSource* lpSource;        /* Wrapped source, used by the reader only */
+    DWORD dwPacketSize;
+    DWORD dwPackets;
+    unsigned char* lpRing;              /* dwPackets buffers of dwPacketSize */
+    DWORD* lpLength;                    /* Bytes in each buffer, or SMDI_SOURCE_ERROR */
+    SMDI_Semaphore* semFree;
+    SMDI_Semaphore* semFilled;
+    SMDI_Thread* thread;
+    SMDI_Semaphore* semStop;            /* Guards bStop */
+    BOOL bStop;                         /* Set when the source is closed early */
+    DWORD dwCurrent;                    /* Buffer being read by the transmission */
+    DWORD dwOffset;                     /* Bytes of it already read */
+    BOOL bHaveBuffer;
+    BOOL bEnd;                          /* No more buffers will be filled */
+    DWORD dwEndResult;                  /* 0 or SMDI_SOURCE_ERROR once at the end */
+} ReadAheadState;
+
+/* Whether the source was closed; the free buffer the reader waited for
+   may have been posted before it was */
+static BOOL SMDI_ReadAheadStopped(ReadAheadState* state) {
+    BOOL bStop;
+    
+    SMDI_WaitSemaphore(state->semStop);
+    bStop = state->bStop;
+    SMDI_PostSemaphore(state->semStop);
+    
+    return bStop;
 }
 
-/* Initialize a file-based sample transmission */
+/* Reader thread: fill free buffers until the source ends */
+static void SMDI_ReadAheadMain(void* lpArg) {
+    ReadAheadState* state;
+    DWORD slot;
+    DWORD count;
+    
+    state = (ReadAheadState*)lpArg;
+    slot = 0;
+    
+    for (;;) {
+        SMDI_WaitSemaphore(state->semFree);
+        if (SMDI_ReadAheadStopped(state)) {
+            break;
+        }
+    
+        count = SMDI_ReadSource(state->lpSource,
+                                state->lpRing + slot * state->dwPacketSize,
+                                state->dwPacketSize);
+        state->lpLength[slot] = count;
+        SMDI_PostSemaphore(state->semFilled);
+    
+        /* A short buffer is the last one */
+        if (count != state->dwPacketSize) {
+            break;
+        }
+    
+        slot = (slot + 1) % state->dwPackets;
+    }
+}
+
+/* Read from the filled buffers */
+static DWORD SMDI_ReadAheadRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    ReadAheadState* state;
+    DWORD length;
+    DWORD count;
+    
+    state = (ReadAheadState*)src->lpState;
+    
+    if (state->bEnd) {
+        return state->dwEndResult;
+    }
+    
+    if (!state->bHaveBuffer) {
+        SMDI_WaitSemaphore(state->semFilled);
+        state->bHaveBuffer = TRUE;
+        state->dwOffset = 0;
+    }
+    
+    length = state->lpLength[state->dwCurrent];
+    if (length == SMDI_SOURCE_ERROR) {
+        state->bEnd = TRUE;
+        state->dwEndResult = SMDI_SOURCE_ERROR;
+        return SMDI_SOURCE_ERROR;
+    }
+    
+    count = length - state->dwOffset;
+    if (count > dwBytes) {
+        count = dwBytes;
+    }
+    memcpy(buffer, state->lpRing + state->dwCurrent * state->dwPacketSize + state->dwOffset, count);
+    state->dwOffset += count;
+    
+    /* Hand a used up buffer back to the reader */
+    if (state->dwOffset == length) {
+        state->bHaveBuffer = FALSE;
+        if (length < state->dwPacketSize) {
+            state->bEnd = TRUE;
+            state->dwEndResult = 0;
+        } else {
+            SMDI_PostSemaphore(state->semFree);
+            state->dwCurrent = (state->dwCurrent + 1) % state->dwPackets;
+        }
+    }
+    
+    return count;
+}
+
+/* Stop the reader and close the wrapped source */
+static void SMDI_ReadAheadClose(SMDI_SampleSource* src) {
+    ReadAheadState* state;
+    
+    state = (ReadAheadState*)src->lpState;
+    
+    /* Wake the reader if it waits for a free buffer */
+    SMDI_WaitSemaphore(state->semStop);
+    state->bStop = TRUE;
+    SMDI_PostSemaphore(state->semStop);
+    SMDI_PostSemaphore(state->semFree);
+    SMDI_JoinThread(state->thread);
+    
+    SMDI_CloseSource(state->lpSource);
+    SMDI_FreeSemaphore(state->semFree);
+    SMDI_FreeSemaphore(state->semFilled);
+    SMDI_FreeSemaphore(state->semStop);
+    free(state->lpRing);
+    free(state->lpLength);
+    free(state);
+}
+
+/* Read a source ahead in a thread of its own; NULL if the thread could
+   not be started, src is left open then */
+SMDI_SampleSource* SMDI_OpenReadAheadSource(SMDI_SampleSource* src, DWORD dwPacketSize, DWORD dwPackets) {
+    SMDI_SampleSource* ra;
+    ReadAheadState* state;
+    
+    if (src == NULL || dwPacketSize == 0 || dwPackets == 0) {
+        return NULL;
+    }
+    
+    ra = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (ReadAheadState*)malloc(sizeof(ReadAheadState));
+    if (ra == NULL || state == NULL) {
+        free(ra);
+        free(state);
+        return NULL;
+    }
+    
+    memset(state, 0, sizeof(ReadAheadState));
+    state->lpSource = src;
+    state->dwPacketSize = dwPacketSize;
+    state->dwPackets = dwPackets;
+    state->lpRing = (unsigned char*)malloc(dwPacketSize * dwPackets);
+    state->lpLength = (DWORD*)malloc(dwPackets * sizeof(DWORD));
+    state->semFree = SMDI_CreateSemaphore(dwPackets);
+    state->semFilled = SMDI_CreateSemaphore(0);
+    state->semStop = SMDI_CreateSemaphore(1);
+    
+    if (state->lpRing != NULL && state->lpLength != NULL && state->semFree != NULL &&
+        state->semFilled != NULL && state->semStop != NULL) {
+        state->thread = SMDI_StartThread(SMDI_ReadAheadMain, state);
+    }
+    
+    if (state->thread == NULL) {
+        SMDI_FreeSemaphore(state->semFree);
+        SMDI_FreeSemaphore(state->semFilled);
+        SMDI_FreeSemaphore(state->semStop);
+        free(state->lpRing);
+        free(state->lpLength);
+        free(state);
+        free(ra);
+        return NULL;
+    }
+    
+    memset(ra, 0, sizeof(SMDI_SampleSource));
+    ra->dwStructSize = sizeof(SMDI_SampleSource);
+    memcpy(&ra->Header, &src->Header, sizeof(SMDI_SampleHeader));
+    ra->lpRead = SMDI_ReadAheadRead;
+    ra->lpClose = SMDI_ReadAheadClose;
+    ra->lpState = state;
+    
+    return ra;
+}
+
+/* Initialize a file-based sample transmission. The data comes from
+   lpSource, or the native file cFileName without one, converted as the
+   transmission's dwCopyMode says; the source is closed when the
+   transmission ends. */
 DWORD SMDI_InitFileSampleTransmission(SMDI_FileTransmissionInfo* lpFileTransmissionInfo) {
     SMDI_FileTransmissionInfo ftiTemp;
     SMDI_TransmissionInfo tiTemp;
     SMDI_SampleHeader shTemp;
+    SMDI_SampleSource* lpReadAhead;
+    SMDI_Connection* conn;
     DWORD dwTemp;
     
     /* Make local copies */
     memcpy(&ftiTemp, lpFileTransmissionInfo, sizeof(SMDI_FileTransmissionInfo));
     memcpy(&tiTemp, ftiTemp.lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
     
-    /* Get the sample header from the file */
-    dwTemp = SMDI_GetFileSampleHeader(ftiTemp.cFileName, tiTemp.lpSampleHeader);
+    /* Without a source the native file is sent */
+    if (ftiTemp.lpSource == NULL) {
+        ftiTemp.lpSource = SMDI_OpenFileSource(ftiTemp.cFileName, &dwTemp);
+        if (ftiTemp.lpSource == NULL) {
+            return dwTemp;
+        }
+    }
     
-    /* Make a local copy of the sample header */
-    memcpy(&shTemp, tiTemp.lpSampleHeader, sizeof(SMDI_SampleHeader));
+    /* Resample to the rate the device plays back at; the filter needs
+       the words in the device's byte order */
+    conn = SMDI_TransmissionConnection(&tiTemp);
+    if (conn != NULL && conn->dwTargetRate > 0 && !SMDI_CopyModeSwaps(tiTemp.dwCopyMode) &&
+        SMDI_PeriodToRate(ftiTemp.lpSource->Header.dwPeriod) != conn->dwTargetRate) {
+        ftiTemp.lpSource = SMDI_OpenResampleSource(ftiTemp.lpSource, 0, conn->dwTargetRate);
+        if (ftiTemp.lpSource == NULL) {
+            lpFileTransmissionInfo->lpSource = NULL;
+            return SMDIM_ERROR;
+        }
+    }
     
-    /* Default pitch settings */
-    shTemp.wPitch = 60;         /* Middle C */
-    shTemp.wPitchFraction = 0;
-    
-    /* Check file format */
-    if (dwTemp == SF_NATIVE) {
-        /* No need for byte swapping on big-endian IRIX */
-        tiTemp.dwCopyMode = CM_NORMAL;
-        
-        /* Initialize the sample transmission */
-        dwTemp = SMDI_InitSampleTransmission(&tiTemp);
-        
-        if (dwTemp == SMDIM_SENDNEXTPACKET) {
-            /* Open the file */
-            ftiTemp.hFile = fopen(ftiTemp.cFileName, "rb");
-            
-            /* Seek to the data */
-            fseek(ftiTemp.hFile, shTemp.dwDataOffset, SEEK_SET);
-            
-            /* Allocate buffer for data */
-            tiTemp.lpSampleData = malloc(tiTemp.dwPacketSize);
-            
-            /* Check for allocation failure */
-            if (tiTemp.lpSampleData == NULL) {
-                fclose(ftiTemp.hFile);
-                return SMDIM_ERROR;
-            }
+    /* Send the source's header; a name given for the upload replaces
+       the source's own */
+    memcpy(&shTemp, &ftiTemp.lpSource->Header, sizeof(SMDI_SampleHeader));
+    if (tiTemp.lpSampleHeader->NameLength > 0) {
+        strcpy(shTemp.cName, tiTemp.lpSampleHeader->cName);
+        shTemp.NameLength = tiTemp.lpSampleHeader->NameLength;
+    }
+    memcpy(tiTemp.lpSampleHeader, &shTemp, sizeof(SMDI_SampleHeader));
+    
+    /* Initialize the sample transmission */
+    dwTemp = SMDI_InitSampleTransmission(&tiTemp);
+    
+    if (dwTemp == SMDIM_SENDNEXTPACKET) {
+        /* The source fills the payload of the connection's packet
+           buffer, so the data is not copied again for sending */
+        tiTemp.lpSampleData = SMDIC_GetPacketBuffer(
+            SMDI_TransmissionConnection(&tiTemp),
+            tiTemp.dwPacketSize);
+    
+        /* Check for allocation failure */
+        if (tiTemp.lpSampleData == NULL) {
+            dwTemp = SMDIM_ERROR;
+        }
+    }
+    
+    /* Read the source ahead now that the packet size is known; without
+       a thread the packets are read inline */
+    if (dwTemp == SMDIM_SENDNEXTPACKET && ftiTemp.dwReadAhead > 0) {
+        lpReadAhead = SMDI_OpenReadAheadSource(ftiTemp.lpSource, tiTemp.dwPacketSize,
+                                               ftiTemp.dwReadAhead);
+        if (lpReadAhead != NULL) {
+            ftiTemp.lpSource = lpReadAhead;
         }
-        
-        /* Copy back the updated headers */
-        memcpy(tiTemp.lpSampleHeader, &shTemp, sizeof(SMDI_SampleHeader));
-        memcpy(ftiTemp.lpTransmissionInfo, &tiTemp, sizeof(SMDI_TransmissionInfo));
-        memcpy(lpFileTransmissionInfo, &ftiTemp, sizeof(SMDI_FileTransmissionInfo));
     }
     
+    if (dwTemp != SMDIM_SENDNEXTPACKET) {
+        SMDI_CloseSource(ftiTemp.lpSource);
+        ftiTemp.lpSource = NULL;
+    }
+    
+    /* Copy back the updated headers */
+    memcpy(ftiTemp.lpTransmissionInfo, &tiTemp, sizeof(SMDI_TransmissionInfo));
+    memcpy(lpFileTransmissionInfo, &ftiTemp, sizeof(SMDI_FileTransmissionInfo));
+    
     return dwTemp;
 }
 
@@ -412,141 +719,236 @@ DWORD SMDI_FileSampleTransmission(SMDI_FileTransmissionInfo* lpFileTransmissionI
 {
     SMDI_FileTransmissionInfo ftiTemp;
     SMDI_TransmissionInfo tiTemp;
-    SMDI_SampleHeader shTemp;
     DWORD dwTemp;
-    size_t bytes_read;
+    DWORD bytes_read;
     
     /* Make local copies */
     memcpy(&ftiTemp, lpFileTransmissionInfo, sizeof(SMDI_FileTransmissionInfo));
     memcpy(&tiTemp, ftiTemp.lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
-    memcpy(&shTemp, tiTemp.lpSampleHeader, sizeof(SMDI_SampleHeader));
     
-    /* Read the next chunk of data from file - ensure we check the actual bytes read */
-    bytes_read = fread(tiTemp.lpSampleData, 1, tiTemp.dwPacketSize, ftiTemp.hFile);
-    
-    /* Handle potential short read */
-    if (bytes_read < tiTemp.dwPacketSize) {
-        /* If not at EOF, there was an error */
-        if (!feof(ftiTemp.hFile)) {
-            /* Log the error */
-            printf("Error reading from file: %lu bytes requested, %lu bytes read\n", 
-                  tiTemp.dwPacketSize, (unsigned long)bytes_read);
-            
-            /* Close file and free resources */
-            free(tiTemp.lpSampleData);
-            fclose(ftiTemp.hFile);
-            return SMDIM_ERROR;
-        }
-        
-        /* Adjust packet size for final short packet */
-        tiTemp.dwPacketSize = bytes_read;
-    }
+    /* Fill the packet buffer with the next chunk of the sample */
+    bytes_read = SMDI_ReadSource(ftiTemp.lpSource, tiTemp.lpSampleData, tiTemp.dwPacketSize);
     
-    /* Send the data */
-    dwTemp = SMDI_SampleTransmission(&tiTemp);
+    if (bytes_read == SMDI_SOURCE_ERROR || bytes_read == 0) {
+        /* The source failed or ended before the sample did */
+        printf("Error reading sample data: %lu bytes requested\n", tiTemp.dwPacketSize);
+        dwTemp = SMDIM_ERROR;
+    } else {
+        /* Adjust packet size for final short packet */
+        if (bytes_read < tiTemp.dwPacketSize) {
+            tiTemp.dwPacketSize = bytes_read;
+        }
     
-    /* Check for end of procedure */
-    if (dwTemp == SMDIM_ENDOFPROCEDURE) {
-        /* Free resources */
-        free(tiTemp.lpSampleData);
-        fclose(ftiTemp.hFile);
-        return dwTemp;
+        /* Send the data */
+        dwTemp = SMDI_SampleTransmission(&tiTemp);
     }
-    else if (dwTemp != SMDIM_SENDNEXTPACKET) {
-        /* Error - free resources */
-        free(tiTemp.lpSampleData);
-        fclose(ftiTemp.hFile);
+    
+    /* Close the source once the transmission is over */
+    if (dwTemp != SMDIM_SENDNEXTPACKET) {
+        SMDI_CloseSource(ftiTemp.lpSource);
+        ftiTemp.lpSource = NULL;
     }
     
     /* Copy back the updated headers */
-    memcpy(tiTemp.lpSampleHeader, &shTemp, sizeof(SMDI_SampleHeader));
     memcpy(ftiTemp.lpTransmissionInfo, &tiTemp, sizeof(SMDI_TransmissionInfo));
     memcpy(lpFileTransmissionInfo, &ftiTemp, sizeof(SMDI_FileTransmissionInfo));
     
     return dwTemp;
 }
 
-/* Initialize file-based sample reception */
+/* Native sample file being written by a download */
+typedef struct {
+    FILE* hFile;
+    char cFileName[MAX_PATH];
+    SMDI_SampleFileHeader Header;       /* Data size and hash so far */
+    unsigned char Buffer[SAMPLE_DATA_ALIGN]; /* Encoded header */
+} FileSinkState;
+
+/* Create the file and write the native sample header; its data size and
+   content hash are filled in when the file is complete */
+static BOOL SMDI_FileSinkBegin(SMDI_SampleSink* sink, SMDI_SampleHeader* sh) {
+    FileSinkState* state;
+    DWORD dwOffset;
+    
+    state = (FileSinkState*)sink->lpState;
+    
+    /* Open output file */
+    state->hFile = fopen(state->cFileName, "wb");
+    if (state->hFile == NULL) {
+        return FALSE;
+    }
+    
+    /* Write native sample format header, padded to the data */
+    memset(&state->Header, 0, sizeof(SMDI_SampleFileHeader));
+    state->Header.flags = SAMPLE_FLAG_HASH;
+    state->Header.content_hash = SAMPLE_HASH_INIT;
+    state->Header.sample_rate = SMDI_PeriodToRate(sh->dwPeriod);
+    memcpy(&state->Header.header, sh, sizeof(SMDI_SampleHeader));
+    
+    dwOffset = SMDI_EncodeSampleFileHeader(&state->Header, state->Buffer);
+    
+    return fwrite(state->Buffer, 1, dwOffset, state->hFile) == dwOffset;
+}
+
+/* Append packet data to the file */
+static BOOL SMDI_FileSinkWrite(SMDI_SampleSink* sink, void* data, DWORD length) {
+    FileSinkState* state;
+    
+    state = (FileSinkState*)sink->lpState;
+    
+    state->Header.data_size += length;
+    state->Header.content_hash = SMDI_HashData(state->Header.content_hash, data, length);
+    
+    return fwrite(data, 1, length, state->hFile) == length;
+}
+
+/* Close the file; a complete one gets its final header, an incomplete
+   one is removed */
+static BOOL SMDI_FileSinkClose(SMDI_SampleSink* sink, BOOL bComplete) {
+    FileSinkState* state;
+    DWORD dwOffset;
+    BOOL ok;
+    
+    state = (FileSinkState*)sink->lpState;
+    
+    ok = TRUE;
+    if (state->hFile != NULL) {
+        if (bComplete) {
+            dwOffset = SMDI_EncodeSampleFileHeader(&state->Header, state->Buffer);
+            ok = fseek(state->hFile, 0, SEEK_SET) == 0 &&
+                 fwrite(state->Buffer, 1, dwOffset, state->hFile) == dwOffset;
+        }
+        if (fclose(state->hFile) != 0) {
+            ok = FALSE;
+        }
+        if (!bComplete || !ok) {
+            remove(state->cFileName);
+        }
+    }
+    
+    free(state);
+    
+    return ok;
+}
+
+/* Open a native sample file as a download sink; the file is created
+   once the sample header is known */
+SMDI_SampleSink* SMDI_OpenFileSink(char cFileName[]) {
+    SMDI_SampleSink* sink;
+    FileSinkState* state;
+    
+    if (cFileName == NULL || strlen(cFileName) >= MAX_PATH) {
+        return NULL;
+    }
+    
+    sink = (SMDI_SampleSink*)malloc(sizeof(SMDI_SampleSink));
+    state = (FileSinkState*)malloc(sizeof(FileSinkState));
+    if (sink == NULL || state == NULL) {
+        free(sink);
+        free(state);
+        return NULL;
+    }
+    
+    memset(sink, 0, sizeof(SMDI_SampleSink));
+    sink->dwStructSize = sizeof(SMDI_SampleSink);
+    
+    state->hFile = NULL;
+    strcpy(state->cFileName, cFileName);
+    
+    sink->lpBegin = SMDI_FileSinkBegin;
+    sink->lpWrite = SMDI_FileSinkWrite;
+    sink->lpClose = SMDI_FileSinkClose;
+    sink->lpState = state;
+    
+    return sink;
+}
+
+/* Close a download sink; FALSE if finishing the output failed */
+BOOL SMDI_CloseSink(SMDI_SampleSink* sink, BOOL bComplete) {
+    BOOL ok;
+    
+    if (sink == NULL) {
+        return FALSE;
+    }
+    
+    ok = TRUE;
+    if (sink->lpClose != NULL) {
+        ok = (*sink->lpClose)(sink, bComplete);
+    }
+    
+    free(sink);
+    
+    return ok;
+}
+
+/* Initialize file-based sample reception. The data goes to lpSink, or
+   the native file cFileName without one, converted as the transmission's
+   dwCopyMode says; the sink is closed when the reception ends. A sample
+   header that already exists is used as it is, else it is requested
+   from the device. */
 DWORD SMDI_InitFileSampleReception(SMDI_FileTransmissionInfo* lpFileTransmissionInfo) {
     SMDI_FileTransmissionInfo ftiTemp;
     SMDI_TransmissionInfo tiTemp;
     SMDI_SampleHeader shTemp;
+    SMDI_Connection* conn;
     DWORD dwTemp;
-    DWORD nameLen;
-    NativeSampleHeader nativeHdr;
     
     /* Make local copies */
     memcpy(&ftiTemp, lpFileTransmissionInfo, sizeof(SMDI_FileTransmissionInfo));
     memcpy(&tiTemp, ftiTemp.lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
     memcpy(&shTemp, tiTemp.lpSampleHeader, sizeof(SMDI_SampleHeader));
     
-    /* Request the sample header */
-    dwTemp = SMDI_SampleHeaderRequest(
-        tiTemp.HA_ID, 
-        tiTemp.SCSI_ID, 
-        tiTemp.dwSampleNumber, 
-        &shTemp);
+    conn = SMDI_TransmissionConnection(&tiTemp);
     
-    if (dwTemp != SMDIM_SAMPLEHEADER) {
-        return dwTemp;
+    /* Without a sink the native file is written */
+    if (ftiTemp.lpSink == NULL) {
+        ftiTemp.lpSink = SMDI_OpenFileSink(ftiTemp.cFileName);
+        if (ftiTemp.lpSink == NULL) {
+            return FE_OPENERROR;
+        }
     }
     
-    /* Set default packet size */
-    tiTemp.dwPacketSize = PACKETSIZE;
-    
-    /* Open output file */
-    ftiTemp.hFile = fopen(ftiTemp.cFileName, "wb");
-    if (ftiTemp.hFile == NULL) {
-        return FE_OPENERROR;
+    /* Request the sample header */
+    dwTemp = SMDIM_SAMPLEHEADER;
+    if (!shTemp.bDoesExist) {
+        dwTemp = SMDIC_SampleHeaderRequest(conn, tiTemp.dwSampleNumber, &shTemp);
     }
     
-    /* Write native sample format header */
-    memcpy(nativeHdr.signature, "SDMP", 4);
-    nativeHdr.version = 1;
-    nativeHdr.bitsPerSample = shTemp.BitsPerWord;
-    nativeHdr.channels = shTemp.NumberOfChannels;
-    nativeHdr.loopType = shTemp.LoopControl;
-    nativeHdr.reserved = 0;
-    nativeHdr.sampleRate = 1000000000 / shTemp.dwPeriod;
-    nativeHdr.sampleCount = shTemp.dwLength;
-    nativeHdr.loopStart = shTemp.dwLoopStart;
-    nativeHdr.loopEnd = shTemp.dwLoopEnd;
-    nativeHdr.pitch = shTemp.wPitch;
-    nativeHdr.pitchFraction = shTemp.wPitchFraction;
-    
-    /* Get the name length */
-    nameLen = strlen(shTemp.cName);
-    if (nameLen > 255) {
-        nameLen = 255;
+    /* The sink writes its header before the transfer starts */
+    if (dwTemp == SMDIM_SAMPLEHEADER && !(*ftiTemp.lpSink->lpBegin)(ftiTemp.lpSink, &shTemp)) {
+        dwTemp = FE_OPENERROR;
     }
-    nativeHdr.nameLength = nameLen;
     
-    /* Write header */
-    fwrite(&nativeHdr, sizeof(NativeSampleHeader), 1, ftiTemp.hFile);
+    if (dwTemp == SMDIM_SAMPLEHEADER) {
+        /* Ask for the largest packet the connection carries; the
+           sampler answers with the length it will actually use */
+        tiTemp.dwTransmittedPackets = 0;
+        tiTemp.dwPacketSize = SMDI_WholeWordPacketSize(&tiTemp, &shTemp,
+                                                       SMDIC_GetMaxPacketSize(conn));
+    
+        dwTemp = SMDIC_SendBeginSampleTransfer(conn, tiTemp.dwSampleNumber, &tiTemp.dwPacketSize);
+        if (dwTemp == SMDIM_MESSAGEREJECT) {
+            dwTemp = SMDIC_GetLastError(conn);
+        }
     
-    /* Write name */
-    if (nameLen > 0) {
-        fwrite(shTemp.cName, 1, nameLen, ftiTemp.hFile);
+        /* Packets go to the sink one by one, so a word split between
+           two of them could not be swapped */
+        if (dwTemp == SMDIM_TRANSFERACKNOWLEDGE &&
+            SMDI_WholeWordPacketSize(&tiTemp, &shTemp, tiTemp.dwPacketSize) != tiTemp.dwPacketSize) {
+            if (conn->Debug.enabled) {
+                printf("SMDI DEBUG: Cannot swap %lu byte packets\n", tiTemp.dwPacketSize);
+            }
+            dwTemp = FE_PACKETSIZE;
+        }
     }
     
-    /* Initialize the sample reception */
-    dwTemp = SMDI_InitSampleReception(&tiTemp);
     if (dwTemp != SMDIM_TRANSFERACKNOWLEDGE) {
-        fclose(ftiTemp.hFile);
-        remove(ftiTemp.cFileName);
+        SMDI_CloseSink(ftiTemp.lpSink, FALSE);
         return dwTemp;
     }
     
-    /* We're on big-endian IRIX, so no byte swapping needed */
-    tiTemp.dwCopyMode = CM_NORMAL;
-    
-    /* Allocate sample data buffer */
-    tiTemp.lpSampleData = malloc(tiTemp.dwPacketSize);
-    if (tiTemp.lpSampleData == NULL) {
-        fclose(ftiTemp.hFile);
-        remove(ftiTemp.cFileName);
-        return SMDIM_ERROR;
-    }
+    /* Packets are written from the connection's receive buffer */
+    tiTemp.lpSampleData = NULL;
     
     /* Copy back the updated headers */
     memcpy(tiTemp.lpSampleHeader, &shTemp, sizeof(SMDI_SampleHeader));
@@ -562,44 +964,199 @@ DWORD SMDI_FileSampleReception(SMDI_FileTransmissionInfo* lpFileTransmissionInfo
     SMDI_TransmissionInfo tiTemp;
     SMDI_SampleHeader shTemp;
     DWORD dwTemp;
+    DWORD samLength;
+    DWORD receivedBytes;
     DWORD bytesToWrite;
+    void* packetData;
+    DWORD packetLength;
     
     /* Make local copies */
     memcpy(&ftiTemp, lpFileTransmissionInfo, sizeof(SMDI_FileTransmissionInfo));
     memcpy(&tiTemp, ftiTemp.lpTransmissionInfo, sizeof(SMDI_TransmissionInfo));
     memcpy(&shTemp, tiTemp.lpSampleHeader, sizeof(SMDI_SampleHeader));
     
-    /* Receive the next packet */
-    dwTemp = SMDI_SampleReception(&tiTemp);
-    
-    /* Calculate bytes to write */
-    bytesToWrite = tiTemp.dwPacketSize;
-    
-    /* If not data packet or last packet, adjust size */
-    if (dwTemp != SMDIM_DATAPACKET) {
-        bytesToWrite = (shTemp.dwLength *
-                      ((DWORD)shTemp.NumberOfChannels) *
-                      (((DWORD)shTemp.BitsPerWord) / 8)) -
-                     (tiTemp.dwPacketSize *
-                      (tiTemp.dwTransmittedPackets - 1));
+    /* Calculate total sample length and bytes already written */
+    samLength = shTemp.dwLength *
+                ((DWORD)shTemp.NumberOfChannels) *
+                (((DWORD)shTemp.BitsPerWord) / 8);
+    receivedBytes = tiTemp.dwPacketSize * tiTemp.dwTransmittedPackets;
+    
+    /* Receive the next packet into the connection's buffer */
+    dwTemp = SMDIC_NextDataPacketBuffer(
+        SMDI_TransmissionConnection(&tiTemp),
+        tiTemp.dwTransmittedPackets,
+        tiTemp.dwPacketSize,
+        &packetData,
+        &packetLength);
+    
+    if (dwTemp == SMDIM_DATAPACKET) {
+        /* Hand the data straight from the packet to the sink, swapped in
+           the packet if the copy mode says so */
+        bytesToWrite = (receivedBytes < samLength) ? samLength - receivedBytes : 0;
+        if (bytesToWrite > packetLength) {
+            bytesToWrite = packetLength;
+        }
+        if (shTemp.BitsPerWord > 8) {
+            SMDI_CopySwap(packetData, packetData, bytesToWrite, tiTemp.dwCopyMode);
+        }
+        if (!(*ftiTemp.lpSink->lpWrite)(ftiTemp.lpSink, packetData, bytesToWrite)) {
+            dwTemp = FE_WRITEERROR;
+        } else {
+            tiTemp.dwTransmittedPackets++;
+    
+            /* If we've transferred enough data, return END OF PROCEDURE */
+            if (receivedBytes + tiTemp.dwPacketSize >= samLength) {
+                dwTemp = SMDIM_ENDOFPROCEDURE;
+            }
+        }
     }
     
-    /* Write the data */
-    fwrite(tiTemp.lpSampleData, 1, bytesToWrite, ftiTemp.hFile);
-    
-    /* Check for end of procedure */
-    if (dwTemp == SMDIM_ENDOFPROCEDURE) {
-        /* Done - close file and free buffer */
-        fclose(ftiTemp.hFile);
-        free(tiTemp.lpSampleData);
+    /* Done - finish the output, or discard it after an error */
+    if (dwTemp != SMDIM_DATAPACKET) {
+        if (!SMDI_CloseSink(ftiTemp.lpSink, dwTemp == SMDIM_ENDOFPROCEDURE) &&
+            dwTemp == SMDIM_ENDOFPROCEDURE) {
+            dwTemp = FE_WRITEERROR;
+        }
+        ftiTemp.lpSink = NULL;
     }
     
     /* Copy back the updated transmission info */
     memcpy(ftiTemp.lpTransmissionInfo, &tiTemp, sizeof(SMDI_TransmissionInfo));
+    memcpy(lpFileTransmissionInfo, &ftiTemp, sizeof(SMDI_FileTransmissionInfo));
     
     return dwTemp;
 }
 
+/* File transfer running on a worker thread */
+struct SMDI_Transfer {
+    SMDI_Thread* thread;
+    unsigned long (*lpMain)(void*);     /* SMDI_SendFileMain or SMDI_ReceiveFileMain */
+    void* lpStart;                      /* Its parameters, freed by it */
+    SMDI_Semaphore* semLock;            /* Guards everything below */
+    BOOL bCancel;                       /* Stop at the next packet */
+    BOOL bDone;
+    DWORD dwResult;
+};
+
+/* Worker thread of an asynchronous transfer */
+static void SMDI_TransferThread(void* lpArg) {
+    SMDI_Transfer* transfer;
+    
+    transfer = (SMDI_Transfer*)lpArg;
+    (*transfer->lpMain)(transfer->lpStart);
+}
+
+/* Run a transfer's main function on a worker thread; NULL if no thread
+   could be started */
+static SMDI_Transfer* SMDI_StartTransfer(unsigned long (*lpMain)(void*), void* lpStart) {
+    SMDI_Transfer* transfer;
+    
+    transfer = (SMDI_Transfer*)malloc(sizeof(SMDI_Transfer));
+    if (transfer == NULL) {
+        return NULL;
+    }
+    
+    memset(transfer, 0, sizeof(SMDI_Transfer));
+    transfer->lpMain = lpMain;
+    transfer->lpStart = lpStart;
+    transfer->dwResult = SMDI_TRANSFER_PENDING;
+    transfer->semLock = SMDI_CreateSemaphore(1);
+    if (transfer->semLock == NULL) {
+        free(transfer);
+        return NULL;
+    }
+    
+    /* The transfer checks for cancellation through its parameters */
+    ((SMDI_FileTransmissionInfo*)lpStart)->lpTransfer = transfer;
+    
+    transfer->thread = SMDI_StartThread(SMDI_TransferThread, transfer);
+    if (transfer->thread == NULL) {
+        ((SMDI_FileTransmissionInfo*)lpStart)->lpTransfer = NULL;
+        SMDI_FreeSemaphore(transfer->semLock);
+        free(transfer);
+        return NULL;
+    }
+    
+    return transfer;
+}
+
+/* Result of a transfer, SMDI_TRANSFER_PENDING while it runs */
+DWORD SMDI_PollTransfer(SMDI_Transfer* transfer) {
+    DWORD dwResult;
+    
+    if (transfer == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    SMDI_WaitSemaphore(transfer->semLock);
+    dwResult = transfer->bDone ? transfer->dwResult : SMDI_TRANSFER_PENDING;
+    SMDI_PostSemaphore(transfer->semLock);
+    
+    return dwResult;
+}
+
+/* Wait for a transfer to end and free it; returns its result */
+DWORD SMDI_WaitTransfer(SMDI_Transfer* transfer) {
+    DWORD dwResult;
+    
+    if (transfer == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    /* The join makes everything the worker stored visible */
+    SMDI_JoinThread(transfer->thread);
+    dwResult = transfer->dwResult;
+    SMDI_FreeSemaphore(transfer->semLock);
+    free(transfer);
+    
+    return dwResult;
+}
+
+/* Ask a transfer to stop; it aborts at the next packet and ends with
+   FE_CANCELLED */
+void SMDI_CancelTransfer(SMDI_Transfer* transfer) {
+    if (transfer != NULL) {
+        SMDI_WaitSemaphore(transfer->semLock);
+        transfer->bCancel = TRUE;
+        SMDI_PostSemaphore(transfer->semLock);
+    }
+}
+
+/* Whether the caller cancelled an asynchronous transfer */
+static BOOL SMDI_TransferCancelled(SMDI_FileTransmissionInfo* fti) {
+    BOOL bCancel;
+    
+    if (fti->lpTransfer == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_WaitSemaphore(fti->lpTransfer->semLock);
+    bCancel = fti->lpTransfer->bCancel;
+    SMDI_PostSemaphore(fti->lpTransfer->semLock);
+    
+    return bCancel;
+}
+
+/* Store the result of a file transfer; an asynchronous transfer is
+   marked done and its callback called a last time */
+static void SMDI_EndFileTransfer(SMDI_FileTransmissionInfo* fti, DWORD dwResult) {
+    if (fti->lpReturnValue != NULL) {
+        *(fti->lpReturnValue) = dwResult;
+    }
+    
+    if (fti->lpTransfer != NULL) {
+        /* A poller sees the result no sooner than bDone */
+        SMDI_WaitSemaphore(fti->lpTransfer->semLock);
+        fti->lpTransfer->dwResult = dwResult;
+        fti->lpTransfer->bDone = TRUE;
+        SMDI_PostSemaphore(fti->lpTransfer->semLock);
+    
+        if (fti->lpCallBackProcedure != NULL) {
+            (*fti->lpCallBackProcedure)(fti, fti->dwUserData);
+        }
+    }
+}
+
 /* Helper function for sample transmission (for SendFile) */
 unsigned long SMDI_SendFileMain(void* lpStart) {
     SMDI_FileTransmissionInfo ftiTemp;
@@ -625,9 +1182,18 @@ unsigned long SMDI_SendFileMain(void* lpStart) {
         /* Continue sending packets until done */
         dwTemp = SMDIM_SENDNEXTPACKET;
         while (dwTemp == SMDIM_SENDNEXTPACKET) {
+            /* A cancelled upload is aborted, the device drops it */
+            if (SMDI_TransferCancelled(&ftiTemp)) {
+                SMDIC_AbortProcedure(SMDI_TransmissionConnection(&tiTemp));
+                SMDI_CloseSource(ftiTemp.lpSource);
+                ftiTemp.lpSource = NULL;
+                dwTemp = FE_CANCELLED;
+                break;
+            }
+    
             /* Send the next packet */
             dwTemp = SMDI_FileSampleTransmission(&ftiTemp);
-            
+    
             /* Call callback if provided */
             if (ftiTemp.lpCallBackProcedure != NULL) {
                 (*ftiTemp.lpCallBackProcedure)(&ftiTemp, ftiTemp.dwUserData);
@@ -635,10 +1201,8 @@ unsigned long SMDI_SendFileMain(void* lpStart) {
         }
     }
     
-    /* Store result if pointer provided */
-    if (ftiTemp.lpReturnValue != NULL) {
-        *(ftiTemp.lpReturnValue) = dwTemp;
-    }
+    /* Store the result */
+    SMDI_EndFileTransfer(&ftiTemp, dwTemp);
     
     return dwTemp;
 }
@@ -651,6 +1215,11 @@ DWORD SMDI_SendFile(SMDI_FileTransfer* lpFileTransfer) {
     void* lpTemp;
     SMDI_FileTransfer fileTransfer;
     
+    /* Until a worker thread runs the transfer there is none to wait for */
+    if (lpFileTransfer->dwStructSize >= sizeof(SMDI_FileTransfer) && lpFileTransfer->lpHandle != NULL) {
+        *(lpFileTransfer->lpHandle) = NULL;
+    }
+    
     /* Allocate memory for the structures */
     ftiTemp = (SMDI_FileTransmissionInfo*)malloc(
         sizeof(SMDI_FileTransmissionInfo) + 
@@ -658,6 +1227,9 @@ DWORD SMDI_SendFile(SMDI_FileTransfer* lpFileTransfer) {
         sizeof(SMDI_SampleHeader));
     
     if (ftiTemp == NULL) {
+        if (lpFileTransfer->dwStructSize >= sizeof(SMDI_FileTransfer)) {
+            SMDI_CloseSource(lpFileTransfer->lpSource);
+        }
         return SMDIM_ERROR;
     }
     
@@ -677,6 +1249,10 @@ DWORD SMDI_SendFile(SMDI_FileTransfer* lpFileTransfer) {
     fileTransfer.lpCallback = NULL;
     fileTransfer.dwUserData = 0;
     fileTransfer.lpReturnValue = NULL;
+    fileTransfer.lpConnection = NULL;
+    fileTransfer.lpSource = NULL;
+    fileTransfer.dwReadAhead = 0;
+    fileTransfer.lpHandle = NULL;
     
     /* Copy the provided structure (using the minimum of the two sizes) */
     memcpy(&fileTransfer, lpFileTransfer,
@@ -692,7 +1268,15 @@ DWORD SMDI_SendFile(SMDI_FileTransfer* lpFileTransfer) {
     tiTemp->HA_ID = fileTransfer.HA_ID;
     tiTemp->SCSI_ID = fileTransfer.SCSI_ID;
     tiTemp->dwSampleNumber = fileTransfer.dwSampleNumber;
-    strcpy(ftiTemp->cFileName, fileTransfer.lpFileName);
+    tiTemp->lpConnection = fileTransfer.lpConnection;
+    ftiTemp->lpSource = fileTransfer.lpSource;
+    ftiTemp->lpSink = NULL;
+    ftiTemp->dwReadAhead = fileTransfer.dwReadAhead;
+    if (fileTransfer.lpFileName != NULL) {
+        strcpy(ftiTemp->cFileName, fileTransfer.lpFileName);
+    } else {
+        ftiTemp->cFileName[0] = '\0';
+    }
     
     /* Set up sample name if provided */
     if (fileTransfer.lpSampleName != NULL) {
@@ -705,7 +1289,8 @@ DWORD SMDI_SendFile(SMDI_FileTransfer* lpFileTransfer) {
         shTemp->NameLength = 0;
     }
     
-    /* Always use normal copy mode on big-endian system */
+    /* Native files, sources and sinks hold the words in the device's
+       byte order */
     tiTemp->dwCopyMode = CM_NORMAL;
     
     /* Set callback and user data */
@@ -719,7 +1304,17 @@ DWORD SMDI_SendFile(SMDI_FileTransfer* lpFileTransfer) {
     
     /* Initialize return value if provided */
     if (fileTransfer.lpReturnValue != NULL) {
-        *(fileTransfer.lpReturnValue) = (DWORD)-1;
+        *(fileTransfer.lpReturnValue) = SMDI_TRANSFER_PENDING;
+    }
+    
+    /* Run on a worker thread if asked to */
+    ftiTemp->lpTransfer = NULL;
+    if (fileTransfer.lpHandle != NULL) {
+        *(fileTransfer.lpHandle) = fileTransfer.bAsync ?
+            SMDI_StartTransfer(SMDI_SendFileMain, lpTemp) : NULL;
+        if (*(fileTransfer.lpHandle) != NULL) {
+            return SMDI_TRANSFER_PENDING;
+        }
     }
     
     /* Execute synchronously */
@@ -751,9 +1346,18 @@ unsigned long SMDI_ReceiveFileMain(void* lpStart) {
         /* Continue receiving packets until done */
         dwTemp = SMDIM_DATAPACKET;
         while (dwTemp == SMDIM_DATAPACKET) {
+            /* A cancelled download is aborted and its output discarded */
+            if (SMDI_TransferCancelled(&ftiTemp)) {
+                SMDIC_AbortProcedure(SMDI_TransmissionConnection(&tiTemp));
+                SMDI_CloseSink(ftiTemp.lpSink, FALSE);
+                ftiTemp.lpSink = NULL;
+                dwTemp = FE_CANCELLED;
+                break;
+            }
+    
             /* Receive the next packet */
             dwTemp = SMDI_FileSampleReception(&ftiTemp);
-            
+    
             /* Call callback if provided */
             if (ftiTemp.lpCallBackProcedure != NULL) {
                 (*ftiTemp.lpCallBackProcedure)(&ftiTemp, ftiTemp.dwUserData);
@@ -761,10 +1365,8 @@ unsigned long SMDI_ReceiveFileMain(void* lpStart) {
         }
     }
     
-    /* Store result if pointer provided */
-    if (ftiTemp.lpReturnValue != NULL) {
-        *(ftiTemp.lpReturnValue) = dwTemp;
-    }
+    /* Store the result */
+    SMDI_EndFileTransfer(&ftiTemp, dwTemp);
     
     return dwTemp;
 }
@@ -777,6 +1379,11 @@ DWORD SMDI_ReceiveFile(SMDI_FileTransfer* lpFileTransfer) {
     void* lpTemp;
     SMDI_FileTransfer fileTransfer;
     
+    /* Until a worker thread runs the transfer there is none to wait for */
+    if (lpFileTransfer->dwStructSize >= sizeof(SMDI_FileTransfer) && lpFileTransfer->lpHandle != NULL) {
+        *(lpFileTransfer->lpHandle) = NULL;
+    }
+    
     /* Allocate memory for the structures */
     ftiTemp = (SMDI_FileTransmissionInfo*)malloc(
         sizeof(SMDI_FileTransmissionInfo) + 
@@ -784,6 +1391,9 @@ DWORD SMDI_ReceiveFile(SMDI_FileTransfer* lpFileTransfer) {
         sizeof(SMDI_SampleHeader));
     
     if (ftiTemp == NULL) {
+        if (lpFileTransfer->dwStructSize >= sizeof(SMDI_FileTransfer)) {
+            SMDI_CloseSink(lpFileTransfer->lpSink, FALSE);
+        }
         return SMDIM_ERROR;
     }
     
@@ -803,6 +1413,11 @@ DWORD SMDI_ReceiveFile(SMDI_FileTransfer* lpFileTransfer) {
     fileTransfer.lpCallback = NULL;
     fileTransfer.dwUserData = 0;
     fileTransfer.lpReturnValue = NULL;
+    fileTransfer.lpConnection = NULL;
+    fileTransfer.lpSink = NULL;
+    fileTransfer.lpSampleHeader = NULL;
+    fileTransfer.dwReadAhead = 0;
+    fileTransfer.lpHandle = NULL;
     
     /* Copy the provided structure (using the minimum of the two sizes) */
     memcpy(&fileTransfer, lpFileTransfer,
@@ -818,13 +1433,30 @@ DWORD SMDI_ReceiveFile(SMDI_FileTransfer* lpFileTransfer) {
     tiTemp->dwSampleNumber = fileTransfer.dwSampleNumber;
     tiTemp->HA_ID = fileTransfer.HA_ID;
     tiTemp->SCSI_ID = fileTransfer.SCSI_ID;
+    tiTemp->lpConnection = fileTransfer.lpConnection;
     
-    /* Always use normal copy mode on big-endian system */
+    /* Native files, sources and sinks hold the words in the device's
+       byte order */
     tiTemp->dwCopyMode = CM_NORMAL;
     
     ftiTemp->dwFileType = fileTransfer.dwFileType;
     ftiTemp->lpReturnValue = fileTransfer.lpReturnValue;
-    strcpy(ftiTemp->cFileName, fileTransfer.lpFileName);
+    ftiTemp->lpSource = NULL;
+    ftiTemp->lpSink = fileTransfer.lpSink;
+    ftiTemp->dwReadAhead = 0;
+    if (fileTransfer.lpFileName != NULL) {
+        strcpy(ftiTemp->cFileName, fileTransfer.lpFileName);
+    } else {
+        ftiTemp->cFileName[0] = '\0';
+    }
+    
+    /* A header the caller already has saves requesting it again */
+    if (fileTransfer.lpSampleHeader != NULL) {
+        memcpy(shTemp, fileTransfer.lpSampleHeader, sizeof(SMDI_SampleHeader));
+        shTemp->dwStructSize = sizeof(*shTemp);
+    } else {
+        shTemp->bDoesExist = FALSE;
+    }
     ftiTemp->lpCallBackProcedure = (void (*)(SMDI_FileTransmissionInfo*, DWORD))fileTransfer.lpCallback;
     ftiTemp->dwUserData = fileTransfer.dwUserData;
     
@@ -834,7 +1466,17 @@ DWORD SMDI_ReceiveFile(SMDI_FileTransfer* lpFileTransfer) {
     
     /* Initialize return value if provided */
     if (fileTransfer.lpReturnValue != NULL) {
-        *(fileTransfer.lpReturnValue) = (DWORD)-1;
+        *(fileTransfer.lpReturnValue) = SMDI_TRANSFER_PENDING;
+    }
+    
+    /* Run on a worker thread if asked to */
+    ftiTemp->lpTransfer = NULL;
+    if (fileTransfer.lpHandle != NULL) {
+        *(fileTransfer.lpHandle) = fileTransfer.bAsync ?
+            SMDI_StartTransfer(SMDI_ReceiveFileMain, lpTemp) : NULL;
+        if (*(fileTransfer.lpHandle) != NULL) {
+            return SMDI_TRANSFER_PENDING;
+        }
     }
     
     /* Execute synchronously */
@@ -0,0 +1,734 @@
+/*
+ * SMDI sample discovery for IRIX 5.3
+ * ANSI C90 compliant for MIPS big-endian architecture
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdi.h"
+#include "aspi_irix.h"
+
+#define MAXFNLEN   1024  /* Maximum file name length for IRIX */
+
+/* Number of devices the occupancy table holds */
+#define SMDI_OCCUPANCY_MAX       32
+
+/* Highest sample number an SMDI message can carry */
+#define SMDI_MAX_SAMPLE_NUMBER   0xFFFFFF
+
+/* Discovery defaults */
+#define SMDI_DISCOVER_GAP        8     /* Empty slots that end a dense scan */
+#define SMDI_DISCOVER_STRIDE     32    /* Probe spacing in unexplored gaps */
+#define SMDI_DISCOVER_SPARSE     4096  /* Most stride probes over the whole range */
+
+/* Result of probing one sample number */
+#define PROBE_OCCUPIED           0
+#define PROBE_EMPTY              1
+#define PROBE_OUTOFRANGE         2
+#define PROBE_ERROR              3
+
+/* Remembered occupancy of one device */
+typedef struct {
+    char cVendor[9];
+    char cProduct[17];
+    BYTE HA_ID;
+    BYTE SCSI_ID;
+    SMDI_Occupancy Occupancy;
+} SMDI_KnownDevice;
+
+static SMDI_KnownDevice known_devices[SMDI_OCCUPANCY_MAX];
+static int known_count = 0;
+static char occupancy_file[MAXFNLEN] = "";
+
+/*
+ * Occupancy maps
+ */
+
+/* Set up an empty occupancy map */
+void SMDI_InitOccupancy(SMDI_Occupancy* occ) {
+    memset(occ, 0, sizeof(SMDI_Occupancy));
+    occ->dwStructSize = sizeof(SMDI_Occupancy);
+    occ->dwMaxSample = SMDI_RANGE_UNKNOWN;
+}
+
+/* Release the runs of an occupancy map and empty it */
+void SMDI_FreeOccupancy(SMDI_Occupancy* occ) {
+    if (occ == NULL) {
+        return;
+    }
+    
+    free(occ->lpRuns);
+    SMDI_InitOccupancy(occ);
+}
+
+/* Mark a sample number occupied. Numbers must come in ascending order
+   after the last run; a number next to the last run extends it. */
+BOOL SMDI_AddOccupied(SMDI_Occupancy* occ, DWORD number) {
+    SMDI_SampleRun* grown;
+    
+    if (occ->dwRuns > 0 && occ->lpRuns[occ->dwRuns - 1].dwLast + 1 == number) {
+        occ->lpRuns[occ->dwRuns - 1].dwLast = number;
+        return TRUE;
+    }
+    
+    if (occ->dwRuns == occ->dwRunAlloc) {
+        grown = (SMDI_SampleRun*)realloc(occ->lpRuns,
+                                         (occ->dwRunAlloc + 64) * sizeof(SMDI_SampleRun));
+        if (grown == NULL) {
+            return FALSE;
+        }
+        occ->lpRuns = grown;
+        occ->dwRunAlloc += 64;
+    }
+    
+    occ->lpRuns[occ->dwRuns].dwFirst = number;
+    occ->lpRuns[occ->dwRuns].dwLast = number;
+    occ->dwRuns++;
+    
+    return TRUE;
+}
+
+/* Append a run after the last one */
+static BOOL occupancy_add_run(SMDI_Occupancy* occ, const SMDI_SampleRun* run) {
+    if (!SMDI_AddOccupied(occ, run->dwFirst)) {
+        return FALSE;
+    }
+    
+    occ->lpRuns[occ->dwRuns - 1].dwLast = run->dwLast;
+    
+    return TRUE;
+}
+
+/* Copy an occupancy map */
+static BOOL occupancy_copy(SMDI_Occupancy* dest, const SMDI_Occupancy* src) {
+    DWORD i;
+    
+    SMDI_FreeOccupancy(dest);
+    dest->dwMaxSample = src->dwMaxSample;
+    
+    for (i = 0; i < src->dwRuns; i++) {
+        if (!occupancy_add_run(dest, &src->lpRuns[i])) {
+            return FALSE;
+        }
+    }
+    
+    return TRUE;
+}
+
+/* Check whether any of first..last is occupied */
+static BOOL occupancy_any(const SMDI_Occupancy* occ, DWORD first, DWORD last) {
+    DWORD i;
+    
+    for (i = 0; i < occ->dwRuns; i++) {
+        if (occ->lpRuns[i].dwFirst <= last && occ->lpRuns[i].dwLast >= first) {
+            return TRUE;
+        }
+    }
+    
+    return FALSE;
+}
+
+/* Replace the occupancy of first..last in occ with the runs of window,
+   which all lie within first..last */
+static BOOL occupancy_merge(SMDI_Occupancy* occ, const SMDI_Occupancy* window,
+                            DWORD first, DWORD last) {
+    SMDI_Occupancy merged;
+    SMDI_SampleRun run;
+    DWORD i;
+    BOOL ok;
+    
+    SMDI_InitOccupancy(&merged);
+    merged.dwMaxSample = window->dwMaxSample;
+    ok = TRUE;
+    
+    /* Runs before the window, cut at its start */
+    for (i = 0; ok && i < occ->dwRuns && occ->lpRuns[i].dwFirst < first; i++) {
+        run = occ->lpRuns[i];
+        if (run.dwLast >= first) {
+            run.dwLast = first - 1;
+        }
+        ok = occupancy_add_run(&merged, &run);
+    }
+    
+    for (i = 0; ok && i < window->dwRuns; i++) {
+        ok = occupancy_add_run(&merged, &window->lpRuns[i]);
+    }
+    
+    /* Runs after the window, cut at its end and the range */
+    for (i = 0; ok && i < occ->dwRuns; i++) {
+        run = occ->lpRuns[i];
+        if (run.dwLast <= last || run.dwFirst > merged.dwMaxSample) {
+            continue;
+        }
+        if (run.dwFirst <= last) {
+            run.dwFirst = last + 1;
+        }
+        if (run.dwLast > merged.dwMaxSample) {
+            run.dwLast = merged.dwMaxSample;
+        }
+        ok = occupancy_add_run(&merged, &run);
+    }
+    
+    if (!ok) {
+        SMDI_FreeOccupancy(&merged);
+        return FALSE;
+    }
+    
+    SMDI_FreeOccupancy(occ);
+    memcpy(occ, &merged, sizeof(SMDI_Occupancy));
+    
+    return TRUE;
+}
+
+/* Number of sample numbers an occupancy map marks occupied */
+DWORD SMDI_OccupiedCount(const SMDI_Occupancy* occ) {
+    DWORD count;
+    DWORD i;
+    
+    count = 0;
+    for (i = 0; i < occ->dwRuns; i++) {
+        count += occ->lpRuns[i].dwLast - occ->lpRuns[i].dwFirst + 1;
+    }
+    
+    return count;
+}
+
+/*
+ * Persistent occupancy per device
+ */
+
+/* Copy an inquiry string, dropping the space padding */
+static void discover_copy_name(char* dest, const char* src, int size) {
+    int length;
+    
+    length = 0;
+    while (length < size - 1 && src[length] != '\0') {
+        dest[length] = src[length];
+        length++;
+    }
+    
+    while (length > 0 && dest[length - 1] == ' ') {
+        length--;
+    }
+    
+    dest[length] = '\0';
+}
+
+/* Find a device in the table, -1 if it is not there */
+static int discover_find(const char* vendor, const char* product, BYTE ha_id, BYTE id) {
+    int i;
+    
+    for (i = 0; i < known_count; i++) {
+        if (known_devices[i].HA_ID == ha_id && known_devices[i].SCSI_ID == id &&
+            strcmp(known_devices[i].cVendor, vendor) == 0 &&
+            strcmp(known_devices[i].cProduct, product) == 0) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+/* Forget every remembered device */
+static void discover_clear(void) {
+    int i;
+    
+    for (i = 0; i < known_count; i++) {
+        SMDI_FreeOccupancy(&known_devices[i].Occupancy);
+    }
+    known_count = 0;
+}
+
+/* Rewrite the occupancy file from the table */
+static BOOL discover_save(void) {
+    FILE* hFile;
+    SMDI_Occupancy* occ;
+    DWORD r;
+    int i;
+    
+    if (occupancy_file[0] == '\0') {
+        return TRUE;
+    }
+    
+    hFile = fopen(occupancy_file, "w");
+    if (hFile == NULL) {
+        return FALSE;
+    }
+    
+    fprintf(hFile, "# SMDI occupancy: vendor<TAB>product<TAB>ha:id<TAB>max<TAB>runs, then first last per run\n");
+    for (i = 0; i < known_count; i++) {
+        occ = &known_devices[i].Occupancy;
+        fprintf(hFile, "%s\t%s\t%d:%d\t%lu\t%lu\n", known_devices[i].cVendor,
+                known_devices[i].cProduct, known_devices[i].HA_ID,
+                known_devices[i].SCSI_ID, occ->dwMaxSample, occ->dwRuns);
+        for (r = 0; r < occ->dwRuns; r++) {
+            fprintf(hFile, "%lu %lu\n", occ->lpRuns[r].dwFirst, occ->lpRuns[r].dwLast);
+        }
+    }
+    
+    return fclose(hFile) == 0;
+}
+
+/* Load the occupancy file into the table */
+static void discover_load(void) {
+    FILE* hFile;
+    SMDI_KnownDevice* dev;
+    char line[128];
+    char* field[5];
+    unsigned long first;
+    unsigned long last;
+    unsigned long runs;
+    unsigned long r;
+    int ha;
+    int id;
+    int i;
+    
+    hFile = fopen(occupancy_file, "r");
+    if (hFile == NULL) {
+        return;
+    }
+    
+    while (known_count < SMDI_OCCUPANCY_MAX && fgets(line, sizeof(line), hFile) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+    
+        /* vendor<TAB>product<TAB>ha:id<TAB>max<TAB>runs */
+        field[0] = line;
+        for (i = 1; i < 5; i++) {
+            field[i] = strchr(field[i - 1], '\t');
+            if (field[i] == NULL) {
+                break;
+            }
+            *field[i]++ = '\0';
+        }
+        if (i < 5 || sscanf(field[2], "%d:%d", &ha, &id) != 2) {
+            continue;
+        }
+    
+        dev = &known_devices[known_count];
+        discover_copy_name(dev->cVendor, field[0], 9);
+        discover_copy_name(dev->cProduct, field[1], 17);
+        dev->HA_ID = (BYTE)ha;
+        dev->SCSI_ID = (BYTE)id;
+        SMDI_InitOccupancy(&dev->Occupancy);
+        dev->Occupancy.dwMaxSample = strtoul(field[3], NULL, 10);
+        runs = strtoul(field[4], NULL, 10);
+    
+        for (r = 0; r < runs; r++) {
+            if (fscanf(hFile, "%lu %lu", &first, &last) != 2 || last < first ||
+                !SMDI_AddOccupied(&dev->Occupancy, first)) {
+                break;
+            }
+            dev->Occupancy.lpRuns[dev->Occupancy.dwRuns - 1].dwLast = last;
+        }
+    
+        known_count++;
+    }
+    
+    fclose(hFile);
+}
+
+/* Get the vendor and product of the device on a connection */
+static void discover_identify(SMDI_Connection* conn, char vendor[9], char product[17]) {
+    SCSI_DevInfo info;
+    
+    memset(&info, 0, sizeof(info));
+    info.dwStructSize = sizeof(info);
+    SMDIC_GetDeviceInfo(conn, &info);
+    
+    discover_copy_name(vendor, info.cManufacturer, 9);
+    discover_copy_name(product, info.cName, 17);
+}
+
+/* Set the file sample occupancy is remembered in between sessions and
+   load it; NULL forgets the file and all remembered devices */
+BOOL SMDI_SetOccupancyFile(const char* filename) {
+    discover_clear();
+    occupancy_file[0] = '\0';
+    
+    if (filename == NULL) {
+        return TRUE;
+    }
+    
+    if (strlen(filename) >= MAXFNLEN) {
+        return FALSE;
+    }
+    
+    strcpy(occupancy_file, filename);
+    discover_load();
+    
+    return TRUE;
+}
+
+/* Get the remembered occupancy of the device on a connection. Returns
+   FALSE and an empty map if nothing is remembered. */
+BOOL SMDIC_LoadOccupancy(SMDI_Connection* conn, SMDI_Occupancy* occ) {
+    char vendor[9];
+    char product[17];
+    int index;
+    
+    if (occ == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_FreeOccupancy(occ);
+    
+    /* Nothing remembered: spare the device the inquiry */
+    if (conn == NULL || known_count == 0) {
+        return FALSE;
+    }
+    
+    discover_identify(conn, vendor, product);
+    
+    index = discover_find(vendor, product, conn->HA_ID, conn->SCSI_ID);
+    if (index < 0) {
+        return FALSE;
+    }
+    
+    return occupancy_copy(occ, &known_devices[index].Occupancy);
+}
+
+/* Remember the occupancy of the device on a connection, updating the
+   file if set */
+BOOL SMDIC_StoreOccupancy(SMDI_Connection* conn, const SMDI_Occupancy* occ) {
+    char vendor[9];
+    char product[17];
+    int index;
+    
+    if (conn == NULL || occ == NULL) {
+        return FALSE;
+    }
+    
+    discover_identify(conn, vendor, product);
+    
+    index = discover_find(vendor, product, conn->HA_ID, conn->SCSI_ID);
+    if (index < 0) {
+        if (known_count >= SMDI_OCCUPANCY_MAX) {
+            return FALSE;
+        }
+    
+        index = known_count++;
+        strcpy(known_devices[index].cVendor, vendor);
+        strcpy(known_devices[index].cProduct, product);
+        known_devices[index].HA_ID = conn->HA_ID;
+        known_devices[index].SCSI_ID = conn->SCSI_ID;
+        SMDI_InitOccupancy(&known_devices[index].Occupancy);
+    }
+    
+    if (!occupancy_copy(&known_devices[index].Occupancy, occ)) {
+        return FALSE;
+    }
+    
+    return discover_save();
+}
+
+/*
+ * Discovery
+ */
+
+/* Ask for the header of one sample number */
+static int discover_probe(SMDI_Connection* conn, DWORD number, SMDI_SampleHeader* sh) {
+    DWORD result;
+    
+    memset(sh, 0, sizeof(SMDI_SampleHeader));
+    sh->dwStructSize = sizeof(SMDI_SampleHeader);
+    
+    result = SMDIC_SampleHeaderRequest(conn, number, sh);
+    if (result == SMDIM_SAMPLEHEADER) {
+        return PROBE_OCCUPIED;
+    }
+    
+    if (result == SMDIM_MESSAGEREJECT) {
+        if (SMDIC_GetLastError(conn) == SMDIE_OUTOFRANGE) {
+            return PROBE_OUTOFRANGE;
+        }
+    
+        /* No sample there (SMDIE_NOSAMPLE) */
+        return PROBE_EMPTY;
+    }
+    
+    return PROBE_ERROR;
+}
+
+/* Find the highest sample number the device accepts. A remembered
+   maximum is checked with two requests, otherwise the 24-bit number
+   space is bisected on out-of-range answers. Returns SMDIM_ENDOFPROCEDURE
+   with *maxSample set, SMDI_RANGE_UNKNOWN if the device has no valid
+   numbers at all. */
+DWORD SMDIC_FindSampleRange(SMDI_Connection* conn,
+                           DWORD hint,
+                           DWORD* maxSample,
+                           DWORD* probes) {
+    SMDI_SampleHeader sh;
+    DWORD valid;
+    DWORD invalid;
+    DWORD mid;
+    DWORD count;
+    int state;
+    
+    if (conn == NULL || maxSample == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    count = 0;
+    valid = SMDI_RANGE_UNKNOWN;
+    invalid = SMDI_MAX_SAMPLE_NUMBER + 1;
+    
+    /* The remembered maximum still holds if it answers and the next
+       number is out of range */
+    if (hint != SMDI_RANGE_UNKNOWN && hint < SMDI_MAX_SAMPLE_NUMBER) {
+        state = discover_probe(conn, hint, &sh);
+        count++;
+        if (state == PROBE_ERROR) {
+            return SMDIM_ERROR;
+        }
+    
+        if (state == PROBE_OUTOFRANGE) {
+            invalid = hint;
+        } else {
+            valid = hint;
+            state = discover_probe(conn, hint + 1, &sh);
+            count++;
+            if (state == PROBE_ERROR) {
+                return SMDIM_ERROR;
+            }
+            if (state == PROBE_OUTOFRANGE) {
+                invalid = hint + 1;
+            } else {
+                valid = hint + 1;
+            }
+        }
+    }
+    
+    /* Sample 0 anchors the search */
+    if (valid == SMDI_RANGE_UNKNOWN && invalid > 0) {
+        state = discover_probe(conn, 0, &sh);
+        count++;
+        if (state == PROBE_ERROR) {
+            return SMDIM_ERROR;
+        }
+        if (state != PROBE_OUTOFRANGE) {
+            valid = 0;
+        }
+    }
+    
+    if (valid != SMDI_RANGE_UNKNOWN) {
+        while (invalid - valid > 1) {
+            mid = valid + (invalid - valid) / 2;
+            state = discover_probe(conn, mid, &sh);
+            count++;
+            if (state == PROBE_ERROR) {
+                return SMDIM_ERROR;
+            }
+    
+            if (state == PROBE_OUTOFRANGE) {
+                invalid = mid;
+            } else {
+                valid = mid;
+            }
+        }
+    }
+    
+    *maxSample = valid;
+    if (probes != NULL) {
+        *probes = count;
+    }
+    
+    return SMDIM_ENDOFPROCEDURE;
+}
+
+/* Find the occupied sample numbers of a device with as few header
+   requests as possible and pass each existing sample to callback in
+   ascending order.
+
+   occ holds the occupancy remembered from an earlier scan (possibly
+   empty) and receives the occupancy found. The range is checked first;
+   then every slot is probed in dense stretches: from sample 0, from a
+   few slots before each remembered run through its end, and after any
+   occupied slot until dwGapLimit empty slots in a row. Gaps in between
+   are only probed every dwStride slots; a hit there rescans the stride
+   it ends. Stride 1 probes every slot.
+
+   dwFirst..dwLimit scan a window of the range, so a long scan can be
+   split up: the range is only checked when the window starts at 0 or
+   occ has no range, and the occupancy found replaces occ only within
+   the window. */
+DWORD SMDIC_DiscoverSamples(SMDI_Connection* conn,
+                           SMDI_Occupancy* occ,
+                           SMDI_DiscoverInfo* info,
+                           SMDI_HeaderCallback callback,
+                           DWORD dwUserData) {
+    SMDI_DiscoverInfo di;
+    SMDI_Occupancy found;
+    SMDI_SampleHeader sh;
+    DWORD result;
+    DWORD hint;
+    DWORD max;
+    DWORD n;
+    DWORD target;
+    DWORD lead;
+    DWORD empties;
+    DWORD h;
+    BOOL dense;
+    BOOL stopped;
+    BOOL opened;
+    int state;
+    
+    if (conn == NULL || occ == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    memset(&di, 0, sizeof(di));
+    if (info != NULL) {
+        memcpy(&di, info, (info->dwStructSize > sizeof(di) || info->dwStructSize == 0) ?
+               sizeof(di) : info->dwStructSize);
+    }
+    di.dwStructSize = sizeof(di);
+    di.dwProbes = 0;
+    di.dwRangeProbes = 0;
+    di.dwCovered = 0;
+    di.dwFound = 0;
+    
+    if (di.dwGapLimit == 0) {
+        di.dwGapLimit = SMDI_DISCOVER_GAP;
+    }
+    
+    /* Hold the handle for the whole scan */
+    opened = !conn->bOpen && ASPI_OpenDevice(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+    
+    hint = (occ->dwStructSize != 0) ? occ->dwMaxSample : SMDI_RANGE_UNKNOWN;
+    if (di.dwFirst == 0 || hint == SMDI_RANGE_UNKNOWN) {
+        result = SMDIC_FindSampleRange(conn, hint, &max, &di.dwRangeProbes);
+    } else {
+        /* Later windows go by the range found for the first */
+        result = SMDIM_ENDOFPROCEDURE;
+        max = hint;
+    }
+    di.dwProbes = di.dwRangeProbes;
+    di.dwMaxSample = max;
+    
+    SMDI_InitOccupancy(&found);
+    found.dwMaxSample = max;
+    stopped = FALSE;
+    
+    if (result == SMDIM_ENDOFPROCEDURE && max != SMDI_RANGE_UNKNOWN &&
+        di.dwFirst <= max) {
+        /* Keep the stride probes over a huge range bounded */
+        if (di.dwStride == 0) {
+            di.dwStride = max / SMDI_DISCOVER_SPARSE + 1;
+            if (di.dwStride < SMDI_DISCOVER_STRIDE) {
+                di.dwStride = SMDI_DISCOVER_STRIDE;
+            }
+        }
+    
+        if (di.dwLimit != 0 && di.dwLimit < max) {
+            max = di.dwLimit;
+        }
+    
+        n = di.dwFirst;
+        h = 0;
+        empties = 0;
+    
+        /* A window carries on the dense stretch of a sample just before it */
+        dense = (n == 0 || occupancy_any(occ, (n > di.dwGapLimit) ? n - di.dwGapLimit : 0, n - 1));
+    
+        while (n <= max) {
+            /* Skip remembered runs that lie behind */
+            while (h < occ->dwRuns && occ->lpRuns[h].dwLast < n) {
+                h++;
+            }
+            lead = SMDI_RANGE_UNKNOWN;
+            if (h < occ->dwRuns) {
+                lead = (occ->lpRuns[h].dwFirst > di.dwGapLimit) ?
+                       occ->lpRuns[h].dwFirst - di.dwGapLimit : 0;
+            }
+    
+            if (!dense) {
+                /* Up to the lead-in of the next remembered run */
+                if (lead != SMDI_RANGE_UNKNOWN && n >= lead) {
+                    dense = TRUE;
+                    empties = 0;
+                    continue;
+                }
+    
+                target = (max - n >= di.dwStride - 1) ? n + di.dwStride - 1 : max;
+                if (lead != SMDI_RANGE_UNKNOWN && target >= lead) {
+                    n = lead;
+                    continue;
+                }
+    
+                state = discover_probe(conn, target, &sh);
+                di.dwProbes++;
+                if (state == PROBE_ERROR) {
+                    result = SMDIM_ERROR;
+                    break;
+                }
+    
+                if (state == PROBE_OCCUPIED) {
+                    /* Rescan the stride densely, target included */
+                    dense = TRUE;
+                    empties = 0;
+                } else {
+                    di.dwCovered++;
+                    n = target + 1;
+                }
+                continue;
+            }
+    
+            state = discover_probe(conn, n, &sh);
+            di.dwProbes++;
+            if (state == PROBE_ERROR) {
+                result = SMDIM_ERROR;
+                break;
+            }
+            di.dwCovered++;
+    
+            if (state == PROBE_OCCUPIED) {
+                empties = 0;
+                di.dwFound++;
+                if (!SMDI_AddOccupied(&found, n)) {
+                    result = SMDIM_ERROR;
+                    break;
+                }
+                if (callback != NULL && !(*callback)(n, &sh, dwUserData)) {
+                    stopped = TRUE;
+                    break;
+                }
+            } else {
+                empties++;
+            }
+    
+            /* Leave the dense stretch after enough empty slots, unless a
+               remembered run still lies ahead within the gap limit */
+            if (empties >= di.dwGapLimit &&
+                (lead == SMDI_RANGE_UNKNOWN || n + 1 < lead)) {
+                dense = FALSE;
+            }
+    
+            if (n == max) {
+                break;
+            }
+            n++;
+        }
+    }
+    
+    if (opened) {
+        ASPI_CloseDevice(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+    }
+    
+    /* A complete scan replaces the remembered occupancy of its window */
+    if (result == SMDIM_ENDOFPROCEDURE && !stopped &&
+        !occupancy_merge(occ, &found, di.dwFirst, max)) {
+        result = SMDIM_ERROR;
+    }
+    SMDI_FreeOccupancy(&found);
+    
+    if (info != NULL) {
+        memcpy(info, &di, (info->dwStructSize > sizeof(di) || info->dwStructSize == 0) ?
+               sizeof(di) : info->dwStructSize);
+    }
+    
+    return result;
+}
@@ -0,0 +1,875 @@
+/*
+ * SMDI job queue for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * One worker thread per queue takes the best queued job, runs it on the
+ * connection and goes straight on to the next. Transfers run as
+ * asynchronous transfers the worker waits for, so a running job can be
+ * cancelled between packets. A semaphore of one unit guards the lists;
+ * another wakes the worker whenever there may be work for it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "smdi.h"
+#include "smdi_thread.h"
+#include "smdi_jobs.h"
+
+/* A job and what it needs to run */
+typedef struct SMDI_QueuedJob {
+    SMDI_JobInfo Info;
+    SMDI_SampleSource* lpSource;        /* Upload source, NULL until an upload file is opened */
+    SMDI_SourceOpener lpOpen;           /* Opens an upload file, NULL: native sample file */
+    SMDI_SampleSink* lpSink;            /* Download sink */
+    SMDI_SampleHeader Header;           /* Download header if bHeader */
+    BOOL bHeader;
+    volatile BOOL bCancel;              /* Stop the running transfer at the next packet */
+    SMDI_JobQueue* lpQueue;
+    struct SMDI_QueuedJob* lpNext;
+} SMDI_QueuedJob;
+
+struct SMDI_JobQueue {
+    SMDI_Connection* lpConnection;
+    SMDI_JobCallback lpCallback;
+    DWORD dwUserData;
+    SMDI_Thread* thread;
+    SMDI_Semaphore* semLock;            /* Guards everything below */
+    SMDI_Semaphore* semWork;            /* Posted when the worker may have work */
+    SMDI_Semaphore* semIdle;            /* Posted once per waiter when the queue runs dry */
+    SMDI_QueuedJob* lpJobs;             /* Queued, in queue order */
+    SMDI_QueuedJob* lpRunning;
+    SMDI_QueuedJob* lpEnded;            /* Ended, oldest first */
+    SMDI_QueuedJob* lpEndedTail;
+    DWORD dwNextID;
+    DWORD dwIdleWaiters;
+    BOOL bBusy;                         /* Jobs were queued since the queue last ran dry */
+    BOOL bReportingIdle;                /* The callback is told the queue ran dry */
+    BOOL bPaused;
+    BOOL bClosing;
+};
+
+static void SMDI_LockQueue(SMDI_JobQueue* queue) {
+    SMDI_WaitSemaphore(queue->semLock);
+}
+
+static void SMDI_UnlockQueue(SMDI_JobQueue* queue) {
+    SMDI_PostSemaphore(queue->semLock);
+}
+
+/* Pass a copy of a job's state to the callback, as the job itself may be
+   collected and freed meanwhile */
+static void SMDI_ReportJob(SMDI_JobQueue* queue, SMDI_QueuedJob* job) {
+    SMDI_JobInfo info;
+    
+    if (queue->lpCallback == NULL) {
+        return;
+    }
+    
+    if (job == NULL) {
+        (*queue->lpCallback)(NULL, queue->dwUserData);
+        return;
+    }
+    
+    memcpy(&info, &job->Info, sizeof(SMDI_JobInfo));
+    (*queue->lpCallback)(&info, queue->dwUserData);
+}
+
+/* Release what a job still holds and free it */
+static void SMDI_FreeJob(SMDI_QueuedJob* job) {
+    SMDI_CloseSource(job->lpSource);
+    if (job->lpSink != NULL) {
+        SMDI_CloseSink(job->lpSink, FALSE);
+    }
+    free(job);
+}
+
+/* Append an ended job to the ended list; called locked */
+static void SMDI_EndJob(SMDI_JobQueue* queue, SMDI_QueuedJob* job) {
+    job->lpNext = NULL;
+    if (queue->lpEndedTail != NULL) {
+        queue->lpEndedTail->lpNext = job;
+    } else {
+        queue->lpEnded = job;
+    }
+    queue->lpEndedTail = job;
+}
+
+/* Whether job a runs before job b */
+static BOOL SMDI_JobBefore(SMDI_QueuedJob* a, SMDI_QueuedJob* b) {
+    if (a->Info.dwPriority != b->Info.dwPriority) {
+        return a->Info.dwPriority < b->Info.dwPriority;
+    }
+    if (a->Info.dwBytes != b->Info.dwBytes) {
+        return a->Info.dwBytes < b->Info.dwBytes;
+    }
+    
+    return a->Info.dwJobID < b->Info.dwJobID;
+}
+
+/* Unlink the job to run next; called locked */
+static SMDI_QueuedJob* SMDI_TakeNextJob(SMDI_JobQueue* queue) {
+    SMDI_QueuedJob** lpLink;
+    SMDI_QueuedJob** lpBest;
+    SMDI_QueuedJob* job;
+    
+    lpBest = NULL;
+    for (lpLink = &queue->lpJobs; *lpLink != NULL; lpLink = &(*lpLink)->lpNext) {
+        if (lpBest == NULL || SMDI_JobBefore(*lpLink, *lpBest)) {
+            lpBest = lpLink;
+        }
+    }
+    
+    if (lpBest == NULL) {
+        return NULL;
+    }
+    
+    job = *lpBest;
+    *lpBest = job->lpNext;
+    job->lpNext = NULL;
+    
+    return job;
+}
+
+/* Unlink a queued job by ID; called locked */
+static SMDI_QueuedJob* SMDI_UnlinkJob(SMDI_JobQueue* queue, DWORD dwJobID) {
+    SMDI_QueuedJob** lpLink;
+    SMDI_QueuedJob* job;
+    
+    for (lpLink = &queue->lpJobs; *lpLink != NULL; lpLink = &(*lpLink)->lpNext) {
+        if ((*lpLink)->Info.dwJobID == dwJobID) {
+            job = *lpLink;
+            *lpLink = job->lpNext;
+            job->lpNext = NULL;
+            return job;
+        }
+    }
+    
+    return NULL;
+}
+
+/* Sample data bytes of a header */
+static DWORD SMDI_HeaderBytes(SMDI_SampleHeader* sh) {
+    return (sh->dwLength * (DWORD)sh->NumberOfChannels * (DWORD)sh->BitsPerWord) / 8;
+}
+
+/* Progress of a running transfer; also where a cancelled job stops it */
+static void SMDI_JobProgress(SMDI_FileTransmissionInfo* fti, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    SMDI_TransmissionInfo* ti;
+    DWORD dwBytes;
+    DWORD dwDone;
+    
+    job = (SMDI_QueuedJob*)dwUserData;
+    ti = fti->lpTransmissionInfo;
+    
+    /* The last call, made once the transfer is marked done, is reported
+       with the end of the job */
+    if (fti->lpTransfer != NULL && SMDI_PollTransfer(fti->lpTransfer) != SMDI_TRANSFER_PENDING) {
+        return;
+    }
+    
+    if (job->bCancel && fti->lpTransfer != NULL) {
+        SMDI_CancelTransfer(fti->lpTransfer);
+    }
+    
+    if (ti == NULL || ti->lpSampleHeader == NULL) {
+        return;
+    }
+    
+    dwBytes = SMDI_HeaderBytes(ti->lpSampleHeader);
+    dwDone = ti->dwTransmittedPackets * ti->dwPacketSize;
+    
+    /* The pair is read under the lock by SMDI_GetJobInfo */
+    SMDI_LockQueue(job->lpQueue);
+    job->Info.dwBytes = dwBytes;
+    job->Info.dwDone = dwDone < dwBytes ? dwDone : dwBytes;
+    SMDI_UnlockQueue(job->lpQueue);
+    
+    SMDI_ReportJob(job->lpQueue, job);
+}
+
+/* Open the file of an upload queued by name as a native sample file */
+static SMDI_SampleSource* SMDI_OpenNativeSource(const char* cFileName) {
+    char cName[MAX_PATH];
+    DWORD dwFileType;
+    
+    strncpy(cName, cFileName, MAX_PATH - 1);
+    cName[MAX_PATH - 1] = '\0';
+    
+    return SMDI_OpenFileSource(cName, &dwFileType);
+}
+
+/* Run an upload or download as an asynchronous transfer and wait for it */
+static DWORD SMDI_RunTransfer(SMDI_JobQueue* queue, SMDI_QueuedJob* job) {
+    SMDI_FileTransfer ft;
+    SMDI_Transfer* transfer;
+    DWORD dwResult;
+    
+    /* Set only once a worker thread runs the transfer */
+    transfer = NULL;
+    
+    memset(&ft, 0, sizeof(SMDI_FileTransfer));
+    ft.dwStructSize = sizeof(SMDI_FileTransfer);
+    ft.HA_ID = queue->lpConnection->HA_ID;
+    ft.SCSI_ID = queue->lpConnection->SCSI_ID;
+    ft.dwSampleNumber = job->Info.dwSampleNumber;
+    ft.lpConnection = queue->lpConnection;
+    ft.lpCallback = (void*)SMDI_JobProgress;
+    ft.dwUserData = (DWORD)job;
+    ft.bAsync = TRUE;
+    ft.lpHandle = &transfer;
+    
+    if (job->Info.dwKind == SMDI_JOB_UPLOAD) {
+        /* An upload queued by name is opened now and read ahead */
+        if (job->lpSource == NULL) {
+            job->lpSource = job->lpOpen != NULL ?
+                (*job->lpOpen)(job->Info.cName, queue->lpConnection) :
+                SMDI_OpenNativeSource(job->Info.cName);
+            if (job->lpSource == NULL) {
+                return FE_OPENERROR;
+            }
+            ft.dwReadAhead = SMDI_READAHEAD_DEFAULT;
+        }
+        SMDI_LockQueue(queue);
+        job->Info.dwBytes = SMDI_HeaderBytes(&job->lpSource->Header);
+        SMDI_UnlockQueue(queue);
+    
+        /* The transfer closes the source */
+        ft.lpSource = job->lpSource;
+        job->lpSource = NULL;
+        dwResult = SMDI_SendFile(&ft);
+    } else {
+        /* The transfer closes the sink */
+        ft.lpSink = job->lpSink;
+        ft.lpSampleHeader = job->bHeader ? &job->Header : NULL;
+        job->lpSink = NULL;
+        dwResult = SMDI_ReceiveFile(&ft);
+    }
+    
+    /* Without a worker thread the transfer has already run and returned
+       its result; otherwise the result comes from the join */
+    if (transfer != NULL) {
+        dwResult = SMDI_WaitTransfer(transfer);
+    }
+    
+    return dwResult;
+}
+
+/* Run a job on the worker thread and set its final state */
+static void SMDI_RunJob(SMDI_JobQueue* queue, SMDI_QueuedJob* job) {
+    DWORD dwResult;
+    BOOL bOk;
+    
+    /* A job that fails before it sends a command must not pick up the
+       reject of the one before */
+    queue->lpConnection->dwLastError = 0;
+    
+    switch (job->Info.dwKind) {
+        case SMDI_JOB_UPLOAD:
+        case SMDI_JOB_DOWNLOAD:
+            dwResult = SMDI_RunTransfer(queue, job);
+            bOk = (dwResult == SMDIM_ENDOFPROCEDURE);
+            break;
+    
+        case SMDI_JOB_DELETE:
+            dwResult = SMDIC_DeleteSample(queue->lpConnection, job->Info.dwSampleNumber);
+            bOk = (dwResult == SMDIM_ACK || dwResult == SMDIM_ENDOFPROCEDURE);
+            break;
+    
+        case SMDI_JOB_RENAME:
+            dwResult = SMDIC_SampleName(queue->lpConnection, job->Info.dwSampleNumber,
+                                        job->Info.cName);
+            bOk = (dwResult == SMDIM_ACK || dwResult == SMDIM_ENDOFPROCEDURE);
+            break;
+    
+        default:
+            dwResult = SMDIM_ERROR;
+            bOk = FALSE;
+            break;
+    }
+    
+    /* A delete returns the reject's error code rather than
+       SMDIM_MESSAGEREJECT: any job the device rejected ends like a
+       rejected transfer */
+    if (!bOk && dwResult != FE_CANCELLED) {
+        job->Info.dwError = SMDIC_GetLastError(queue->lpConnection);
+        if (job->Info.dwError != 0) {
+            dwResult = SMDIM_MESSAGEREJECT;
+        }
+    }
+    job->Info.dwResult = dwResult;
+    
+    if (bOk) {
+        job->Info.dwState = SMDI_JOB_DONE;
+    } else if (dwResult == FE_CANCELLED) {
+        job->Info.dwState = SMDI_JOB_CANCELLED;
+    } else {
+        job->Info.dwState = SMDI_JOB_FAILED;
+    }
+}
+
+/* Worker thread: run jobs until the queue is closed */
+static void SMDI_JobWorker(void* lpArg) {
+    SMDI_JobQueue* queue;
+    SMDI_QueuedJob* job;
+    SMDI_JobInfo info;
+    DWORD dwWaiters;
+    BOOL bIdle;
+    BOOL bClosing;
+    
+    queue = (SMDI_JobQueue*)lpArg;
+    
+    for (;;) {
+        SMDI_LockQueue(queue);
+    
+        job = NULL;
+        if (!queue->bPaused && !queue->bClosing) {
+            job = SMDI_TakeNextJob(queue);
+        }
+        queue->lpRunning = job;
+        if (job != NULL) {
+            job->Info.dwState = SMDI_JOB_RUNNING;
+        }
+    
+        /* Ran dry: wake whoever waits for that */
+        bIdle = FALSE;
+        dwWaiters = 0;
+        if (job == NULL && queue->lpJobs == NULL && queue->bBusy) {
+            queue->bBusy = FALSE;
+            queue->bReportingIdle = TRUE;
+            bIdle = TRUE;
+            dwWaiters = queue->dwIdleWaiters;
+            queue->dwIdleWaiters = 0;
+        }
+        bClosing = queue->bClosing;
+    
+        SMDI_UnlockQueue(queue);
+    
+        if (job == NULL) {
+            if (bIdle) {
+                SMDI_ReportJob(queue, NULL);
+    
+                /* Those who came to wait during the report are woken too,
+                   unless jobs were queued meanwhile */
+                SMDI_LockQueue(queue);
+                queue->bReportingIdle = FALSE;
+                if (!queue->bBusy) {
+                    dwWaiters += queue->dwIdleWaiters;
+                    queue->dwIdleWaiters = 0;
+                }
+                SMDI_UnlockQueue(queue);
+    
+                while (dwWaiters-- > 0) {
+                    SMDI_PostSemaphore(queue->semIdle);
+                }
+            }
+            if (bClosing) {
+                break;
+            }
+            SMDI_WaitSemaphore(queue->semWork);
+            continue;
+        }
+    
+        SMDI_ReportJob(queue, job);
+    
+        /* Cancelled between being taken and starting */
+        if (job->bCancel) {
+            job->Info.dwResult = FE_CANCELLED;
+            job->Info.dwState = SMDI_JOB_CANCELLED;
+        } else {
+            SMDI_RunJob(queue, job);
+        }
+    
+        /* Once ended the job may be collected and freed */
+        SMDI_LockQueue(queue);
+        queue->lpRunning = NULL;
+        memcpy(&info, &job->Info, sizeof(SMDI_JobInfo));
+        SMDI_EndJob(queue, job);
+        SMDI_UnlockQueue(queue);
+    
+        if (queue->lpCallback != NULL) {
+            (*queue->lpCallback)(&info, queue->dwUserData);
+        }
+    }
+}
+
+/* Open a job queue on a connection and start its worker */
+SMDI_JobQueue* SMDI_OpenJobQueue(SMDI_Connection* conn, SMDI_JobCallback callback, DWORD dwUserData) {
+    SMDI_JobQueue* queue;
+    
+    if (conn == NULL) {
+        return NULL;
+    }
+    
+    queue = (SMDI_JobQueue*)malloc(sizeof(SMDI_JobQueue));
+    if (queue == NULL) {
+        return NULL;
+    }
+    
+    memset(queue, 0, sizeof(SMDI_JobQueue));
+    queue->lpConnection = conn;
+    queue->lpCallback = callback;
+    queue->dwUserData = dwUserData;
+    queue->dwNextID = 1;
+    
+    queue->semLock = SMDI_CreateSemaphore(1);
+    queue->semWork = SMDI_CreateSemaphore(0);
+    queue->semIdle = SMDI_CreateSemaphore(0);
+    if (queue->semLock != NULL && queue->semWork != NULL && queue->semIdle != NULL) {
+        queue->thread = SMDI_StartThread(SMDI_JobWorker, queue);
+    }
+    
+    if (queue->thread == NULL) {
+        SMDI_FreeSemaphore(queue->semLock);
+        SMDI_FreeSemaphore(queue->semWork);
+        SMDI_FreeSemaphore(queue->semIdle);
+        free(queue);
+        return NULL;
+    }
+    
+    return queue;
+}
+
+/* Cancel every job, stop the worker and free the queue */
+void SMDI_CloseJobQueue(SMDI_JobQueue* queue) {
+    SMDI_QueuedJob* job;
+    
+    if (queue == NULL) {
+        return;
+    }
+    
+    SMDI_LockQueue(queue);
+    queue->bClosing = TRUE;
+    SMDI_UnlockQueue(queue);
+    
+    SMDI_CancelAllJobs(queue);
+    
+    SMDI_PostSemaphore(queue->semWork);
+    SMDI_JoinThread(queue->thread);
+    
+    /* Nobody collects the ended jobs any more */
+    while (queue->lpEnded != NULL) {
+        job = queue->lpEnded;
+        queue->lpEnded = job->lpNext;
+        SMDI_FreeJob(job);
+    }
+    
+    SMDI_FreeSemaphore(queue->semLock);
+    SMDI_FreeSemaphore(queue->semWork);
+    SMDI_FreeSemaphore(queue->semIdle);
+    free(queue);
+}
+
+/* Allocate a job of a kind; NULL if out of memory */
+static SMDI_QueuedJob* SMDI_NewJob(SMDI_JobQueue* queue, DWORD dwKind, DWORD dwSampleNumber,
+                                   DWORD dwPriority, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    
+    if (queue == NULL) {
+        return NULL;
+    }
+    
+    job = (SMDI_QueuedJob*)malloc(sizeof(SMDI_QueuedJob));
+    if (job == NULL) {
+        return NULL;
+    }
+    
+    memset(job, 0, sizeof(SMDI_QueuedJob));
+    job->Info.dwStructSize = sizeof(SMDI_JobInfo);
+    job->Info.dwKind = dwKind;
+    job->Info.dwPriority = dwPriority;
+    job->Info.dwState = SMDI_JOB_QUEUED;
+    job->Info.dwSampleNumber = dwSampleNumber;
+    job->Info.dwResult = SMDI_TRANSFER_PENDING;
+    job->Info.dwUserData = dwUserData;
+    job->lpQueue = queue;
+    
+    return job;
+}
+
+/* Give a job its ID, append it and wake the worker */
+static DWORD SMDI_AddJob(SMDI_JobQueue* queue, SMDI_QueuedJob* job) {
+    SMDI_QueuedJob** lpLink;
+    DWORD dwJobID;
+    
+    SMDI_LockQueue(queue);
+    
+    if (queue->bClosing) {
+        SMDI_UnlockQueue(queue);
+        SMDI_FreeJob(job);
+        return 0;
+    }
+    
+    dwJobID = queue->dwNextID++;
+    if (queue->dwNextID == 0) {
+        queue->dwNextID = 1;
+    }
+    job->Info.dwJobID = dwJobID;
+    
+    for (lpLink = &queue->lpJobs; *lpLink != NULL; lpLink = &(*lpLink)->lpNext) {
+        /* Find the end */
+    }
+    *lpLink = job;
+    queue->bBusy = TRUE;
+    
+    SMDI_UnlockQueue(queue);
+    
+    SMDI_PostSemaphore(queue->semWork);
+    
+    return dwJobID;
+}
+
+/* Queue the upload of a source */
+DWORD SMDI_QueueUpload(SMDI_JobQueue* queue, DWORD dwSampleNumber, SMDI_SampleSource* src,
+                       DWORD dwPriority, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    
+    if (src == NULL) {
+        return 0;
+    }
+    
+    job = SMDI_NewJob(queue, SMDI_JOB_UPLOAD, dwSampleNumber, dwPriority, dwUserData);
+    if (job == NULL) {
+        SMDI_CloseSource(src);
+        return 0;
+    }
+    
+    job->lpSource = src;
+    job->Info.dwBytes = SMDI_HeaderBytes(&src->Header);
+    strncpy(job->Info.cName, src->Header.cName, MAX_PATH - 1);
+    
+    return SMDI_AddJob(queue, job);
+}
+
+/* Queue the upload of a file, opened when the job starts */
+DWORD SMDI_QueueUploadFile(SMDI_JobQueue* queue, DWORD dwSampleNumber, const char* cFileName,
+                           SMDI_SourceOpener lpOpen, DWORD dwPriority, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    struct stat st;
+    
+    if (cFileName == NULL) {
+        return 0;
+    }
+    
+    job = SMDI_NewJob(queue, SMDI_JOB_UPLOAD, dwSampleNumber, dwPriority, dwUserData);
+    if (job == NULL) {
+        return 0;
+    }
+    
+    job->lpOpen = lpOpen;
+    strncpy(job->Info.cName, cFileName, MAX_PATH - 1);
+    
+    /* The file size stands in for the sample size until it is opened */
+    job->Info.dwBytes = stat(cFileName, &st) == 0 ? (DWORD)st.st_size : SMDI_JOB_SIZE_UNKNOWN;
+    
+    return SMDI_AddJob(queue, job);
+}
+
+/* Queue the download of a sample into a sink */
+DWORD SMDI_QueueDownload(SMDI_JobQueue* queue, DWORD dwSampleNumber, SMDI_SampleSink* sink,
+                         SMDI_SampleHeader* sh, DWORD dwPriority, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    
+    if (sink == NULL) {
+        return 0;
+    }
+    
+    job = SMDI_NewJob(queue, SMDI_JOB_DOWNLOAD, dwSampleNumber, dwPriority, dwUserData);
+    if (job == NULL) {
+        SMDI_CloseSink(sink, FALSE);
+        return 0;
+    }
+    
+    job->lpSink = sink;
+    job->Info.dwBytes = SMDI_JOB_SIZE_UNKNOWN;
+    if (sh != NULL) {
+        memcpy(&job->Header, sh, sizeof(SMDI_SampleHeader));
+        job->bHeader = TRUE;
+        job->Info.dwBytes = SMDI_HeaderBytes(sh);
+    }
+    
+    return SMDI_AddJob(queue, job);
+}
+
+/* Queue the deletion of a sample */
+DWORD SMDI_QueueDelete(SMDI_JobQueue* queue, DWORD dwSampleNumber,
+                       DWORD dwPriority, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    
+    job = SMDI_NewJob(queue, SMDI_JOB_DELETE, dwSampleNumber, dwPriority, dwUserData);
+    if (job == NULL) {
+        return 0;
+    }
+    
+    return SMDI_AddJob(queue, job);
+}
+
+/* Queue the renaming of a sample */
+DWORD SMDI_QueueRename(SMDI_JobQueue* queue, DWORD dwSampleNumber, const char* cName,
+                       DWORD dwPriority, DWORD dwUserData) {
+    SMDI_QueuedJob* job;
+    
+    if (cName == NULL) {
+        return 0;
+    }
+    
+    job = SMDI_NewJob(queue, SMDI_JOB_RENAME, dwSampleNumber, dwPriority, dwUserData);
+    if (job == NULL) {
+        return 0;
+    }
+    
+    /* Sample names are at most 255 characters */
+    strncpy(job->Info.cName, cName, 255);
+    
+    return SMDI_AddJob(queue, job);
+}
+
+/* End a job that never ran as cancelled */
+static void SMDI_DropJob(SMDI_QueuedJob* job) {
+    SMDI_CloseSource(job->lpSource);
+    job->lpSource = NULL;
+    if (job->lpSink != NULL) {
+        SMDI_CloseSink(job->lpSink, FALSE);
+        job->lpSink = NULL;
+    }
+    
+    job->Info.dwResult = FE_CANCELLED;
+    job->Info.dwState = SMDI_JOB_CANCELLED;
+}
+
+/* Cancel a queued or running job */
+BOOL SMDI_CancelJob(SMDI_JobQueue* queue, DWORD dwJobID) {
+    SMDI_QueuedJob* job;
+    SMDI_JobInfo info;
+    
+    if (queue == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_LockQueue(queue);
+    
+    if (queue->lpRunning != NULL && queue->lpRunning->Info.dwJobID == dwJobID) {
+        queue->lpRunning->bCancel = TRUE;
+        SMDI_UnlockQueue(queue);
+        return TRUE;
+    }
+    
+    job = SMDI_UnlinkJob(queue, dwJobID);
+    if (job == NULL) {
+        SMDI_UnlockQueue(queue);
+        return FALSE;
+    }
+    
+    SMDI_DropJob(job);
+    memcpy(&info, &job->Info, sizeof(SMDI_JobInfo));
+    SMDI_EndJob(queue, job);
+    
+    SMDI_UnlockQueue(queue);
+    
+    if (queue->lpCallback != NULL) {
+        (*queue->lpCallback)(&info, queue->dwUserData);
+    }
+    
+    /* The worker notices if the queue ran dry */
+    SMDI_PostSemaphore(queue->semWork);
+    
+    return TRUE;
+}
+
+/* Cancel every queued and running job */
+void SMDI_CancelAllJobs(SMDI_JobQueue* queue) {
+    SMDI_QueuedJob* job;
+    SMDI_JobInfo* lpInfo;
+    DWORD dwCount;
+    DWORD dwJobID;
+    DWORD i;
+    
+    if (queue == NULL) {
+        return;
+    }
+    
+    SMDI_LockQueue(queue);
+    
+    if (queue->lpRunning != NULL) {
+        queue->lpRunning->bCancel = TRUE;
+    }
+    
+    dwCount = 0;
+    for (job = queue->lpJobs; job != NULL; job = job->lpNext) {
+        dwCount++;
+    }
+    
+    /* End them all in one pass, keeping copies to report: once unlocked
+       the ended jobs may be collected and freed */
+    lpInfo = dwCount > 0 ? (SMDI_JobInfo*)malloc(dwCount * sizeof(SMDI_JobInfo)) : NULL;
+    if (lpInfo != NULL) {
+        for (i = 0; i < dwCount; i++) {
+            job = queue->lpJobs;
+            queue->lpJobs = job->lpNext;
+    
+            SMDI_DropJob(job);
+            memcpy(&lpInfo[i], &job->Info, sizeof(SMDI_JobInfo));
+            SMDI_EndJob(queue, job);
+        }
+    }
+    
+    SMDI_UnlockQueue(queue);
+    
+    if (lpInfo != NULL) {
+        if (queue->lpCallback != NULL) {
+            for (i = 0; i < dwCount; i++) {
+                (*queue->lpCallback)(&lpInfo[i], queue->dwUserData);
+            }
+        }
+        free(lpInfo);
+    
+        /* The worker notices if the queue ran dry */
+        SMDI_PostSemaphore(queue->semWork);
+        return;
+    }
+    
+    /* Out of memory for the copies: cancel one at a time */
+    for (;;) {
+        SMDI_LockQueue(queue);
+        job = queue->lpJobs;
+        dwJobID = job != NULL ? job->Info.dwJobID : 0;
+        SMDI_UnlockQueue(queue);
+    
+        if (job == NULL) {
+            break;
+        }
+    
+        SMDI_CancelJob(queue, dwJobID);
+    }
+}
+
+/* Move a queued job to another priority */
+BOOL SMDI_SetJobPriority(SMDI_JobQueue* queue, DWORD dwJobID, DWORD dwPriority) {
+    SMDI_QueuedJob* job;
+    
+    if (queue == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_LockQueue(queue);
+    for (job = queue->lpJobs; job != NULL; job = job->lpNext) {
+        if (job->Info.dwJobID == dwJobID) {
+            job->Info.dwPriority = dwPriority;
+            break;
+        }
+    }
+    SMDI_UnlockQueue(queue);
+    
+    return job != NULL;
+}
+
+/* Stop or resume starting jobs */
+void SMDI_PauseJobQueue(SMDI_JobQueue* queue, BOOL bPause) {
+    if (queue == NULL) {
+        return;
+    }
+    
+    SMDI_LockQueue(queue);
+    queue->bPaused = bPause;
+    SMDI_UnlockQueue(queue);
+    
+    if (!bPause) {
+        SMDI_PostSemaphore(queue->semWork);
+    }
+}
+
+/* State of a queued or running job */
+BOOL SMDI_GetJobInfo(SMDI_JobQueue* queue, DWORD dwJobID, SMDI_JobInfo* info) {
+    SMDI_QueuedJob* job;
+    
+    if (queue == NULL || info == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_LockQueue(queue);
+    
+    job = queue->lpRunning;
+    if (job == NULL || job->Info.dwJobID != dwJobID) {
+        for (job = queue->lpJobs; job != NULL; job = job->lpNext) {
+            if (job->Info.dwJobID == dwJobID) {
+                break;
+            }
+        }
+    }
+    if (job != NULL) {
+        memcpy(info, &job->Info, sizeof(SMDI_JobInfo));
+    }
+    
+    SMDI_UnlockQueue(queue);
+    
+    return job != NULL;
+}
+
+/* Take the oldest ended job */
+BOOL SMDI_CollectJob(SMDI_JobQueue* queue, SMDI_JobInfo* info) {
+    SMDI_QueuedJob* job;
+    
+    if (queue == NULL || info == NULL) {
+        return FALSE;
+    }
+    
+    SMDI_LockQueue(queue);
+    job = queue->lpEnded;
+    if (job != NULL) {
+        queue->lpEnded = job->lpNext;
+        if (queue->lpEnded == NULL) {
+            queue->lpEndedTail = NULL;
+        }
+    }
+    SMDI_UnlockQueue(queue);
+    
+    if (job == NULL) {
+        return FALSE;
+    }
+    
+    memcpy(info, &job->Info, sizeof(SMDI_JobInfo));
+    SMDI_FreeJob(job);
+    
+    return TRUE;
+}
+
+/* Jobs queued and running */
+DWORD SMDI_PendingJobs(SMDI_JobQueue* queue) {
+    SMDI_QueuedJob* job;
+    DWORD dwCount;
+    
+    if (queue == NULL) {
+        return 0;
+    }
+    
+    SMDI_LockQueue(queue);
+    dwCount = queue->lpRunning != NULL ? 1 : 0;
+    for (job = queue->lpJobs; job != NULL; job = job->lpNext) {
+        dwCount++;
+    }
+    SMDI_UnlockQueue(queue);
+    
+    return dwCount;
+}
+
+/* Wait until no job is queued or running and the callback has been
+   told so */
+void SMDI_WaitJobQueue(SMDI_JobQueue* queue) {
+    if (queue == NULL) {
+        return;
+    }
+    
+    SMDI_LockQueue(queue);
+    if (queue->lpJobs == NULL && queue->lpRunning == NULL && !queue->bBusy &&
+        !queue->bReportingIdle) {
+        SMDI_UnlockQueue(queue);
+        return;
+    }
+    queue->dwIdleWaiters++;
+    SMDI_UnlockQueue(queue);
+    
+    SMDI_WaitSemaphore(queue->semIdle);
+}
@@ -1,57 +1,449 @@
 /* src/smdi_operations.c - SMDI device operations */
 #include "app_all.h"
+#include <fcntl.h>
 
-/* Structure for progress callback */
+/* Jobs the GUI has queued on one device, kept by the GUI thread */
 typedef struct {
-    int sample_id;
+    int pending;             /* Queued and not collected yet */
+    int batch_total;         /* Jobs of the batch upload running */
+    int batch_ok;
+    int batch_failed;
+    int list_stale;          /* Jobs changed the samples on the device */
+    int resume_revalidate;   /* Catalog revalidation was stopped for the jobs */
     char status_message[256];
-} ProgressData;
+    
+    /* Last progress sent, kept by the device's worker */
+    DWORD last_job;
+    int last_percent;
+} JobsData;
 
-/* Progress callback function for file transfers */
-void progress_callback(SMDI_FileTransmissionInfo* fti, DWORD userData)
-{
-    SMDI_TransmissionInfo* ti;
-    SMDI_SampleHeader* header;
-    DWORD total_bytes;
-    DWORD bytes_sent;
+/* Progress record written by the job queue of a session: percentage
+   done of a running job, or -1 when a job has ended or the queue has
+   run dry */
+typedef struct {
+    int session;
+    DWORD kind;
+    DWORD sample_id;
     int percent;
-    ProgressData* progress_data;
+} ProgressMessage;
 
-    /* ANSI C90: All variables must be declared at the beginning */
-    progress_data = (ProgressData*)userData;
+static JobsData jobs_data[MAX_SESSIONS];
 
-    if (fti == NULL || fti->lpTransmissionInfo == NULL) {
-        return;
+static Boolean revalidate_step(XtPointer client_data);
+
+/* Job bookkeeping of a session */
+static JobsData *session_jobs(DeviceSession *s)
+{
+    return &jobs_data[s - app_data.sessions];
+}
+
+/* Session of a connected device, NULL if it is not connected */
+static DeviceSession *find_session(int ha_id, int id)
+{
+    int i;
+    
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (app_data.sessions[i].inUse &&
+            app_data.sessions[i].ha == ha_id && app_data.sessions[i].id == id) {
+            return &app_data.sessions[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/* Progress callback of a job queue; runs on the queue's threads, so it
+   only writes to the progress pipe */
+static void jobs_callback(SMDI_JobInfo* job, DWORD user_data)
+{
+    JobsData *jobs;
+    ProgressMessage msg;
+    
+    jobs = &jobs_data[user_data];
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.session = (int)user_data;
+    msg.percent = -1;
+    
+    if (job != NULL && job->dwState == SMDI_JOB_RUNNING) {
+        msg.kind = job->dwKind;
+        msg.sample_id = job->dwSampleNumber;
+        if (job->dwBytes == 0 || job->dwBytes == SMDI_JOB_SIZE_UNKNOWN) {
+            msg.percent = 0;
+        } else if (job->dwBytes >= 100) {
+            msg.percent = (int)(job->dwDone / (job->dwBytes / 100));
+        } else {
+            msg.percent = (int)(job->dwDone * 100 / job->dwBytes);
+        }
+        if (msg.percent > 100) {
+            msg.percent = 100;
+        }
+    
+        /* Only a new percentage is worth a wakeup */
+        if (job->dwJobID == jobs->last_job && msg.percent == jobs->last_percent) {
+            return;
+        }
+        jobs->last_job = job->dwJobID;
+        jobs->last_percent = msg.percent;
+    }
+    
+    /* Hand the progress to the GUI thread; the pipe does not block, a
+       record that does not fit is dropped as the next one supersedes it.
+       Records are shorter than PIPE_BUF, so the workers of several
+       devices cannot interleave them. */
+    write(app_data.progressPipe[1], &msg, sizeof(msg));
+}
+
+/* Message for the progress bar while a job runs */
+static void job_message(JobsData *jobs, DWORD kind, DWORD sample_id)
+{
+    char *message;
+    
+    message = jobs->status_message;
+    
+    switch (kind) {
+        case SMDI_JOB_UPLOAD:
+            sprintf(message, "Sending to sample %lu", sample_id);
+            break;
+    
+        case SMDI_JOB_DOWNLOAD:
+            sprintf(message, "Receiving sample %lu", sample_id);
+            break;
+    
+        case SMDI_JOB_DELETE:
+            sprintf(message, "Deleting sample %lu", sample_id);
+            break;
+    
+        default:
+            sprintf(message, "Renaming sample %lu", sample_id);
+            break;
     }
+    
+    if (jobs->pending > 1) {
+        sprintf(message + strlen(message), " (%d more queued)", jobs->pending - 1);
+    }
+}
 
-    ti = fti->lpTransmissionInfo;
+/* Report why the device rejected a job */
+static void report_reject(const char *what, SMDI_JobInfo *job)
+{
+    switch (job->dwError) {
+        case SMDIE_OUTOFRANGE:
+            update_status("%s failed: Sample ID out of range", what);
+            break;
+    
+        case SMDIE_NOSAMPLE:
+            update_status("%s failed: Sample %lu does not exist on the device",
+                        what, job->dwSampleNumber);
+            break;
+    
+        case SMDIE_NOMEMORY:
+            update_status("%s failed: Device has insufficient memory for this operation", what);
+            break;
     
-    if (ti->lpSampleHeader == NULL) {
+        case SMDIE_UNSUPPSAMBITS:
+            update_status("%s failed: Unsupported sample bits format", what);
+            break;
+    
+        default:
+            update_status("%s failed with error code: 0x%08lX", what, job->dwError);
+            break;
+    }
+}
+
+/* Report a job of a session that has ended; returns whether it succeeded */
+static int report_job(DeviceSession *s, SMDI_JobInfo *job)
+{
+    JobsData *jobs;
+    char *filename;
+    char *title;
+    int ok;
+    
+    jobs = session_jobs(s);
+    jobs->pending--;
+    ok = (job->dwState == SMDI_JOB_DONE);
+    title = NULL;
+    
+    switch (job->dwKind) {
+        case SMDI_JOB_UPLOAD:
+            /* Whatever was cataloged in the slot is stale now; the list
+               refresh picks up the new header */
+            SMDI_CatalogRemove(s->catalog, job->dwSampleNumber);
+            jobs->list_stale = 1;
+            title = "Send Error";
+    
+            if (ok) {
+                update_status("Sample uploaded successfully to sample %lu on %d:%d",
+                            job->dwSampleNumber, s->ha, s->id);
+            } else if (job->dwState == SMDI_JOB_CANCELLED) {
+                update_status("Upload to sample %lu cancelled", job->dwSampleNumber);
+            } else if (job->dwResult == FE_OPENERROR) {
+                update_status("Failed to load sample file '%s'", job->cName);
+            } else if (job->dwResult == SMDIM_MESSAGEREJECT) {
+                report_reject("Upload", job);
+            } else {
+                update_status("Failed to upload sample. Error code: 0x%08lX", job->dwResult);
+            }
+    
+            /* A batch is summed up when it is done */
+            if (job->dwPriority == SMDI_PRIORITY_BATCH) {
+                if (ok) {
+                    jobs->batch_ok++;
+                } else {
+                    jobs->batch_failed++;
+                }
+                title = NULL;
+            }
+            break;
+    
+        case SMDI_JOB_DOWNLOAD:
+            filename = (char *)job->dwUserData;
+            title = "Receive Error";
+    
+            if (ok) {
+                update_status("Sample %lu received from %d:%d and saved as %s",
+                            job->dwSampleNumber, s->ha, s->id, filename);
+            } else if (job->dwState == SMDI_JOB_CANCELLED) {
+                update_status("Download of sample %lu cancelled", job->dwSampleNumber);
+            } else if (job->dwResult == FE_WRITEERROR) {
+                update_status("Failed to write sample file '%s'", filename);
+            } else if (job->dwResult == FE_PACKETSIZE) {
+                update_status("Failed to receive sample: the device's packets split its sample words");
+            } else if (job->dwResult == SMDIM_MESSAGEREJECT) {
+                report_reject("Download", job);
+            } else {
+                update_status("Failed to receive sample. Error code: 0x%08lX", job->dwResult);
+            }
+            XtFree(filename);
+            break;
+    
+        case SMDI_JOB_DELETE:
+            title = "Delete Error";
+    
+            if (ok) {
+                SMDI_CatalogRemove(s->catalog, job->dwSampleNumber);
+                jobs->list_stale = 1;
+                update_status("Sample %lu deleted successfully from %d:%d",
+                            job->dwSampleNumber, s->ha, s->id);
+            } else if (job->dwState == SMDI_JOB_CANCELLED) {
+                update_status("Delete of sample %lu cancelled", job->dwSampleNumber);
+            } else if (job->dwResult == SMDIM_MESSAGEREJECT) {
+                report_reject("Delete", job);
+            } else {
+                update_status("Failed to delete sample %lu. Response: 0x%08lX",
+                            job->dwSampleNumber, job->dwResult);
+            }
+            break;
+    
+        default:
+            jobs->list_stale = 1;
+            if (ok || job->dwState == SMDI_JOB_CANCELLED) {
+                break;
+            }
+            if (job->dwResult == SMDIM_MESSAGEREJECT) {
+                report_reject("Rename", job);
+            } else {
+                update_status("Failed to rename sample %lu. Response: 0x%08lX",
+                            job->dwSampleNumber, job->dwResult);
+            }
+            break;
+    }
+    
+    /* Only a failed interactive job interrupts the user */
+    if (!ok && title != NULL && job->dwState != SMDI_JOB_CANCELLED) {
+        show_message_dialog(app_data.mainWindow, title,
+                           app_data.statusMessage, XmDIALOG_ERROR);
+    }
+    
+    return ok;
+}
+
+/* Every job queued on a session has been reported: sum up a batch, show
+   what the jobs changed and go on checking the sample list. A device
+   that is not shown has its list refreshed when it is shown again. */
+static void jobs_done(DeviceSession *s)
+{
+    JobsData *jobs;
+    char message[256];
+    
+    jobs = session_jobs(s);
+    
+    if (s == app_data.session) {
+        app_data.operationInProgress = 0;
+        hide_progress();
+    }
+    
+    if (jobs->batch_total > 0) {
+        sprintf(message, "Upload to %d:%d complete: %d successful, %d failed",
+               s->ha, s->id, jobs->batch_ok, jobs->batch_failed);
+        jobs->batch_total = 0;
+        jobs->batch_ok = 0;
+        jobs->batch_failed = 0;
+    
+        update_status("%s", message);
+        show_message_dialog(app_data.mainWindow, "Upload Results",
+                           message, XmDIALOG_INFORMATION);
+    }
+    
+    /* One refresh for the whole queue; it revalidates from the start */
+    if (jobs->list_stale) {
+        jobs->resume_revalidate = 0;
+        if (s == app_data.session) {
+            jobs->list_stale = 0;
+            clear_sample_list();
+            refresh_sample_list();
+        }
         return;
     }
     
-    header = ti->lpSampleHeader;
+    /* Go on checking the sample list where the jobs interrupted it */
+    if (jobs->resume_revalidate && s->revalidateProc == 0) {
+        s->revalidateProc = XtAppAddWorkProc(app_context, revalidate_step, (XtPointer)s);
+    }
+    jobs->resume_revalidate = 0;
+}
+
+/* Progress and ended jobs from the queues, read on the GUI thread */
+static void jobs_input(XtPointer client_data, int *source, XtInputId *id)
+{
+    ProgressMessage msg;
+    ProgressMessage running;
+    SMDI_JobInfo collected;
+    DeviceSession *s;
+    JobsData *jobs;
+    int i;
+    
+    /* Only the latest percentage of the device shown matters */
+    running.percent = -1;
+    while (read(*source, &msg, sizeof(msg)) == sizeof(msg)) {
+        if (msg.percent >= 0 && app_data.session != NULL &&
+            &app_data.sessions[msg.session] == app_data.session) {
+            running = msg;
+        }
+    }
+    
+    /* Collected from every device on every wakeup, so a dropped record
+       loses no job */
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        s = &app_data.sessions[i];
+        jobs = &jobs_data[i];
+        if (!s->inUse || jobs->pending == 0) {
+            continue;
+        }
+    
+        while (jobs->pending > 0 && SMDI_CollectJob(s->jobs, &collected)) {
+            report_job(s, &collected);
+        }
+    
+        if (jobs->pending == 0) {
+            jobs_done(s);
+        }
+    }
+    
+    if (running.percent >= 0 && session_jobs(app_data.session)->pending > 0) {
+        jobs = session_jobs(app_data.session);
+        job_message(jobs, running.kind, running.sample_id);
+        show_progress(running.percent, jobs->status_message);
+    }
+}
 
-    /* Calculate total bytes */
-    total_bytes = header->dwLength * header->NumberOfChannels * header->BitsPerWord / 8;
+/* Create the progress pipe and watch it from the main loop */
+int init_transfers(void)
+{
+    if (pipe(app_data.progressPipe) != 0) {
+        return 0;
+    }
+    
+    fcntl(app_data.progressPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(app_data.progressPipe[1], F_SETFL, O_NONBLOCK);
+    
+    app_data.progressInput = XtAppAddInput(app_context, app_data.progressPipe[0],
+                                           (XtPointer)XtInputReadMask,
+                                           jobs_input, NULL);
+    
+    return 1;
+}
 
-    /* Calculate bytes sent so far */
-    bytes_sent = ti->dwTransmittedPackets * ti->dwPacketSize;
+/* Hand the device shown to its job queue; catalog revalidation pauses
+   while jobs are queued */
+static void begin_job(void)
+{
+    DeviceSession *s;
+    
+    s = app_data.session;
+    if (session_jobs(s)->pending == 0 && s->revalidateProc != 0) {
+        XtRemoveWorkProc(s->revalidateProc);
+        s->revalidateProc = 0;
+        session_jobs(s)->resume_revalidate = 1;
+        hide_progress();
+    }
+    
+    app_data.operationInProgress = 1;
+}
 
-    /* Adjust for last packet */
-    if (bytes_sent > total_bytes) {
-        bytes_sent = total_bytes;
+/* Count a job the queue of the device shown accepted; 0 if it was refused */
+static int job_queued(DWORD job_id)
+{
+    JobsData *jobs;
+    
+    jobs = session_jobs(app_data.session);
+    
+    if (job_id == 0) {
+        update_status("Failed to queue the operation");
+        if (jobs->pending == 0) {
+            jobs_done(app_data.session);
+        }
+        return 0;
     }
+    
+    jobs->pending++;
+    
+    return 1;
+}
 
-    /* Calculate percentage */
-    if (total_bytes > 0) {
-        percent = (int)((bytes_sent * 100) / total_bytes);
-    } else {
-        percent = 0;
+/* Whether queued jobs have the device shown */
+int transfers_pending(void)
+{
+    return app_data.session != NULL && session_jobs(app_data.session)->pending > 0;
+}
+
+/* Cancel every job queued on the device shown and stop the running one
+   at the next packet; the other devices carry on */
+void cancel_transfers(void)
+{
+    if (!transfers_pending()) {
+        update_status("No transfer in progress");
+        return;
     }
+    
+    SMDI_CancelAllJobs(app_data.session->jobs);
+    update_status("Cancelling %d queued operations on %d:%d...",
+                session_jobs(app_data.session)->pending,
+                app_data.session->ha, app_data.session->id);
+}
 
-    /* Update progress in UI */
-    show_progress(percent, progress_data->status_message);
+/* Stop or resume starting queued jobs on every device; the running ones
+   finish */
+void pause_transfers(int pause)
+{
+    int queued;
+    int i;
+    
+    app_data.transfersPaused = pause;
+    
+    queued = 0;
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (app_data.sessions[i].inUse) {
+            SMDI_PauseJobQueue(app_data.sessions[i].jobs, pause ? TRUE : FALSE);
+            queued += jobs_data[i].pending;
+        }
+    }
+    
+    if (pause) {
+        update_status("Transfers paused, %d queued", queued);
+    } else {
+        update_status("Transfers resumed");
+    }
 }
 
 /* Scan for SCSI devices on a host adapter */
@@ -110,11 +502,31 @@ int scan_scsi_devices(int ha_id, char *device_names[], int *device_types)
     return count;
 }
 
-/* Connect to a SMDI device */
+/* Connect to a SMDI device; devices connected before stay connected,
+   each with its own transfer queue */
 int connect_to_device(int ha_id, int id)
 {
     SCSI_DevInfo dev_info;
     DWORD response;
+    DeviceSession *s;
+    int i;
+    
+    /* Already connected: just show it */
+    if (find_session(ha_id, id) != NULL) {
+        select_device(ha_id, id);
+        return 1;
+    }
+    
+    s = NULL;
+    for (i = 0; i < MAX_SESSIONS && s == NULL; i++) {
+        if (!app_data.sessions[i].inUse) {
+            s = &app_data.sessions[i];
+        }
+    }
+    if (s == NULL) {
+        update_status("Cannot connect more than %d devices at once", MAX_SESSIONS);
+        return 0;
+    }
     
     /* Initialize device info */
     memset(&dev_info, 0, sizeof(SCSI_DevInfo));
@@ -137,118 +549,225 @@ int connect_to_device(int ha_id, int id)
         return 0;
     }
     
+    /* Open a connection that keeps the device open for every command */
+    s->connection = SMDI_OpenConnection(ha_id, id);
+    if (s->connection == NULL) {
+        update_status("Failed to open device %d:%d", ha_id, id);
+        return 0;
+    }
+    
     /* Try sending an SMDI Master Identify command */
-    response = SMDI_MasterIdentify(ha_id, id);
+    response = SMDIC_MasterIdentify(s->connection);
     
     if (response != SMDIM_SLAVEIDENTIFY) {
+        SMDI_CloseConnection(s->connection);
+        s->connection = NULL;
         update_status("Device did not respond correctly to SMDI identity check");
         return 0;
     }
     
+    /* Sample headers cataloged in earlier sessions */
+    s->catalog = SMDIC_OpenCatalog(s->connection);
+    if (s->catalog == NULL) {
+        SMDI_CloseConnection(s->connection);
+        s->connection = NULL;
+        update_status("Out of memory opening the sample catalog");
+        return 0;
+    }
+    
+    /* Uploads, downloads and deletes run from here on, on a worker of
+       the device's own */
+    memset(session_jobs(s), 0, sizeof(JobsData));
+    s->jobs = SMDI_OpenJobQueue(s->connection, jobs_callback, (DWORD)(s - app_data.sessions));
+    if (s->jobs == NULL) {
+        SMDI_CloseCatalog(s->catalog);
+        s->catalog = NULL;
+        SMDI_CloseConnection(s->connection);
+        s->connection = NULL;
+        update_status("Failed to start the transfer queue");
+        return 0;
+    }
+    SMDI_PauseJobQueue(s->jobs, app_data.transfersPaused ? TRUE : FALSE);
+    
     /* Store connection info */
-    app_data.connected = 1;
-    app_data.currentHA = ha_id;
-    app_data.currentID = id;
+    s->inUse = 1;
+    s->ha = ha_id;
+    s->id = id;
+    s->revalidateProc = 0;
+    strncpy(s->deviceName, dev_info.cName, sizeof(s->deviceName) - 1);
+    s->deviceName[sizeof(s->deviceName) - 1] = '\0';
+    strncpy(s->deviceVendor, dev_info.cManufacturer, sizeof(s->deviceVendor) - 1);
+    s->deviceVendor[sizeof(s->deviceVendor) - 1] = '\0';
     
-    /* Update device info */
-    update_device_info(dev_info.cName, dev_info.cManufacturer);
+    select_device(ha_id, id);
     
-    update_status("Connected to SMDI device: %s %s", 
+    update_status("Connected to SMDI device: %s %s",
                 dev_info.cManufacturer, dev_info.cName);
     
     return 1;
 }
 
+/* Disconnect a device */
+static void close_session(DeviceSession *s)
+{
+    SMDI_JobInfo job;
+    
+    /* Queued jobs are dropped and the running one stopped first */
+    SMDI_CancelAllJobs(s->jobs);
+    SMDI_WaitJobQueue(s->jobs);
+    while (SMDI_CollectJob(s->jobs, &job)) {
+        report_job(s, &job);
+    }
+    SMDI_CloseJobQueue(s->jobs);
+    s->jobs = NULL;
+    memset(session_jobs(s), 0, sizeof(JobsData));
+    
+    /* Stop revalidating and keep what was learned for the next session */
+    if (s->revalidateProc != 0) {
+        XtRemoveWorkProc(s->revalidateProc);
+        s->revalidateProc = 0;
+    }
+    if (s->catalog->bDirty) {
+        SMDI_SaveCatalog(s->catalog);
+    }
+    SMDI_CloseCatalog(s->catalog);
+    s->catalog = NULL;
+    
+    /* Release the device handle held since connect */
+    SMDI_CloseConnection(s->connection);
+    s->connection = NULL;
+    
+    s->inUse = 0;
+}
 
-int refresh_sample_list(void)
+/* Disconnect from the device shown */
+void disconnect_from_device(void)
 {
-    SMDI_SampleHeader sh;
-    SampleInfo sample_info;
-    int i;
-    int found;
-    DWORD result;
+    int ha_id;
+    int id;
     
-    /* Check if connected */
     if (!app_data.connected) {
-        update_status("Not connected to any device");
-        return 0;
+        return;
     }
     
-    update_status("Reading sample list from device %d:%d...", 
-                app_data.currentHA, app_data.currentID);
+    ha_id = app_data.session->ha;
+    id = app_data.session->id;
     
-    /* Clear the list */
-    clear_sample_list();
+    close_session(app_data.session);
+    select_device(ha_id, id);
     
-    /* Scan for samples */
-    found = 0;
+    update_status("Disconnected from device %d:%d", ha_id, id);
+}
+
+/* Disconnect from every device */
+void disconnect_all_devices(void)
+{
+    int i;
     
-    /* Modified to scan the first MAX_SAMPLES_TO_SCAN samples */
-    for (i = 0; i < MAX_SAMPLES_TO_SCAN; i++) {
-        /* Initialize sample header */
-        memset(&sh, 0, sizeof(SMDI_SampleHeader));
-        sh.dwStructSize = sizeof(SMDI_SampleHeader);
-        
-        /* Request sample header */
-        result = SMDI_SampleHeaderRequest(app_data.currentHA, app_data.currentID, i, &sh);
-        
-        /* If we got a valid header response */
-        if (result == SMDIM_SAMPLEHEADER) {
-            /* Check if the sample exists */
-            if (sh.bDoesExist) {
-                /* Format sample properties */
-                sample_info.id = i;
-                strncpy(sample_info.name, sh.cName, 255);
-                sample_info.name[255] = '\0';
-                sample_info.rate = (int)(1000000000 / sh.dwPeriod);  /* Convert period to rate */
-                sample_info.length = (int)sh.dwLength;
-                sample_info.bits = (int)sh.BitsPerWord;
-                sample_info.channels = (int)sh.NumberOfChannels;
-                sample_info.exists = 1;
-                
-                /* Add to list */
-                add_sample_to_list(&sample_info);
-                
-                found++;
-            }
-        } else {
-            /* Log error but continue scanning */
-            update_status("Error reading sample %d: response code 0x%08lx", i, result);
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (app_data.sessions[i].inUse) {
+            close_session(&app_data.sessions[i]);
         }
     }
     
-    /* Hide any progress indicator that might be showing */
-    hide_progress();
+    app_data.session = NULL;
+    app_data.connected = 0;
+}
+
+/* Sample numbers revalidated per background step */
+#define REVALIDATE_SLOTS 32
+
+/* Show the cataloged samples of a device */
+static int list_catalog(DeviceSession *s)
+{
+    SMDI_CatalogEntry *entry;
+    SMDI_SampleHeader *sh;
+    SampleInfo sample_info;
+    DWORD i;
     
-    if (found == 0) {
-        update_status("No samples found on device %d:%d", 
-                    app_data.currentHA, app_data.currentID);
-    } else {
-        update_status("Found %d samples on device %d:%d", 
-                    found, app_data.currentHA, app_data.currentID);
+    clear_sample_list();
+    
+    for (i = 0; i < s->catalog->dwEntries; i++) {
+        entry = &s->catalog->lpEntries[i];
+        sh = &entry->Header;
+    
+        /* Format sample properties */
+        sample_info.id = (int)entry->dwSampleNumber;
+        strncpy(sample_info.name, sh->cName, 255);
+        sample_info.name[255] = '\0';
+        sample_info.rate = sh->dwPeriod ? (int)(1000000000 / sh->dwPeriod) : 0;  /* Convert period to rate */
+        sample_info.length = (int)sh->dwLength;
+        sample_info.bits = (int)sh->BitsPerWord;
+        sample_info.channels = (int)sh->NumberOfChannels;
+        sample_info.exists = 1;
+    
+        add_sample_to_list(&sample_info);
     }
     
-    return found;
+    return (int)s->catalog->dwEntries;
 }
 
+/* Note that revalidation changed the catalog */
+static void catalog_changed(SMDI_Catalog *cat, DWORD sample_number,
+                            SMDI_CatalogEntry *entry, DWORD change, DWORD user_data)
+{
+    *(int *)user_data = 1;
+}
 
-
-
-/* Receive a sample as AIF file */
-int receive_sample_as_aif(int sample_id, const char *filename)
+/* Revalidate the next few sample numbers of a device while the GUI is
+   idle; devices that are not shown are revalidated too */
+static Boolean revalidate_step(XtPointer client_data)
 {
-    ProgressData progress_data;
-    SMDI_SampleHeader sh;
-    SMDI_Sample *sample;
-    void *buffer;
+    DeviceSession *s;
+    SMDI_Catalog *cat;
     DWORD result;
-    DWORD packet_size;
-    DWORD total_data_size;
-    DWORD bytes_received;
-    DWORD packet_num;
-    void *current_pos;
-    DWORD bytes_to_receive;
-    int percent;
+    int changed;
+    
+    s = (DeviceSession *)client_data;
+    cat = s->catalog;
+    changed = 0;
+    
+    result = SMDIC_RevalidateCatalog(s->connection, cat, REVALIDATE_SLOTS,
+                                     catalog_changed, (DWORD)&changed);
+    
+    /* Redraw only when the device differs from the catalog */
+    if (changed && s == app_data.session) {
+        list_catalog(s);
+    }
+    
+    if (result == SMDIM_ACK) {
+        if (cat->dwMaxSample != SMDI_RANGE_UNKNOWN && s == app_data.session) {
+            show_progress((int)(cat->dwRevalidateNext * 100 / (cat->dwMaxSample + 1)),
+                          "Checking sample list");
+        }
+        return False;
+    }
+    
+    /* Done: remember the headers for the next session */
+    s->revalidateProc = 0;
+    if (s == app_data.session) {
+        hide_progress();
+    }
+    
+    if (result != SMDIM_ENDOFPROCEDURE) {
+        update_status("Error checking sample list: response code 0x%08lx", result);
+        return True;
+    }
+    
+    if (cat->bDirty) {
+        SMDI_SaveCatalog(cat);
+    }
+    
+    update_status("Found %lu samples in %lu slots on device %d:%d",
+                cat->dwEntries, cat->dwMaxSample + 1, s->ha, s->id);
+    
+    return True;
+}
+
+int refresh_sample_list(void)
+{
+    DeviceSession *s;
+    int found;
     
     /* Check if connected */
     if (!app_data.connected) {
@@ -256,156 +775,126 @@ int receive_sample_as_aif(int sample_id, const char *filename)
         return 0;
     }
     
-    /* Initialize all pointers to NULL */
-    sample = NULL;
-    buffer = NULL;
+    s = app_data.session;
     
-    /* Setup progress data */
-    progress_data.sample_id = sample_id;
-    sprintf(progress_data.status_message, "Receiving sample %d", sample_id);
+    /* The list is refreshed when the queued jobs are done */
+    if (transfers_pending()) {
+        session_jobs(s)->list_stale = 1;
+        update_status("The sample list is refreshed when the transfers are done");
+        return 0;
+    }
     
-    update_status("Receiving sample %d from device %d:%d...", 
-                sample_id, app_data.currentHA, app_data.currentID);
+    /* Show the catalog right away and check it against the device in
+       the background; rows change as differences turn up */
+    found = list_catalog(s);
     
-    /* Initialize packet size */
-    packet_size = PACKETSIZE;  /* Now defined in smdi.h */
+    s->catalog->dwRevalidateNext = 0;
+    if (s->revalidateProc == 0) {
+        s->revalidateProc = XtAppAddWorkProc(app_context, revalidate_step, (XtPointer)s);
+    }
     
-    /* First, get sample header to determine size */
-    memset(&sh, 0, sizeof(SMDI_SampleHeader));
-    sh.dwStructSize = sizeof(SMDI_SampleHeader);
+    update_status("%d cataloged samples, checking device %d:%d...", 
+                found, s->ha, s->id);
     
-    result = SMDI_SampleHeaderRequest(app_data.currentHA, app_data.currentID, sample_id, &sh);
-    if (result != SMDIM_SAMPLEHEADER || !sh.bDoesExist) {
-        update_status("Sample %d not found on device", sample_id);
-        return 0;
+    return found;
+}
+
+/* Show the device at an address: its samples if it is connected, an
+   empty list otherwise. Transfers and revalidation of the other
+   connected devices go on in the background. */
+void select_device(int ha_id, int id)
+{
+    DeviceSession *s;
+    
+    app_data.currentHA = ha_id;
+    app_data.currentID = id;
+    
+    s = find_session(ha_id, id);
+    if (s == app_data.session && s != NULL) {
+        return;
     }
     
-    /* Validate header information */
-    if (sh.dwLength == 0 || sh.NumberOfChannels == 0 || sh.BitsPerWord == 0) {
-        update_status("Invalid sample parameters in header");
-        return 0;
+    app_data.session = s;
+    app_data.connected = (s != NULL);
+    app_data.operationInProgress = transfers_pending();
+    hide_progress();
+    
+    if (s == NULL) {
+        update_device_info("", "");
+        clear_sample_list();
+        return;
     }
     
-    /* Calculate total data size with overflow check */
-    if (sh.dwLength > 0xFFFFFFFF / (sh.NumberOfChannels * sh.BitsPerWord / 8)) {
-        update_status("Sample too large to process");
-        return 0;
+    update_device_info(s->deviceName, s->deviceVendor);
+    
+    /* Jobs that ran while another device was shown changed the list */
+    if (session_jobs(s)->list_stale && !transfers_pending()) {
+        session_jobs(s)->list_stale = 0;
+        clear_sample_list();
+        refresh_sample_list();
+        return;
     }
     
-    total_data_size = (sh.dwLength * sh.NumberOfChannels * sh.BitsPerWord) / 8;
+    list_catalog(s);
+}
+
+
+
+
+/* Receive a sample as AIF or WAV file, as the file name's extension
+   says; the download is queued and reported when it ends */
+int receive_sample_as_aif(int sample_id, const char *filename)
+{
+    SMDI_CatalogEntry *entry;
+    SMDI_SampleSink *sink;
+    char *name;
+    DWORD job_id;
     
-    /* Additional sanity check on data size */
-    if (total_data_size == 0 || total_data_size > 100 * 1024 * 1024) {  /* 100MB max */
-        update_status("Invalid sample data size: %lu bytes", total_data_size);
+    /* Check if connected */
+    if (!app_data.connected) {
+        update_status("Not connected to any device");
         return 0;
     }
     
-    /* Allocate memory for the sample data */
-    buffer = malloc(total_data_size);
-    if (buffer == NULL) {
-        update_status("Failed to allocate memory for sample data (%lu bytes)", total_data_size);
+    /* Each packet's frames are written to the file as they arrive, so
+       only one packet is ever held in memory */
+    if (SMDI_IsWAVFileName(filename)) {
+        sink = SMDI_OpenWAVSink(filename, SMDI_IsBWFFileName(filename));
+    } else {
+        sink = SMDI_OpenAIFSink(filename, 0);  /* 0 = not AIFC */
+    }
+    if (sink == NULL) {
+        update_status("Failed to create sample file '%s'", filename);
         return 0;
     }
     
-    /* Zero the buffer */
-    memset(buffer, 0, total_data_size);
+    /* A header confirmed this session is passed along so it is not
+       requested again; otherwise the job asks the device for it */
+    entry = SMDI_CatalogLookup(app_data.session->catalog, sample_id);
     
-    /* Begin receiving sample */
-    result = SMDI_SendBeginSampleTransfer(app_data.currentHA, app_data.currentID, 
-                                        sample_id, &packet_size);
+    /* The file name is kept for the report */
+    name = XtNewString(filename);
     
-    if (result == SMDIM_TRANSFERACKNOWLEDGE) {
-        /* Initialize for packet reception */
-        bytes_received = 0;
-        packet_num = 0;
-        
-        /* Set operation in progress flag */
-        app_data.operationInProgress = 1;
-        
-        /* Loop receiving packets */
-        while (bytes_received < total_data_size) {
-            current_pos = (char*)buffer + bytes_received;
-            bytes_to_receive = packet_size;
-            
-            /* For the last packet, adjust size if needed */
-            if (bytes_received + bytes_to_receive > total_data_size) {
-                bytes_to_receive = total_data_size - bytes_received;
-            }
-            
-            /* Receive packet */
-            result = SMDI_NextDataPacketRequest(app_data.currentHA, app_data.currentID, 
-                                         packet_num, current_pos, bytes_to_receive);
-            
-            if (result != SMDIM_DATAPACKET && result != SMDIM_ENDOFPROCEDURE) {
-                /* Error receiving packet */
-                update_status("Error receiving packet %d: 0x%08lX", packet_num, result);
-                free(buffer);
-                app_data.operationInProgress = 0;
-                return 0;
-            }
-            
-            /* Update progress */
-            bytes_received += bytes_to_receive;
-            packet_num++;
-            
-            /* Show progress */
-            if (total_data_size > 0) {
-                percent = (int)((bytes_received * 100) / total_data_size);
-                show_progress(percent, progress_data.status_message);
-            }
-            
-            /* Check if complete */
-            if (result == SMDIM_ENDOFPROCEDURE || bytes_received >= total_data_size) {
-                break;
-            }
-        }
-        
-        /* Clear operation flag */
-        app_data.operationInProgress = 0;
-        
-        /* Create sample object from header and buffer */
-        sample = SMDI_HeaderToSample(&sh, buffer);
-        
-        /* Free the raw buffer, it's copied into the sample structure */
-        free(buffer);
-        buffer = NULL;  /* Prevent accidental use after free */
-        
-        if (sample != NULL) {
-            /* Save as AIF */
-            if (SMDI_SaveAIFSample(sample, filename, 0)) {  /* 0 = not AIFC */
-                /* Success - clean up and return */
-                SMDI_FreeSample(sample);
-                hide_progress();
-                update_status("Sample %d received and saved as %s", sample_id, filename);
-                return 1;
-            } else {
-                /* Failed to save AIF */
-                SMDI_FreeSample(sample);
-                hide_progress();
-                update_status("Failed to convert sample to AIF format");
-                return 0;
-            }
-        } else {
-            /* Failed to create sample object */
-            update_status("Failed to process downloaded sample");
-            return 0;
-        }
-    } else {
-        /* Failed to begin transfer */
-        free(buffer);
-        update_status("Failed to begin sample transfer. Error code: 0x%08lX", result);
+    begin_job();
+    job_id = SMDI_QueueDownload(app_data.session->jobs, sample_id, sink,
+                                entry != NULL && entry->bValid ? &entry->Header : NULL,
+                                SMDI_PRIORITY_INTERACTIVE, (DWORD)name);
+    if (!job_queued(job_id)) {
+        XtFree(name);
         return 0;
     }
+    
+    update_status("Receiving sample %d from device %d:%d...", 
+                sample_id, app_data.session->ha, app_data.session->id);
+    
+    return 1;
 }
 
 
-/* Modify the delete_sample function in smdi_operations.c */
+/* Delete a sample; the delete is queued and reported when it ends */
 int delete_sample(int sample_id)
 {
-    DWORD result;
-    DWORD error_code;
-    SMDI_SampleHeader sh;
-    int success = 0;  /* Initialize to failure */
+    DWORD job_id;
     
     /* Check if connected */
     if (!app_data.connected) {
@@ -413,73 +902,50 @@ int delete_sample(int sample_id)
         return 0;
     }
     
-    update_status("Deleting sample %d from device %d:%d...", 
-                sample_id, app_data.currentHA, app_data.currentID);
-    
-    /* First verify the sample exists */
-    memset(&sh, 0, sizeof(SMDI_SampleHeader));
-    sh.dwStructSize = sizeof(SMDI_SampleHeader);
-    
-    if (SMDI_SampleHeaderRequest(app_data.currentHA, app_data.currentID, sample_id, &sh) != SMDIM_SAMPLEHEADER || !sh.bDoesExist) {
-        update_status("Sample %d not found on device %d:%d", 
-                    sample_id, app_data.currentHA, app_data.currentID);
+    begin_job();
+    job_id = SMDI_QueueDelete(app_data.session->jobs, sample_id, SMDI_PRIORITY_INTERACTIVE, 0);
+    if (!job_queued(job_id)) {
         return 0;
     }
     
-    /* Perform the deletion */
-    result = SMDI_DeleteSample(app_data.currentHA, app_data.currentID, sample_id);
+    update_status("Deleting sample %d from device %d:%d...", 
+                sample_id, app_data.session->ha, app_data.session->id);
     
-    /* Handle the result */
-    if (result == SMDIM_ACK || result == SMDIM_ENDOFPROCEDURE) {
-        update_status("Sample %d deleted successfully", sample_id);
-        hide_progress();
-        success = 1;  /* Set success flag */
-    } 
-    /* Check for specific error codes */
-    else if (result == SMDIM_MESSAGEREJECT) {
-        /* Get the last error */
-        error_code = SMDI_GetLastError();
-        
-        /* Provide specific error message based on the error code */
-        switch (error_code) {
-            case SMDIE_OUTOFRANGE:
-                update_status("Delete failed: Sample ID out of range");
-                break;
-                
-            case SMDIE_NOSAMPLE:
-                update_status("Delete failed: Sample %d does not exist on the device", sample_id);
-                break;
-                
-            case SMDIE_NOMEMORY:
-                update_status("Delete failed: Device has insufficient memory for this operation");
-                break;
-                
-            case SMDIE_UNSUPPSAMBITS:
-                update_status("Delete failed: Unsupported sample bits format");
-                break;
-                
-            default:
-                update_status("Delete failed with error code: 0x%08lX", error_code);
-                break;
-        }
-    } else {
-        update_status("Failed to delete sample %d. Response: 0x%08lX", 
-                    sample_id, result);
-        hide_progress();
-    }
+    return 1;
+}
+
+
+/* Open a sample file to upload: WAV and BWF files by their extension,
+   anything else as AIF, converted as the session's connection is set */
+static SMDI_SampleSource *open_sample_file(const char *filename, SMDI_Connection *conn)
+{
+    BYTE bits;
+    DWORD flags;
+    
+    bits = (BYTE)SMDIC_GetTargetBits(conn);
+    flags = SMDIC_GetConvertFlags(conn);
     
-    return success;
+    if (SMDI_IsWAVFileName(filename)) {
+        return SMDI_OpenWAVSourceAs(filename, bits, flags);
+    }
+    return SMDI_OpenAIFSourceAs(filename, bits, flags);
 }
 
+/* Open a sample file for its header only, picked as open_sample_file
+   picks it */
+static SMDI_SampleFile *open_sample_header(const char *filename)
+{
+    if (SMDI_IsWAVFileName(filename)) {
+        return SMDI_OpenWAVSampleFile(filename);
+    }
+    return SMDI_OpenAIFSampleFile(filename);
+}
 
-/* Send an AIF file to the device */
+/* Send an AIF or WAV file to the device; the upload is queued ahead of any
+   batch and reported when it ends */
 int send_aif_file(const char *filename, int sample_id)
 {
-    SMDI_Sample* sample;
-    SMDI_FileTransfer ft;
-    DWORD result;
-    ProgressData progress_data;
-    char temp_filename[MAX_PATH];
+    DWORD job_id;
     
     /* Check if connected */
     if (!app_data.connected) {
@@ -487,63 +953,73 @@ int send_aif_file(const char *filename, int sample_id)
         return 0;
     }
     
-    update_status("Loading AIF file '%s'...", filename);
-    
-    /* Load AIF file */
-    sample = SMDI_LoadAIFSample(filename);
-    if (sample == NULL) {
-        update_status("Failed to load AIF file '%s'", filename);
+    /* The file is opened when the upload starts, and its frames are
+       decoded into packets by a reader thread while the packets before
+       them go out */
+    begin_job();
+    job_id = SMDI_QueueUploadFile(app_data.session->jobs, sample_id, filename, open_sample_file,
+                                  SMDI_PRIORITY_INTERACTIVE, 0);
+    if (!job_queued(job_id)) {
         return 0;
     }
     
-    update_status("AIF file loaded: %s, %lu Hz, %d bits, %d channels",
-                sample->name, sample->sample_rate, sample->bits_per_sample, sample->channels);
+    update_status("Sending '%s' to sample %d...", filename, sample_id);
     
-    /* Create temporary file in native format */
-    sprintf(temp_filename, "/tmp/smdi_temp_%lu.sdmp", (unsigned long)sample_id);
-    if (!SMDI_SaveSample(sample, temp_filename)) {
-        update_status("Failed to create temporary file");
-        SMDI_FreeSample(sample);
+    return 1;
+}
+
+/* Queue the upload of AIF or WAV files to consecutive samples as one batch;
+   the queue runs them back to back, smallest first, and the batch is
+   summed up when it is done. Only the headers are read to plan the
+   batch; each file's data is read as its upload sends it. Returns the
+   number of files queued. */
+int send_aif_files(char **filenames, int file_count, int start_sample_id)
+{
+    SMDI_SampleFile *file;
+    JobsData *jobs;
+    DWORD total_bytes;
+    int queued;
+    int i;
+    
+    /* Check if connected */
+    if (!app_data.connected) {
+        update_status("Not connected to any device");
         return 0;
     }
     
-    /* Setup progress data */
-    progress_data.sample_id = sample_id;
-    sprintf(progress_data.status_message, "Sending to sample %d", sample_id);
-    
-    /* Set up file transfer */
-    memset(&ft, 0, sizeof(SMDI_FileTransfer));
-    ft.dwStructSize = sizeof(SMDI_FileTransfer);
-    ft.HA_ID = app_data.currentHA;
-    ft.SCSI_ID = app_data.currentID;
-    ft.dwSampleNumber = sample_id;
-    ft.lpFileName = temp_filename;
-    ft.lpSampleName = sample->name;
-    ft.lpCallback = (void*)progress_callback;
-    ft.dwUserData = (DWORD)&progress_data;
-    ft.bAsync = FALSE;
-    ft.lpReturnValue = &result;
-    
-    /* Set operation in progress flag */
-    app_data.operationInProgress = 1;
+    jobs = session_jobs(app_data.session);
     
-    /* Send the file */
-    result = SMDI_SendFile(&ft);
-    
-    /* Clear operation flag */
-    app_data.operationInProgress = 0;
+    queued = 0;
+    total_bytes = 0;
+    for (i = 0; i < file_count; i++) {
+        /* A file that cannot be sent fails before anything is queued */
+        file = open_sample_header(filenames[i]);
+        if (file == NULL) {
+            jobs->batch_failed++;
+            continue;
+        }
+        total_bytes += file->Info.data_size;
+        SMDI_CloseSampleFile(file);
     
-    /* Clean up */
-    SMDI_FreeSample(sample);
-    unlink(temp_filename);  /* Remove temporary file */
+        begin_job();
+        if (job_queued(SMDI_QueueUploadFile(app_data.session->jobs, start_sample_id + i,
+                                            filenames[i], open_sample_file,
+                                            SMDI_PRIORITY_BATCH, 0))) {
+            queued++;
+        } else {
+            jobs->batch_failed++;
+        }
+    }
+    jobs->batch_total += file_count;
     
-    if (result == SMDIM_ENDOFPROCEDURE || result == SMDIM_ACK) {
-        update_status("Sample uploaded successfully to sample %d", sample_id);
-	hide_progress(); 
-        return 1;
-    } else {
-        update_status("Failed to upload sample. Error code: 0x%08lX", result);
-	hide_progress(); 
+    /* Nothing was queued: sum up right away */
+    if (jobs->pending == 0) {
+        jobs_done(app_data.session);
         return 0;
     }
+    
+    update_status("Queued %d of %d files (%lu KB) from sample ID %d",
+                 queued, file_count, total_bytes / 1024, start_sample_id);
+    
+    return queued;
 }
@@ -0,0 +1,130 @@
+/*
+ * smdi_probe - command line SCSI/SMDI probe
+ * Scans a host adapter for SMDI devices or lists the samples of one
+ * device. Used to check a transport backend without the Motif GUI.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdi.h"
+
+/* Print usage information */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d] [ha [id]]\n", prog);
+    fprintf(stderr, "  ha      host adapter to scan (default 0)\n");
+    fprintf(stderr, "  id      target to identify and list samples of\n");
+    fprintf(stderr, "  -d      enable SMDI debug output\n");
+}
+
+/* Scan all targets of a host adapter */
+static int scan_bus(int ha_id)
+{
+    SCSI_DevInfo info;
+    int id;
+    int found;
+
+    found = 0;
+    printf("Scanning host adapter %d\n", ha_id);
+
+    for (id = 0; id < 16; id++) {
+        if (!SMDI_TestUnitReady((BYTE)ha_id, (BYTE)id)) {
+            continue;
+        }
+
+        memset(&info, 0, sizeof(info));
+        info.dwStructSize = sizeof(info);
+        SMDI_GetDeviceInfo((BYTE)ha_id, (BYTE)id, &info);
+
+        printf("  %d:%d  type %2d  %-8.8s %-16.16s%s\n",
+               ha_id, id, info.DevType, info.cManufacturer, info.cName,
+               info.bSMDI ? "  (SMDI)" : "");
+        found++;
+    }
+
+    printf("%d device(s) found\n", found);
+    return found;
+}
+
+/* Print one enumerated sample */
+static BOOL print_sample(DWORD sample_number, SMDI_SampleHeader *sh, DWORD user_data)
+{
+    int *found;
+
+    found = (int *)user_data;
+
+    printf("  %5lu  %-32.32s %6lu Hz %2d bit %d ch %9lu frames\n",
+           sample_number, sh->cName, sh->dwPeriod ? 1000000000UL / sh->dwPeriod : 0UL,
+           sh->BitsPerWord, sh->NumberOfChannels, sh->dwLength);
+    (*found)++;
+
+    return TRUE;
+}
+
+/* Identify one device and list its samples */
+static int list_samples(int ha_id, int id)
+{
+    SMDI_DiscoverInfo info;
+    SMDI_Occupancy occ;
+    DWORD result;
+    int found;
+
+    if (!SMDI_OpenDevice((BYTE)ha_id, (BYTE)id)) {
+        printf("Cannot open device %d:%d\n", ha_id, id);
+        return 0;
+    }
+
+    if (SMDI_MasterIdentify((BYTE)ha_id, (BYTE)id) != SMDIM_SLAVEIDENTIFY) {
+        printf("Device %d:%d did not answer Master Identify\n", ha_id, id);
+        SMDI_CloseDevice((BYTE)ha_id, (BYTE)id);
+        return 0;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.dwStructSize = sizeof(info);
+    SMDI_InitOccupancy(&occ);
+
+    found = 0;
+    result = SMDIC_DiscoverSamples(SMDI_GetDefaultConnection((BYTE)ha_id, (BYTE)id),
+                                   &occ, &info, print_sample, (DWORD)&found);
+    SMDI_FreeOccupancy(&occ);
+    if (result != SMDIM_ENDOFPROCEDURE) {
+        printf("Sample list ended with answer 0x%08lX\n", result);
+    }
+
+    printf("%d sample(s) found in %lu slots with %lu requests\n",
+           found, info.dwMaxSample + 1, info.dwProbes);
+    SMDI_CloseDevice((BYTE)ha_id, (BYTE)id);
+    return found;
+}
+
+int main(int argc, char *argv[])
+{
+    int argi;
+    int ha_id;
+
+    argi = 1;
+    if (argi < argc && strcmp(argv[argi], "-d") == 0) {
+        SMDI_SetDebugMode(1);
+        argi++;
+    }
+
+    if (argi < argc && (argv[argi][0] < '0' || argv[argi][0] > '9')) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (!SMDI_Init()) {
+        fprintf(stderr, "No SCSI devices available\n");
+        return 1;
+    }
+
+    ha_id = (argi < argc) ? atoi(argv[argi]) : 0;
+
+    if (argi + 1 < argc) {
+        return list_samples(ha_id, atoi(argv[argi + 1])) > 0 ? 0 : 1;
+    }
+
+    return scan_bus(ha_id) > 0 ? 0 : 1;
+}
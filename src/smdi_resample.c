@@ -0,0 +1,649 @@
+/*
+ * SMDI sample rate conversion for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * A polyphase FIR resampler: for a ratio of L output to M input samples
+ * (the rates divided by their greatest common divisor) a windowed sinc
+ * low-pass is sampled at L phases between two input samples, each phase
+ * SMDI_RESAMPLE_TAPS taps long. Every output sample is the dot product
+ * of one phase with the input samples around it, computed per channel
+ * on an SSE2 or AVX2 kernel where the CPU has one (chosen when first
+ * used). Banks are built once per ratio and kept for the sources that
+ * follow, so a batch of uploads at the same rates pays for one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "smdi.h"
+#include "smdi_swap.h"
+#include "smdi_thread.h"
+#include "smdi_resample.h"
+
+/* x86 kernels need GCC 4.9 or clang for intrinsics outside -m flags */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SMDI_RESAMPLE_X86
+#include <immintrin.h>
+#endif
+
+/* Input samples buffered per channel besides the filter's reach */
+#define RESAMPLE_BLOCK 4096
+#define RESAMPLE_BUFFER (RESAMPLE_BLOCK + SMDI_RESAMPLE_TAPS)
+
+/* Highest sample rate taken */
+#define RESAMPLE_MAX_RATE 1000000
+
+/* Kaiser window shape, about 80 dB stopband at 64 taps */
+#define RESAMPLE_BETA 8.0
+
+/* Passband edge as a fraction of the lower Nyquist frequency */
+#define RESAMPLE_CUTOFF 0.95
+
+#define RESAMPLE_PI 3.14159265358979323846
+
+/* Ratios whose banks are kept */
+#define RESAMPLE_CACHED_BANKS 8
+
+typedef float (*SMDI_DotProc)(const float* a, const float* b, DWORD count);
+
+/* Rates a period rounded to whole nanoseconds stands for */
+static const DWORD standard_rates[] = {
+    8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000,
+    88200, 96000, 176400, 192000
+};
+
+/* Kernel in use, chosen on first use */
+static SMDI_DotProc dot_proc = NULL;
+static DWORD resample_kernel = SMDI_SWAP_SCALAR;
+
+/* Filter bank of a ratio, kept until the process ends */
+typedef struct {
+    DWORD up;
+    DWORD down;
+    float* bank;
+} ResampleBank;
+
+/* Banks are looked up and built under the lock, which SMDI_Init creates;
+   without it each source builds its own */
+static ResampleBank banks[RESAMPLE_CACHED_BANKS];
+static SMDI_Semaphore* bank_lock = NULL;
+
+/* Data of a source being resampled */
+typedef struct {
+    SMDI_SampleSource* src;
+    DWORD up;                           /* L: output samples... */
+    DWORD down;                         /* M: ...per input samples */
+    DWORD phases;
+    float* bank;                        /* phases + 1 phases of SMDI_RESAMPLE_TAPS taps */
+    BOOL own_bank;                      /* Not kept for other sources */
+    BYTE channels;
+    DWORD word_bytes;
+    DWORD frame_bytes;
+    float* input;                       /* RESAMPLE_BUFFER samples per channel */
+    DWORD start;                        /* Input position of input[0], zeros before the sample counted */
+    DWORD fill;
+    DWORD skip;                         /* Input frames to drop before filling */
+    DWORD pos;                          /* Input position of the next output sample's first tap */
+    DWORD frac;                         /* ...and its phase, in 1/up input samples */
+    DWORD produced;
+    DWORD length;
+    unsigned char* raw;                 /* Read from src, less than a frame left over */
+    DWORD raw_fill;
+    BOOL ended;
+    unsigned char frame[2 * 255];       /* A frame split between two packets */
+    DWORD frame_used;
+    DWORD frame_fill;
+} ResampleSourceState;
+
+static float SMDI_DotScalar(const float* a, const float* b, DWORD count) {
+    float sum;
+    DWORD i;
+    
+    sum = 0.0f;
+    for (i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    
+    return sum;
+}
+
+#ifdef SMDI_RESAMPLE_X86
+
+/* Counts are multiples of 16, as SMDI_RESAMPLE_TAPS */
+__attribute__((target("sse2")))
+static float SMDI_DotSSE2(const float* a, const float* b, DWORD count) {
+    __m128 s0;
+    __m128 s1;
+    DWORD i;
+    
+    s0 = _mm_setzero_ps();
+    s1 = _mm_setzero_ps();
+    for (i = 0; i < count; i += 8) {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    
+    s0 = _mm_add_ps(s0, s1);
+    s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+    s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+    
+    return _mm_cvtss_f32(s0);
+}
+
+__attribute__((target("avx2")))
+static float SMDI_DotAVX2(const float* a, const float* b, DWORD count) {
+    __m256 s0;
+    __m256 s1;
+    __m128 s;
+    DWORD i;
+    
+    s0 = _mm256_setzero_ps();
+    s1 = _mm256_setzero_ps();
+    for (i = 0; i < count; i += 16) {
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    
+    s0 = _mm256_add_ps(s0, s1);
+    s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    
+    return _mm_cvtss_f32(s);
+}
+
+#endif /* SMDI_RESAMPLE_X86 */
+
+/* Kernel procedure, NULL if the build or the CPU lacks it */
+static SMDI_DotProc SMDI_ResampleKernelProc(DWORD dwKernel) {
+    switch (dwKernel) {
+        case SMDI_SWAP_SCALAR:
+            return SMDI_DotScalar;
+#ifdef SMDI_RESAMPLE_X86
+        case SMDI_SWAP_SSE2:
+            return __builtin_cpu_supports("sse2") ? SMDI_DotSSE2 : NULL;
+        case SMDI_SWAP_AVX2:
+            return __builtin_cpu_supports("avx2") ? SMDI_DotAVX2 : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+/* Pick the fastest kernel */
+static void SMDI_PickResampleKernel(void) {
+    DWORD kernel;
+    
+    /* The scalar kernel ends the search */
+    kernel = SMDI_SWAP_KERNELS - 1;
+    while (SMDI_ResampleKernelProc(kernel) == NULL) {
+        kernel--;
+    }
+    
+    resample_kernel = kernel;
+    dot_proc = SMDI_ResampleKernelProc(kernel);
+}
+
+/* Sample rate of a header period */
+DWORD SMDI_PeriodToRate(DWORD dwPeriod) {
+    DWORD rate;
+    DWORD diff;
+    int i;
+    
+    if (dwPeriod == 0) {
+        return 0;
+    }
+    
+    rate = (1000000000UL + dwPeriod / 2) / dwPeriod;
+    for (i = 0; i < (int)(sizeof(standard_rates) / sizeof(standard_rates[0])); i++) {
+        diff = (rate > standard_rates[i]) ? rate - standard_rates[i] : standard_rates[i] - rate;
+        if (diff <= standard_rates[i] / 2000) {
+            return standard_rates[i];
+        }
+    }
+    
+    return rate;
+}
+
+/* Period of a sample rate */
+DWORD SMDI_RateToPeriod(DWORD dwRate) {
+    if (dwRate == 0) {
+        return 0;
+    }
+    
+    return (1000000000UL + dwRate / 2) / dwRate;
+}
+
+/* Greatest common divisor */
+static DWORD SMDI_Gcd(DWORD a, DWORD b) {
+    DWORD t;
+    
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    
+    return a;
+}
+
+/* Frames a resampled stream has; the remainder's share in double, where
+   it cannot round wrongly */
+DWORD SMDI_ResampledLength(DWORD dwFrames, DWORD dwSourceRate, DWORD dwTargetRate) {
+    DWORD g;
+    DWORD up;
+    DWORD down;
+    
+    if (dwSourceRate == 0 || dwTargetRate == 0) {
+        return 0;
+    }
+    
+    g = SMDI_Gcd(dwSourceRate, dwTargetRate);
+    up = dwTargetRate / g;
+    down = dwSourceRate / g;
+    
+    return (dwFrames / down) * up +
+           (DWORD)(((double)(dwFrames % down) * (double)up + (double)(down - 1)) / (double)down);
+}
+
+/* Zeroth order modified Bessel function, for the Kaiser window */
+static double SMDI_BesselI0(double x) {
+    double sum;
+    double term;
+    int k;
+    
+    sum = 1.0;
+    term = 1.0;
+    for (k = 1; k < 40; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    
+    return sum;
+}
+
+/* Fill the bank: phase p holds the taps for an output sample p/phases
+   of an input sample after the filter's middle tap, scaled for unity
+   gain at DC */
+static void SMDI_BuildBank(float* bank, DWORD phases, DWORD up, DWORD down) {
+    double cutoff;
+    double reach;
+    double norm;
+    double taps[SMDI_RESAMPLE_TAPS];
+    double t;
+    double r;
+    double sum;
+    DWORD p;
+    int j;
+    
+    /* Cycles per input sample the output can still carry */
+    cutoff = 0.5 * RESAMPLE_CUTOFF * ((up < down) ? (double)up / (double)down : 1.0);
+    reach = SMDI_RESAMPLE_TAPS / 2;
+    norm = SMDI_BesselI0(RESAMPLE_BETA);
+    
+    for (p = 0; p <= phases; p++) {
+        sum = 0.0;
+        for (j = 0; j < SMDI_RESAMPLE_TAPS; j++) {
+            t = (double)(j - (SMDI_RESAMPLE_TAPS / 2 - 1)) - (double)p / (double)phases;
+            r = t / reach;
+            if (r <= -1.0 || r >= 1.0) {
+                taps[j] = 0.0;
+            } else {
+                taps[j] = SMDI_BesselI0(RESAMPLE_BETA * sqrt(1.0 - r * r)) / norm;
+                if (t != 0.0) {
+                    taps[j] *= sin(2.0 * RESAMPLE_PI * cutoff * t) / (RESAMPLE_PI * t);
+                } else {
+                    taps[j] *= 2.0 * cutoff;
+                }
+            }
+            sum += taps[j];
+        }
+    
+        for (j = 0; j < SMDI_RESAMPLE_TAPS; j++) {
+            bank[p * SMDI_RESAMPLE_TAPS + j] = (float)(taps[j] / sum);
+        }
+    }
+}
+
+/* Bank of a ratio: a kept one, else built and kept, else built for the
+   caller alone once all places are taken (*own set) */
+static float* SMDI_GetBank(DWORD up, DWORD down, DWORD phases, BOOL* own) {
+    float* bank;
+    int i;
+    
+    if (bank_lock != NULL) {
+        SMDI_WaitSemaphore(bank_lock);
+    }
+    
+    bank = NULL;
+    for (i = 0; i < RESAMPLE_CACHED_BANKS && banks[i].bank != NULL; i++) {
+        if (banks[i].up == up && banks[i].down == down) {
+            bank = banks[i].bank;
+            break;
+        }
+    }
+    
+    *own = FALSE;
+    if (bank == NULL) {
+        bank = (float*)malloc((phases + 1) * SMDI_RESAMPLE_TAPS * sizeof(float));
+        if (bank != NULL) {
+            SMDI_BuildBank(bank, phases, up, down);
+            if (i < RESAMPLE_CACHED_BANKS && bank_lock != NULL) {
+                banks[i].up = up;
+                banks[i].down = down;
+                banks[i].bank = bank;
+            } else {
+                *own = TRUE;
+            }
+        }
+    }
+    
+    if (bank_lock != NULL) {
+        SMDI_PostSemaphore(bank_lock);
+    }
+    
+    return bank;
+}
+
+/* Read more input, dropping what the next output sample no longer
+   reaches; after the source ends the sample goes on in silence */
+static BOOL SMDI_ResampleFill(ResampleSourceState* state) {
+    unsigned char* in;
+    DWORD keep;
+    DWORD space;
+    DWORD got;
+    DWORD frames;
+    DWORD i;
+    DWORD ch;
+    float* dest;
+    
+    /* The next output sample may start beyond what is buffered */
+    if (state->pos >= state->start + state->fill) {
+        state->skip += state->pos - (state->start + state->fill);
+        state->start = state->pos;
+        state->fill = 0;
+    } else {
+        keep = state->start + state->fill - state->pos;
+        for (ch = 0; ch < state->channels; ch++) {
+            dest = state->input + ch * RESAMPLE_BUFFER;
+            memmove(dest, dest + (state->pos - state->start), keep * sizeof(float));
+        }
+        state->start = state->pos;
+        state->fill = keep;
+    }
+    space = RESAMPLE_BUFFER - state->fill;
+    
+    if (state->ended) {
+        for (ch = 0; ch < state->channels; ch++) {
+            memset(state->input + ch * RESAMPLE_BUFFER + state->fill, 0, space * sizeof(float));
+        }
+        state->fill = RESAMPLE_BUFFER;
+        state->skip = 0;
+        return TRUE;
+    }
+    
+    got = SMDI_ReadSource(state->src, state->raw + state->raw_fill,
+                          space * state->frame_bytes - state->raw_fill);
+    if (got == SMDI_SOURCE_ERROR) {
+        return FALSE;
+    }
+    if (got == 0) {
+        state->ended = TRUE;
+        return TRUE;
+    }
+    state->raw_fill += got;
+    
+    /* Whole frames are spread over the channels */
+    frames = state->raw_fill / state->frame_bytes;
+    in = state->raw;
+    for (i = 0; i < frames; i++) {
+        if (state->skip > 0) {
+            state->skip--;
+            in += state->frame_bytes;
+            continue;
+        }
+        dest = state->input + state->fill;
+        for (ch = 0; ch < state->channels; ch++, dest += RESAMPLE_BUFFER) {
+            if (state->word_bytes == 2) {
+                *dest = (float)(short)((in[0] << 8) | in[1]);
+                in += 2;
+            } else {
+                *dest = (float)(signed char)in[0];
+                in++;
+            }
+        }
+        state->fill++;
+    }
+    
+    state->raw_fill -= frames * state->frame_bytes;
+    memmove(state->raw, in, state->raw_fill);
+    
+    return TRUE;
+}
+
+/* Filter one output frame at the current position into out */
+static void SMDI_ResampleFrame(ResampleSourceState* state, unsigned char* out) {
+    const float* taps;
+    const float* in;
+    float y;
+    long q;
+    long most;
+    DWORD ch;
+    
+    /* With fewer phases than the ratio has, the nearest one */
+    taps = state->bank + ((state->frac * state->phases + state->up / 2) / state->up) *
+                         SMDI_RESAMPLE_TAPS;
+    in = state->input + (state->pos - state->start);
+    most = (state->word_bytes == 2) ? 32767 : 127;
+    
+    for (ch = 0; ch < state->channels; ch++, in += RESAMPLE_BUFFER) {
+        y = (*dot_proc)(taps, in, SMDI_RESAMPLE_TAPS);
+        q = (long)((y >= 0.0f) ? y + 0.5f : y - 0.5f);
+        if (q > most) {
+            q = most;
+        } else if (q < -most - 1) {
+            q = -most - 1;
+        }
+    
+        if (state->word_bytes == 2) {
+            *out++ = (unsigned char)((q >> 8) & 0xFF);
+            *out++ = (unsigned char)(q & 0xFF);
+        } else {
+            *out++ = (unsigned char)(q & 0xFF);
+        }
+    }
+}
+
+/* Resample the next frames of the source into an upload packet */
+static DWORD SMDI_ResampleSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    ResampleSourceState* state;
+    unsigned char* out;
+    DWORD count;
+    
+    state = (ResampleSourceState*)src->lpState;
+    out = (unsigned char*)buffer;
+    count = 0;
+    
+    while (count < dwBytes) {
+        /* Rest of a frame split at the end of the last packet */
+        if (state->frame_used < state->frame_fill) {
+            out[count++] = state->frame[state->frame_used++];
+            continue;
+        }
+    
+        if (state->produced == state->length) {
+            break;
+        }
+    
+        /* The filter reaches SMDI_RESAMPLE_TAPS input samples on */
+        if (state->pos + SMDI_RESAMPLE_TAPS > state->start + state->fill) {
+            if (!SMDI_ResampleFill(state)) {
+                return SMDI_SOURCE_ERROR;
+            }
+            continue;
+        }
+    
+        /* A packet length that is not a whole number of frames splits one */
+        if (dwBytes - count < state->frame_bytes) {
+            SMDI_ResampleFrame(state, state->frame);
+            state->frame_fill = state->frame_bytes;
+            state->frame_used = 0;
+        } else {
+            SMDI_ResampleFrame(state, out + count);
+            count += state->frame_bytes;
+        }
+    
+        state->produced++;
+        state->frac += state->down;
+        state->pos += state->frac / state->up;
+        state->frac %= state->up;
+    }
+    
+    return count;
+}
+
+/* Close the resampled source */
+static void SMDI_ResampleSourceClose(SMDI_SampleSource* src) {
+    ResampleSourceState* state;
+    
+    state = (ResampleSourceState*)src->lpState;
+    SMDI_CloseSource(state->src);
+    if (state->own_bank) {
+        free(state->bank);
+    }
+    free(state->input);
+    free(state->raw);
+    free(state);
+}
+
+/* Point of a loop at the new rate, within the sample */
+static DWORD SMDI_ResamplePoint(DWORD dwPoint, DWORD dwSourceRate, DWORD dwTargetRate,
+                                DWORD dwLength) {
+    DWORD point;
+    
+    point = (DWORD)((double)dwPoint * (double)dwTargetRate / (double)dwSourceRate + 0.5);
+    
+    return (point < dwLength || dwLength == 0) ? point : dwLength - 1;
+}
+
+/* Open a source resampling another */
+SMDI_SampleSource* SMDI_OpenResampleSource(SMDI_SampleSource* src, DWORD dwSourceRate,
+                                           DWORD dwTargetRate) {
+    SMDI_SampleSource* rs;
+    ResampleSourceState* state;
+    DWORD g;
+    int ok;
+    
+    if (src == NULL) {
+        return NULL;
+    }
+    
+    if (dwSourceRate == 0) {
+        dwSourceRate = SMDI_PeriodToRate(src->Header.dwPeriod);
+    }
+    if (dwSourceRate == dwTargetRate && dwSourceRate != 0) {
+        return src;
+    }
+    
+    if (dot_proc == NULL) {
+        SMDI_PickResampleKernel();
+    }
+    
+    rs = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (ResampleSourceState*)malloc(sizeof(ResampleSourceState));
+    ok = rs != NULL && state != NULL &&
+         dwSourceRate > 0 && dwSourceRate <= RESAMPLE_MAX_RATE &&
+         dwTargetRate > 0 && dwTargetRate <= RESAMPLE_MAX_RATE &&
+         (src->Header.BitsPerWord == 8 || src->Header.BitsPerWord == 16) &&
+         src->Header.NumberOfChannels > 0;
+    if (ok) {
+        memset(state, 0, sizeof(ResampleSourceState));
+        g = SMDI_Gcd(dwSourceRate, dwTargetRate);
+        state->up = dwTargetRate / g;
+        state->down = dwSourceRate / g;
+        state->phases = (state->up < SMDI_RESAMPLE_MAX_PHASES) ? state->up : SMDI_RESAMPLE_MAX_PHASES;
+        state->channels = src->Header.NumberOfChannels;
+        state->word_bytes = src->Header.BitsPerWord / 8;
+        state->frame_bytes = state->channels * state->word_bytes;
+        state->bank = SMDI_GetBank(state->up, state->down, state->phases, &state->own_bank);
+        state->input = (float*)calloc(state->channels * RESAMPLE_BUFFER, sizeof(float));
+        state->raw = (unsigned char*)malloc(RESAMPLE_BUFFER * state->frame_bytes);
+        ok = state->bank != NULL && state->input != NULL && state->raw != NULL;
+        if (!ok) {
+            if (state->own_bank) {
+                free(state->bank);
+            }
+            free(state->input);
+            free(state->raw);
+        }
+    }
+    if (!ok) {
+        free(rs);
+        free(state);
+        SMDI_CloseSource(src);
+        return NULL;
+    }
+    
+    state->src = src;
+    state->length = SMDI_ResampledLength(src->Header.dwLength, dwSourceRate, dwTargetRate);
+    
+    /* Silence before the sample for the first output sample's taps */
+    state->fill = SMDI_RESAMPLE_TAPS / 2 - 1;
+    
+    /* Same sample at the new rate, its loop at the same times */
+    memset(rs, 0, sizeof(SMDI_SampleSource));
+    rs->dwStructSize = sizeof(SMDI_SampleSource);
+    memcpy(&rs->Header, &src->Header, sizeof(SMDI_SampleHeader));
+    rs->Header.dwPeriod = SMDI_RateToPeriod(dwTargetRate);
+    rs->Header.dwLength = state->length;
+    rs->Header.dwLoopStart = SMDI_ResamplePoint(src->Header.dwLoopStart, dwSourceRate,
+                                                dwTargetRate, state->length);
+    rs->Header.dwLoopEnd = SMDI_ResamplePoint(src->Header.dwLoopEnd, dwSourceRate,
+                                              dwTargetRate, state->length);
+    rs->lpRead = SMDI_ResampleSourceRead;
+    rs->lpClose = SMDI_ResampleSourceClose;
+    rs->lpState = state;
+    
+    return rs;
+}
+
+/* Create the bank lock and pick the kernel, before any thread resamples */
+BOOL SMDI_InitResample(void) {
+    if (bank_lock == NULL) {
+        bank_lock = SMDI_CreateSemaphore(1);
+    }
+    if (dot_proc == NULL) {
+        SMDI_PickResampleKernel();
+    }
+    
+    return bank_lock != NULL;
+}
+
+/* Kernel in use */
+DWORD SMDI_GetResampleKernel(void) {
+    if (dot_proc == NULL) {
+        SMDI_PickResampleKernel();
+    }
+    
+    return resample_kernel;
+}
+
+/* Use another kernel */
+BOOL SMDI_SetResampleKernel(DWORD dwKernel) {
+    SMDI_DotProc proc;
+    
+    proc = SMDI_ResampleKernelProc(dwKernel);
+    if (proc == NULL) {
+        return FALSE;
+    }
+    
+    resample_kernel = dwKernel;
+    dot_proc = proc;
+    
+    return TRUE;
+}
@@ -1,15 +1,37 @@
 /*
  * SMDI sample handling implementation for IRIX 5.3
  * ANSI C90 compliant for MIPS big-endian architecture
+ *
+ * Native sample files, version 2 (all fields big-endian):
+ *
+ *    0  "SDMP", version, header checksum, flags
+ *   16  data offset, data size, content hash, sample rate
+ *   32  period, sample count, loop start, loop end
+ *   48  pitch, pitch fraction (16 bits each), bits, channels,
+ *       loop type, name length, 8 bytes reserved
+ *   64  name, then zeros up to the data offset
+ *
+ * The data offset is a multiple of SAMPLE_DATA_ALIGN, so a mapped file
+ * has its data page-aligned. The header checksum is the FNV-1a hash of
+ * the header and name with the checksum field taken as zero; the content
+ * hash, if SAMPLE_FLAG_HASH is set, that of the data.
+ *
+ * Version 1 files hold the NativeSampleHeaderV1 struct as the writing
+ * host laid it out, the name and the data right after it.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "smdi.h"
 #include "smdi_sample.h"
 
-/* Structure for native sample format header */
+/* Native sample file header, version 1 */
 typedef struct {
     BYTE  signature[4];       /* 'SDMP' */
     DWORD version;            /* Version number (1) */
@@ -26,11 +48,32 @@ typedef struct {
     DWORD nameLength;         /* Length of name string */
     /* Name string follows... */
     /* Then sample data... */
-} NativeSampleHeader;
+} NativeSampleHeaderV1;
 
-/* Create a new sample */
-SMDI_Sample* SMDI_CreateSample(DWORD sample_rate, BYTE bits_per_sample, 
-                             BYTE channels, DWORD sample_count) {
+/* Big-endian field access */
+DWORD SMDI_Get32(const unsigned char* p) {
+    return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+}
+
+static WORD SMDI_Get16(const unsigned char* p) {
+    return (WORD)(((WORD)p[0] << 8) | (WORD)p[1]);
+}
+
+void SMDI_Put32(unsigned char* p, DWORD v) {
+    p[0] = (unsigned char)((v >> 24) & 0xFF);
+    p[1] = (unsigned char)((v >> 16) & 0xFF);
+    p[2] = (unsigned char)((v >> 8) & 0xFF);
+    p[3] = (unsigned char)(v & 0xFF);
+}
+
+static void SMDI_Put16(unsigned char* p, WORD v) {
+    p[0] = (unsigned char)((v >> 8) & 0xFF);
+    p[1] = (unsigned char)(v & 0xFF);
+}
+
+/* Allocate a sample, optionally clearing its data */
+static SMDI_Sample* SMDI_AllocSample(DWORD sample_rate, BYTE bits_per_sample, 
+                                    BYTE channels, DWORD sample_count, BOOL clear) {
     SMDI_Sample* sample;
     DWORD data_size;
     
@@ -74,7 +117,9 @@ SMDI_Sample* SMDI_CreateSample(DWORD sample_rate, BYTE bits_per_sample,
     }
     
     /* Clear the sample data */
-    memset(sample->sample_data, 0, data_size);
+    if (clear) {
+        memset(sample->sample_data, 0, data_size);
+    }
     
     /* Store the data size */
     sample->data_size = data_size;
@@ -82,6 +127,12 @@ SMDI_Sample* SMDI_CreateSample(DWORD sample_rate, BYTE bits_per_sample,
     return sample;
 }
 
+/* Create a new sample */
+SMDI_Sample* SMDI_CreateSample(DWORD sample_rate, BYTE bits_per_sample, 
+                             BYTE channels, DWORD sample_count) {
+    return SMDI_AllocSample(sample_rate, bits_per_sample, channels, sample_count, TRUE);
+}
+
 /* Free a sample */
 void SMDI_FreeSample(SMDI_Sample* sample) {
     if (sample == NULL) {
@@ -103,7 +154,7 @@ SMDI_Sample* SMDI_HeaderToSample(SMDI_SampleHeader* header, void* data) {
     DWORD data_size;
     
     /* Verify parameters */
-    if (header == NULL || data == NULL) {
+    if (header == NULL) {
         return NULL;
     }
     
@@ -112,12 +163,13 @@ SMDI_Sample* SMDI_HeaderToSample(SMDI_SampleHeader* header, void* data) {
         return NULL;
     }
     
-    /* Create a new sample */
-    sample = SMDI_CreateSample(
+    /* Create a new sample; the data is copied or received over it */
+    sample = SMDI_AllocSample(
         1000000000 / header->dwPeriod,    /* Convert period to rate */
         header->BitsPerWord,
         header->NumberOfChannels,
-        header->dwLength);
+        header->dwLength,
+        FALSE);
     
     if (sample == NULL) {
         return NULL;
@@ -132,9 +184,11 @@ SMDI_Sample* SMDI_HeaderToSample(SMDI_SampleHeader* header, void* data) {
     strncpy(sample->name, header->cName, 255);
     sample->name[255] = '\0';
     
-    /* Copy the sample data */
+    /* Copy the sample data, if given */
     data_size = (header->dwLength * header->NumberOfChannels * header->BitsPerWord) / 8;
-    memcpy(sample->sample_data, data, data_size);
+    if (data != NULL) {
+        memcpy(sample->sample_data, data, data_size);
+    }
     
     /* Store the data size */
     sample->data_size = data_size;
@@ -179,155 +233,668 @@ void SMDI_SampleToHeader(SMDI_Sample* sample, SMDI_SampleHeader* header) {
 /* Save a sample to a file */
 BOOL SMDI_SaveSample(SMDI_Sample* sample, const char* filename) {
     FILE* file;
-    NativeSampleHeader header;
-    size_t name_len;
+    SMDI_SampleFileHeader fh;
+    unsigned char* buffer;
+    DWORD offset;
+    BOOL ok;
     
     /* Verify parameters */
     if (sample == NULL || filename == NULL) {
         return FALSE;
     }
     
+    /* Create the file header */
+    memset(&fh, 0, sizeof(SMDI_SampleFileHeader));
+    fh.flags = SAMPLE_FLAG_HASH;
+    fh.data_size = sample->data_size;
+    fh.content_hash = SMDI_HashData(SAMPLE_HASH_INIT, sample->sample_data, sample->data_size);
+    fh.sample_rate = sample->sample_rate;
+    SMDI_SampleToHeader(sample, &fh.header);
+    
+    buffer = (unsigned char*)malloc(SAMPLE_DATA_ALIGN);
+    if (buffer == NULL) {
+        return FALSE;
+    }
+    offset = SMDI_EncodeSampleFileHeader(&fh, buffer);
+    
     /* Open the file */
     file = fopen(filename, "wb");
     if (file == NULL) {
+        free(buffer);
         return FALSE;
     }
     
-    /* Create the file header */
-    memcpy(header.signature, "SDMP", 4);
-    header.version = 1;
-    header.bitsPerSample = sample->bits_per_sample;
-    header.channels = sample->channels;
-    header.loopType = sample->loop_type;
-    header.reserved = 0;
-    header.sampleRate = sample->sample_rate;
-    header.sampleCount = sample->sample_count;
-    header.loopStart = sample->loop_start;
-    header.loopEnd = sample->loop_end;
-    header.pitch = sample->root_note;
-    header.pitchFraction = sample->fine_tune;
-    
-    /* Get the name length */
-    name_len = strlen(sample->name);
-    if (name_len > 255) {
-        name_len = 255;
-    }
-    header.nameLength = name_len;
-    
-    /* Write the header */
-    if (fwrite(&header, sizeof(NativeSampleHeader), 1, file) != 1) {
-        fclose(file);
+    /* Write the header, padded to the data, then the sample data */
+    ok = fwrite(buffer, 1, offset, file) == offset &&
+         fwrite(sample->sample_data, 1, sample->data_size, file) == sample->data_size;
+    free(buffer);
+    
+    /* Close the file */
+    if (fclose(file) != 0) {
+        ok = FALSE;
+    }
+    
+    return ok;
+}
+
+/* Load a sample from a file */
+SMDI_Sample* SMDI_LoadSample(const char* filename) {
+    SMDI_FileMap map;
+    SMDI_SampleFileHeader fh;
+    SMDI_Sample* sample;
+    
+    /* Verify parameters */
+    if (filename == NULL) {
+        return NULL;
+    }
+    
+    /* Map the file and copy the sample out of it */
+    if (!SMDI_MapFile(filename, &map)) {
+        return NULL;
+    }
+    
+    sample = NULL;
+    if (SMDI_DecodeSampleFileHeader(map.data, map.size, &fh)) {
+        sample = SMDI_LoadMappedSample(&map, 0, &fh);
+    }
+    
+    SMDI_UnmapFile(&map);
+    
+    return sample;
+}
+
+/* TRUE if the data of the image at offset lies within the mapping */
+static BOOL SMDI_ImageFits(const SMDI_FileMap* map, DWORD offset, SMDI_SampleFileHeader* fh) {
+    return offset <= map->size &&
+           fh->data_offset <= map->size - offset &&
+           fh->data_size <= map->size - offset - fh->data_offset;
+}
+
+/* Load the native sample image at offset in a mapped file */
+SMDI_Sample* SMDI_LoadMappedSample(const SMDI_FileMap* map, DWORD offset, SMDI_SampleFileHeader* fh) {
+    SMDI_Sample* sample;
+    const unsigned char* data;
+    
+    /* The data must be in the file and match its hash */
+    if (!SMDI_ImageFits(map, offset, fh)) {
+        return NULL;
+    }
+    data = map->data + offset + fh->data_offset;
+    
+    if ((fh->flags & SAMPLE_FLAG_HASH) &&
+        SMDI_HashData(SAMPLE_HASH_INIT, data, fh->data_size) != fh->content_hash) {
+        return NULL;
+    }
+    
+    /* Create a new sample */
+    sample = SMDI_AllocSample(
+        fh->sample_rate,
+        fh->header.BitsPerWord,
+        fh->header.NumberOfChannels,
+        fh->header.dwLength,
+        FALSE);
+    
+    if (sample == NULL || sample->data_size != fh->data_size) {
+        SMDI_FreeSample(sample);
+        return NULL;
+    }
+    
+    /* Copy the sample properties */
+    sample->loop_type = fh->header.LoopControl;
+    sample->loop_start = fh->header.dwLoopStart;
+    sample->loop_end = fh->header.dwLoopEnd;
+    sample->root_note = fh->header.wPitch;
+    sample->fine_tune = fh->header.wPitchFraction;
+    strcpy(sample->name, fh->header.cName);
+    
+    /* Copy the sample data */
+    memcpy(sample->sample_data, data, fh->data_size);
+    
+    return sample;
+}
+
+/* FNV-1a hash of a block of bytes */
+DWORD SMDI_HashData(DWORD hash, const void* data, DWORD length) {
+    const unsigned char* p;
+    DWORD i;
+    
+    p = (const unsigned char*)data;
+    for (i = 0; i < length; i++) {
+        hash ^= (DWORD)p[i];
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    
+    return hash;
+}
+
+/* Checksum of an encoded version 2 header; the checksum field counts
+   as zero */
+static DWORD SMDI_HeaderChecksum(const unsigned char* buffer) {
+    static const unsigned char zero[4] = { 0, 0, 0, 0 };
+    DWORD hash;
+    
+    hash = SMDI_HashData(SAMPLE_HASH_INIT, buffer, 8);
+    hash = SMDI_HashData(hash, zero, 4);
+    
+    return SMDI_HashData(hash, buffer + 12, SAMPLE_HEADER_SIZE - 12 + (DWORD)buffer[55]);
+}
+
+/* Encode a version 2 native sample file header */
+DWORD SMDI_EncodeSampleFileHeader(SMDI_SampleFileHeader* fh, unsigned char* buffer) {
+    SMDI_SampleHeader* sh;
+    DWORD nameLength;
+    
+    sh = &fh->header;
+    nameLength = strlen(sh->cName);
+    if (nameLength > 255) {
+        nameLength = 255;
+    }
+    
+    fh->version = SAMPLE_FILE_VERSION;
+    fh->data_offset = (SAMPLE_HEADER_SIZE + nameLength + SAMPLE_DATA_ALIGN - 1) &
+                      ~(DWORD)(SAMPLE_DATA_ALIGN - 1);
+    sh->dwDataOffset = fh->data_offset;
+    
+    memset(buffer, 0, fh->data_offset);
+    memcpy(&buffer[0], SAMPLE_FILE_SIGNATURE, 4);
+    SMDI_Put32(&buffer[4], fh->version);
+    SMDI_Put32(&buffer[12], fh->flags);
+    SMDI_Put32(&buffer[16], fh->data_offset);
+    SMDI_Put32(&buffer[20], fh->data_size);
+    SMDI_Put32(&buffer[24], fh->content_hash);
+    SMDI_Put32(&buffer[28], fh->sample_rate);
+    SMDI_Put32(&buffer[32], sh->dwPeriod);
+    SMDI_Put32(&buffer[36], sh->dwLength);
+    SMDI_Put32(&buffer[40], sh->dwLoopStart);
+    SMDI_Put32(&buffer[44], sh->dwLoopEnd);
+    SMDI_Put16(&buffer[48], sh->wPitch);
+    SMDI_Put16(&buffer[50], sh->wPitchFraction);
+    buffer[52] = sh->BitsPerWord;
+    buffer[53] = sh->NumberOfChannels;
+    buffer[54] = sh->LoopControl;
+    buffer[55] = (unsigned char)nameLength;
+    memcpy(&buffer[SAMPLE_HEADER_SIZE], sh->cName, nameLength);
+    
+    SMDI_Put32(&buffer[8], SMDI_HeaderChecksum(buffer));
+    
+    return fh->data_offset;
+}
+
+/* Decode a version 1 header, laid out as the host lays out the struct */
+static BOOL SMDI_DecodeHeaderV1(const unsigned char* data, DWORD size, SMDI_SampleFileHeader* fh) {
+    NativeSampleHeaderV1 v1;
+    SMDI_SampleHeader* sh;
+    DWORD nameLength;
+    
+    if (size < sizeof(NativeSampleHeaderV1)) {
+        return FALSE;
+    }
+    memcpy(&v1, data, sizeof(NativeSampleHeaderV1));
+    
+    nameLength = v1.nameLength > 255 ? 255 : v1.nameLength;
+    if (v1.version != 1 || v1.sampleRate == 0 ||
+        v1.nameLength > size - sizeof(NativeSampleHeaderV1)) {
         return FALSE;
     }
     
-    /* Write the name */
-    if (name_len > 0) {
-        if (fwrite(sample->name, 1, name_len, file) != name_len) {
-            fclose(file);
+    sh = &fh->header;
+    fh->version = 1;
+    fh->data_offset = sizeof(NativeSampleHeaderV1) + v1.nameLength;
+    fh->data_size = v1.sampleCount * v1.channels * ((v1.bitsPerSample + 7) / 8);
+    fh->sample_rate = v1.sampleRate;
+    sh->dwPeriod = 1000000000 / v1.sampleRate;
+    sh->dwLength = v1.sampleCount;
+    sh->dwLoopStart = v1.loopStart;
+    sh->dwLoopEnd = v1.loopEnd;
+    sh->wPitch = v1.pitch;
+    sh->wPitchFraction = v1.pitchFraction;
+    sh->BitsPerWord = v1.bitsPerSample;
+    sh->NumberOfChannels = v1.channels;
+    sh->LoopControl = v1.loopType;
+    sh->NameLength = (BYTE)nameLength;
+    memcpy(sh->cName, data + sizeof(NativeSampleHeaderV1), nameLength);
+    
+    return TRUE;
+}
+
+/* Decode a native sample file header */
+BOOL SMDI_DecodeSampleFileHeader(const unsigned char* data, DWORD size, SMDI_SampleFileHeader* fh) {
+    SMDI_SampleHeader* sh;
+    DWORD nameLength;
+    
+    memset(fh, 0, sizeof(SMDI_SampleFileHeader));
+    sh = &fh->header;
+    sh->dwStructSize = sizeof(SMDI_SampleHeader);
+    sh->bDoesExist = TRUE;
+    
+    if (size < 8 || memcmp(data, SAMPLE_FILE_SIGNATURE, 4) != 0) {
+        return FALSE;
+    }
+    
+    /* Version 1 wrote its version as a host DWORD, so it never reads as 2 */
+    if (SMDI_Get32(&data[4]) != SAMPLE_FILE_VERSION) {
+        if (!SMDI_DecodeHeaderV1(data, size, fh)) {
             return FALSE;
         }
+        sh->dwDataOffset = fh->data_offset;
+        return TRUE;
     }
     
-    /* Write the sample data */
-    if (fwrite(sample->sample_data, 1, sample->data_size, file) != sample->data_size) {
-        fclose(file);
+    if (size < SAMPLE_HEADER_SIZE) {
+        return FALSE;
+    }
+    nameLength = data[55];
+    if (size < SAMPLE_HEADER_SIZE + nameLength ||
+        SMDI_Get32(&data[8]) != SMDI_HeaderChecksum(data)) {
         return FALSE;
     }
     
-    /* Close the file */
-    fclose(file);
+    fh->version = SAMPLE_FILE_VERSION;
+    fh->flags = SMDI_Get32(&data[12]);
+    fh->data_offset = SMDI_Get32(&data[16]);
+    fh->data_size = SMDI_Get32(&data[20]);
+    fh->content_hash = SMDI_Get32(&data[24]);
+    fh->sample_rate = SMDI_Get32(&data[28]);
+    sh->dwPeriod = SMDI_Get32(&data[32]);
+    sh->dwLength = SMDI_Get32(&data[36]);
+    sh->dwLoopStart = SMDI_Get32(&data[40]);
+    sh->dwLoopEnd = SMDI_Get32(&data[44]);
+    sh->wPitch = SMDI_Get16(&data[48]);
+    sh->wPitchFraction = SMDI_Get16(&data[50]);
+    sh->BitsPerWord = data[52];
+    sh->NumberOfChannels = data[53];
+    sh->LoopControl = data[54];
+    sh->NameLength = (BYTE)nameLength;
+    memcpy(sh->cName, &data[SAMPLE_HEADER_SIZE], nameLength);
+    sh->dwDataOffset = fh->data_offset;
+    
+    /* The period is exact where the device gave it */
+    if (fh->sample_rate == 0 || fh->data_offset < SAMPLE_HEADER_SIZE + nameLength) {
+        return FALSE;
+    }
+    if (sh->dwPeriod == 0) {
+        sh->dwPeriod = 1000000000 / fh->sample_rate;
+    }
     
     return TRUE;
 }
 
-/* Load a sample from a file */
-SMDI_Sample* SMDI_LoadSample(const char* filename) {
-    FILE* file;
-    NativeSampleHeader header;
+/* Read position in a sample uploaded from memory */
+typedef struct {
     SMDI_Sample* sample;
-    char* name_buffer;
-    DWORD data_size;
+    DWORD position;
+} SampleSourceState;
+
+/* Copy the next bytes of the sample data */
+static DWORD SMDI_SampleSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    SampleSourceState* state;
+    DWORD left;
+    
+    state = (SampleSourceState*)src->lpState;
+    
+    left = state->sample->data_size - state->position;
+    if (dwBytes > left) {
+        dwBytes = left;
+    }
+    
+    memcpy(buffer, (char*)state->sample->sample_data + state->position, dwBytes);
+    state->position += dwBytes;
+    
+    return dwBytes;
+}
+
+/* Release the read position */
+static void SMDI_SampleSourceClose(SMDI_SampleSource* src) {
+    free(src->lpState);
+}
+
+/* Open an in-memory sample as an upload source */
+SMDI_SampleSource* SMDI_OpenSampleSource(SMDI_Sample* sample) {
+    SMDI_SampleSource* src;
+    SampleSourceState* state;
     
     /* Verify parameters */
+    if (sample == NULL || sample->sample_data == NULL) {
+        return NULL;
+    }
+    
+    src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (SampleSourceState*)malloc(sizeof(SampleSourceState));
+    if (src == NULL || state == NULL) {
+        free(src);
+        free(state);
+        return NULL;
+    }
+    
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    SMDI_SampleToHeader(sample, &src->Header);
+    
+    state->sample = sample;
+    state->position = 0;
+    
+    src->lpRead = SMDI_SampleSourceRead;
+    src->lpClose = SMDI_SampleSourceClose;
+    src->lpState = state;
+    
+    return src;
+}
+
+/* Native sample image in a mapped file, read by an upload */
+typedef struct {
+    SMDI_FileMap map;
+    DWORD position;            /* Next data byte in the mapping */
+    DWORD end;                 /* End of the data */
+    BOOL  check_hash;          /* The image has a content hash */
+    DWORD content_hash;
+    DWORD hash;                /* Of the data read so far */
+} MappedSourceState;
+
+/* Copy the next bytes of the data out of the mapping */
+static DWORD SMDI_MappedSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    MappedSourceState* state;
+    DWORD left;
+    
+    state = (MappedSourceState*)src->lpState;
+    
+    left = state->end - state->position;
+    if (dwBytes > left) {
+        dwBytes = left;
+    }
+    
+    memcpy(buffer, state->map.data + state->position, dwBytes);
+    state->position += dwBytes;
+    
+    /* Data that does not match its hash fails the transfer before its
+       last packet */
+    if (state->check_hash) {
+        state->hash = SMDI_HashData(state->hash, buffer, dwBytes);
+        if (state->position == state->end && state->hash != state->content_hash) {
+            return SMDI_SOURCE_ERROR;
+        }
+    }
+    
+    return dwBytes;
+}
+
+/* Unmap the file */
+static void SMDI_MappedSourceClose(SMDI_SampleSource* src) {
+    MappedSourceState* state;
+    
+    state = (MappedSourceState*)src->lpState;
+    SMDI_UnmapFile(&state->map);
+    free(state);
+}
+
+/* Open a native sample image in a mapped file as an upload source */
+SMDI_SampleSource* SMDI_OpenMappedSource(SMDI_FileMap* map, DWORD offset, SMDI_SampleFileHeader* fh) {
+    SMDI_SampleSource* src;
+    MappedSourceState* state;
+    
+    src = NULL;
+    state = NULL;
+    if (SMDI_ImageFits(map, offset, fh)) {
+        src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+        state = (MappedSourceState*)malloc(sizeof(MappedSourceState));
+    }
+    if (src == NULL || state == NULL) {
+        free(src);
+        free(state);
+        SMDI_UnmapFile(map);
+        return NULL;
+    }
+    
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    memcpy(&src->Header, &fh->header, sizeof(SMDI_SampleHeader));
+    
+    /* The source takes the mapping over */
+    memcpy(&state->map, map, sizeof(SMDI_FileMap));
+    memset(map, 0, sizeof(SMDI_FileMap));
+    state->position = offset + fh->data_offset;
+    state->end = state->position + fh->data_size;
+    state->check_hash = (fh->flags & SAMPLE_FLAG_HASH) != 0;
+    state->content_hash = fh->content_hash;
+    state->hash = SAMPLE_HASH_INIT;
+    
+    src->lpRead = SMDI_MappedSourceRead;
+    src->lpClose = SMDI_MappedSourceClose;
+    src->lpState = state;
+    
+    return src;
+}
+
+/* Sample file read by an upload, opened at its first packet */
+typedef struct {
+    char filename[MAX_PATH];
+    SMDI_SampleSource* (*open_source)(const char* filename);
+    SMDI_SampleSource* source;  /* NULL until the first read */
+} SampleFileSourceState;
+
+/* TRUE if a header holds the sample a handle was opened with */
+static BOOL SMDI_SampleFileMatches(SMDI_SampleHeader* header, SMDI_SampleHeader* expected) {
+    return header->BitsPerWord == expected->BitsPerWord &&
+           header->NumberOfChannels == expected->NumberOfChannels &&
+           header->dwLength == expected->dwLength;
+}
+
+/* Open the file at the first packet, then read from its source */
+static DWORD SMDI_SampleFileSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    SampleFileSourceState* state;
+    
+    state = (SampleFileSourceState*)src->lpState;
+    
+    if (state->source == NULL) {
+        state->source = (*state->open_source)(state->filename);
+        if (state->source == NULL) {
+            return SMDI_SOURCE_ERROR;
+        }
+        if (!SMDI_SampleFileMatches(&state->source->Header, &src->Header)) {
+            fprintf(stderr, "SMDI_OpenSampleFileSource: '%s' has changed\n", state->filename);
+            return SMDI_SOURCE_ERROR;
+        }
+    }
+    
+    return SMDI_ReadSource(state->source, buffer, dwBytes);
+}
+
+/* Close the file if it was opened */
+static void SMDI_SampleFileSourceClose(SMDI_SampleSource* src) {
+    SampleFileSourceState* state;
+    
+    state = (SampleFileSourceState*)src->lpState;
+    SMDI_CloseSource(state->source);
+    free(state);
+}
+
+/* Make a handle for a parsed sample file */
+SMDI_SampleFile* SMDI_CreateSampleFile(const char* filename, SMDI_Sample* info,
+                                       SMDI_SampleSource* (*lpOpenSource)(const char* filename),
+                                       SMDI_Sample* (*lpLoad)(const char* filename)) {
+    SMDI_SampleFile* file;
+    
+    if (filename == NULL || strlen(filename) >= MAX_PATH) {
+        return NULL;
+    }
+    
+    file = (SMDI_SampleFile*)malloc(sizeof(SMDI_SampleFile));
+    if (file == NULL) {
+        return NULL;
+    }
+    
+    memcpy(&file->Info, info, sizeof(SMDI_Sample));
+    file->Info.sample_data = NULL;
+    strcpy(file->cFileName, filename);
+    file->lpOpenSource = lpOpenSource;
+    file->lpLoad = lpLoad;
+    
+    return file;
+}
+
+/* Native sample files are uploaded through the file source */
+static SMDI_SampleSource* SMDI_OpenNativeSource(const char* filename) {
+    return SMDI_OpenFileSource((char*)filename, NULL);
+}
+
+/* Open a native sample file for its header */
+SMDI_SampleFile* SMDI_OpenSampleFile(const char* filename) {
+    SMDI_SampleFileHeader fh;
+    SMDI_Sample info;
+    unsigned char buffer[512];
+    FILE* file;
+    DWORD got;
+    long size;
+    
     if (filename == NULL) {
         return NULL;
     }
     
-    /* Open the file */
+    /* The header and name fit in the first bytes; the file size tells
+       whether the data is all there */
     file = fopen(filename, "rb");
     if (file == NULL) {
         return NULL;
     }
+    got = (DWORD)fread(buffer, 1, sizeof(buffer), file);
+    size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+    fclose(file);
     
-    /* Read the header */
-    if (fread(&header, sizeof(NativeSampleHeader), 1, file) != 1) {
-        fclose(file);
+    if (!SMDI_DecodeSampleFileHeader(buffer, got, &fh) || fh.sample_rate == 0 || size < 0 ||
+        fh.data_offset > (DWORD)size || fh.data_size > (DWORD)size - fh.data_offset) {
         return NULL;
     }
     
-    /* Verify the signature */
-    if (memcmp(header.signature, "SDMP", 4) != 0) {
-        fclose(file);
+    /* Format, loop and name as SMDI_LoadSample sets them */
+    memset(&info, 0, sizeof(SMDI_Sample));
+    info.sample_rate = fh.sample_rate;
+    info.bits_per_sample = fh.header.BitsPerWord;
+    info.channels = fh.header.NumberOfChannels;
+    info.sample_count = fh.header.dwLength;
+    info.loop_type = fh.header.LoopControl;
+    info.loop_start = fh.header.dwLoopStart;
+    info.loop_end = fh.header.dwLoopEnd;
+    info.root_note = fh.header.wPitch;
+    info.fine_tune = fh.header.wPitchFraction;
+    info.data_size = fh.data_size;
+    strcpy(info.name, fh.header.cName);
+    
+    return SMDI_CreateSampleFile(filename, &info, SMDI_OpenNativeSource, SMDI_LoadSample);
+}
+
+/* Open a sample file as an upload source that opens the file when its
+   first packet is read */
+SMDI_SampleSource* SMDI_OpenSampleFileSource(SMDI_SampleFile* file) {
+    SMDI_SampleSource* src;
+    SampleFileSourceState* state;
+    
+    if (file == NULL || file->lpOpenSource == NULL) {
         return NULL;
     }
     
-    /* Create a new sample */
-    sample = SMDI_CreateSample(
-        header.sampleRate,
-        header.bitsPerSample,
-        header.channels,
-        header.sampleCount);
-    
-    if (sample == NULL) {
-        fclose(file);
+    src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (SampleFileSourceState*)malloc(sizeof(SampleFileSourceState));
+    if (src == NULL || state == NULL) {
+        free(src);
+        free(state);
         return NULL;
     }
     
-    /* Copy the sample properties */
-    sample->loop_type = header.loopType;
-    sample->loop_start = header.loopStart;
-    sample->loop_end = header.loopEnd;
-    sample->root_note = header.pitch;
-    sample->fine_tune = header.pitchFraction;
-    
-    /* Read the name */
-    if (header.nameLength > 0) {
-        /* Allocate a buffer for the name */
-        name_buffer = (char*)malloc(header.nameLength + 1);
-        if (name_buffer == NULL) {
-            SMDI_FreeSample(sample);
-            fclose(file);
-            return NULL;
-        }
-        
-        /* Read the name */
-        if (fread(name_buffer, 1, header.nameLength, file) != header.nameLength) {
-            free(name_buffer);
-            SMDI_FreeSample(sample);
-            fclose(file);
-            return NULL;
-        }
-        
-        /* Null-terminate the name */
-        name_buffer[header.nameLength] = '\0';
-        
-        /* Copy the name to the sample */
-        strncpy(sample->name, name_buffer, 255);
-        sample->name[255] = '\0';
-        
-        /* Free the name buffer */
-        free(name_buffer);
-    }
-    
-    /* Read the sample data */
-    if (fread(sample->sample_data, 1, sample->data_size, file) != sample->data_size) {
-        SMDI_FreeSample(sample);
-        fclose(file);
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    SMDI_SampleToHeader(&file->Info, &src->Header);
+    
+    strcpy(state->filename, file->cFileName);
+    state->open_source = file->lpOpenSource;
+    state->source = NULL;
+    
+    src->lpRead = SMDI_SampleFileSourceRead;
+    src->lpClose = SMDI_SampleFileSourceClose;
+    src->lpState = state;
+    
+    return src;
+}
+
+/* Load the data of a sample file */
+SMDI_Sample* SMDI_LoadSampleFile(SMDI_SampleFile* file) {
+    SMDI_Sample* sample;
+    
+    if (file == NULL || file->lpLoad == NULL) {
         return NULL;
     }
     
-    /* Close the file */
-    fclose(file);
+    sample = (*file->lpLoad)(file->cFileName);
+    if (sample != NULL && (sample->bits_per_sample != file->Info.bits_per_sample ||
+                           sample->channels != file->Info.channels ||
+                           sample->sample_count != file->Info.sample_count)) {
+        fprintf(stderr, "SMDI_LoadSampleFile: '%s' has changed\n", file->cFileName);
+        SMDI_FreeSample(sample);
+        sample = NULL;
+    }
     
     return sample;
 }
+
+/* Release a sample file handle */
+void SMDI_CloseSampleFile(SMDI_SampleFile* file) {
+    free(file);
+}
+
+/* Map or, where mapping fails, read a whole file */
+BOOL SMDI_MapFile(const char* filename, SMDI_FileMap* map) {
+    struct stat st;
+    int fd;
+    void* view;
+    long got;
+    DWORD total;
+    
+    memset(map, 0, sizeof(SMDI_FileMap));
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return FALSE;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return FALSE;
+    }
+    map->size = (DWORD)st.st_size;
+    
+    view = mmap(NULL, map->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (view != MAP_FAILED) {
+        close(fd);
+        map->data = (unsigned char*)view;
+        map->mapped = TRUE;
+        return TRUE;
+    }
+    
+    map->data = (unsigned char*)malloc(map->size);
+    if (map->data == NULL) {
+        close(fd);
+        return FALSE;
+    }
+    for (total = 0; total < map->size; total += (DWORD)got) {
+        got = (long)read(fd, map->data + total, map->size - total);
+        if (got <= 0) {
+            break;
+        }
+    }
+    close(fd);
+    
+    if (total != map->size) {
+        SMDI_UnmapFile(map);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
+/* Release a mapped or read file */
+void SMDI_UnmapFile(SMDI_FileMap* map) {
+    if (map->mapped) {
+        munmap((void*)map->data, map->size);
+    } else {
+        free(map->data);
+    }
+    
+    memset(map, 0, sizeof(SMDI_FileMap));
+}
@@ -0,0 +1,223 @@
+/*
+ * SMDI sample data byte order conversion for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * The sampler keeps 16-bit sample words big-endian. IRIX sends its own
+ * words as they are; little-endian hosts and little-endian file data
+ * swap the two bytes of every word on the way to and from the device.
+ * The swap runs on the fastest kernel the build and the CPU support:
+ * SSE2 or AVX2 on x86 (chosen when first used), NEON on ARM, portable
+ * C elsewhere.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "smdi.h"
+#include "smdi_swap.h"
+
+/* x86 kernels need GCC 4.9 or clang for intrinsics outside -m flags */
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SMDI_SWAP_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SMDI_SWAP_ARM
+#include <arm_neon.h>
+#endif
+
+typedef void (*SMDI_SwapProc)(unsigned char* dest, const unsigned char* src, DWORD length);
+
+/* Kernel in use, chosen on first use */
+static SMDI_SwapProc swap_proc = NULL;
+static DWORD swap_kernel = SMDI_SWAP_SCALAR;
+
+static const char* swap_names[SMDI_SWAP_KERNELS] = {
+    "scalar", "sse2", "avx2", "neon"
+};
+
+/* Swap word by word; each word is read before it is written, so this
+   works in place */
+static void SMDI_Swap16Scalar(unsigned char* dest, const unsigned char* src, DWORD length) {
+    unsigned char first;
+    DWORD i;
+    
+    for (i = 0; i + 1 < length; i += 2) {
+        first = src[i];
+        dest[i] = src[i + 1];
+        dest[i + 1] = first;
+    }
+    
+    if (i < length) {
+        dest[i] = src[i];
+    }
+}
+
+#ifdef SMDI_SWAP_X86
+
+__attribute__((target("sse2")))
+static void SMDI_Swap16SSE2(unsigned char* dest, const unsigned char* src, DWORD length) {
+    __m128i a;
+    __m128i b;
+    DWORD i;
+    
+    /* Both vectors are loaded before either is stored */
+    for (i = 0; i + 32 <= length; i += 32) {
+        a = _mm_loadu_si128((const __m128i*)(src + i));
+        b = _mm_loadu_si128((const __m128i*)(src + i + 16));
+        a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i*)(dest + i), a);
+        _mm_storeu_si128((__m128i*)(dest + i + 16), b);
+    }
+    
+    SMDI_Swap16Scalar(dest + i, src + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static void SMDI_Swap16AVX2(unsigned char* dest, const unsigned char* src, DWORD length) {
+    __m256i a;
+    __m256i b;
+    DWORD i;
+    
+    for (i = 0; i + 64 <= length; i += 64) {
+        a = _mm256_loadu_si256((const __m256i*)(src + i));
+        b = _mm256_loadu_si256((const __m256i*)(src + i + 32));
+        a = _mm256_or_si256(_mm256_slli_epi16(a, 8), _mm256_srli_epi16(a, 8));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 8), _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256((__m256i*)(dest + i), a);
+        _mm256_storeu_si256((__m256i*)(dest + i + 32), b);
+    }
+    
+    SMDI_Swap16Scalar(dest + i, src + i, length - i);
+}
+
+#endif /* SMDI_SWAP_X86 */
+
+#ifdef SMDI_SWAP_ARM
+
+static void SMDI_Swap16NEON(unsigned char* dest, const unsigned char* src, DWORD length) {
+    uint8x16_t a;
+    uint8x16_t b;
+    DWORD i;
+    
+    for (i = 0; i + 32 <= length; i += 32) {
+        a = vld1q_u8(src + i);
+        b = vld1q_u8(src + i + 16);
+        vst1q_u8(dest + i, vrev16q_u8(a));
+        vst1q_u8(dest + i + 16, vrev16q_u8(b));
+    }
+    
+    SMDI_Swap16Scalar(dest + i, src + i, length - i);
+}
+
+#endif /* SMDI_SWAP_ARM */
+
+/* Kernel procedure, NULL if the build or the CPU lacks it */
+static SMDI_SwapProc SMDI_SwapKernelProc(DWORD dwKernel) {
+    switch (dwKernel) {
+        case SMDI_SWAP_SCALAR:
+            return SMDI_Swap16Scalar;
+#ifdef SMDI_SWAP_X86
+        case SMDI_SWAP_SSE2:
+            return __builtin_cpu_supports("sse2") ? SMDI_Swap16SSE2 : NULL;
+        case SMDI_SWAP_AVX2:
+            return __builtin_cpu_supports("avx2") ? SMDI_Swap16AVX2 : NULL;
+#endif
+#ifdef SMDI_SWAP_ARM
+        case SMDI_SWAP_NEON:
+            return SMDI_Swap16NEON;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+/* Pick the fastest kernel; racing threads pick the same one */
+static void SMDI_InitSwap(void) {
+    DWORD kernel;
+    
+    /* The scalar kernel ends the search */
+    kernel = SMDI_SWAP_KERNELS - 1;
+    while (SMDI_SwapKernelProc(kernel) == NULL) {
+        kernel--;
+    }
+    
+    swap_kernel = kernel;
+    swap_proc = SMDI_SwapKernelProc(kernel);
+}
+
+/* TRUE on little-endian hosts */
+static BOOL SMDI_HostIsLittleEndian(void) {
+    union {
+        unsigned short word;
+        unsigned char bytes[2];
+    } probe;
+    
+    probe.word = 1;
+    
+    return probe.bytes[0] == 1;
+}
+
+/* Whether a copy mode swaps on this host */
+BOOL SMDI_CopyModeSwaps(DWORD dwCopyMode) {
+    switch (dwCopyMode) {
+        case CM_BYTESWAP:
+            return TRUE;
+        case CM_HOSTORDER:
+            return SMDI_HostIsLittleEndian();
+        default:
+            return FALSE;
+    }
+}
+
+/* Copy sample data as the copy mode says */
+void SMDI_CopySwap(void* dest, const void* src, DWORD dwLength, DWORD dwCopyMode) {
+    if (!SMDI_CopyModeSwaps(dwCopyMode)) {
+        if (dest != src) {
+            memcpy(dest, src, dwLength);
+        }
+        return;
+    }
+    
+    if (swap_proc == NULL) {
+        SMDI_InitSwap();
+    }
+    
+    (*swap_proc)((unsigned char*)dest, (const unsigned char*)src, dwLength);
+}
+
+/* Kernel in use */
+DWORD SMDI_GetSwapKernel(void) {
+    if (swap_proc == NULL) {
+        SMDI_InitSwap();
+    }
+    
+    return swap_kernel;
+}
+
+/* Use another kernel */
+BOOL SMDI_SetSwapKernel(DWORD dwKernel) {
+    SMDI_SwapProc proc;
+    
+    proc = SMDI_SwapKernelProc(dwKernel);
+    if (proc == NULL) {
+        return FALSE;
+    }
+    
+    swap_kernel = dwKernel;
+    swap_proc = proc;
+    
+    return TRUE;
+}
+
+/* Name of a kernel */
+const char* SMDI_SwapKernelName(DWORD dwKernel) {
+    if (dwKernel >= SMDI_SWAP_KERNELS) {
+        return "unknown";
+    }
+    
+    return swap_names[dwKernel];
+}
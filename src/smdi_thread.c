@@ -0,0 +1,229 @@
+/*
+ * SMDI threads and semaphores for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * IRIX 5.3 has no POSIX threads: a thread is a sproc() process sharing
+ * the address space and file descriptors, and semaphores come from a
+ * shared arena (ulocks). Other systems use POSIX threads and semaphores.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "smdi.h"
+#include "smdi_thread.h"
+
+#if defined(__sgi) && !defined(SMDI_PTHREADS)
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <ulocks.h>
+
+struct SMDI_Thread {
+    pid_t pid;
+};
+
+struct SMDI_Semaphore {
+    usema_t* sema;
+};
+
+/* Arena the semaphores live in, created on first use */
+static usptr_t* arena = NULL;
+
+static usptr_t* SMDI_GetArena(void) {
+    char name[L_tmpnam];
+    
+    if (arena == NULL) {
+        /* The arena file is only needed to create the arena */
+        if (tmpnam(name) == NULL) {
+            return NULL;
+        }
+        usconfig(CONF_ARENATYPE, US_SHAREDONLY);
+        arena = usinit(name);
+        unlink(name);
+        if (arena == NULL) {
+            fprintf(stderr, "SMDI_GetArena: usinit failed\n");
+        }
+    }
+    
+    return arena;
+}
+
+/* Start a thread */
+SMDI_Thread* SMDI_StartThread(void (*lpProc)(void*), void* lpArg) {
+    SMDI_Thread* thread;
+    
+    /* The arena must exist before the share group does */
+    if (SMDI_GetArena() == NULL) {
+        return NULL;
+    }
+    
+    thread = (SMDI_Thread*)malloc(sizeof(SMDI_Thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    
+    thread->pid = sproc(lpProc, PR_SADDR | PR_SFDS, lpArg);
+    if (thread->pid < 0) {
+        free(thread);
+        return NULL;
+    }
+    
+    return thread;
+}
+
+/* Wait for a thread to finish */
+void SMDI_JoinThread(SMDI_Thread* thread) {
+    int status;
+    
+    if (thread == NULL) {
+        return;
+    }
+    
+    while (waitpid(thread->pid, &status, 0) < 0 && errno == EINTR) {
+        /* Interrupted by a signal, wait again */
+    }
+    
+    free(thread);
+}
+
+/* Create a semaphore */
+SMDI_Semaphore* SMDI_CreateSemaphore(DWORD dwCount) {
+    SMDI_Semaphore* sem;
+    
+    if (SMDI_GetArena() == NULL) {
+        return NULL;
+    }
+    
+    sem = (SMDI_Semaphore*)malloc(sizeof(SMDI_Semaphore));
+    if (sem == NULL) {
+        return NULL;
+    }
+    
+    sem->sema = usnewsema(arena, (int)dwCount);
+    if (sem->sema == NULL) {
+        free(sem);
+        return NULL;
+    }
+    
+    return sem;
+}
+
+/* Free a semaphore */
+void SMDI_FreeSemaphore(SMDI_Semaphore* sem) {
+    if (sem == NULL) {
+        return;
+    }
+    
+    usfreesema(sem->sema, arena);
+    free(sem);
+}
+
+/* Take a unit */
+void SMDI_WaitSemaphore(SMDI_Semaphore* sem) {
+    uspsema(sem->sema);
+}
+
+/* Return a unit */
+void SMDI_PostSemaphore(SMDI_Semaphore* sem) {
+    usvsema(sem->sema);
+}
+
+#else /* POSIX threads */
+
+#include <pthread.h>
+#include <semaphore.h>
+
+struct SMDI_Thread {
+    pthread_t tid;
+    void (*lpProc)(void*);
+    void* lpArg;
+};
+
+struct SMDI_Semaphore {
+    sem_t sem;
+};
+
+/* Adapt the thread procedure to the pthread signature */
+static void* SMDI_ThreadMain(void* lpStart) {
+    SMDI_Thread* thread;
+    
+    thread = (SMDI_Thread*)lpStart;
+    (*thread->lpProc)(thread->lpArg);
+    
+    return NULL;
+}
+
+/* Start a thread */
+SMDI_Thread* SMDI_StartThread(void (*lpProc)(void*), void* lpArg) {
+    SMDI_Thread* thread;
+    
+    thread = (SMDI_Thread*)malloc(sizeof(SMDI_Thread));
+    if (thread == NULL) {
+        return NULL;
+    }
+    
+    thread->lpProc = lpProc;
+    thread->lpArg = lpArg;
+    
+    if (pthread_create(&thread->tid, NULL, SMDI_ThreadMain, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+    
+    return thread;
+}
+
+/* Wait for a thread to finish */
+void SMDI_JoinThread(SMDI_Thread* thread) {
+    if (thread == NULL) {
+        return;
+    }
+    
+    pthread_join(thread->tid, NULL);
+    free(thread);
+}
+
+/* Create a semaphore */
+SMDI_Semaphore* SMDI_CreateSemaphore(DWORD dwCount) {
+    SMDI_Semaphore* sem;
+    
+    sem = (SMDI_Semaphore*)malloc(sizeof(SMDI_Semaphore));
+    if (sem == NULL) {
+        return NULL;
+    }
+    
+    if (sem_init(&sem->sem, 0, (unsigned int)dwCount) != 0) {
+        free(sem);
+        return NULL;
+    }
+    
+    return sem;
+}
+
+/* Free a semaphore */
+void SMDI_FreeSemaphore(SMDI_Semaphore* sem) {
+    if (sem == NULL) {
+        return;
+    }
+    
+    sem_destroy(&sem->sem);
+    free(sem);
+}
+
+/* Take a unit */
+void SMDI_WaitSemaphore(SMDI_Semaphore* sem) {
+    while (sem_wait(&sem->sem) != 0 && errno == EINTR) {
+        /* Interrupted by a signal, wait again */
+    }
+}
+
+/* Return a unit */
+void SMDI_PostSemaphore(SMDI_Semaphore* sem) {
+    sem_post(&sem->sem);
+}
+
+#endif
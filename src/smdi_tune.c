@@ -0,0 +1,407 @@
+/*
+ * SMDI packet size calibration for IRIX 5.3
+ * ANSI C90 compliant for MIPS big-endian architecture
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "smdi.h"
+#include "smdi_thread.h"
+
+#define MAXFNLEN   1024  /* Maximum file name length for IRIX */
+
+/* Number of device models the packet size table holds */
+#define SMDI_TUNED_MAX           32
+
+/* Defaults for a calibration run */
+#define SMDI_CALIBRATE_BYTES     (256 * 1024)
+#define SMDI_CALIBRATE_MIN       1024
+
+/* Calibrated packet size of one device model */
+typedef struct {
+    char cVendor[9];
+    char cProduct[17];
+    DWORD dwPacketSize;
+} SMDI_TunedDevice;
+
+static SMDI_TunedDevice tuned_devices[SMDI_TUNED_MAX];
+static int tuned_count = 0;
+static char tuned_file[MAXFNLEN] = "";
+
+/* Guards the table and the file: connections to several devices may
+   calibrate and look sizes up at once. Created by SMDI_Init, before any
+   connection exists. */
+static SMDI_Semaphore* tuned_lock = NULL;
+
+/* Current time in seconds */
+static double tune_now(void) {
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    
+    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+/* Copy an inquiry string, dropping the space padding */
+static void tune_copy_name(char* dest, const char* src, int size) {
+    int length;
+    
+    length = 0;
+    while (length < size - 1 && src[length] != '\0') {
+        dest[length] = src[length];
+        length++;
+    }
+    
+    while (length > 0 && dest[length - 1] == ' ') {
+        length--;
+    }
+    
+    dest[length] = '\0';
+}
+
+/* Take and release the table; without SMDI_Init there is no lock, nor
+   any other connection */
+static void tune_lock(void) {
+    if (tuned_lock != NULL) {
+        SMDI_WaitSemaphore(tuned_lock);
+    }
+}
+
+static void tune_unlock(void) {
+    if (tuned_lock != NULL) {
+        SMDI_PostSemaphore(tuned_lock);
+    }
+}
+
+/* Find a device model in the table, -1 if it is not there; the table
+   must be locked */
+static int tune_find(const char* vendor, const char* product) {
+    int i;
+    
+    for (i = 0; i < tuned_count; i++) {
+        if (strcmp(tuned_devices[i].cVendor, vendor) == 0 &&
+            strcmp(tuned_devices[i].cProduct, product) == 0) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+/* Rewrite the packet size file from the table; the table must be locked */
+static BOOL tune_save(void) {
+    FILE* hFile;
+    int i;
+    
+    if (tuned_file[0] == '\0') {
+        return TRUE;
+    }
+    
+    hFile = fopen(tuned_file, "w");
+    if (hFile == NULL) {
+        return FALSE;
+    }
+    
+    fprintf(hFile, "# SMDI packet sizes: vendor<TAB>product<TAB>bytes\n");
+    for (i = 0; i < tuned_count; i++) {
+        fprintf(hFile, "%s\t%s\t%lu\n", tuned_devices[i].cVendor,
+                tuned_devices[i].cProduct, tuned_devices[i].dwPacketSize);
+    }
+    
+    return fclose(hFile) == 0;
+}
+
+/* Load the packet size file into the table; the table must be locked */
+static void tune_load(void) {
+    FILE* hFile;
+    char line[128];
+    char* product;
+    char* size;
+    
+    hFile = fopen(tuned_file, "r");
+    if (hFile == NULL) {
+        return;
+    }
+    
+    while (tuned_count < SMDI_TUNED_MAX && fgets(line, sizeof(line), hFile) != NULL) {
+        if (line[0] == '#') {
+            continue;
+        }
+    
+        /* vendor<TAB>product<TAB>bytes */
+        product = strchr(line, '\t');
+        size = (product != NULL) ? strchr(product + 1, '\t') : NULL;
+        if (size == NULL) {
+            continue;
+        }
+        *product++ = '\0';
+        *size++ = '\0';
+    
+        tune_copy_name(tuned_devices[tuned_count].cVendor, line, 9);
+        tune_copy_name(tuned_devices[tuned_count].cProduct, product, 17);
+        tuned_devices[tuned_count].dwPacketSize = strtoul(size, NULL, 10);
+    
+        if (tuned_devices[tuned_count].dwPacketSize != 0) {
+            tuned_count++;
+        }
+    }
+    
+    fclose(hFile);
+}
+
+/* Get the vendor and product of the device on a connection */
+static void tune_identify(SMDI_Connection* conn, char vendor[9], char product[17]) {
+    SCSI_DevInfo info;
+    
+    memset(&info, 0, sizeof(info));
+    info.dwStructSize = sizeof(info);
+    SMDIC_GetDeviceInfo(conn, &info);
+    
+    tune_copy_name(vendor, info.cManufacturer, 9);
+    tune_copy_name(product, info.cName, 17);
+}
+
+/* Set the file calibrated packet sizes are kept in and load it; NULL
+   forgets the file and all stored sizes */
+BOOL SMDI_SetPacketSizeFile(const char* filename) {
+    if (filename != NULL && strlen(filename) >= MAXFNLEN) {
+        return FALSE;
+    }
+    
+    tune_lock();
+    
+    tuned_count = 0;
+    tuned_file[0] = '\0';
+    
+    if (filename != NULL) {
+        strcpy(tuned_file, filename);
+        tune_load();
+    }
+    
+    tune_unlock();
+    
+    return TRUE;
+}
+
+/* Store the packet size of a device model, updating the file if set */
+BOOL SMDI_StorePacketSize(const char* vendor, const char* product, DWORD size) {
+    char cVendor[9];
+    char cProduct[17];
+    int index;
+    BOOL result;
+    
+    if (vendor == NULL || product == NULL || size == 0) {
+        return FALSE;
+    }
+    
+    tune_copy_name(cVendor, vendor, 9);
+    tune_copy_name(cProduct, product, 17);
+    
+    tune_lock();
+    
+    index = tune_find(cVendor, cProduct);
+    if (index < 0 && tuned_count < SMDI_TUNED_MAX) {
+        index = tuned_count++;
+        strcpy(tuned_devices[index].cVendor, cVendor);
+        strcpy(tuned_devices[index].cProduct, cProduct);
+    }
+    
+    if (index < 0) {
+        result = FALSE;
+    } else {
+        tuned_devices[index].dwPacketSize = size;
+        result = tune_save();
+    }
+    
+    tune_unlock();
+    
+    return result;
+}
+
+/* Get the stored packet size of the device on a connection, 0 if none */
+DWORD SMDIC_GetStoredPacketSize(SMDI_Connection* conn) {
+    char vendor[9];
+    char product[17];
+    int index;
+    DWORD size;
+    
+    if (conn == NULL) {
+        return 0;
+    }
+    
+    /* Nothing stored: spare the device the inquiry */
+    tune_lock();
+    index = tuned_count;
+    tune_unlock();
+    
+    if (index == 0) {
+        return 0;
+    }
+    
+    tune_identify(conn, vendor, product);
+    
+    tune_lock();
+    index = tune_find(vendor, product);
+    size = (index < 0) ? 0 : tuned_devices[index].dwPacketSize;
+    tune_unlock();
+    
+    return size;
+}
+
+/* Create the lock of the packet size table; called by SMDI_Init */
+BOOL SMDI_InitPacketSizes(void) {
+    if (tuned_lock == NULL) {
+        tuned_lock = SMDI_CreateSemaphore(1);
+    }
+    
+    return tuned_lock != NULL;
+}
+
+/* Upload the test data once; returns the bytes/s, 0 on failure */
+static double tune_upload(SMDI_Connection* conn,
+                          DWORD sampleNumber,
+                          unsigned char* data,
+                          DWORD bytes,
+                          DWORD* negotiated) {
+    SMDI_TransmissionInfo ti;
+    SMDI_SampleHeader sh;
+    DWORD result;
+    double start;
+    double seconds;
+    
+    memset(&sh, 0, sizeof(sh));
+    sh.dwStructSize = sizeof(sh);
+    sh.bDoesExist = TRUE;
+    sh.BitsPerWord = 16;
+    sh.NumberOfChannels = 1;
+    sh.dwPeriod = 1000000000 / 44100;
+    sh.dwLength = bytes / 2;
+    sh.dwLoopEnd = sh.dwLength - 1;
+    sh.wPitch = 60;
+    strcpy(sh.cName, "Calibration");
+    sh.NameLength = (BYTE)strlen(sh.cName);
+    
+    memset(&ti, 0, sizeof(ti));
+    ti.dwStructSize = sizeof(ti);
+    ti.HA_ID = conn->HA_ID;
+    ti.SCSI_ID = conn->SCSI_ID;
+    ti.lpConnection = conn;
+    ti.dwSampleNumber = sampleNumber;
+    ti.lpSampleHeader = &sh;
+    ti.dwCopyMode = CM_NORMAL;
+    
+    start = tune_now();
+    
+    result = SMDI_InitSampleTransmission(&ti);
+    *negotiated = ti.dwPacketSize;
+    
+    while (result == SMDIM_SENDNEXTPACKET) {
+        ti.lpSampleData = data + ti.dwTransmittedPackets * ti.dwPacketSize;
+        result = SMDI_SampleTransmission(&ti);
+    }
+    
+    seconds = tune_now() - start;
+    
+    if (result != SMDIM_ENDOFPROCEDURE) {
+        return 0.0;
+    }
+    
+    /* Too fast to measure counts as very fast */
+    if (seconds < 0.000001) {
+        seconds = 0.000001;
+    }
+    
+    return (double)bytes / seconds;
+}
+
+/* Find the fastest packet size for the device on a connection by
+   uploading testBytes (0 = 256 KB) to scratchSample at doubling packet
+   sizes up to the transport limit. The scratch sample is deleted
+   afterwards. Returns the packet size now used, 0 if every upload
+   failed. */
+DWORD SMDIC_CalibratePacketSize(SMDI_Connection* conn,
+                               DWORD scratchSample,
+                               DWORD testBytes,
+                               DWORD* bytesPerSecond) {
+    unsigned char* data;
+    char vendor[9];
+    char product[17];
+    DWORD previous;
+    DWORD limit;
+    DWORD size;
+    DWORD negotiated;
+    DWORD best;
+    double rate;
+    double bestRate;
+    DWORD i;
+    
+    if (conn == NULL) {
+        return 0;
+    }
+    
+    if (testBytes == 0) {
+        testBytes = SMDI_CALIBRATE_BYTES;
+    }
+    testBytes &= ~(DWORD)1;
+    
+    data = (unsigned char*)malloc(testBytes);
+    if (data == NULL) {
+        return 0;
+    }
+    
+    for (i = 0; i < testBytes; i++) {
+        data[i] = (unsigned char)(i * 31);
+    }
+    
+    /* Find the transport limit */
+    previous = conn->dwMaxPacketSize;
+    SMDIC_SetMaxPacketSize(conn, SMDI_MAX_PACKETSIZE);
+    limit = conn->dwMaxPacketSize;
+    
+    best = 0;
+    bestRate = 0.0;
+    
+    size = (SMDI_CALIBRATE_MIN < limit) ? SMDI_CALIBRATE_MIN : limit;
+    for (;;) {
+        SMDIC_SetMaxPacketSize(conn, size);
+    
+        negotiated = 0;
+        rate = tune_upload(conn, scratchSample, data, testBytes, &negotiated);
+    
+        if (rate > bestRate) {
+            bestRate = rate;
+            best = negotiated;
+        }
+    
+        /* Stop once the sampler caps the length or the test data fits
+           one packet; larger requests cannot change anything */
+        if (size >= limit || size >= testBytes ||
+            (negotiated != 0 && negotiated < size)) {
+            break;
+        }
+    
+        size = (size > limit / 2) ? limit : size * 2;
+    }
+    
+    SMDIC_DeleteSample(conn, scratchSample);
+    free(data);
+    
+    if (best == 0) {
+        conn->dwMaxPacketSize = previous;
+        return 0;
+    }
+    
+    SMDIC_SetMaxPacketSize(conn, best);
+    
+    tune_identify(conn, vendor, product);
+    SMDI_StorePacketSize(vendor, product, best);
+    
+    if (bytesPerSecond != NULL) {
+        *bytesPerSecond = (DWORD)bestRate;
+    }
+    
+    return best;
+}
@@ -9,30 +9,64 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <sys/time.h>
+#include <sys/types.h>
 #include "smdi.h"
+#include "smdi_thread.h"
+#include "smdi_convert.h"
+#include "smdi_resample.h"
 #include "aspi_irix.h"
 #include "scsi_debug.h"
 
-/* Standard data packet size for SMDI transfers */
-#define PACKETSIZE 16384
-
-/* Global command buffer */
-static unsigned char smdicmd[256];
-
 /* Global debug flag - changed to non-static so it can be accessed from other files */
 int g_smdi_debug_enabled = 0;
 
-/* Sleep function for IRIX */
+/* Default connections used by the HA_ID/SCSI_ID entry points */
+#define SMDI_DEFAULT_MAX_HA      16
+#define SMDI_DEFAULT_MAX_ID      16
+
+static SMDI_Connection* default_connections[SMDI_DEFAULT_MAX_HA][SMDI_DEFAULT_MAX_ID];
+
+/* Default connection used last, for SMDI_GetLastError */
+static SMDI_Connection* last_default_connection = NULL;
+
+/* Guards the default connections and the buses; created by SMDI_Init */
+static SMDI_Semaphore* connection_lock = NULL;
+
+/* Take and release the tables; without SMDI_Init there is no lock, nor
+   any other thread */
+static void SMDI_LockConnections(void) {
+    if (connection_lock != NULL) {
+        SMDI_WaitSemaphore(connection_lock);
+    }
+}
+
+static void SMDI_UnlockConnections(void) {
+    if (connection_lock != NULL) {
+        SMDI_PostSemaphore(connection_lock);
+    }
+}
+
+/* Sleep function */
 static void sleep_ms(int ms) {
+#ifdef __sgi
     /* Convert ms to clock ticks (10ms each), rounding up */
     sginap((ms + 9) / 10);
+#else
+    struct timeval tv;
+    
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    select(0, NULL, NULL, NULL, &tv);
+#endif
 }
 
-/* Debug print function */
-static void debug_print(const char* format, ...) {
+/* Debug print function - follows the connection's setting, or the global
+   one when there is no connection */
+static void debug_print(SMDI_Connection* conn, const char* format, ...) {
     va_list args;
     
-    if (!g_smdi_debug_enabled) {
+    if (conn != NULL ? !conn->Debug.enabled : !g_smdi_debug_enabled) {
         return;
     }
     
@@ -43,24 +77,526 @@ static void debug_print(const char* format, ...) {
     va_end(args);
 }
 
+/*
+ * Bus arbitration
+ *
+ * A SCSI bus carries one command at a time and, left to itself, gives
+ * it to the highest target ID, so one sampler's transfer can hold off
+ * another's until it is done. The connections to the devices of a host
+ * adapter hand its bus on in the order they asked for it instead: every
+ * command waits only for those queued before it, so transfers to the
+ * samplers on one bus interleave packet by packet, and one device works
+ * on a packet while the next device's packet is on the bus. Host
+ * adapters do not wait for each other.
+ */
+
+/* Connection waiting for the bus, on the waiting thread's stack */
+typedef struct SMDI_BusWaiter {
+    SMDI_Semaphore* semTurn;            /* Posted when the bus is handed over */
+    struct SMDI_BusWaiter* lpNext;
+} SMDI_BusWaiter;
+
+/* Bus of one host adapter */
+struct SMDI_Bus {
+    SMDI_Semaphore* semLock;            /* Guards the fields below */
+    BOOL bBusy;                         /* A command is on the bus */
+    SMDI_BusWaiter* lpFirst;            /* Waiting connections, longest waiting first */
+    SMDI_BusWaiter* lpLast;
+};
+
+/* Buses are created by the first connection to a host adapter */
+static struct SMDI_Bus* buses[SMDI_DEFAULT_MAX_HA];
+
+/* Get the bus of a host adapter, NULL if its commands cannot be
+   arbitrated; called locked */
+static struct SMDI_Bus* SMDI_GetBus(BYTE ha_id) {
+    struct SMDI_Bus* bus;
+    
+    if (ha_id >= SMDI_DEFAULT_MAX_HA) {
+        return NULL;
+    }
+    
+    if (buses[ha_id] == NULL) {
+        bus = (struct SMDI_Bus*)malloc(sizeof(struct SMDI_Bus));
+        if (bus == NULL) {
+            return NULL;
+        }
+    
+        bus->semLock = SMDI_CreateSemaphore(1);
+        if (bus->semLock == NULL) {
+            free(bus);
+            return NULL;
+        }
+    
+        bus->bBusy = FALSE;
+        bus->lpFirst = NULL;
+        bus->lpLast = NULL;
+        buses[ha_id] = bus;
+    }
+    
+    return buses[ha_id];
+}
+
+/* Wait until the bus is free or handed to this connection */
+static void SMDI_AcquireBus(SMDI_Connection* conn) {
+    struct SMDI_Bus* bus;
+    SMDI_BusWaiter waiter;
+    
+    bus = conn->lpBus;
+    if (bus == NULL) {
+        return;
+    }
+    
+    SMDI_WaitSemaphore(bus->semLock);
+    
+    if (!bus->bBusy) {
+        bus->bBusy = TRUE;
+        SMDI_PostSemaphore(bus->semLock);
+        return;
+    }
+    
+    /* Queue up behind the connections already waiting */
+    waiter.semTurn = conn->lpBusTurn;
+    waiter.lpNext = NULL;
+    if (bus->lpLast == NULL) {
+        bus->lpFirst = &waiter;
+    } else {
+        bus->lpLast->lpNext = &waiter;
+    }
+    bus->lpLast = &waiter;
+    conn->dwBusWaits++;
+    
+    SMDI_PostSemaphore(bus->semLock);
+    
+    SMDI_WaitSemaphore(conn->lpBusTurn);
+}
+
+/* Hand the bus to the connection that has waited longest, or free it */
+static void SMDI_ReleaseBus(SMDI_Connection* conn) {
+    struct SMDI_Bus* bus;
+    SMDI_Semaphore* next;
+    
+    bus = conn->lpBus;
+    if (bus == NULL) {
+        return;
+    }
+    
+    SMDI_WaitSemaphore(bus->semLock);
+    
+    if (bus->lpFirst == NULL) {
+        bus->bBusy = FALSE;
+        SMDI_PostSemaphore(bus->semLock);
+        return;
+    }
+    
+    /* The bus stays busy: it passes straight on */
+    next = bus->lpFirst->semTurn;
+    bus->lpFirst = bus->lpFirst->lpNext;
+    if (bus->lpFirst == NULL) {
+        bus->lpLast = NULL;
+    }
+    
+    SMDI_PostSemaphore(bus->semLock);
+    SMDI_PostSemaphore(next);
+}
+
+/* SCSI WRITE of a message, holding the bus for its transfer */
+static BOOL SMDI_BusSend(SMDI_Connection* conn, void* buffer, unsigned long size) {
+    BOOL sent;
+    
+    SMDI_AcquireBus(conn);
+    sent = ASPI_Send(&conn->Debug, conn->HA_ID, conn->SCSI_ID, buffer, size);
+    SMDI_ReleaseBus(conn);
+    
+    return sent;
+}
+
+/* SCSI READ of an answer, holding the bus for its transfer */
+static unsigned long SMDI_BusReceive(SMDI_Connection* conn, void* buffer, unsigned long size) {
+    unsigned long received;
+    
+    SMDI_AcquireBus(conn);
+    received = ASPI_Receive(&conn->Debug, conn->HA_ID, conn->SCSI_ID, buffer, size);
+    SMDI_ReleaseBus(conn);
+    
+    return received;
+}
+
+/* TEST UNIT READY, holding the bus */
+static int SMDI_BusTestUnitReady(SMDI_Connection* conn) {
+    int ready;
+    
+    SMDI_AcquireBus(conn);
+    ready = ASPI_TestUnitReady(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+    SMDI_ReleaseBus(conn);
+    
+    return ready;
+}
+
+/*
+ * Response readiness polling
+ *
+ * Instead of sleeping a fixed time between the SCSI WRITE of a command
+ * and the READ of its answer, the READ is retried on a short backoff
+ * schedule until the device returns an SMDI message. The turnaround seen
+ * for each command type on each device is averaged, and later commands
+ * start reading just before the answer is expected.
+ */
+
+/* Give up waiting for an answer after this long */
+#define SMDI_RESPONSE_TIMEOUT_MS 3000
+
+/* Longest single pause between two READ attempts */
+#define SMDI_RETRY_MAX_MS        50
+
+/* Current time in microseconds */
+static unsigned long now_us(void) {
+    struct timeval tv;
+    
+    gettimeofday(&tv, NULL);
+    
+    return (unsigned long)tv.tv_sec * 1000000UL + (unsigned long)tv.tv_usec;
+}
+
+/* Wait for the answer to a command that was just sent and read it into
+   buffer. Returns the number of bytes received, 0 on timeout. */
+static unsigned long SMDI_AwaitResponse(SMDI_Connection* conn,
+                                        int rc,
+                                        void* buffer,
+                                        unsigned long size) {
+    SMDI_ResponseTiming* timing;
+    unsigned long start;
+    unsigned long elapsed;
+    unsigned long received;
+    int pause_ms;
+    int attempts;
+    
+    timing = &conn->Timing[rc];
+    start = now_us();
+    attempts = 0;
+    
+    /* Sleep through most of the expected turnaround before the first READ */
+    if (timing->dwSamples > 0 && timing->dwAverage >= 4000) {
+        sleep_ms((int)(timing->dwAverage * 3 / 4000));
+    }
+    
+    pause_ms = 1;
+    
+    for (;;) {
+        /* Make sure a stale signature is not taken for an answer */
+        memset(buffer, 0, 4);
+    
+        received = SMDI_BusReceive(conn, buffer, size);
+        attempts++;
+        elapsed = now_us() - start;
+    
+        if (received >= 11 && memcmp(buffer, "SMDI", 4) == 0) {
+            break;
+        }
+    
+        timing->dwRetries++;
+    
+        if (elapsed >= (unsigned long)SMDI_RESPONSE_TIMEOUT_MS * 1000) {
+            debug_print(conn, "No answer from %d:%d after %lu ms",
+                        conn->HA_ID, conn->SCSI_ID, elapsed / 1000);
+            return received;
+        }
+    
+        sleep_ms(pause_ms);
+    
+        if (pause_ms < SMDI_RETRY_MAX_MS) {
+            pause_ms *= 2;
+        }
+    }
+    
+    /* Fold the measured turnaround into the running average */
+    if (timing->dwSamples == 0) {
+        timing->dwAverage = elapsed;
+    } else {
+        timing->dwAverage = timing->dwAverage - timing->dwAverage / 4 + elapsed / 4;
+    }
+    timing->dwSamples++;
+    
+    debug_print(conn, "Answer after %lu us, %d READ(s)", elapsed, attempts);
+    
+    return received;
+}
+
+/* Remember the error code if an answer is a Message Reject */
+static void SMDI_NoteReject(SMDI_Connection* conn, unsigned char answer[], unsigned long received) {
+    if (received < 15 || memcmp(answer, "SMDI", 4) != 0) {
+        return;
+    }
+    
+    if (answer[4] == 0x00 && answer[5] == 0x02 && answer[6] == 0x00 && answer[7] == 0x00) {
+        /* For MessageReject, the error code is in bytes 11-14 */
+        conn->dwLastError = ((DWORD)answer[11] << 24) |
+                            ((DWORD)answer[12] << 16) |
+                            ((DWORD)answer[13] << 8) |
+                            (DWORD)answer[14];
+    }
+}
+
+/* Send a command on a connection, clearing the error of the previous one */
+static int SMDI_SendCommand(SMDI_Connection* conn, void* buffer, unsigned long size) {
+    conn->dwLastError = 0;
+    
+    return SMDI_BusSend(conn, buffer, size);
+}
+
+/* Wait for and read the answer to the command just sent */
+static unsigned long SMDI_ReadAnswer(SMDI_Connection* conn,
+                                     int rc,
+                                     void* buffer,
+                                     unsigned long size) {
+    unsigned long received;
+    
+    received = SMDI_AwaitResponse(conn, rc, buffer, size);
+    SMDI_NoteReject(conn, (unsigned char*)buffer, received);
+    
+    return received;
+}
+
+/*
+ * Connections
+ */
+
+/* Set up a connection for a device; called locked */
+static void SMDI_InitConnection(SMDI_Connection* conn, BYTE ha_id, BYTE id) {
+    memset(conn, 0, sizeof(SMDI_Connection));
+    conn->dwStructSize = sizeof(SMDI_Connection);
+    conn->HA_ID = ha_id;
+    conn->SCSI_ID = id;
+    conn->bOpen = FALSE;
+    conn->dwLastError = 0;
+    conn->dwPacketSize = PACKETSIZE;
+    conn->dwConvertFlags = SMDI_CONVERT_DITHER;
+    
+    scsi_debug_init(&conn->Debug);
+    conn->Debug.enabled = g_smdi_debug_enabled;
+    
+    /* Without a semaphore to be handed the bus on, the connection's
+       commands go out unarbitrated */
+    conn->lpBus = SMDI_GetBus(ha_id);
+    if (conn->lpBus != NULL) {
+        conn->lpBusTurn = SMDI_CreateSemaphore(0);
+        if (conn->lpBusTurn == NULL) {
+            conn->lpBus = NULL;
+        }
+    }
+}
+
+/* Open a connection to a device, keeping its transport handle open */
+SMDI_Connection* SMDI_OpenConnection(BYTE ha_id, BYTE id) {
+    SMDI_Connection* conn;
+    
+    conn = (SMDI_Connection*)malloc(sizeof(SMDI_Connection));
+    if (conn == NULL) {
+        debug_print(NULL, "ERROR: Failed to allocate connection for %d:%d", ha_id, id);
+        return NULL;
+    }
+    
+    SMDI_LockConnections();
+    SMDI_InitConnection(conn, ha_id, id);
+    SMDI_UnlockConnections();
+    
+    if (!ASPI_OpenDevice(&conn->Debug, ha_id, id)) {
+        debug_print(conn, "SMDI_OpenConnection: Cannot open device %d:%d", ha_id, id);
+        SMDI_FreeSemaphore(conn->lpBusTurn);
+        free(conn);
+        return NULL;
+    }
+    
+    conn->bOpen = TRUE;
+    debug_print(conn, "SMDI_OpenConnection: Connected to device %d:%d", ha_id, id);
+    
+    return conn;
+}
+
+/* Largest packet payload the transport can carry for a connection */
+static DWORD SMDI_TransportPacketLimit(SMDI_Connection* conn) {
+    unsigned long transfer;
+    
+    transfer = ASPI_GetMaxTransfer(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+    
+    /* Unknown limit: stay with the default packet size */
+    if (transfer <= 14) {
+        return PACKETSIZE;
+    }
+    
+    /* The data packet header travels in the same transfer */
+    transfer -= 14;
+    if (transfer > SMDI_MAX_PACKETSIZE) {
+        transfer = SMDI_MAX_PACKETSIZE;
+    }
+    
+    return (DWORD)transfer;
+}
+
+/* Get the packet length transfers on a connection ask for */
+DWORD SMDIC_GetMaxPacketSize(SMDI_Connection* conn) {
+    DWORD limit;
+    DWORD stored;
+    
+    if (conn == NULL) {
+        return PACKETSIZE;
+    }
+    
+    if (conn->dwMaxPacketSize == 0) {
+        limit = SMDI_TransportPacketLimit(conn);
+    
+        /* A calibrated size for this model wins over the transport limit */
+        stored = SMDIC_GetStoredPacketSize(conn);
+        conn->dwMaxPacketSize = (stored != 0 && stored < limit) ? stored : limit;
+    
+        debug_print(conn, "Packet size for %d:%d is %lu (transport limit %lu)",
+                    conn->HA_ID, conn->SCSI_ID, conn->dwMaxPacketSize, limit);
+    }
+    
+    return conn->dwMaxPacketSize;
+}
+
+/* Set the packet length transfers on a connection ask for, 0 = automatic */
+void SMDIC_SetMaxPacketSize(SMDI_Connection* conn, DWORD size) {
+    DWORD limit;
+    
+    if (conn == NULL) {
+        return;
+    }
+    
+    if (size == 0) {
+        conn->dwMaxPacketSize = 0;
+        return;
+    }
+    
+    limit = SMDI_TransportPacketLimit(conn);
+    conn->dwMaxPacketSize = (size < limit) ? size : limit;
+}
+
+/* Get the sample rate uploads on a connection are resampled to */
+DWORD SMDIC_GetTargetRate(SMDI_Connection* conn) {
+    return (conn != NULL) ? conn->dwTargetRate : 0;
+}
+
+/* Set the sample rate uploads on a connection are resampled to, 0 = none */
+void SMDIC_SetTargetRate(SMDI_Connection* conn, DWORD rate) {
+    if (conn != NULL) {
+        conn->dwTargetRate = rate;
+    }
+}
+
+/* Get the bits sample files are converted to for a connection */
+DWORD SMDIC_GetTargetBits(SMDI_Connection* conn) {
+    return (conn != NULL) ? conn->dwTargetBits : 0;
+}
+
+/* Set the bits sample files are converted to for a connection: 8, 16,
+   or 0 for what their reader picks */
+void SMDIC_SetTargetBits(SMDI_Connection* conn, DWORD bits) {
+    if (conn != NULL && (bits == 0 || bits == 8 || bits == 16)) {
+        conn->dwTargetBits = bits;
+    }
+}
+
+/* Get the options sample files are converted with for a connection */
+DWORD SMDIC_GetConvertFlags(SMDI_Connection* conn) {
+    return (conn != NULL) ? conn->dwConvertFlags : SMDI_CONVERT_DITHER;
+}
+
+/* Set the options sample files are converted with, SMDI_CONVERT_* */
+void SMDIC_SetConvertFlags(SMDI_Connection* conn, DWORD flags) {
+    if (conn != NULL) {
+        conn->dwConvertFlags = flags;
+    }
+}
+
+/* Close a connection opened with SMDI_OpenConnection */
+void SMDI_CloseConnection(SMDI_Connection* conn) {
+    if (conn == NULL) {
+        return;
+    }
+    
+    if (conn->bOpen) {
+        ASPI_CloseDevice(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+        conn->bOpen = FALSE;
+    }
+    
+    free(conn->lpPacket);
+    free(conn->lpReceive);
+    SMDI_FreeSemaphore(conn->lpBusTurn);
+    
+    debug_print(conn, "SMDI_CloseConnection: Closed device %d:%d", conn->HA_ID, conn->SCSI_ID);
+    
+    free(conn);
+}
+
+/* Get the connection used by the HA_ID/SCSI_ID functions for a device */
+SMDI_Connection* SMDI_GetDefaultConnection(BYTE ha_id, BYTE id) {
+    SMDI_Connection* conn;
+    
+    if (ha_id >= SMDI_DEFAULT_MAX_HA || id >= SMDI_DEFAULT_MAX_ID) {
+        return NULL;
+    }
+    
+    /* Transfers on worker threads may ask for the same device at once */
+    SMDI_LockConnections();
+    
+    conn = default_connections[ha_id][id];
+    if (conn == NULL) {
+        conn = (SMDI_Connection*)malloc(sizeof(SMDI_Connection));
+        if (conn != NULL) {
+            SMDI_InitConnection(conn, ha_id, id);
+            default_connections[ha_id][id] = conn;
+        }
+    }
+    
+    if (conn != NULL) {
+        last_default_connection = conn;
+    }
+    
+    SMDI_UnlockConnections();
+    
+    return conn;
+}
+
+/* Get the error code of the last rejected command on a connection */
+DWORD SMDIC_GetLastError(SMDI_Connection* conn) {
+    if (conn == NULL) {
+        return 0;
+    }
+    
+    return conn->dwLastError;
+}
+
 /* Get the last SMDI error code */
 DWORD SMDI_GetLastError(void) {
-    DWORD error_code;
+    SMDI_Connection* conn;
     
-    /* For MessageReject, the error code is in bytes 11-14 */
-    /* Reconstruct 32-bit value in big-endian order */
-    error_code = ((DWORD)smdicmd[11] << 24) |
-                ((DWORD)smdicmd[12] << 16) |
-                ((DWORD)smdicmd[13] << 8) |
-                (DWORD)smdicmd[14];
+    SMDI_LockConnections();
+    conn = last_default_connection;
+    SMDI_UnlockConnections();
     
-    return error_code;
+    return SMDIC_GetLastError(conn);
 }
 
 /* Public function to get/set debug mode */
 void SMDI_SetDebugMode(int enable) {
+    int ha;
+    int id;
+    
     g_smdi_debug_enabled = enable ? 1 : 0;
     
+    /* Default connections follow the global setting */
+    SMDI_LockConnections();
+    for (ha = 0; ha < SMDI_DEFAULT_MAX_HA; ha++) {
+        for (id = 0; id < SMDI_DEFAULT_MAX_ID; id++) {
+            if (default_connections[ha][id] != NULL) {
+                default_connections[ha][id]->Debug.enabled = g_smdi_debug_enabled;
+            }
+        }
+    }
+    SMDI_UnlockConnections();
+    
     if (enable) {
         printf("SMDI DEBUG: Debug mode enabled\n");
     } else {
@@ -73,9 +609,22 @@ int SMDI_GetDebugMode(void) {
     return g_smdi_debug_enabled;
 }
 
+/* Set debug mode for one connection */
+void SMDIC_SetDebugMode(SMDI_Connection* conn, int enable) {
+    if (conn != NULL) {
+        conn->Debug.enabled = enable ? 1 : 0;
+    }
+}
+
+/* Get debug mode of one connection */
+int SMDIC_GetDebugMode(SMDI_Connection* conn) {
+    return (conn != NULL) ? conn->Debug.enabled : 0;
+}
+
 /* Create an SMDI message header */
-static void SMDI_MakeMessageHeader(unsigned char mheader[], 
-                                  DWORD messageID, 
+static void SMDI_MakeMessageHeader(SMDI_Connection* conn,
+                                  unsigned char mheader[],
+                                  DWORD messageID,
                                   DWORD additionalLength) {
     /* The "SMDI" signature */
     memcpy(mheader, "SMDI", 4);
@@ -94,7 +643,7 @@ static void SMDI_MakeMessageHeader(unsigned char mheader[],
     mheader[9] = (unsigned char)((additionalLength >> 8) & 0xFF);
     mheader[10] = (unsigned char)(additionalLength & 0xFF);
     
-    debug_print("Created SMDI header: ID=%08lX, Len=%lu", messageID, additionalLength);
+    debug_print(conn, "Created SMDI header: ID=%08lX, Len=%lu", messageID, additionalLength);
 }
 
 /* Get additional length from an SMDI message header */
@@ -102,15 +651,15 @@ static DWORD SMDI_GetAdditionalLength(unsigned char mheader[]) {
     DWORD length;
     
     /* Extract 24-bit value (3 bytes) */
-    length = ((DWORD)mheader[8] << 16) | 
-             ((DWORD)mheader[9] << 8) | 
+    length = ((DWORD)mheader[8] << 16) |
+             ((DWORD)mheader[9] << 8) |
              (DWORD)mheader[10];
     
     return length;
 }
 
 /* Get whole message ID from an SMDI message header */
-static DWORD SMDI_GetWholeMessageID(unsigned char mheader[]) {
+static DWORD SMDI_GetWholeMessageID(SMDI_Connection* conn, unsigned char mheader[]) {
     DWORD messageID;
     
     /* Reconstruct 32-bit message ID from 4 bytes in big-endian order */
@@ -119,400 +668,609 @@ static DWORD SMDI_GetWholeMessageID(unsigned char mheader[]) {
                ((DWORD)mheader[6] << 8) |
                (DWORD)mheader[7];
     
-    debug_print("Parsed message ID: 0x%08lX from bytes: %02X %02X %02X %02X",
+    debug_print(conn, "Parsed message ID: 0x%08lX from bytes: %02X %02X %02X %02X",
                messageID, mheader[4], mheader[5], mheader[6], mheader[7]);
     
     return messageID;
 }
 
 /* Get a message from the device */
-DWORD SMDI_GetMessage(BYTE ha_id, BYTE id) {
-    scsi_debug_t debug;
+DWORD SMDIC_GetMessage(SMDI_Connection* conn) {
     unsigned long bytes_received;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
     
-    debug_print("Getting message from device %d:%d", ha_id, id);
-    bytes_received = ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
+    debug_print(conn, "Getting message from device %d:%d", conn->HA_ID, conn->SCSI_ID);
+    bytes_received = SMDI_BusReceive(conn, conn->cResponse, sizeof(conn->cResponse));
+    SMDI_NoteReject(conn, conn->cResponse, bytes_received);
     
-    debug_print("Received %lu bytes", bytes_received);
+    debug_print(conn, "Received %lu bytes", bytes_received);
     
-    return SMDI_GetWholeMessageID(smdicmd);
+    return SMDI_GetWholeMessageID(conn, conn->cResponse);
+}
+
+/* Get the payload region of the connection's data packet buffer, large
+   enough for length bytes. Data placed there is sent by SMDIC_SendDataPacket
+   without another copy. The region moves when it has to grow. */
+void* SMDIC_GetPacketBuffer(SMDI_Connection* conn, DWORD length) {
+    unsigned char* packet;
+    
+    if (conn == NULL) {
+        return NULL;
+    }
+    
+    if (conn->lpPacket == NULL || length > conn->dwPacketAlloc) {
+        packet = (unsigned char*)malloc(14 + length);
+        if (packet == NULL) {
+            debug_print(conn, "ERROR: Failed to allocate %lu byte packet buffer", 14 + length);
+            return NULL;
+        }
+    
+        free(conn->lpPacket);
+        conn->lpPacket = packet;
+        conn->dwPacketAlloc = length;
+    }
+    
+    return conn->lpPacket + 14;
 }
 
 /* Send an SMDI data packet to the device */
-DWORD SMDI_SendDataPacket(BYTE ha_id,
-                        BYTE id, 
-                        DWORD pn, 
-                        void* data, 
-                        DWORD length) {
-    void* datamessage;
+DWORD SMDIC_SendDataPacket(SMDI_Connection* conn,
+                          DWORD pn, 
+                          void* data, 
+                          DWORD length) {
+    unsigned char* payload;
     DWORD result;
-    scsi_debug_t debug;
     int send_success;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
-
-    debug_print("SendDataPacket to %d:%d, packet %lu, length %lu", 
-                ha_id, id, pn, length);
-
-    datamessage = malloc(14 + length);
-    if (datamessage == NULL) {
-        debug_print("ERROR: Failed to allocate memory for data packet");
+    if (conn == NULL) {
         return SMDIM_ERROR;
     }
     
-    /* Prepare the message header */
-    SMDI_MakeMessageHeader(smdicmd, SMDIM_DATAPACKET, 3 + length);
+    debug_print(conn, "SendDataPacket to %d:%d, packet %lu, length %lu", 
+                conn->HA_ID, conn->SCSI_ID, pn, length);
+    
+    /* Payload already in the packet buffer goes out as it is, anything
+       else is copied in once. The buffer cannot grow under a payload
+       placed in it, which would be freed before it was copied. */
+    if (conn->lpPacket != NULL && data == (void*)(conn->lpPacket + 14)) {
+        if (length > conn->dwPacketAlloc) {
+            debug_print(conn, "ERROR: %lu byte payload overruns the %lu byte packet buffer",
+                        length, conn->dwPacketAlloc);
+            return SMDIM_ERROR;
+        }
+        payload = conn->lpPacket + 14;
+    } else {
+        payload = (unsigned char*)SMDIC_GetPacketBuffer(conn, length);
+        if (payload == NULL) {
+            return SMDIM_ERROR;
+        }
     
-    /* Set packet number (24-bit value) */
-    smdicmd[11] = (unsigned char)((pn >> 16) & 0xFF);
-    smdicmd[12] = (unsigned char)((pn >> 8) & 0xFF);
-    smdicmd[13] = (unsigned char)(pn & 0xFF);
+        /* Copy the data directly (no byte swapping needed on big-endian system) */
+        memcpy(payload, data, length);
+    }
     
-    /* Copy the header to the message buffer */
-    memcpy(datamessage, smdicmd, 14);
-
-    /* Copy the data directly (no byte swapping needed on big-endian system) */
-    memcpy((void*)(((unsigned long)datamessage) + 14), data, length);
+    /* Prepare the message header in front of the payload */
+    SMDI_MakeMessageHeader(conn, conn->lpPacket, SMDIM_DATAPACKET, 3 + length);
+    
+    /* Set packet number (24-bit value) */
+    conn->lpPacket[11] = (unsigned char)((pn >> 16) & 0xFF);
+    conn->lpPacket[12] = (unsigned char)((pn >> 8) & 0xFF);
+    conn->lpPacket[13] = (unsigned char)(pn & 0xFF);
     
     /* Send the data packet */
-    send_success = ASPI_Send(&debug, ha_id, id, datamessage, 14 + length);
+    send_success = SMDI_SendCommand(conn, conn->lpPacket, 14 + length);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
-        free(datamessage);
+        debug_print(conn, "ERROR: ASPI_Send failed");
         return SMDIM_ERROR;
     }
     
-    /* Wait a short time for the device to process */
-    sleep_ms(50);
-    
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_DATAPACKET, conn->cResponse, sizeof(conn->cResponse));
     
     /* Get the message ID from the response */
-    result = SMDI_GetWholeMessageID(smdicmd);
-    debug_print("Response message ID: 0x%08lX", result);
-    
-    /* Free the message buffer */
-    free(datamessage);
+    result = SMDI_GetWholeMessageID(conn, conn->cResponse);
+    debug_print(conn, "Response message ID: 0x%08lX", result);
     
     return result;
 }
 
 /* Send a sample name to the device */
-DWORD SMDI_SampleName(BYTE ha_id,
-                    BYTE id,
-                    DWORD sampleNum,
-                    char sampleName[]) {
+DWORD SMDIC_SampleName(SMDI_Connection* conn,
+                      DWORD sampleNum,
+                      char sampleName[]) {
     DWORD nameLen;
-    scsi_debug_t debug;
     int send_success;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
     
     nameLen = strlen(sampleName);
     
-    debug_print("SMDI_SampleName: Setting name for sample %lu to '%s'", 
+    debug_print(conn, "SMDI_SampleName: Setting name for sample %lu to '%s'",
                 sampleNum, sampleName);
     
     /* Prepare the message header */
-    SMDI_MakeMessageHeader(smdicmd, SMDIM_SAMPLENAME, 0x000004 + nameLen);
+    SMDI_MakeMessageHeader(conn, conn->cCommand, SMDIM_SAMPLENAME, 0x000004 + nameLen);
     
     /* Sample Number (24-bit value) */
-    smdicmd[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
-    smdicmd[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
-    smdicmd[13] = (unsigned char)(sampleNum & 0xFF);
+    conn->cCommand[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
+    conn->cCommand[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
+    conn->cCommand[13] = (unsigned char)(sampleNum & 0xFF);
     
     /* Sample Name Length */
-    smdicmd[14] = (unsigned char)nameLen;
+    conn->cCommand[14] = (unsigned char)nameLen;
     
     /* Sample Name */
-    memcpy(&smdicmd[15], sampleName, nameLen);
+    memcpy(&conn->cCommand[15], sampleName, nameLen);
     
     /* Send the command */
-    send_success = ASPI_Send(&debug, ha_id, id, smdicmd, 15 + nameLen);
+    send_success = SMDI_SendCommand(conn, conn->cCommand, 15 + nameLen);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
+        debug_print(conn, "ERROR: ASPI_Send failed");
         return SMDIM_ERROR;
     }
     
-    /* Wait a short time for the device to process */
-    sleep_ms(50);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_SAMPLENAME, conn->cResponse, sizeof(conn->cResponse));
+    
+    return SMDI_GetWholeMessageID(conn, conn->cResponse);
+}
+
+/* Abort the transfer in progress; the device answers ACK */
+DWORD SMDIC_AbortProcedure(SMDI_Connection* conn) {
+    int send_success;
+    
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    debug_print(conn, "SMDI_AbortProcedure: Aborting transfer on device %d:%d",
+                conn->HA_ID, conn->SCSI_ID);
+    
+    /* The message has no data */
+    SMDI_MakeMessageHeader(conn, conn->cCommand, SMDIM_ABORTPROCEDURE, 0);
+    
+    /* Send the command */
+    send_success = SMDI_SendCommand(conn, conn->cCommand, 11);
+    
+    if (!send_success) {
+        debug_print(conn, "ERROR: ASPI_Send failed");
+        return SMDIM_ERROR;
+    }
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_ABORT, conn->cResponse, sizeof(conn->cResponse));
     
-    return SMDI_GetWholeMessageID(smdicmd);
+    return SMDI_GetWholeMessageID(conn, conn->cResponse);
 }
 
 /* Send a "Begin Sample Transfer" command */
-DWORD SMDI_SendBeginSampleTransfer(BYTE ha_id,
-                                 BYTE id,
-                                 DWORD sampleNum,
-                                 void* packetLength) {
-    scsi_debug_t debug;
+DWORD SMDIC_SendBeginSampleTransfer(SMDI_Connection* conn,
+                                   DWORD sampleNum,
+                                   void* packetLength) {
     DWORD result;
     DWORD length;
     int send_success;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
     
     /* Copy the packet length */
     memcpy(&length, packetLength, sizeof(DWORD));
     
-    debug_print("Begin Sample Transfer for sample %lu, packet length %lu", 
+    debug_print(conn, "Begin Sample Transfer for sample %lu, packet length %lu",
                 sampleNum, length);
     
     /* Prepare the message header */
-    SMDI_MakeMessageHeader(smdicmd, SMDIM_BEGINSAMPLETRANSFER, 0x000006);
+    SMDI_MakeMessageHeader(conn, conn->cCommand, SMDIM_BEGINSAMPLETRANSFER, 0x000006);
     
     /* Sample Number (24-bit value) */
-    smdicmd[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
-    smdicmd[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
-    smdicmd[13] = (unsigned char)(sampleNum & 0xFF);
+    conn->cCommand[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
+    conn->cCommand[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
+    conn->cCommand[13] = (unsigned char)(sampleNum & 0xFF);
     
     /* Data Packet Length (24-bit value) */
-    smdicmd[14] = (unsigned char)((length >> 16) & 0xFF);
-    smdicmd[15] = (unsigned char)((length >> 8) & 0xFF);
-    smdicmd[16] = (unsigned char)(length & 0xFF);
+    conn->cCommand[14] = (unsigned char)((length >> 16) & 0xFF);
+    conn->cCommand[15] = (unsigned char)((length >> 8) & 0xFF);
+    conn->cCommand[16] = (unsigned char)(length & 0xFF);
     
     /* Send the command */
-    send_success = ASPI_Send(&debug, ha_id, id, smdicmd, 17);
+    send_success = SMDI_SendCommand(conn, conn->cCommand, 17);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
+        debug_print(conn, "ERROR: ASPI_Send failed");
         return SMDIM_ERROR;
     }
     
-    /* Wait a short time for the device to process */
-    sleep_ms(50);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_BEGINTRANSFER, conn->cResponse, sizeof(conn->cResponse));
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
-    
-    result = SMDI_GetWholeMessageID(smdicmd);
+    result = SMDI_GetWholeMessageID(conn, conn->cResponse);
     
     /* If transfer acknowledge, get the packet length from the response */
     if (result == SMDIM_TRANSFERACKNOWLEDGE) {
         DWORD respLength;
-        
+    
         /* Extract 24-bit value */
-        respLength = ((DWORD)smdicmd[14] << 16) |
-                     ((DWORD)smdicmd[15] << 8) |
-                     (DWORD)smdicmd[16];
-        
-        debug_print("Transfer acknowledged, new packet length is %lu", respLength);
-        
+        respLength = ((DWORD)conn->cResponse[14] << 16) |
+                     ((DWORD)conn->cResponse[15] << 8) |
+                     (DWORD)conn->cResponse[16];
+    
+        debug_print(conn, "Transfer acknowledged, new packet length is %lu", respLength);
+    
         /* Update the packet length */
         memcpy(packetLength, &respLength, sizeof(DWORD));
+        conn->dwPacketSize = respLength;
     }
     
     return result;
 }
 
 /* Send a sample header */
-DWORD SMDI_SendSampleHeader(BYTE ha_id,
-                          BYTE id,
-                          DWORD sampleNum,
-                          SMDI_SampleHeader* shA,
-                          DWORD* dataPacketLength) {
+DWORD SMDIC_SendSampleHeader(SMDI_Connection* conn,
+                            DWORD sampleNum,
+                            SMDI_SampleHeader* shA,
+                            DWORD* dataPacketLength) {
     SMDI_SampleHeader sh;
-    scsi_debug_t debug;
+    unsigned char* cmd;
     DWORD result;
     int send_success;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    cmd = conn->cCommand;
     
     /* Make a copy of the sample header */
     memcpy(&sh, shA, sizeof(SMDI_SampleHeader));
     
-    debug_print("Sending sample header for sample %lu", sampleNum);
-    debug_print("  Bits: %d, Channels: %d, Length: %lu", 
+    debug_print(conn, "Sending sample header for sample %lu", sampleNum);
+    debug_print(conn, "  Bits: %d, Channels: %d, Length: %lu",
                sh.BitsPerWord, sh.NumberOfChannels, sh.dwLength);
     
     /* Prepare the message header */
-    SMDI_MakeMessageHeader(smdicmd, SMDIM_SAMPLEHEADER, 0x00001a + (DWORD)sh.NameLength);
+    SMDI_MakeMessageHeader(conn, cmd, SMDIM_SAMPLEHEADER, 0x00001a + (DWORD)sh.NameLength);
     
     /* Sample number (24-bit value) */
-    smdicmd[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
-    smdicmd[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
-    smdicmd[13] = (unsigned char)(sampleNum & 0xFF);
+    cmd[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
+    cmd[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
+    cmd[13] = (unsigned char)(sampleNum & 0xFF);
     
     /* Bits per word */
-    smdicmd[14] = sh.BitsPerWord;
+    cmd[14] = sh.BitsPerWord;
     
     /* Number of channels */
-    smdicmd[15] = sh.NumberOfChannels;
+    cmd[15] = sh.NumberOfChannels;
     
     /* Sample Period (nanoseconds) */
-    smdicmd[16] = (unsigned char)((sh.dwPeriod >> 16) & 0xFF);
-    smdicmd[17] = (unsigned char)((sh.dwPeriod >> 8) & 0xFF);
-    smdicmd[18] = (unsigned char)(sh.dwPeriod & 0xFF);
+    cmd[16] = (unsigned char)((sh.dwPeriod >> 16) & 0xFF);
+    cmd[17] = (unsigned char)((sh.dwPeriod >> 8) & 0xFF);
+    cmd[18] = (unsigned char)(sh.dwPeriod & 0xFF);
     
     /* Sample Length (words) */
-    smdicmd[19] = (unsigned char)((sh.dwLength >> 24) & 0xFF);
-    smdicmd[20] = (unsigned char)((sh.dwLength >> 16) & 0xFF);
-    smdicmd[21] = (unsigned char)((sh.dwLength >> 8) & 0xFF);
-    smdicmd[22] = (unsigned char)(sh.dwLength & 0xFF);
+    cmd[19] = (unsigned char)((sh.dwLength >> 24) & 0xFF);
+    cmd[20] = (unsigned char)((sh.dwLength >> 16) & 0xFF);
+    cmd[21] = (unsigned char)((sh.dwLength >> 8) & 0xFF);
+    cmd[22] = (unsigned char)(sh.dwLength & 0xFF);
     
     /* Loop Start (word number) */
-    smdicmd[23] = (unsigned char)((sh.dwLoopStart >> 24) & 0xFF);
-    smdicmd[24] = (unsigned char)((sh.dwLoopStart >> 16) & 0xFF);
-    smdicmd[25] = (unsigned char)((sh.dwLoopStart >> 8) & 0xFF);
-    smdicmd[26] = (unsigned char)(sh.dwLoopStart & 0xFF);
+    cmd[23] = (unsigned char)((sh.dwLoopStart >> 24) & 0xFF);
+    cmd[24] = (unsigned char)((sh.dwLoopStart >> 16) & 0xFF);
+    cmd[25] = (unsigned char)((sh.dwLoopStart >> 8) & 0xFF);
+    cmd[26] = (unsigned char)(sh.dwLoopStart & 0xFF);
     
     /* Loop End (word number) */
-    smdicmd[27] = (unsigned char)((sh.dwLoopEnd >> 24) & 0xFF);
-    smdicmd[28] = (unsigned char)((sh.dwLoopEnd >> 16) & 0xFF);
-    smdicmd[29] = (unsigned char)((sh.dwLoopEnd >> 8) & 0xFF);
-    smdicmd[30] = (unsigned char)(sh.dwLoopEnd & 0xFF);
+    cmd[27] = (unsigned char)((sh.dwLoopEnd >> 24) & 0xFF);
+    cmd[28] = (unsigned char)((sh.dwLoopEnd >> 16) & 0xFF);
+    cmd[29] = (unsigned char)((sh.dwLoopEnd >> 8) & 0xFF);
+    cmd[30] = (unsigned char)(sh.dwLoopEnd & 0xFF);
     
     /* Loop Control */
-    smdicmd[31] = sh.LoopControl;
+    cmd[31] = sh.LoopControl;
     
     /* Pitch Integer */
-    smdicmd[32] = (unsigned char)((sh.wPitch >> 8) & 0xFF);
-    smdicmd[33] = (unsigned char)(sh.wPitch & 0xFF);
+    cmd[32] = (unsigned char)((sh.wPitch >> 8) & 0xFF);
+    cmd[33] = (unsigned char)(sh.wPitch & 0xFF);
     
     /* Pitch Fraction */
-    smdicmd[34] = (unsigned char)((sh.wPitchFraction >> 8) & 0xFF);
-    smdicmd[35] = (unsigned char)(sh.wPitchFraction & 0xFF);
+    cmd[34] = (unsigned char)((sh.wPitchFraction >> 8) & 0xFF);
+    cmd[35] = (unsigned char)(sh.wPitchFraction & 0xFF);
     
     /* Sample Name Length */
-    smdicmd[36] = sh.NameLength;
+    cmd[36] = sh.NameLength;
     
     /* Sample Name */
-    memcpy(&smdicmd[37], &sh.cName, (unsigned long)sh.NameLength);
+    memcpy(&cmd[37], &sh.cName, (unsigned long)sh.NameLength);
     
     /* Send the command */
-    send_success = ASPI_Send(&debug, ha_id, id, smdicmd, 37 + (unsigned long)sh.NameLength);
+    send_success = SMDI_SendCommand(conn, cmd, 37 + (unsigned long)sh.NameLength);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
+        debug_print(conn, "ERROR: ASPI_Send failed");
         return SMDIM_ERROR;
     }
     
-    /* Wait a short time for the device to process */
-    sleep_ms(50);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_SAMPLEHEADER, conn->cResponse, sizeof(conn->cResponse));
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
-    
-    result = SMDI_GetWholeMessageID(smdicmd);
+    result = SMDI_GetWholeMessageID(conn, conn->cResponse);
     
     /* If transfer acknowledge, get the packet length from the response */
     if (result == SMDIM_TRANSFERACKNOWLEDGE) {
         DWORD respLength;
-        
+    
         /* Extract 24-bit value */
-        respLength = ((DWORD)smdicmd[14] << 16) |
-                     ((DWORD)smdicmd[15] << 8) |
-                     (DWORD)smdicmd[16];
-        
-        debug_print("Transfer acknowledged, packet length is %lu", respLength);
-        
+        respLength = ((DWORD)conn->cResponse[14] << 16) |
+                     ((DWORD)conn->cResponse[15] << 8) |
+                     (DWORD)conn->cResponse[16];
+    
+        debug_print(conn, "Transfer acknowledged, packet length is %lu", respLength);
+    
         /* Update the packet length */
         *dataPacketLength = respLength;
+        conn->dwPacketSize = respLength;
     }
-
+    
     if (result != SMDIM_TRANSFERACKNOWLEDGE) {
-        debug_print("Error response from sampler: 0x%08lx", result);
+        debug_print(conn, "Error response from sampler: 0x%08lx", result);
         if (result == SMDIM_MESSAGEREJECT) {
-            debug_print("Last error code: 0x%08lx", SMDI_GetLastError());
+            debug_print(conn, "Last error code: 0x%08lx", conn->dwLastError);
         }
     }
     
     return result;
 }
 
-/* Request the next data packet */
-DWORD SMDI_NextDataPacketRequest(BYTE ha_id,
-                               BYTE id,
-                               DWORD packetNumber,
-                               void* buffer,
-                               DWORD maxlen) {
-    void* mybuffer;
-    DWORD reply;
-    scsi_debug_t debug;
+/* Ask the device for a data packet */
+static int SMDI_RequestDataPacket(SMDI_Connection* conn, DWORD packetNumber) {
     int send_success;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
-    
-    debug_print("NextDataPacketRequest: Requesting packet %lu from device %d:%d", 
-               packetNumber, ha_id, id);
-    
-    mybuffer = malloc(maxlen + 14);
-    if (mybuffer == NULL) {
-        debug_print("ERROR: Failed to allocate memory");
-        return SMDIM_ERROR;
-    }
+    debug_print(conn, "NextDataPacketRequest: Requesting packet %lu from device %d:%d", 
+               packetNumber, conn->HA_ID, conn->SCSI_ID);
     
     /* Prepare the message header */
-    SMDI_MakeMessageHeader(smdicmd, SMDIM_SENDNEXTPACKET, 0x000003);
+    SMDI_MakeMessageHeader(conn, conn->cCommand, SMDIM_SENDNEXTPACKET, 0x000003);
     
     /* Packet Number (24-bit value) */
-    smdicmd[11] = (unsigned char)((packetNumber >> 16) & 0xFF);
-    smdicmd[12] = (unsigned char)((packetNumber >> 8) & 0xFF);
-    smdicmd[13] = (unsigned char)(packetNumber & 0xFF);
+    conn->cCommand[11] = (unsigned char)((packetNumber >> 16) & 0xFF);
+    conn->cCommand[12] = (unsigned char)((packetNumber >> 8) & 0xFF);
+    conn->cCommand[13] = (unsigned char)(packetNumber & 0xFF);
     
     /* Send the command */
-    send_success = ASPI_Send(&debug, ha_id, id, smdicmd, 14);
+    send_success = SMDI_SendCommand(conn, conn->cCommand, 14);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
-        free(mybuffer);
+        debug_print(conn, "ERROR: ASPI_Send failed");
+    }
+    
+    return send_success;
+}
+
+/* Payload bytes of a data packet answer of received bytes */
+static DWORD SMDI_DataPacketPayload(unsigned char answer[], unsigned long received) {
+    DWORD length;
+    
+    if (received < 14) {
+        return 0;
+    }
+    
+    /* The additional length covers the packet number and the payload */
+    length = SMDI_GetAdditionalLength(answer);
+    length = (length >= 3) ? length - 3 : 0;
+    
+    if (length > received - 14) {
+        length = received - 14;
+    }
+    
+    return length;
+}
+
+/* Request the next data packet and hand over the connection's receive
+   buffer. *data points at the payload and stays valid until the next
+   data packet request on the connection. */
+DWORD SMDIC_NextDataPacketBuffer(SMDI_Connection* conn,
+                                DWORD packetNumber,
+                                DWORD maxlen,
+                                void** data,
+                                DWORD* length) {
+    unsigned char* receive;
+    unsigned long received;
+    DWORD reply;
+    
+    if (conn == NULL || data == NULL || length == NULL) {
         return SMDIM_ERROR;
     }
     
-    /* Wait a short time for the device to process */
-    sleep_ms(50);
+    *data = NULL;
+    *length = 0;
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, mybuffer, maxlen + 14);
+    /* Grow the receive buffer to the packet length */
+    if (conn->lpReceive == NULL || maxlen > conn->dwReceiveAlloc) {
+        receive = (unsigned char*)malloc(14 + maxlen);
+        if (receive == NULL) {
+            debug_print(conn, "ERROR: Failed to allocate memory");
+            return SMDIM_ERROR;
+        }
     
-    /* Copy the data directly (no byte swapping needed on big-endian system) */
-    memcpy(buffer, (void*)(((unsigned long)mybuffer) + 14), maxlen);
+        free(conn->lpReceive);
+        conn->lpReceive = receive;
+        conn->dwReceiveAlloc = maxlen;
+    }
+    
+    if (!SMDI_RequestDataPacket(conn, packetNumber)) {
+        return SMDIM_ERROR;
+    }
+    
+    /* Poll for the data packet */
+    received = SMDI_ReadAnswer(conn, SMDI_RC_NEXTPACKET, conn->lpReceive, maxlen + 14);
+    
+    /* Keep the message header with the connection */
+    memcpy(conn->cResponse, conn->lpReceive, 14);
     
     /* Get the message ID from the response */
-    reply = SMDI_GetWholeMessageID(mybuffer);
-    debug_print("Reply message ID: 0x%08lX", reply);
+    reply = SMDI_GetWholeMessageID(conn, conn->cResponse);
+    debug_print(conn, "Reply message ID: 0x%08lX", reply);
     
-    /* Free the temporary buffer */
-    free(mybuffer);
+    if (reply == SMDIM_DATAPACKET) {
+        *data = conn->lpReceive + 14;
+        *length = SMDI_DataPacketPayload(conn->lpReceive, received);
+    }
     
     return reply;
 }
 
+/* Request the next data packet and receive its payload straight into
+   buffer. With bHeadroom the 14 bytes in front of buffer belong to the
+   caller as well: the message header is read into them and they are
+   restored afterwards, so the payload is not copied at all. */
+DWORD SMDIC_NextDataPacketInPlace(SMDI_Connection* conn,
+                                 DWORD packetNumber,
+                                 void* buffer,
+                                 DWORD maxlen,
+                                 BOOL bHeadroom) {
+    unsigned char* landing;
+    unsigned char saved[14];
+    DWORD reply;
+    
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    if (!bHeadroom) {
+        return SMDIC_NextDataPacketRequest(conn, packetNumber, buffer, maxlen);
+    }
+    
+    if (!SMDI_RequestDataPacket(conn, packetNumber)) {
+        return SMDIM_ERROR;
+    }
+    
+    landing = (unsigned char*)buffer - 14;
+    memcpy(saved, landing, 14);
+    
+    /* Poll for the data packet */
+    SMDI_ReadAnswer(conn, SMDI_RC_NEXTPACKET, landing, maxlen + 14);
+    
+    /* Move the message header to the connection and put back the bytes
+       it covered */
+    memcpy(conn->cResponse, landing, 14);
+    memcpy(landing, saved, 14);
+    
+    /* Get the message ID from the response */
+    reply = SMDI_GetWholeMessageID(conn, conn->cResponse);
+    debug_print(conn, "Reply message ID: 0x%08lX", reply);
+    
+    return reply;
+}
+
+/* Request the next data packet */
+DWORD SMDIC_NextDataPacketRequest(SMDI_Connection* conn,
+                                 DWORD packetNumber,
+                                 void* buffer,
+                                 DWORD maxlen) {
+    void* data;
+    DWORD length;
+    DWORD reply;
+    
+    reply = SMDIC_NextDataPacketBuffer(conn, packetNumber, maxlen, &data, &length);
+    
+    /* Copy the data directly (no byte swapping needed on big-endian system) */
+    if (reply == SMDIM_DATAPACKET) {
+        memcpy(buffer, data, length);
+    }
+    
+    return reply;
+}
+
+/* Parse the Sample Header message in answer into sh */
+static void SMDI_ParseSampleHeader(unsigned char answer[],
+                                   unsigned long received,
+                                   SMDI_SampleHeader* sh) {
+    DWORD nameLength;
+    
+    sh->bDoesExist = TRUE;
+    sh->BitsPerWord = answer[14]; /* Bits Per Word */
+    sh->NumberOfChannels = answer[15]; /* Number Of Channels */
+    
+    /* Period (24-bit value) */
+    sh->dwPeriod = ((DWORD)answer[16] << 16) |
+                  ((DWORD)answer[17] << 8) |
+                  (DWORD)answer[18];
+    
+    /* Sample Length */
+    sh->dwLength = ((DWORD)answer[19] << 24) |
+                  ((DWORD)answer[20] << 16) |
+                  ((DWORD)answer[21] << 8) |
+                  (DWORD)answer[22];
+    
+    /* Loop Start */
+    sh->dwLoopStart = ((DWORD)answer[23] << 24) |
+                     ((DWORD)answer[24] << 16) |
+                     ((DWORD)answer[25] << 8) |
+                     (DWORD)answer[26];
+    
+    /* Loop End */
+    sh->dwLoopEnd = ((DWORD)answer[27] << 24) |
+                   ((DWORD)answer[28] << 16) |
+                   ((DWORD)answer[29] << 8) |
+                   (DWORD)answer[30];
+    
+    /* Loop Control */
+    sh->LoopControl = answer[31];
+    
+    /* Pitch */
+    sh->wPitch = ((WORD)answer[32] << 8) |
+                (WORD)answer[33];
+    
+    /* Pitch Fraction */
+    sh->wPitchFraction = ((WORD)answer[34] << 8) |
+                        (WORD)answer[35];
+    
+    /* Name length, limited to what was actually received */
+    nameLength = answer[36];
+    if (received < 37) {
+        nameLength = 0;
+    } else if (nameLength > received - 37) {
+        nameLength = received - 37;
+    }
+    sh->NameLength = (BYTE)nameLength;
+    
+    /* Name */
+    memset(&sh->cName, 0, 256);
+    memcpy(sh->cName, &answer[37], nameLength);
+}
+
 /* Request a sample header */
-DWORD SMDI_SampleHeaderRequest(BYTE ha_id,
-                             BYTE id,
-                             DWORD sampleNum,
-                             SMDI_SampleHeader* shTemp) {
+DWORD SMDIC_SampleHeaderRequest(SMDI_Connection* conn,
+                               DWORD sampleNum,
+                               SMDI_SampleHeader* shTemp) {
     SMDI_SampleHeader sh;
-    scsi_debug_t debug;
+    unsigned char* answer;
     DWORD result;
     unsigned char cmd[14];
+    unsigned long received;
     int i;
     int send_result; /* Declare variable with correct name */
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    answer = conn->cResponse;
     
-    debug_print("SampleHeaderRequest for sample %lu on device %d:%d", 
-               sampleNum, ha_id, id);
+    debug_print(conn, "SampleHeaderRequest for sample %lu on device %d:%d",
+               sampleNum, conn->HA_ID, conn->SCSI_ID);
     
     /* Add NULL check */
     if (shTemp == NULL) {
-        debug_print("ERROR: shTemp is NULL");
+        debug_print(conn, "ERROR: shTemp is NULL");
         return SMDIM_ERROR;
     }
     
@@ -524,8 +1282,8 @@ DWORD SMDI_SampleHeaderRequest(BYTE ha_id,
     memcpy(cmd, "SMDI", 4);
     
     /* Message ID for SMDIM_SAMPLEHEADERREQUEST (0x01200000) */
-    cmd[4] = 0x01; 
-    cmd[5] = 0x20; 
+    cmd[4] = 0x01;
+    cmd[5] = 0x20;
     /* cmd[4] = 0x00; */
     /* cmd[5] = 0x12; */
     cmd[6] = 0x00;
@@ -541,8 +1299,8 @@ DWORD SMDI_SampleHeaderRequest(BYTE ha_id,
     cmd[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
     cmd[13] = (unsigned char)(sampleNum & 0xFF);
     
-    if (g_smdi_debug_enabled) {
-        debug_print("Command bytes:");
+    if (conn->Debug.enabled) {
+        debug_print(conn, "Command bytes:");
         for (i = 0; i < 14; i++) {
             printf("%02X ", cmd[i]);
         }
@@ -550,112 +1308,66 @@ DWORD SMDI_SampleHeaderRequest(BYTE ha_id,
     }
     
     /* Send the command */
-    send_result = ASPI_Send(&debug, ha_id, id, cmd, 14);
+    send_result = SMDI_SendCommand(conn, cmd, 14);
     
     /* Check what ASPI_Send returned to determine the cause of failure */
-    debug_print("ASPI_Send returned %d", send_result);
+    debug_print(conn, "ASPI_Send returned %d", send_result);
     
     if (!send_result) {
         /* If ASPI_Send failed, let's check if the device exists and is ready */
-        int ready = ASPI_TestUnitReady(&debug, ha_id, id);
-        debug_print("ASPI_TestUnitReady returned %d", ready);
-        
+        int ready = SMDI_BusTestUnitReady(conn);
+        debug_print(conn, "ASPI_TestUnitReady returned %d", ready);
+    
         if (!ready) {
-            debug_print("ERROR: Device %d:%d is not ready", ha_id, id);
+            debug_print(conn, "ERROR: Device %d:%d is not ready", conn->HA_ID, conn->SCSI_ID);
         } else {
-            debug_print("ERROR: Device is ready but ASPI_Send failed");
+            debug_print(conn, "ERROR: Device is ready but ASPI_Send failed");
         }
-        
+    
         return SMDIM_ERROR;
     }
     
-    /* Wait a bit longer for the device to process - 100ms */
-    sleep_ms(100);
-    
     /* Clear the receive buffer first */
-    memset(smdicmd, 0, sizeof(smdicmd));
+    memset(answer, 0, sizeof(conn->cResponse));
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
+    /* Poll for the response */
+    received = SMDI_ReadAnswer(conn, SMDI_RC_HEADERREQUEST, answer, sizeof(conn->cResponse));
     
-    if (g_smdi_debug_enabled) {
-        debug_print("Response first 16 bytes:");
+    if (conn->Debug.enabled) {
+        debug_print(conn, "Response first 16 bytes:");
         for (i = 0; i < 16; i++) {
-            printf("%02X ", smdicmd[i]);
+            printf("%02X ", answer[i]);
         }
         printf("\n");
     }
     
     /* Check if it's a valid SMDI response */
-    if (memcmp(smdicmd, "SMDI", 4) == 0) {
+    if (memcmp(answer, "SMDI", 4) == 0) {
         /* Extract message ID - directly from bytes 4-7 */
-        result = ((DWORD)smdicmd[4] << 24) |
-                ((DWORD)smdicmd[5] << 16) |
-                ((DWORD)smdicmd[6] << 8) |
-                (DWORD)smdicmd[7];
-        
-        debug_print("SMDI response ID: 0x%08lX", result);
-        
+        result = ((DWORD)answer[4] << 24) |
+                ((DWORD)answer[5] << 16) |
+                ((DWORD)answer[6] << 8) |
+                (DWORD)answer[7];
+    
+        debug_print(conn, "SMDI response ID: 0x%08lX", result);
+    
         /* Check for SAMPLEHEADER response (0x01210000) */
         if (result == SMDIM_SAMPLEHEADER) {
             /* Parse sample header data */
-            sh.bDoesExist = TRUE;
-            sh.BitsPerWord = smdicmd[14]; /* Bits Per Word */
-            sh.NumberOfChannels = smdicmd[15]; /* Number Of Channels */
-            
-            /* Period (24-bit value) */
-            sh.dwPeriod = ((DWORD)smdicmd[16] << 16) |
-                         ((DWORD)smdicmd[17] << 8) |
-                         (DWORD)smdicmd[18];
-            
-            /* Sample Length */
-            sh.dwLength = ((DWORD)smdicmd[19] << 24) |
-                         ((DWORD)smdicmd[20] << 16) |
-                         ((DWORD)smdicmd[21] << 8) |
-                         (DWORD)smdicmd[22];
-            
-            /* Loop Start */
-            sh.dwLoopStart = ((DWORD)smdicmd[23] << 24) |
-                            ((DWORD)smdicmd[24] << 16) |
-                            ((DWORD)smdicmd[25] << 8) |
-                            (DWORD)smdicmd[26];
-            
-            /* Loop End */
-            sh.dwLoopEnd = ((DWORD)smdicmd[27] << 24) |
-                          ((DWORD)smdicmd[28] << 16) |
-                          ((DWORD)smdicmd[29] << 8) |
-                          (DWORD)smdicmd[30];
-            
-            /* Loop Control */
-            sh.LoopControl = smdicmd[31];
-            
-            /* Pitch */
-            sh.wPitch = ((WORD)smdicmd[32] << 8) |
-                       (WORD)smdicmd[33];
-            
-            /* Pitch Fraction */
-            sh.wPitchFraction = ((WORD)smdicmd[34] << 8) |
-                               (WORD)smdicmd[35];
-            
-            /* Name length */
-            sh.NameLength = smdicmd[36];
-            
-            /* Name */
-            memset(&sh.cName, 0, 256);
-            memcpy(sh.cName, &smdicmd[37], (unsigned long)sh.NameLength);
-            
-            debug_print("Sample exists: %s", sh.bDoesExist ? "Yes" : "No");
-            debug_print("Bits per word: %d", sh.BitsPerWord);
-            debug_print("Channels: %d", sh.NumberOfChannels);
-            debug_print("Period: %lu", sh.dwPeriod);
-            debug_print("Length: %lu", sh.dwLength);
-            debug_print("Name: %s", sh.cName);
+            SMDI_ParseSampleHeader(answer, received, &sh);
+    
+            debug_print(conn, "Sample exists: %s", sh.bDoesExist ? "Yes" : "No");
+            debug_print(conn, "Bits per word: %d", sh.BitsPerWord);
+            debug_print(conn, "Channels: %d", sh.NumberOfChannels);
+            debug_print(conn, "Period: %lu", sh.dwPeriod);
+            debug_print(conn, "Length: %lu", sh.dwLength);
+            debug_print(conn, "Name: %s", sh.cName);
         } else {
             sh.bDoesExist = FALSE;
-            debug_print("Sample does not exist (response: 0x%08lX)", result);
+            debug_print(conn, "Sample does not exist (response: 0x%08lX)", result);
         }
     } else {
-        debug_print("Not a valid SMDI response");
+        debug_print(conn, "Not a valid SMDI response");
         result = SMDIM_ERROR;
         sh.bDoesExist = FALSE;
     }
@@ -666,20 +1378,112 @@ DWORD SMDI_SampleHeaderRequest(BYTE ha_id,
     return result;
 }
 
+/* Request the sample headers of first..last and pass every existing
+   sample to callback as soon as its header arrives. The request is built
+   once and only its sample number changes; the transport handle stays
+   open throughout. Stops at the end of the sampler's range
+   (SMDIE_OUTOFRANGE) or when callback returns FALSE. Returns
+   SMDIM_ENDOFPROCEDURE when done, else the answer that ended the scan. */
+DWORD SMDIC_EnumerateHeaders(SMDI_Connection* conn,
+                            DWORD first,
+                            DWORD last,
+                            SMDI_HeaderCallback callback,
+                            DWORD dwUserData) {
+    SMDI_SampleHeader sh;
+    unsigned long received;
+    DWORD sampleNum;
+    DWORD reply;
+    DWORD result;
+    BOOL opened;
+    
+    if (conn == NULL || callback == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    debug_print(conn, "EnumerateHeaders: samples %lu to %lu on device %d:%d",
+               first, last, conn->HA_ID, conn->SCSI_ID);
+    
+    /* Hold the handle for the whole scan */
+    opened = !conn->bOpen && ASPI_OpenDevice(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+    
+    /* Sample Header Request, sample number filled in per sample */
+    SMDI_MakeMessageHeader(conn, conn->cCommand, SMDIM_SAMPLEHEADERREQUEST, 0x000003);
+    
+    result = SMDIM_ENDOFPROCEDURE;
+    for (sampleNum = first; sampleNum <= last; sampleNum++) {
+        conn->cCommand[11] = (unsigned char)((sampleNum >> 16) & 0xFF);
+        conn->cCommand[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
+        conn->cCommand[13] = (unsigned char)(sampleNum & 0xFF);
+    
+        if (!SMDI_SendCommand(conn, conn->cCommand, 14)) {
+            debug_print(conn, "ERROR: ASPI_Send failed at sample %lu", sampleNum);
+            result = SMDIM_ERROR;
+            break;
+        }
+    
+        received = SMDI_ReadAnswer(conn, SMDI_RC_HEADERREQUEST,
+                                   conn->cResponse, sizeof(conn->cResponse));
+        if (received < 11 || memcmp(conn->cResponse, "SMDI", 4) != 0) {
+            debug_print(conn, "ERROR: No valid answer for sample %lu", sampleNum);
+            result = SMDIM_ERROR;
+            break;
+        }
+    
+        reply = SMDI_GetWholeMessageID(conn, conn->cResponse);
+        switch (reply) {
+            case SMDIM_SAMPLEHEADER:
+                memset(&sh, 0, sizeof(sh));
+                sh.dwStructSize = sizeof(sh);
+                SMDI_ParseSampleHeader(conn->cResponse, received, &sh);
+    
+                if (!(*callback)(sampleNum, &sh, dwUserData)) {
+                    sampleNum = last;
+                }
+                break;
+    
+            case SMDIM_MESSAGEREJECT:
+                /* Past the last sample the device has */
+                if (conn->dwLastError == SMDIE_OUTOFRANGE) {
+                    debug_print(conn, "EnumerateHeaders: range ends before sample %lu", sampleNum);
+                    sampleNum = last;
+                }
+                break;
+    
+            default:
+                result = reply;
+                sampleNum = last;
+                break;
+        }
+    
+        /* Don't wrap around at the top of the DWORD range */
+        if (sampleNum == last) {
+            break;
+        }
+    }
+    
+    if (opened) {
+        ASPI_CloseDevice(&conn->Debug, conn->HA_ID, conn->SCSI_ID);
+    }
+    
+    return result;
+}
+
 /* Delete a sample */
-DWORD SMDI_DeleteSample(BYTE ha_id,
-                      BYTE id,
-                      DWORD sampleNum) {
+DWORD SMDIC_DeleteSample(SMDI_Connection* conn,
+                        DWORD sampleNum) {
     DWORD messageID;
-    scsi_debug_t debug;
+    unsigned char* answer;
     unsigned char cmd[14];
     int i;
     int send_success;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    answer = conn->cResponse;
     
-    debug_print("Deleting sample number: %lu", sampleNum);
+    debug_print(conn, "Deleting sample number: %lu", sampleNum);
     
     /* Prepare the message header */
     /* SMDI header signature */
@@ -701,8 +1505,8 @@ DWORD SMDI_DeleteSample(BYTE ha_id,
     cmd[12] = (unsigned char)((sampleNum >> 8) & 0xFF);
     cmd[13] = (unsigned char)(sampleNum & 0xFF);
     
-    if (g_smdi_debug_enabled) {
-        debug_print("Command to send:");
+    if (conn->Debug.enabled) {
+        debug_print(conn, "Command to send:");
         for (i = 0; i < 14; i++) {
             printf(" %02X", cmd[i]);
         }
@@ -710,77 +1514,74 @@ DWORD SMDI_DeleteSample(BYTE ha_id,
     }
     
     /* Send the command */
-    send_success = ASPI_Send(&debug, ha_id, id, cmd, 14);
+    send_success = SMDI_SendCommand(conn, cmd, 14);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
+        debug_print(conn, "ERROR: ASPI_Send failed");
         return SMDIM_ERROR;
     }
     
-    /* Wait a bit longer for the device to process - 100ms */
-    sleep_ms(100);
-    
     /* Clear the receive buffer first */
-    memset(smdicmd, 0, sizeof(smdicmd));
+    memset(answer, 0, sizeof(conn->cResponse));
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_DELETE, answer, sizeof(conn->cResponse));
     
     /* Enhanced debug - dump full response buffer */
-    if (g_smdi_debug_enabled) {
-        debug_print("Response dump (first 32 bytes):");
+    if (conn->Debug.enabled) {
+        debug_print(conn, "Response dump (first 32 bytes):");
         for (i = 0; i < 32; i++) {
             if (i % 16 == 0) {
                 printf("\n%04X: ", i);
             }
-            printf("%02X ", smdicmd[i]);
+            printf("%02X ", answer[i]);
         }
         printf("\n");
     }
     
     /* Check if it's a valid SMDI response */
-    if (memcmp(smdicmd, "SMDI", 4) == 0) {
+    if (memcmp(answer, "SMDI", 4) == 0) {
         /* Extract message ID - directly from bytes 4-7 */
-        messageID = ((DWORD)smdicmd[4] << 24) |
-                   ((DWORD)smdicmd[5] << 16) |
-                   ((DWORD)smdicmd[6] << 8) |
-                   (DWORD)smdicmd[7];
-        
-        debug_print("Received message ID: 0x%08lX", messageID);
-        
-        if (g_smdi_debug_enabled) {
-            debug_print("Response Bytes:");
+        messageID = ((DWORD)answer[4] << 24) |
+                   ((DWORD)answer[5] << 16) |
+                   ((DWORD)answer[6] << 8) |
+                   (DWORD)answer[7];
+    
+        debug_print(conn, "Received message ID: 0x%08lX", messageID);
+    
+        if (conn->Debug.enabled) {
+            debug_print(conn, "Response Bytes:");
             for (i = 0; i < 16; i++) {
-                printf(" %02X", smdicmd[i]);
+                printf(" %02X", answer[i]);
             }
             printf("\n");
         }
-        
+    
         if (messageID == SMDIM_MESSAGEREJECT) {
-            debug_print("Error in MessageReject, looking at raw bytes around error code");
-            if (g_smdi_debug_enabled) {
-                debug_print("Bytes 8-15:");
+            debug_print(conn, "Error in MessageReject, looking at raw bytes around error code");
+            if (conn->Debug.enabled) {
+                debug_print(conn, "Bytes 8-15:");
                 for (i = 8; i < 16; i++) {
-                    printf(" %02X", smdicmd[i]);
+                    printf(" %02X", answer[i]);
                 }
                 printf("\n");
             }
-            
-            return SMDI_GetLastError();
+    
+            return conn->dwLastError;
         } else {
-            debug_print("Successful response: 0x%08lX", messageID);
+            debug_print(conn, "Successful response: 0x%08lX", messageID);
             return messageID;
         }
     } else {
-        debug_print("Not a valid SMDI response");
+        debug_print(conn, "Not a valid SMDI response");
         return SMDIM_ERROR;
     }
 }
 
 /* Identify a master device */
-DWORD SMDI_MasterIdentify(BYTE ha_id, BYTE id) {
-    scsi_debug_t debug;
+DWORD SMDIC_MasterIdentify(SMDI_Connection* conn) {
     DWORD response;
+    unsigned char* answer;
     int i;
     int send_success;
     
@@ -791,13 +1592,16 @@ DWORD SMDI_MasterIdentify(BYTE ha_id, BYTE id) {
         0x00, 0x00, 0x00  /* Additional length (0) */
     };
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return SMDIM_ERROR;
+    }
+    
+    answer = conn->cResponse;
     
-    debug_print("SMDI_MasterIdentify: Sending to device %d:%d", ha_id, id);
+    debug_print(conn, "SMDI_MasterIdentify: Sending to device %d:%d", conn->HA_ID, conn->SCSI_ID);
     
-    if (g_smdi_debug_enabled) {
-        debug_print("SMDI Command Bytes:");
+    if (conn->Debug.enabled) {
+        debug_print(conn, "SMDI Command Bytes:");
         for (i = 0; i < 11; i++) {
             printf(" %02X", cmd[i]);
         }
@@ -805,41 +1609,38 @@ DWORD SMDI_MasterIdentify(BYTE ha_id, BYTE id) {
     }
     
     /* Send the manually constructed command */
-    send_success = ASPI_Send(&debug, ha_id, id, cmd, 11);
+    send_success = SMDI_SendCommand(conn, cmd, 11);
     
     if (!send_success) {
-        debug_print("ERROR: ASPI_Send failed");
+        debug_print(conn, "ERROR: ASPI_Send failed");
         return SMDIM_ERROR;
     }
     
-    /* Wait longer for the device to process - 50ms */
-    sleep_ms(50);
-    
     /* Clear the receive buffer first */
-    memset(smdicmd, 0, sizeof(smdicmd));
+    memset(answer, 0, sizeof(conn->cResponse));
     
-    /* Receive the response */
-    ASPI_Receive(&debug, ha_id, id, smdicmd, 256);
+    /* Poll for the response */
+    SMDI_ReadAnswer(conn, SMDI_RC_IDENTIFY, answer, sizeof(conn->cResponse));
     
-    if (g_smdi_debug_enabled) {
-        debug_print("Raw Response:");
+    if (conn->Debug.enabled) {
+        debug_print(conn, "Raw Response:");
         for (i = 0; i < 16; i++) {
-            printf(" %02X", smdicmd[i]);
+            printf(" %02X", answer[i]);
         }
         printf("\n");
     }
     
     /* Check if it's a valid SMDI response */
-    if (memcmp(smdicmd, "SMDI", 4) == 0) {
+    if (memcmp(answer, "SMDI", 4) == 0) {
         /* Extract message ID - directly from bytes 4-7 */
-        response = ((DWORD)smdicmd[4] << 24) |
-                  ((DWORD)smdicmd[5] << 16) |
-                  ((DWORD)smdicmd[6] << 8) |
-                  (DWORD)smdicmd[7];
-        
-        debug_print("Valid SMDI response: 0x%08lX", response);
+        response = ((DWORD)answer[4] << 24) |
+                  ((DWORD)answer[5] << 16) |
+                  ((DWORD)answer[6] << 8) |
+                  (DWORD)answer[7];
+    
+        debug_print(conn, "Valid SMDI response: 0x%08lX", response);
     } else {
-        debug_print("Not a valid SMDI response");
+        debug_print(conn, "Not a valid SMDI response");
         response = 0; /* Not a valid response */
     }
     
@@ -850,50 +1651,97 @@ DWORD SMDI_MasterIdentify(BYTE ha_id, BYTE id) {
 BYTE SMDI_Init(void) {
     int result;
     
-    debug_print("SMDI_Init: Initializing SMDI");
+    debug_print(NULL, "SMDI_Init: Initializing SMDI");
     
     /* Cast int return value from ASPI_Check to BYTE */
     result = ASPI_Check(NULL);
     
-    debug_print("ASPI_Check returned %d, casting to BYTE", result);
+    debug_print(NULL, "ASPI_Check returned %d, casting to BYTE", result);
+    
+    /* Tables connections share are locked from the start */
+    if (result && connection_lock == NULL) {
+        connection_lock = SMDI_CreateSemaphore(1);
+        if (connection_lock == NULL) {
+            debug_print(NULL, "SMDI_Init: Cannot create the connection lock");
+            result = 0;
+        }
+    }
+    if (result && !SMDI_InitPacketSizes()) {
+        debug_print(NULL, "SMDI_Init: Cannot create the packet size lock");
+        result = 0;
+    }
+    if (result && !SMDI_InitResample()) {
+        debug_print(NULL, "SMDI_Init: Cannot create the filter bank lock");
+        result = 0;
+    }
     
     return (BYTE)result;
 }
 
 /* Test if a device is ready */
-BOOL SMDI_TestUnitReady(BYTE ha_id, BYTE id) {
+BOOL SMDIC_TestUnitReady(SMDI_Connection* conn) {
     int result;
+    
+    if (conn == NULL) {
+        return FALSE;
+    }
+    
+    debug_print(conn, "SMDI_TestUnitReady: Checking device %d:%d", conn->HA_ID, conn->SCSI_ID);
+    
+    /* ASPI_TestUnitReady returns int which we are expecting as BOOL */
+    result = SMDI_BusTestUnitReady(conn);
+    
+    debug_print(conn, "ASPI_TestUnitReady returned %d", result);
+    
+    return result;
+}
+
+/* Keep a device open for the duration of a connection */
+BOOL SMDI_OpenDevice(BYTE ha_id, BYTE id) {
     scsi_debug_t debug;
     
     scsi_debug_init(&debug);
     debug.enabled = g_smdi_debug_enabled;
     
-    debug_print("SMDI_TestUnitReady: Checking device %d:%d", ha_id, id);
+    debug_print(NULL, "SMDI_OpenDevice: Opening device %d:%d", ha_id, id);
     
-    /* ASPI_TestUnitReady returns int which we are expecting as BOOL */
-    result = ASPI_TestUnitReady(&debug, ha_id, id);
+    return ASPI_OpenDevice(&debug, ha_id, id);
+}
+
+/* Release a device opened with SMDI_OpenDevice */
+void SMDI_CloseDevice(BYTE ha_id, BYTE id) {
+    scsi_debug_t debug;
+    ASPI_HandleStats stats;
     
-    debug_print("ASPI_TestUnitReady returned %d", result);
+    scsi_debug_init(&debug);
+    debug.enabled = g_smdi_debug_enabled;
     
-    return result;
+    ASPI_CloseDevice(&debug, ha_id, id);
+    
+    ASPI_GetHandleStats(&stats);
+    debug_print(NULL, "SMDI_CloseDevice: %d:%d closed (%lu opens, %lu saved, %lu dropped)",
+               ha_id, id, stats.opens, stats.reuses, stats.invalidations);
 }
 
 /* Get device information */
-void SMDI_GetDeviceInfo(BYTE ha_id, BYTE id, SCSI_DevInfo* info) {
+void SMDIC_GetDeviceInfo(SMDI_Connection* conn, SCSI_DevInfo* info) {
     SCSI_DevInfo devInfo;
     char inquire[96];
-    scsi_debug_t debug;
     DWORD response;
     
-    scsi_debug_init(&debug);
-    debug.enabled = g_smdi_debug_enabled;
+    if (conn == NULL) {
+        return;
+    }
     
-    debug_print("SMDI_GetDeviceInfo: Getting info for device %d:%d", ha_id, id);
+    debug_print(conn, "SMDI_GetDeviceInfo: Getting info for device %d:%d",
+                conn->HA_ID, conn->SCSI_ID);
     
     memset(inquire, 0, 96);
     devInfo.dwStructSize = sizeof(SCSI_DevInfo);
     
-    ASPI_InquireDevice(&debug, inquire, ha_id, id);
+    SMDI_AcquireBus(conn);
+    ASPI_InquireDevice(&conn->Debug, inquire, conn->HA_ID, conn->SCSI_ID);
+    SMDI_ReleaseBus(conn);
     devInfo.DevType = inquire[0] & 0x1f;
     devInfo.bSMDI = FALSE;
     
@@ -902,27 +1750,81 @@ void SMDI_GetDeviceInfo(BYTE ha_id, BYTE id, SCSI_DevInfo* info) {
     memcpy(devInfo.cName, &inquire[16], 16);
     memcpy(devInfo.cManufacturer, &inquire[8], 8);
     
-    debug_print("Device %d:%d - Type: %d, Manufacturer: %.8s, Name: %.16s", 
-               ha_id, id, devInfo.DevType, devInfo.cManufacturer, devInfo.cName);
+    debug_print(conn, "Device %d:%d - Type: %d, Manufacturer: %.8s, Name: %.16s",
+               conn->HA_ID, conn->SCSI_ID, devInfo.DevType, devInfo.cManufacturer, devInfo.cName);
     
     /* Try SMDI identification. We'll primarily check "Processor"
        type devices (Type 3), but will try others if needed. */
     if (devInfo.DevType == 3) {
         /* Try to send SMDI Master Identify command */
-        debug_print("Sending SMDI Master Identify to device %d:%d...", ha_id, id);
-        
+        debug_print(conn, "Sending SMDI Master Identify to device %d:%d...",
+                    conn->HA_ID, conn->SCSI_ID);
+    
         /* Send the SMDI Master Identify command */
-        response = SMDI_MasterIdentify(ha_id, id);
-        
+        response = SMDIC_MasterIdentify(conn);
+    
         /* Check for SMDI Slave Identify response (0x00010001) */
         if (response == SMDIM_SLAVEIDENTIFY) {
-            debug_print("Device is SMDI capable (SlaveIdentify response: 0x%08lX)", response);
+            debug_print(conn, "Device is SMDI capable (SlaveIdentify response: 0x%08lX)", response);
             devInfo.bSMDI = TRUE;
         } else {
-            debug_print("Device is not SMDI capable (response: 0x%08lX)", response);
+            debug_print(conn, "Device is not SMDI capable (response: 0x%08lX)", response);
         }
     }
     
     /* Copy back to caller's structure */
     memcpy(info, &devInfo, sizeof(SCSI_DevInfo));
 }
+
+/*
+ * HA_ID/SCSI_ID entry points on the default connection of a device
+ */
+
+DWORD SMDI_GetMessage(BYTE ha_id, BYTE id) {
+    return SMDIC_GetMessage(SMDI_GetDefaultConnection(ha_id, id));
+}
+
+DWORD SMDI_SendDataPacket(BYTE ha_id, BYTE id, DWORD pn, void* data, DWORD length) {
+    return SMDIC_SendDataPacket(SMDI_GetDefaultConnection(ha_id, id), pn, data, length);
+}
+
+DWORD SMDI_SampleName(BYTE ha_id, BYTE id, DWORD sampleNum, char sampleName[]) {
+    return SMDIC_SampleName(SMDI_GetDefaultConnection(ha_id, id), sampleNum, sampleName);
+}
+
+DWORD SMDI_SendBeginSampleTransfer(BYTE ha_id, BYTE id, DWORD sampleNum, void* packetLength) {
+    return SMDIC_SendBeginSampleTransfer(SMDI_GetDefaultConnection(ha_id, id),
+                                         sampleNum, packetLength);
+}
+
+DWORD SMDI_SendSampleHeader(BYTE ha_id, BYTE id, DWORD sampleNum,
+                          SMDI_SampleHeader* sh, DWORD* dataPacketLength) {
+    return SMDIC_SendSampleHeader(SMDI_GetDefaultConnection(ha_id, id),
+                                  sampleNum, sh, dataPacketLength);
+}
+
+DWORD SMDI_NextDataPacketRequest(BYTE ha_id, BYTE id, DWORD packetNumber,
+                               void* buffer, DWORD maxlen) {
+    return SMDIC_NextDataPacketRequest(SMDI_GetDefaultConnection(ha_id, id),
+                                       packetNumber, buffer, maxlen);
+}
+
+DWORD SMDI_SampleHeaderRequest(BYTE ha_id, BYTE id, DWORD sampleNum, SMDI_SampleHeader* sh) {
+    return SMDIC_SampleHeaderRequest(SMDI_GetDefaultConnection(ha_id, id), sampleNum, sh);
+}
+
+DWORD SMDI_DeleteSample(BYTE ha_id, BYTE id, DWORD sampleNum) {
+    return SMDIC_DeleteSample(SMDI_GetDefaultConnection(ha_id, id), sampleNum);
+}
+
+DWORD SMDI_MasterIdentify(BYTE ha_id, BYTE id) {
+    return SMDIC_MasterIdentify(SMDI_GetDefaultConnection(ha_id, id));
+}
+
+BOOL SMDI_TestUnitReady(BYTE ha_id, BYTE id) {
+    return SMDIC_TestUnitReady(SMDI_GetDefaultConnection(ha_id, id));
+}
+
+void SMDI_GetDeviceInfo(BYTE ha_id, BYTE id, SCSI_DevInfo* info) {
+    SMDIC_GetDeviceInfo(SMDI_GetDefaultConnection(ha_id, id), info);
+}
@@ -0,0 +1,841 @@
+/*
+ * SMDI WAV file format support for IRIX 5.3
+ * ANSI C90 compliant implementation for MIPS big-endian architecture
+ *
+ * WAV and Broadcast WAV files are read and written here the way AIF
+ * files are in smdi_aif.c: a file is mapped into memory and its chunks
+ * parsed in place - fmt gives the format, data the frames, smpl (or inst)
+ * the unity note, fine tune and loop, LIST INFO INAM or the bext
+ * description the name. WAV frames are little-endian and 8-bit ones
+ * unsigned, so they always pass through the converter on their way to
+ * the sampler, a packet at a time; downloads are swapped back the same
+ * way as each packet is written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "smdi.h"
+#include "smdi_sample.h"
+#include "smdi_swap.h"
+#include "smdi_convert.h"
+#include "smdi_resample.h"
+#include "smdi_wav.h"
+
+/* Format tags of the fmt chunk */
+#define WAV_FORMAT_PCM        0x0001
+#define WAV_FORMAT_FLOAT      0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+
+/* Loop types of the smpl chunk */
+#define WAV_LOOP_FORWARD      0
+#define WAV_LOOP_ALTERNATING  1
+
+/* Size of a Broadcast WAV bext chunk without coding history */
+#define WAV_BEXT_SIZE         602
+
+/* Bytes swapped at a time when downloading */
+#define WAV_SINK_BUFFER       4096
+
+/* Frames still to be read from a WAV file uploaded as a source */
+typedef struct {
+    SMDI_WAVFile* wav;
+    DWORD pos;
+} WAVSourceState;
+
+/* WAV file being written by a download */
+typedef struct {
+    FILE* file;
+    char filename[MAX_PATH];
+    int use_bwf;
+    DWORD bits;
+    DWORD data_size;
+    DWORD written;
+    unsigned char carry;          /* First byte of a word split between two packets */
+    unsigned char buffer[WAV_SINK_BUFFER];
+} WAVSinkState;
+
+/* Little-endian fields of the chunks */
+static DWORD SMDI_GetLE32(const unsigned char* p) {
+    return ((DWORD)p[3] << 24) | ((DWORD)p[2] << 16) | ((DWORD)p[1] << 8) | (DWORD)p[0];
+}
+
+static WORD SMDI_GetLE16(const unsigned char* p) {
+    return (WORD)((p[1] << 8) | p[0]);
+}
+
+static void SMDI_PutLE32(unsigned char* p, DWORD v) {
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)((v >> 8) & 0xFF);
+    p[2] = (unsigned char)((v >> 16) & 0xFF);
+    p[3] = (unsigned char)((v >> 24) & 0xFF);
+}
+
+static void SMDI_PutLE16(unsigned char* p, WORD v) {
+    p[0] = (unsigned char)(v & 0xFF);
+    p[1] = (unsigned char)((v >> 8) & 0xFF);
+}
+
+/* Layout of the frames from the fmt chunk. Samples narrower than their
+   bytes are left-justified, so integers are taken at the full width of
+   their bytes; 8-bit ones are unsigned. */
+static BOOL SMDI_ParseFormat(SMDI_PCMFormat* format, const unsigned char* fmt, DWORD size) {
+    WORD tag;
+    WORD channels;
+    WORD align;
+    WORD bits;
+    
+    if (size < 16) {
+        return FALSE;
+    }
+    
+    tag = SMDI_GetLE16(fmt);
+    channels = SMDI_GetLE16(fmt + 2);
+    align = SMDI_GetLE16(fmt + 12);
+    bits = SMDI_GetLE16(fmt + 14);
+    
+    /* An extensible format's sub-format GUID starts with the tag */
+    if (tag == WAV_FORMAT_EXTENSIBLE) {
+        if (size < 40 || SMDI_GetLE16(fmt + 16) < 22) {
+            return FALSE;
+        }
+        tag = SMDI_GetLE16(fmt + 24);
+    }
+    if (channels == 0 || align % channels != 0) {
+        return FALSE;
+    }
+    
+    format->dwBytes = align / channels;
+    format->dwBits = format->dwBytes * 8;
+    format->dwByteOrder = SMDI_PCM_LITTLEENDIAN;
+    
+    if (tag == WAV_FORMAT_PCM) {
+        format->dwEncoding = (format->dwBytes == 1) ? SMDI_PCM_UNSIGNED : SMDI_PCM_SIGNED;
+        return bits >= 1 && bits <= format->dwBits && format->dwBytes <= 4;
+    }
+    if (tag == WAV_FORMAT_FLOAT) {
+        format->dwEncoding = SMDI_PCM_FLOAT;
+        return bits == 32 && format->dwBytes == 4;
+    }
+    
+    return FALSE;
+}
+
+/* Unity note, fine tune and first loop of a smpl chunk */
+static void SMDI_ParseSampler(SMDI_Sample* info, const unsigned char* smpl, DWORD size) {
+    DWORD note;
+    DWORD cents;
+    const unsigned char* loop;
+    
+    if (size < 36) {
+        return;
+    }
+    
+    /* The pitch fraction raises the note by up to a semitone; above half
+       of one it is taken down from the next note */
+    note = SMDI_GetLE32(smpl + 12);
+    cents = (DWORD)((double)SMDI_GetLE32(smpl + 16) / 42949672.96 + 0.5);
+    if (cents > 50) {
+        note++;
+        info->fine_tune = (WORD)(short)((long)cents - 100);
+    } else {
+        info->fine_tune = (WORD)cents;
+    }
+    info->root_note = (WORD)(note & 0x7F);
+    
+    if (SMDI_GetLE32(smpl + 28) > 0 && size >= 36 + 24) {
+        loop = smpl + 36;
+        info->loop_type = (SMDI_GetLE32(loop + 4) == WAV_LOOP_ALTERNATING) ?
+                          SAMPLE_LOOP_BIDIRECTIONAL : SAMPLE_LOOP_FORWARD;
+        info->loop_start = SMDI_GetLE32(loop + 8);
+        info->loop_end = SMDI_GetLE32(loop + 12);
+    }
+}
+
+/* Name of a LIST INFO chunk's INAM entry */
+static void SMDI_ParseInfo(SMDI_Sample* info, const unsigned char* list, DWORD size) {
+    DWORD off;
+    DWORD len;
+    
+    if (size < 4 || memcmp(list, "INFO", 4) != 0) {
+        return;
+    }
+    
+    for (off = 4; size - off >= 8; off += 8 + ((len + 1) & ~(DWORD)1)) {
+        len = SMDI_GetLE32(list + off + 4);
+        if (len > size - off - 8) {
+            len = size - off - 8;
+        }
+        if (memcmp(list + off, "INAM", 4) == 0) {
+            if (len > 255) {
+                len = 255;
+            }
+            memcpy(info->name, list + off + 8, len);
+            info->name[len] = '\0';
+            return;
+        }
+        if (size - off - 8 - len < 2) {
+            break;
+        }
+    }
+}
+
+/* Open a WAV file and parse its chunks */
+SMDI_WAVFile* SMDI_OpenWAVFile(const char* filename) {
+    SMDI_WAVFile* wav;
+    SMDI_Sample* info;
+    const unsigned char* p;
+    const unsigned char* end;
+    const unsigned char* fmt;
+    const unsigned char* data;
+    const unsigned char* smpl;
+    const unsigned char* inst;
+    const unsigned char* list;
+    const unsigned char* bext;
+    DWORD fmt_size;
+    DWORD data_size;
+    DWORD smpl_size;
+    DWORD list_size;
+    DWORD size;
+    DWORD frame_bytes;
+    const char* basename;
+    char* dot;
+    
+    wav = (SMDI_WAVFile*)malloc(sizeof(SMDI_WAVFile));
+    if (wav == NULL) {
+        return NULL;
+    }
+    memset(wav, 0, sizeof(SMDI_WAVFile));
+    info = &wav->Info;
+    
+    if (!SMDI_MapFile(filename, &wav->Map)) {
+        fprintf(stderr, "SMDI_OpenWAVFile: Failed to open file '%s'\n", filename);
+        SMDI_CloseWAVFile(wav);
+        return NULL;
+    }
+    
+    /* A RIFF of WAVE; one claiming more than the file holds is cut short */
+    p = wav->Map.data;
+    if (wav->Map.size < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+        fprintf(stderr, "SMDI_OpenWAVFile: File '%s' is not WAV format\n", filename);
+        SMDI_CloseWAVFile(wav);
+        return NULL;
+    }
+    size = SMDI_GetLE32(p + 4);
+    end = p + 8 + ((size < wav->Map.size - 8) ? size : wav->Map.size - 8);
+    
+    /* Find the chunks; an odd-sized one is followed by a pad byte */
+    fmt = data = smpl = inst = list = bext = NULL;
+    fmt_size = data_size = smpl_size = list_size = 0;
+    for (p += 12; end - p >= 8; p += 8 + ((size + 1) & ~(DWORD)1)) {
+        size = SMDI_GetLE32(p + 4);
+        if (size > (DWORD)(end - p) - 8) {
+            size = (DWORD)(end - p) - 8;
+        }
+    
+        if (memcmp(p, "fmt ", 4) == 0) {
+            fmt = p + 8;
+            fmt_size = size;
+        } else if (memcmp(p, "data", 4) == 0) {
+            data = p + 8;
+            data_size = size;
+        } else if (memcmp(p, "smpl", 4) == 0) {
+            smpl = p + 8;
+            smpl_size = size;
+        } else if (memcmp(p, "inst", 4) == 0 && size >= 7) {
+            inst = p + 8;
+        } else if (memcmp(p, "LIST", 4) == 0 && list == NULL) {
+            list = p + 8;
+            list_size = size;
+        } else if (memcmp(p, "bext", 4) == 0 && size >= 256) {
+            bext = p + 8;
+        }
+    
+        /* The last chunk may lack its pad byte */
+        if ((DWORD)(end - p) - 8 - size < 2) {
+            break;
+        }
+    }
+    
+    if (fmt == NULL || data == NULL || !SMDI_ParseFormat(&wav->Format, fmt, fmt_size) ||
+        SMDI_GetLE16(fmt + 2) > 255) {
+        fprintf(stderr, "SMDI_OpenWAVFile: Unsupported sample format in '%s'\n", filename);
+        SMDI_CloseWAVFile(wav);
+        return NULL;
+    }
+    
+    /* 8-bit samples are sent as 8 bits, anything else as 16 bits */
+    info->channels = (BYTE)SMDI_GetLE16(fmt + 2);
+    info->sample_rate = SMDI_GetLE32(fmt + 4);
+    info->bits_per_sample = (wav->Format.dwEncoding == SMDI_PCM_UNSIGNED) ? 8 : 16;
+    info->root_note = 60;  /* Middle C */
+    
+    frame_bytes = info->channels * wav->Format.dwBytes;
+    wav->lpFrames = data;
+    info->sample_count = data_size / frame_bytes;
+    wav->dwDataSize = info->sample_count * frame_bytes;
+    info->data_size = info->sample_count * info->channels * (info->bits_per_sample / 8);
+    
+    /* Unity note, fine tune and loop; inst has no loop but is taken for
+       the note where there is no smpl */
+    if (smpl != NULL) {
+        SMDI_ParseSampler(info, smpl, smpl_size);
+    } else if (inst != NULL) {
+        info->root_note = inst[0] & 0x7F;
+        info->fine_tune = (WORD)(short)(signed char)inst[1];
+    }
+    
+    /* Ensure fine tune is in range -50 to +50 cents */
+    if ((short)info->fine_tune < -50) info->fine_tune = (WORD)-50;
+    if ((short)info->fine_tune > 50) info->fine_tune = 50;
+    
+    /* The name is the INFO list's, or else the Broadcast WAV description */
+    if (list != NULL) {
+        SMDI_ParseInfo(info, list, list_size);
+    }
+    if (info->name[0] == '\0' && bext != NULL) {
+        memcpy(info->name, bext, 255);
+        info->name[255] = '\0';
+    }
+    
+    /* If no name was found, use filename as fallback */
+    if (info->name[0] == '\0') {
+        basename = strrchr(filename, '/');
+        if (basename) {
+            basename++; /* Skip the slash */
+        } else {
+            basename = filename;
+        }
+    
+        /* Copy basename and remove extension */
+        strncpy(info->name, basename, 255);
+        info->name[255] = '\0';
+        dot = strrchr(info->name, '.');
+        if (dot) {
+            *dot = '\0';
+        }
+    }
+    
+    return wav;
+}
+
+/* Close a file opened with SMDI_OpenWAVFile */
+void SMDI_CloseWAVFile(SMDI_WAVFile* wav) {
+    if (wav == NULL) {
+        return;
+    }
+    
+    SMDI_UnmapFile(&wav->Map);
+    free(wav);
+}
+
+/* Open a WAV file for bBits-bit samples, 0 for as Info has them */
+static SMDI_WAVFile* SMDI_OpenWAVFileAs(const char* filename, BYTE bBits) {
+    SMDI_WAVFile* wav;
+    
+    if (bBits != 0 && bBits != 8 && bBits != 16) {
+        return NULL;
+    }
+    
+    wav = SMDI_OpenWAVFile(filename);
+    if (wav != NULL && bBits != 0) {
+        wav->Info.bits_per_sample = bBits;
+        wav->Info.data_size = wav->Info.sample_count * wav->Info.channels * (bBits / 8);
+    }
+    
+    return wav;
+}
+
+/* Load a WAV file into SMDI sample format */
+SMDI_Sample* SMDI_LoadWAVSample(const char* filename) {
+    return SMDI_LoadWAVSampleAs(filename, 0, SMDI_CONVERT_DITHER);
+}
+
+/* Load a WAV file as bBits-bit samples */
+SMDI_Sample* SMDI_LoadWAVSampleAs(const char* filename, BYTE bBits, DWORD dwFlags) {
+    SMDI_WAVFile* wav;
+    SMDI_Sample* sample;
+    SMDI_Converter* conv;
+    short* data;
+    
+    wav = SMDI_OpenWAVFileAs(filename, bBits);
+    if (wav == NULL) {
+        return NULL;
+    }
+    
+    /* Create a new sample */
+    sample = SMDI_CreateSample(wav->Info.sample_rate, wav->Info.bits_per_sample,
+                               wav->Info.channels, wav->Info.sample_count);
+    if (sample == NULL) {
+        fprintf(stderr, "SMDI_LoadWAVSample: Failed to create sample\n");
+        SMDI_CloseWAVFile(wav);
+        return NULL;
+    }
+    
+    /* Take over format, loop and name */
+    data = sample->sample_data;
+    memcpy(sample, &wav->Info, sizeof(SMDI_Sample));
+    sample->sample_data = data;
+    
+    /* The frames are converted out of the mapping */
+    conv = SMDI_CreateConverter(&wav->Format, sample->channels, sample->bits_per_sample,
+                                dwFlags);
+    if (conv == NULL) {
+        fprintf(stderr, "SMDI_LoadWAVSample: Failed to set up conversion\n");
+        SMDI_FreeSample(sample);
+        SMDI_CloseWAVFile(wav);
+        return NULL;
+    }
+    SMDI_ConvertFrames(conv, sample->sample_data, wav->lpFrames, sample->sample_count);
+    SMDI_FreeConverter(conv);
+    
+    /* Clean up */
+    SMDI_CloseWAVFile(wav);
+    
+    return sample;
+}
+
+/* Copy the next bytes of the mapped frames into a packet to convert */
+static DWORD SMDI_WAVSourceRead(SMDI_SampleSource* src, void* buffer, DWORD dwBytes) {
+    WAVSourceState* state;
+    
+    state = (WAVSourceState*)src->lpState;
+    
+    if (dwBytes > state->wav->dwDataSize - state->pos) {
+        dwBytes = state->wav->dwDataSize - state->pos;
+    }
+    memcpy(buffer, state->wav->lpFrames + state->pos, dwBytes);
+    state->pos += dwBytes;
+    
+    return dwBytes;
+}
+
+/* Close a WAV file uploaded as a source */
+static void SMDI_WAVSourceClose(SMDI_SampleSource* src) {
+    WAVSourceState* state;
+    
+    state = (WAVSourceState*)src->lpState;
+    SMDI_CloseWAVFile(state->wav);
+    free(state);
+}
+
+/* Open a WAV file as an upload source */
+SMDI_SampleSource* SMDI_OpenWAVSource(const char* filename) {
+    return SMDI_OpenWAVSourceAs(filename, 0, SMDI_CONVERT_DITHER);
+}
+
+/* Open a WAV file as an upload source of bBits-bit samples */
+SMDI_SampleSource* SMDI_OpenWAVSourceAs(const char* filename, BYTE bBits, DWORD dwFlags) {
+    SMDI_SampleSource* src;
+    WAVSourceState* state;
+    SMDI_WAVFile* wav;
+    
+    wav = SMDI_OpenWAVFileAs(filename, bBits);
+    if (wav == NULL) {
+        return NULL;
+    }
+    
+    src = (SMDI_SampleSource*)malloc(sizeof(SMDI_SampleSource));
+    state = (WAVSourceState*)malloc(sizeof(WAVSourceState));
+    if (src == NULL || state == NULL) {
+        free(src);
+        free(state);
+        SMDI_CloseWAVFile(wav);
+        return NULL;
+    }
+    
+    memset(src, 0, sizeof(SMDI_SampleSource));
+    src->dwStructSize = sizeof(SMDI_SampleSource);
+    SMDI_SampleToHeader(&wav->Info, &src->Header);
+    
+    memset(state, 0, sizeof(WAVSourceState));
+    state->wav = wav;
+    
+    src->lpRead = SMDI_WAVSourceRead;
+    src->lpClose = SMDI_WAVSourceClose;
+    src->lpState = state;
+    
+    /* Converted to the sampler's byte order and sign on the way */
+    return SMDI_OpenConvertSource(src, &wav->Format, wav->Info.bits_per_sample,
+                                  dwFlags);
+}
+
+/* Open a WAV file for its header only. The file is mapped to parse its
+   chunks and unmapped again, so only the pages holding them are read. */
+SMDI_SampleFile* SMDI_OpenWAVSampleFile(const char* filename) {
+    SMDI_WAVFile* wav;
+    SMDI_SampleFile* file;
+    
+    wav = SMDI_OpenWAVFile(filename);
+    if (wav == NULL) {
+        return NULL;
+    }
+    
+    file = SMDI_CreateSampleFile(filename, &wav->Info, SMDI_OpenWAVSource, SMDI_LoadWAVSample);
+    SMDI_CloseWAVFile(wav);
+    
+    return file;
+}
+
+/* Write a chunk header */
+static BOOL SMDI_WriteChunk(FILE* file, const char* id, DWORD size) {
+    unsigned char head[8];
+    
+    memcpy(head, id, 4);
+    SMDI_PutLE32(head + 4, size);
+    
+    return fwrite(head, 1, 8, file) == 8;
+}
+
+/* Broadcast WAV description, originator and origination time */
+static void SMDI_FillBext(unsigned char* bext, const char* name) {
+    time_t now;
+    struct tm* tm;
+    char stamp[64];
+    
+    memset(bext, 0, WAV_BEXT_SIZE);
+    strncpy((char*)bext, name, 256);
+    memcpy(bext + 256, "SMDI Sampler Manager", 20);
+    
+    now = time(NULL);
+    tm = localtime(&now);
+    if (tm != NULL) {
+        sprintf(stamp, "%04d-%02d-%02d%02d:%02d:%02d", tm->tm_year + 1900, tm->tm_mon + 1,
+                tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+        memcpy(bext + 320, stamp, 18);
+    }
+    
+    /* Version 1, time reference and UMID left zero */
+    SMDI_PutLE16(bext + 346, 1);
+}
+
+/* Create a WAV file for a sample's format, loop and name and write it
+   up to its frames, which the caller writes */
+static FILE* SMDI_CreateWAV(SMDI_Sample* sample, const char* filename, int use_bwf) {
+    unsigned char buf[WAV_BEXT_SIZE];
+    FILE* file;
+    DWORD bytes;
+    DWORD data_size;
+    DWORD name_size;
+    DWORD list_size;
+    DWORD smpl_size;
+    DWORD riff_size;
+    DWORD cents;
+    WORD note;
+    BOOL loop;
+    BOOL ok;
+    
+    if (sample->channels == 0 ||
+        (sample->bits_per_sample != 8 && sample->bits_per_sample != 16)) {
+        fprintf(stderr, "SMDI_CreateWAV: Unsupported sample format\n");
+        return NULL;
+    }
+    
+    bytes = sample->bits_per_sample / 8;
+    data_size = sample->sample_count * sample->channels * bytes;
+    name_size = (DWORD)strlen(sample->name);
+    loop = (sample->loop_type != SAMPLE_LOOP_NONE && sample->loop_start < sample->loop_end);
+    
+    /* Chunk sizes; every chunk is padded to an even length in the RIFF.
+       The name is stored with its terminating zero. */
+    smpl_size = 36 + (loop ? 24 : 0);
+    list_size = 4 + 8 + ((name_size + 2) & ~(DWORD)1);
+    riff_size = 4 + (use_bwf ? 8 + WAV_BEXT_SIZE : 0) + 8 + 16 + 8 + smpl_size +
+                (name_size > 0 ? 8 + list_size : 0) + 8 + ((data_size + 1) & ~(DWORD)1);
+    
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "SMDI_CreateWAV: Failed to open file '%s' for writing\n", filename);
+        return NULL;
+    }
+    
+    ok = SMDI_WriteChunk(file, "RIFF", riff_size) && fwrite("WAVE", 1, 4, file) == 4;
+    
+    if (ok && use_bwf) {
+        SMDI_FillBext(buf, sample->name);
+        ok = SMDI_WriteChunk(file, "bext", WAV_BEXT_SIZE) &&
+             fwrite(buf, 1, WAV_BEXT_SIZE, file) == WAV_BEXT_SIZE;
+    }
+    
+    /* Format */
+    memset(buf, 0, 16);
+    SMDI_PutLE16(buf, WAV_FORMAT_PCM);
+    SMDI_PutLE16(buf + 2, sample->channels);
+    SMDI_PutLE32(buf + 4, sample->sample_rate);
+    SMDI_PutLE32(buf + 8, sample->sample_rate * sample->channels * bytes);
+    SMDI_PutLE16(buf + 12, (WORD)(sample->channels * bytes));
+    SMDI_PutLE16(buf + 14, sample->bits_per_sample);
+    ok = ok && SMDI_WriteChunk(file, "fmt ", 16) && fwrite(buf, 1, 16, file) == 16;
+    
+    /* Unity note raised by the fine tune, a note lower if that is down;
+       the loop if there is one */
+    note = (WORD)(sample->root_note & 0x7F);
+    cents = 0;
+    if ((short)sample->fine_tune > 0 && (short)sample->fine_tune <= 50) {
+        cents = sample->fine_tune;
+    } else if ((short)sample->fine_tune < 0 && (short)sample->fine_tune >= -50 && note > 0) {
+        note--;
+        cents = (DWORD)(100 + (short)sample->fine_tune);
+    }
+    
+    memset(buf, 0, smpl_size);
+    SMDI_PutLE32(buf + 8, sample->sample_rate ? 1000000000UL / sample->sample_rate : 0);
+    SMDI_PutLE32(buf + 12, note);
+    SMDI_PutLE32(buf + 16, (DWORD)((double)cents * 42949672.96 + 0.5));
+    if (loop) {
+        SMDI_PutLE32(buf + 28, 1);
+        SMDI_PutLE32(buf + 36 + 4, (sample->loop_type == SAMPLE_LOOP_BIDIRECTIONAL) ?
+                                   WAV_LOOP_ALTERNATING : WAV_LOOP_FORWARD);
+        SMDI_PutLE32(buf + 36 + 8, sample->loop_start);
+        SMDI_PutLE32(buf + 36 + 12, sample->loop_end);
+    }
+    ok = ok && SMDI_WriteChunk(file, "smpl", smpl_size) &&
+         fwrite(buf, 1, smpl_size, file) == smpl_size;
+    
+    if (ok && name_size > 0) {
+        ok = SMDI_WriteChunk(file, "LIST", list_size) && fwrite("INFO", 1, 4, file) == 4 &&
+             SMDI_WriteChunk(file, "INAM", name_size + 1) &&
+             fwrite(sample->name, 1, name_size + 1, file) == name_size + 1 &&
+             ((name_size & 1) == 1 || fputc(0, file) != EOF);
+    }
+    
+    ok = ok && SMDI_WriteChunk(file, "data", data_size);
+    
+    if (!ok) {
+        fprintf(stderr, "SMDI_CreateWAV: Failed to write '%s'\n", filename);
+        fclose(file);
+        remove(filename);
+        return NULL;
+    }
+    
+    return file;
+}
+
+/* Pad the frames to an even length and close the file */
+static BOOL SMDI_FinishWAV(FILE* file, DWORD data_size) {
+    BOOL ok;
+    
+    ok = (data_size & 1) == 0 || fputc(0, file) != EOF;
+    
+    return (fclose(file) == 0) && ok;
+}
+
+/* Write device words in WAV byte order: 16-bit words swapped, 8-bit
+   samples made unsigned. A 16-bit word split between two packets is
+   written once its second byte comes. */
+static BOOL SMDI_WriteWAVFrames(WAVSinkState* state, const unsigned char* in, DWORD length) {
+    DWORD fill;
+    DWORD count;
+    DWORD i;
+    
+    while (length > 0) {
+        fill = 0;
+        if (state->bits == 8) {
+            count = (length < WAV_SINK_BUFFER) ? length : WAV_SINK_BUFFER;
+            for (i = 0; i < count; i++) {
+                state->buffer[i] = (unsigned char)(in[i] ^ 0x80);
+            }
+            fill = count;
+        } else {
+            if (state->written & 1) {
+                state->buffer[0] = in[0];
+                state->buffer[1] = state->carry;
+                in++;
+                length--;
+                state->written++;
+                fill = 2;
+            }
+            count = (length < WAV_SINK_BUFFER - fill) ? length : WAV_SINK_BUFFER - fill;
+            SMDI_CopySwap(state->buffer + fill, in, count & ~(DWORD)1, CM_BYTESWAP);
+            fill += count & ~(DWORD)1;
+            if (count & 1) {
+                state->carry = in[count - 1];
+            }
+        }
+    
+        if (fwrite(state->buffer, 1, fill, state->file) != fill) {
+            return FALSE;
+        }
+        in += count;
+        length -= count;
+        state->written += count;
+    }
+    
+    return TRUE;
+}
+
+/* Save SMDI sample as WAV file */
+BOOL SMDI_SaveWAVSample(SMDI_Sample* sample, const char* filename, int use_bwf) {
+    WAVSinkState* state;
+    BOOL ok;
+    
+    /* Verify parameters */
+    if (sample == NULL || filename == NULL) {
+        return FALSE;
+    }
+    
+    state = (WAVSinkState*)malloc(sizeof(WAVSinkState));
+    if (state == NULL) {
+        return FALSE;
+    }
+    memset(state, 0, sizeof(WAVSinkState));
+    
+    state->file = SMDI_CreateWAV(sample, filename, use_bwf);
+    if (state->file == NULL) {
+        free(state);
+        return FALSE;
+    }
+    
+    /* The sample's words are big-endian and swapped on the way */
+    state->bits = sample->bits_per_sample;
+    state->data_size = sample->sample_count * sample->channels * (state->bits / 8);
+    ok = SMDI_WriteWAVFrames(state, (const unsigned char*)sample->sample_data, state->data_size);
+    if (!ok) {
+        fprintf(stderr, "SMDI_SaveWAVSample: Failed to write frames\n");
+    }
+    
+    ok = SMDI_FinishWAV(state->file, state->data_size) && ok;
+    if (!ok) {
+        remove(filename);
+    }
+    free(state);
+    
+    return ok;
+}
+
+/* Create the WAV file from the sample header */
+static BOOL SMDI_WAVSinkBegin(SMDI_SampleSink* sink, SMDI_SampleHeader* sh) {
+    WAVSinkState* state;
+    SMDI_Sample info;
+    
+    state = (WAVSinkState*)sink->lpState;
+    
+    if (sh->dwPeriod == 0 || sh->NumberOfChannels == 0 ||
+        (sh->BitsPerWord != 8 && sh->BitsPerWord != 16)) {
+        fprintf(stderr, "SMDI_WAVSinkBegin: Unsupported sample format\n");
+        return FALSE;
+    }
+    
+    /* Format, loop and name of the sample, without its data */
+    memset(&info, 0, sizeof(SMDI_Sample));
+    info.sample_rate = SMDI_PeriodToRate(sh->dwPeriod);
+    info.bits_per_sample = sh->BitsPerWord;
+    info.channels = sh->NumberOfChannels;
+    info.loop_type = sh->LoopControl;
+    info.sample_count = sh->dwLength;
+    info.loop_start = sh->dwLoopStart;
+    info.loop_end = sh->dwLoopEnd;
+    info.root_note = sh->wPitch;
+    info.fine_tune = sh->wPitchFraction;
+    strncpy(info.name, sh->cName, 255);
+    info.name[255] = '\0';
+    
+    state->bits = info.bits_per_sample;
+    state->data_size = info.sample_count * info.channels * (info.bits_per_sample / 8);
+    state->file = SMDI_CreateWAV(&info, state->filename, state->use_bwf);
+    
+    return state->file != NULL;
+}
+
+/* Write the frames of one packet in WAV byte order */
+static BOOL SMDI_WAVSinkWrite(SMDI_SampleSink* sink, void* data, DWORD length) {
+    WAVSinkState* state;
+    
+    state = (WAVSinkState*)sink->lpState;
+    
+    /* No more than the header said there is */
+    if (length > state->data_size - state->written) {
+        return FALSE;
+    }
+    
+    return SMDI_WriteWAVFrames(state, (const unsigned char*)data, length);
+}
+
+/* Close the WAV file; an incomplete one is removed */
+static BOOL SMDI_WAVSinkClose(SMDI_SampleSink* sink, BOOL bComplete) {
+    WAVSinkState* state;
+    BOOL ok;
+    
+    state = (WAVSinkState*)sink->lpState;
+    
+    ok = TRUE;
+    if (state->file != NULL) {
+        ok = SMDI_FinishWAV(state->file, state->data_size);
+        if (!bComplete || !ok || state->written != state->data_size) {
+            remove(state->filename);
+        }
+    }
+    
+    free(state);
+    
+    return ok;
+}
+
+/* Open a WAV file as a download sink */
+SMDI_SampleSink* SMDI_OpenWAVSink(const char* filename, int use_bwf) {
+    SMDI_SampleSink* sink;
+    WAVSinkState* state;
+    
+    if (filename == NULL || strlen(filename) >= MAX_PATH) {
+        return NULL;
+    }
+    
+    sink = (SMDI_SampleSink*)malloc(sizeof(SMDI_SampleSink));
+    state = (WAVSinkState*)malloc(sizeof(WAVSinkState));
+    if (sink == NULL || state == NULL) {
+        free(sink);
+        free(state);
+        return NULL;
+    }
+    
+    memset(sink, 0, sizeof(SMDI_SampleSink));
+    sink->dwStructSize = sizeof(SMDI_SampleSink);
+    
+    memset(state, 0, sizeof(WAVSinkState));
+    state->file = NULL;
+    strcpy(state->filename, filename);
+    state->use_bwf = use_bwf;
+    
+    sink->lpBegin = SMDI_WAVSinkBegin;
+    sink->lpWrite = SMDI_WAVSinkWrite;
+    sink->lpClose = SMDI_WAVSinkClose;
+    sink->lpState = state;
+    
+    return sink;
+}
+
+/* Lower-cased three letter extension of a file name into ext; FALSE if
+   the name has none */
+static BOOL SMDI_GetExtension(const char* filename, char ext[4]) {
+    const char* dot;
+    int i;
+    
+    dot = (filename != NULL) ? strrchr(filename, '.') : NULL;
+    if (dot == NULL || strlen(dot) != 4) {
+        return FALSE;
+    }
+    
+    for (i = 0; i < 3; i++) {
+        ext[i] = (char)((dot[i + 1] >= 'A' && dot[i + 1] <= 'Z') ? dot[i + 1] - 'A' + 'a' :
+                        dot[i + 1]);
+    }
+    ext[3] = '\0';
+    
+    return TRUE;
+}
+
+/* Whether a file name has a WAV extension */
+BOOL SMDI_IsWAVFileName(const char* filename) {
+    char ext[4];
+    
+    return SMDI_GetExtension(filename, ext) &&
+           (strcmp(ext, "wav") == 0 || strcmp(ext, "bwf") == 0);
+}
+
+/* Whether a file name ends in .bwf, in any case */
+BOOL SMDI_IsBWFFileName(const char* filename) {
+    char ext[4];
+    
+    return SMDI_GetExtension(filename, ext) && strcmp(ext, "bwf") == 0;
+}